@@ -7,7 +7,162 @@
 //
 
 #include "clite.h"
-#include <unistd.h>
+#include <ctype.h>
+#include <sys/stat.h>
+
+#pragma mark Include Guards
+
+/* Skips whitespace and comments */
+static const char *act_guard_skip(const char *p) {
+    while (true) {
+        if (isspace(*p)) {
+            p++;
+        } else if (p[0] == '/' && p[1] == '/') {
+            while (*p != 0 && *p != '\n') {
+                p++;
+            }
+        } else if (p[0] == '/' && p[1] == '*') {
+            const char *end = strstr(p + 2, "*/");
+            if (end == NULL) {
+                return p + strlen(p);
+            }
+            p = end + 2;
+        } else {
+            return p;
+        }
+    }
+}
+
+static const char *act_guard_ident(const char *p, size_t *length) {
+    const char *start = p;
+    while (isalnum(*p) || *p == '_') {
+        p++;
+    }
+    
+    *length = p - start;
+    return p;
+}
+
+/* p is at a '#'. Returns the directive's name, and where it ends in end */
+static const char *act_guard_directive(const char *p, size_t *length, const char **end) {
+    assert(*p == '#');
+    p++;
+    while (*p == ' ' || *p == '\t') {
+        p++;
+    }
+    
+    *end = act_guard_ident(p, length);
+    return p;
+}
+
+/* If the whole file is wrapped in #ifndef X / #define X ... #endif, returns X.
+ * Once X is defined, including the file again can't add anything, so it
+ * doesn't need to be read again
+ */
+static char *act_include_guard(SourceFile *source) {
+    const char *p = act_guard_skip((const char *)source->buf);
+    if (*p != '#') {
+        return NULL;
+    }
+    
+    size_t length = 0;
+    const char *name = act_guard_directive(p, &length, &p);
+    if (length != 6 || strncmp(name, "ifndef", 6)) {
+        return NULL;
+    }
+    
+    while (*p == ' ' || *p == '\t') {
+        p++;
+    }
+    
+    size_t guard_length = 0;
+    const char *guard = p;
+    p = act_guard_ident(p, &guard_length);
+    if (guard_length == 0) {
+        return NULL;
+    }
+    
+    p = act_guard_skip(p);
+    if (*p != '#') {
+        return NULL;
+    }
+    
+    name = act_guard_directive(p, &length, &p);
+    if (length != 6 || strncmp(name, "define", 6)) {
+        return NULL;
+    }
+    
+    while (*p == ' ' || *p == '\t') {
+        p++;
+    }
+    
+    const char *defined = p;
+    p = act_guard_ident(p, &length);
+    if (length != guard_length || strncmp(defined, guard, length)) {
+        return NULL;
+    }
+    
+    // Find the #endif that matches the #ifndef
+    int depth = 1;
+    bool line_start = false;
+    while (*p != 0) {
+        char ch = *p;
+        if (ch == '\n') {
+            line_start = true;
+            p++;
+        } else if (ch == ' ' || ch == '\t') {
+            p++;
+        } else if (ch == '/' && (p[1] == '/' || p[1] == '*')) {
+            // Comments are whitespace as far as a directive is concerned
+            const char *comment = p;
+            p = act_guard_skip(p);
+            line_start = line_start || memchr(comment, '\n', p - comment) != NULL;
+        } else if (ch == '"' || ch == '\'') {
+            p++;
+            while (*p != 0 && *p != ch && *p != '\n') {
+                if (*p == '\\' && p[1] != 0) {
+                    p++;
+                }
+                p++;
+            }
+            if (*p == ch) {
+                p++;
+            }
+            line_start = false;
+        } else if (ch == '#' && line_start) {
+            name = act_guard_directive(p, &length, &p);
+            if (length >= 2 && !strncmp(name, "if", 2)) {
+                depth++;
+            } else if (length == 5 && !strncmp(name, "endif", 5) && --depth == 0) {
+                // Only whitespace and comments can follow
+                while (*p != 0 && *p != '\n') {
+                    if (p[0] == '/' && p[1] == '*') {
+                        break;
+                    }
+                    p++;
+                }
+                
+                return *act_guard_skip(p) == 0 ? strndup(guard, guard_length) : NULL;
+            }
+            line_start = false;
+        } else {
+            line_start = false;
+            p++;
+        }
+    }
+    
+    return NULL;
+}
+
+static bool act_pp_is_defined(Context *ctx, const char *name) {
+    List_FOREACH(ASTPPDefinition*, defn, ctx->pp_defines, {
+        if (spelling_streq(defn->name->base.location.spelling, name)) {
+            return true;
+        }
+    })
+    
+    return false;
+}
 
 #pragma mark Preprocessor
 
@@ -40,9 +195,10 @@ void act_on_pp_run(SourceLocation sl, Context *ctx, Token chunk, char chunk_esca
     // TODO(bloggins): Fork/join here
     Context *run_ctx = context_create();
     run_ctx->ast = NULL;
-    run_ctx->buf = (uint8_t*)chunk_processed;
-    run_ctx->buf_size = idx;
-    run_ctx->pos = run_ctx->buf;
+    
+    // The chunk's nodes point into the processed text, so the source manager
+    // keeps it
+    context_load_source(run_ctx, source_manager_add(NULL, (uint8_t*)chunk_processed, idx, true));
     
     if (parser(run_ctx, &(run_ctx->ast))) {
         analyzer_analyze(run_ctx->ast);
@@ -56,8 +212,8 @@ void act_on_pp_run(SourceLocation sl, Context *ctx, Token chunk, char chunk_esca
     */
     
     *result = run_ctx->ast;
+    run_ctx->source->ctx = NULL;
     ct_release(run_ctx);
-    free(chunk_processed);
 }
 
 void act_on_pp_pragma(SourceLocation sl, ASTIdent *arg1, ASTIdent *arg2, Token rest,
@@ -94,7 +250,7 @@ void act_on_pp_pragma(SourceLocation sl, ASTIdent *arg1, ASTIdent *arg2, Token r
         }
         *hp_end = 0;
         
-        list_append(&(sl.ctx->system_header_paths), header_path);
+        list_append(&(context_for_location(sl)->system_header_paths), header_path);
 
     }
 
@@ -105,33 +261,59 @@ void act_on_pp_include(SourceLocation sl, const char *include_file, bool system_
                        Scope *scope, ASTBase **result) {
     if (result == NULL) return;
     
-    Context *ctx = (Context *)calloc(1, sizeof(Context));
-    *ctx = *sl.ctx;
-    ctx->file = NULL;
-    ctx->active_scope = NULL;
-    
-    char *full_path = NULL;
-    if (system_include && include_file[0] != '/') {
-        // Try to find the system header
-        List_FOREACH(char *, hpath, sl.ctx->system_header_paths, {
-            asprintf(&full_path, "%s/%s", hpath, include_file);
-            if (access(full_path, R_OK) == -1) {
-                free(full_path);
-                full_path = NULL;
-                continue;
-            }
-        })
+    Context *parent = context_for_location(sl);
+    
+    struct stat st;
+    const char *path = context_find_header(parent, include_file, system_include, &st);
+    if (path == NULL) {
+        diag_emit(DIAG_ERROR, ERR_FILE_NOT_FOUND, NULL, "input file not found (%s)", include_file);
     }
     
-    if (full_path != NULL) {
-        context_load_file(ctx, full_path);
-    } else {
-        context_load_file(ctx, include_file);
+    // Have we already read this file (by this or any other name)?
+    IncludeCacheEntry *entry = context_include_find(parent, &st);
+    if (entry != NULL) {
+        if (entry->once || (entry->guard != NULL && act_pp_is_defined(parent, entry->guard))) {
+            // Including it again wouldn't add anything
+            *result = NULL;
+            return;
+        } else if (!entry->conditional) {
+            *result = (ASTBase*)entry->ast;
+            return;
+        }
+        
+        // Its groups might go the other way with what's defined now, so it's
+        // read again
     }
     
+    // The header gets a cursor of its own that shares the includer's
+    // preprocessor state
+    Context *ctx = context_create();
+    ctx->system_header_paths = parent->system_header_paths;
+    ctx->pp_defines = parent->pp_defines;
+    ctx->parse_mode = parent->parse_mode;
+    ctx->lex_mode = parent->lex_mode;
+    
+    // The includer is still in the middle of its #include, where keywords
+    // are identifiers. The header starts out at the top level
+    ctx->lex_mode.lex_keywords_as_identifiers = false;
+    ctx->include_cache = context_include_cache(parent);
+    
+    context_load_file(ctx, path);
+    
     context_scope_push(ctx);
     parser_parse(ctx);
     
+    // If the includer's lists were empty, the header's are new lists the
+    // includer doesn't know about yet
+    parent->pp_defines = ctx->pp_defines;
+    parent->system_header_paths = ctx->system_header_paths;
+    
+    entry = context_include_add(parent, path, &st);
+    entry->ast = (ASTTopLevel*)ctx->ast;
+    entry->once = ctx->pragma_once;
+    entry->conditional = ctx->pp_conditional;
+    entry->guard = act_include_guard(ctx->source);
+    
     *result = ctx->ast;
 }
 
@@ -145,7 +327,7 @@ void act_on_pp_define(SourceLocation sl, ASTIdent *name, Spelling value,
     pp_defn->name = name;
     pp_defn->value = value;
     
-    list_append(&sl.ctx->pp_defines, pp_defn);
+    list_append(&context_for_location(sl)->pp_defines, pp_defn);
     
     *result = pp_defn;
 }
@@ -157,14 +339,29 @@ void act_on_pp_ifndef(SourceLocation sl, ASTIdent *ident, ASTPPIf **result) {
     AST_BASE(pp_if)->location = sl;
     pp_if->kind = PP_IF_IFNDEF;
     // pp_if->ident = ident;
-    // sl.ctx->lex_mode = LEX_PP_ONLY;
+    // context_for_location(sl)->lex_mode = LEX_PP_ONLY;
     
     *result = pp_if;
 }
 
+void act_on_pp_defined(SourceLocation sl, ASTIdent *ident, bool *result) {
+    if (result == NULL) return;
+    
+    *result = false;
+    if (ident == NULL) return;
+    
+    Spelling name = AST_BASE(ident)->location.spelling;
+    List_FOREACH(ASTPPDefinition*, defn, context_for_location(sl)->pp_defines, {
+        if (spelling_equal(defn->name->base.location.spelling, name)) {
+            *result = true;
+            return;
+        }
+    })
+}
+
 #pragma mark Toplevel
 
-void act_on_toplevel(SourceLocation sl, Scope *scope, List *stmts,
+void act_on_toplevel(SourceLocation sl, Scope *scope, List *stmts, List *includes,
                      ASTTopLevel **result) {
     if (result == NULL) return;
     
@@ -173,6 +370,7 @@ void act_on_toplevel(SourceLocation sl, Scope *scope, List *stmts,
     tl->base.location = sl;
     tl->base.scope = scope;
     tl->definitions = stmts;
+    tl->includes = includes;
     
     List_FOREACH(ASTBase*, stmt, stmts, {
         stmt->parent = (ASTBase*)tl;
@@ -205,6 +403,11 @@ void act_on_decl_var(SourceLocation sl, Scope *scope, ASTTypeExpression*type, bo
         scope_declaration_add(scope, (ASTDeclaration*)decl);
     }
     
+    if (ast_node_is_type_definition((ASTBase*)decl)) {
+        // From here on the lexer marks the name
+        scope_type_name_add(name->base.location.spelling);
+    }
+    
     *result = decl;
 }
 
@@ -247,6 +450,7 @@ void act_on_block(SourceLocation sl, List *stmts, ASTBlock **result) {
     
     ASTBlock *b = ast_create_block();
     AST_BASE(b)->location = sl;
+    AST_BASE(b)->scope = context_for_location(sl)->active_scope;
     
     List_FOREACH(ASTBase*, stmt, stmts, {
         stmt->parent = (ASTBase*)b;
@@ -309,7 +513,7 @@ void act_on_stmt_if(SourceLocation sl, ASTExpression *condition,
     if (result == NULL) return;
     
     ASTStmtIf *stmt_if = ast_create_stmt_if();
-    AST_BASE(stmt_if)->scope = sl.ctx->active_scope;
+    AST_BASE(stmt_if)->scope = context_for_location(sl)->active_scope;
     AST_BASE(stmt_if)->location = sl;
     
     AST_BASE(condition)->parent = (ASTBase*)stmt_if;
@@ -337,7 +541,7 @@ void act_on_stmt_jump(SourceLocation sl, Token keyword, ASTIdent *label,
     
     if (label != NULL) {
         AST_BASE(label)->parent = (ASTBase*)stmt_jump;
-        AST_BASE(label)->scope = sl.ctx->active_scope;
+        AST_BASE(label)->scope = context_for_location(sl)->active_scope;
     }
     
     stmt_jump->keyword = keyword;
@@ -356,8 +560,9 @@ void act_on_stmt_labeled(SourceLocation sl, ASTIdent *label, ASTStatement *stmt,
     
     stmt_l->label = label;
     stmt_l->stmt = stmt;
-    if (sl.ctx && sl.ctx->active_scope) {
-        scope_label_add(sl.ctx->active_scope, (ASTBase*)stmt_l);
+    Context *ctx = context_for_location(sl);
+    if (ctx && ctx->active_scope) {
+        scope_label_add(ctx->active_scope, (ASTBase*)stmt_l);
     }
     
     *result = stmt_l;
@@ -469,7 +674,7 @@ void act_on_expr_call(SourceLocation sl, ASTExpression *callable, List *args,
         AST_BASE(arg)->parent = (ASTBase*)call;
         
         // TODO(bloggins): Should we pass scope in?
-        AST_BASE(arg)->scope = sl.ctx->active_scope;
+        AST_BASE(arg)->scope = context_for_location(sl)->active_scope;
     })
     
     AST_BASE(call)->location = sl;
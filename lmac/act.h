@@ -34,9 +34,13 @@ void act_on_pp_define(SourceLocation sl, ASTIdent *name, Spelling value,
 
 void act_on_pp_ifndef(SourceLocation sl, ASTIdent *ident, ASTPPIf **result);
 
+/* Whether #ifdef, #ifndef or defined() would find ident #defined */
+void act_on_pp_defined(SourceLocation sl, ASTIdent *ident, bool *result);
+
 #pragma mark Toplevel
 
-void act_on_toplevel(SourceLocation sl, Scope *scope, List *stmts, ASTTopLevel **result);
+void act_on_toplevel(SourceLocation sl, Scope *scope, List *stmts, List *includes,
+                     ASTTopLevel **result);
 
 #pragma mark Declarations
 
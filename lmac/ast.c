@@ -31,14 +31,21 @@ const char *ast_get_kind_name(ASTKind kind) {
 }
 
 
+global_variable _Thread_local size_t g_ast_created_count;
+
 ASTBase *ast_create(ASTKind kind, size_t size) {
     ASTBase *node = (ASTBase *)ct_create(CT_TYPE_ASTBase, size - sizeof(ASTBase));
     node->magic = 0;//AST_MAGIC;
     node->kind = kind;
     
+    g_ast_created_count++;
     return node;
 }
 
+size_t ast_created_count() {
+    return g_ast_created_count;
+}
+
 //
 // Visitor acceptors
 //
@@ -350,6 +357,136 @@ type *ast_create_##name() {                                 \
 }
 #include "ast.def.h"
 
+global_variable int (*g_ast_accept_fns[])(ASTBase *, VisitFn, void *) = {
+#   define AST(kind, ...) accept_AST_##kind,
+#   include "ast.def.h"
+};
+
+void ASTBase_pointers(CTTypeInfo *type_info, CTRuntimeClass *runtime_class, void *writer, ASTBase *node) {
+    ct_image_add_pointer(writer, &node->parent);
+    ct_image_add_pointer(writer, &node->scope);
+    ct_image_add_pointer(writer, &node->inferred_type);
+    
+    switch (node->kind) {
+        case AST_TOPLEVEL:
+            ct_image_add_pointer(writer, &((ASTTopLevel*)node)->definitions);
+            ct_image_add_pointer(writer, &((ASTTopLevel*)node)->source);
+            ct_image_add_pointer(writer, &((ASTTopLevel*)node)->includes);
+            break;
+        case AST_BLOCK:
+            ct_image_add_pointer(writer, &((ASTBlock*)node)->statements);
+            break;
+        case AST_IDENT:
+            ct_image_add_pointer(writer, &((ASTIdent*)node)->declaration);
+            break;
+        case AST_STMT_RETURN:
+            ct_image_add_pointer(writer, &((ASTStmtReturn*)node)->expression);
+            break;
+        case AST_STMT_DECL:
+            ct_image_add_pointer(writer, &((ASTStmtDecl*)node)->declaration);
+            break;
+        case AST_STMT_EXPR:
+            ct_image_add_pointer(writer, &((ASTStmtExpr*)node)->expression);
+            break;
+        case AST_STMT_IF:
+            ct_image_add_pointer(writer, &((ASTStmtIf*)node)->condition);
+            ct_image_add_pointer(writer, &((ASTStmtIf*)node)->stmt_true);
+            ct_image_add_pointer(writer, &((ASTStmtIf*)node)->stmt_false);
+            break;
+        case AST_STMT_JUMP:
+            ct_image_add_pointer(writer, &((ASTStmtJump*)node)->label);
+            break;
+        case AST_STMT_LABELED:
+            ct_image_add_pointer(writer, &((ASTStmtLabeled*)node)->label);
+            ct_image_add_pointer(writer, &((ASTStmtLabeled*)node)->stmt);
+            break;
+        case AST_DECL_FUNC:
+            ct_image_add_pointer(writer, &((ASTDeclaration*)node)->name);
+            ct_image_add_pointer(writer, &((ASTDeclFunc*)node)->type);
+            ct_image_add_pointer(writer, &((ASTDeclFunc*)node)->params);
+            ct_image_add_pointer(writer, &((ASTDeclFunc*)node)->block);
+            ct_image_add_pointer(writer, &((ASTDeclFunc*)node)->lazy_scope);
+            break;
+        case AST_DECL_VAR:
+            ct_image_add_pointer(writer, &((ASTDeclaration*)node)->name);
+            ct_image_add_pointer(writer, &((ASTDeclVar*)node)->type);
+            ct_image_add_pointer(writer, &((ASTDeclVar*)node)->expression);
+            break;
+        case AST_EXPR_IDENT:
+            ct_image_add_pointer(writer, &((ASTExprIdent*)node)->name);
+            break;
+        case AST_EXPR_PAREN:
+            ct_image_add_pointer(writer, &((ASTExprParen*)node)->inner);
+            break;
+        case AST_EXPR_CAST:
+            ct_image_add_pointer(writer, &((ASTExprCast*)node)->type);
+            ct_image_add_pointer(writer, &((ASTExprCast*)node)->expr);
+            break;
+        case AST_EXPR_BINARY:
+            ct_image_add_pointer(writer, &((ASTExprBinary*)node)->left);
+            ct_image_add_pointer(writer, &((ASTExprBinary*)node)->op);
+            ct_image_add_pointer(writer, &((ASTExprBinary*)node)->right);
+            break;
+        case AST_EXPR_CALL:
+            ct_image_add_pointer(writer, &((ASTExprCall*)node)->callable);
+            ct_image_add_pointer(writer, &((ASTExprCall*)node)->args);
+            break;
+        case AST_PP_PRAGMA:
+            ct_image_add_pointer(writer, &((ASTPPPragma*)node)->arg);
+            break;
+        case AST_PP_DEFINITION:
+            ct_image_add_pointer(writer, &((ASTPPDefinition*)node)->name);
+            break;
+        case AST_TYPE_NAME:
+            ct_image_add_pointer(writer, &((ASTTypeName*)node)->name);
+            ct_image_add_pointer(writer, &((ASTTypeName*)node)->resolved_type);
+            break;
+        case AST_TYPE_POINTER:
+            ct_image_add_pointer(writer, &((ASTTypePointer*)node)->pointer_to);
+            break;
+        case AST_OPERATOR:
+        case AST_EXPR_EMPTY:
+        case AST_EXPR_NUMBER:
+        case AST_EXPR_STRING:
+        case AST_PP_IF:
+        case AST_TYPE_CONSTANT:
+            // Tokens and spellings are offsets, not pointers
+            break;
+        case AST_UNKNOWN:
+        case AST_STMT_BEGIN:
+        case AST_STMT_END:
+        case AST_DECL_BEGIN:
+        case AST_DECL_END:
+        case AST_EXPR_BEGIN:
+        case AST_EXPR_END:
+        case AST_TYPE_BEGIN:
+        case AST_TYPE_END:
+        case AST_LAST:
+            // Only mark where the groups of kinds are. Never made
+            break;
+        default:
+            assert(false && "node kind doesn't say where its pointers are");
+            break;
+    }
+}
+
+void ASTBase_layout(CTTypeInfo *type_info, CTRuntimeClass *runtime_class, void *describer) {
+    // Each kind has a struct of its own
+#   define AST(ucase_name, name, type) {                    \
+        type probe = {};                                    \
+        ((ASTBase*)&probe)->kind = AST_##ucase_name;        \
+        ct_image_describe(describer, &probe, sizeof(type)); \
+    }
+#   include "ast.def.h"
+}
+
+void ASTBase_thaw(CTTypeInfo *type_info, CTRuntimeClass *runtime_class, ASTBase *node) {
+    // Function pointers and visit data don't survive being written to an image
+    assert(node->kind < AST_LAST);
+    node->accept = g_ast_accept_fns[node->kind];
+    node->visit_data = NULL;
+}
+
 int ast_visit(ASTBase *node, VisitFn visitor, void *ctx) {
     return node->accept(node, visitor, ctx);
 }
@@ -374,11 +511,12 @@ void ast_fprint(FILE *f, ASTBase *node, int indent_level) {
     }
     indent[indent_level] = 0;
     
-    fprintf(f, "%s%d:%s", indent, node->location.line, ast_get_kind_name(node->kind));
+    fprintf(f, "%s%d:%s", indent, source_location_line(node->location), ast_get_kind_name(node->kind));
     if (AST_IS(node, AST_DECL_VAR) || AST_IS(node, AST_IDENT)) {
-        size_t content_size = node->location.range_end - node->location.range_start;
+        size_t content_size = node->location.length;
         char content[content_size + 1];
-        char *pc = (char *)node->location.range_start;
+        const char *pc = content_size > 0 ?
+            (const char *)source_manager_pointer(node->location.start) : NULL;
         for (int i = 0; i < content_size; i++) {
             content[i] = *pc++;
             if (content[i] == '\n') content[i] = '$';
@@ -397,7 +535,6 @@ void ast_fprint(FILE *f, ASTBase *node, int indent_level) {
 
 Scope *ast_nearest_scope(ASTBase *node) {
     assert(node && "node should not be null");
-    assert(node->location.ctx && "node scope not searchable without parse context");
     
     if (node->scope != NULL) {
         // That's convenient
@@ -414,7 +551,8 @@ Scope *ast_nearest_scope(ASTBase *node) {
         search_node = search_node->parent;
     }
     
-    Context *ctx = node->location.ctx;
+    Context *ctx = context_for_location(node->location);
+    assert(ctx && "node scope not searchable without parse context");
     assert(ctx->active_scope && "context does not have an active scope");
     
     // Might as well cache it now. It's not like it's going to change
@@ -471,12 +609,18 @@ ASTBase *ast_ident_find_label(ASTIdent *name) {
     Scope *scope = ast_nearest_scope((ASTBase*)name);
     assert(scope);
     
-    List_FOREACH(ASTStmtLabeled*, stmt, scope->labels, {
-        if (spelling_equal(AST_BASE(name)->location.spelling,
-                           AST_BASE(stmt->label)->location.spelling)) {
-            return (ASTBase*)stmt;
-        }
-    });
+    // Labels belong to the whole function, so a goto in a nested block can
+    // see the labels of the blocks around it
+    while (scope != NULL) {
+        List_FOREACH(ASTStmtLabeled*, stmt, scope->labels, {
+            if (spelling_equal(AST_BASE(name)->location.spelling,
+                               AST_BASE(stmt->label)->location.spelling)) {
+                return (ASTBase*)stmt;
+            }
+        });
+        
+        scope = scope->parent;
+    }
     
     return NULL;
 }
@@ -492,6 +636,18 @@ bool ast_ident_is_type_name(ASTIdent *name) {
     
 }
 
+ASTBlock *ast_decl_func_block(ASTDeclFunc *fn) {
+    if (fn->block == NULL && fn->lazy_body.start != SOURCE_OFFSET_NONE) {
+        parser_parse_lazy_body(fn);
+    }
+    
+    return fn->block;
+}
+
+bool ast_decl_func_has_body(ASTDeclFunc *fn) {
+    return fn->block != NULL || fn->lazy_body.start != SOURCE_OFFSET_NONE;
+}
+
 ASTTypeExpression *ast_typename_resolve(ASTTypeName *name) {
     if (name->resolved_type != NULL) {
         return name->resolved_type;
@@ -566,7 +722,7 @@ ASTTypeExpression *ast_type_get_canonical_type(ASTTypeExpression *type) {
 uint32_t ast_type_next_type_id() {
     // TODO(bloggins): Common types should probably be pre-reserved for more stable
     // type ids
-    static uint32_t next_id = 1;
+    static _Atomic uint32_t next_id = 1;
     
     return next_id++;
 }
@@ -150,8 +150,15 @@ typedef struct {
     List *params;
     bool has_varargs;
     
+    /* Use ast_decl_func_block, which parses a lazy body the first time it's
+     * asked for */
     struct ASTBlock *block;
     
+    /* A body that hasn't been parsed yet (braces and all) and the scope of
+     * the parameters it's parsed in */
+    SourceLocation lazy_body;
+    struct Scope *lazy_scope;
+    
 } ASTDeclFunc;
 
 typedef struct {
@@ -222,6 +229,14 @@ typedef struct {
     ASTBase base;
     
     List *definitions;
+    
+    /* The file the top level was parsed from */
+    struct SourceFile *source;
+    
+    /* The top levels of the files it included. Their definitions were
+     * merged into this one, but their offsets still point into their own
+     * source, which images have to carry along */
+    List *includes;
 } ASTTopLevel;
 
 // see http://jhnet.co.uk/articles/cpp_magic for fun
@@ -313,6 +328,9 @@ typedef struct {
 
 
 const char *ast_get_kind_name(ASTKind kind);
+
+/* How many nodes this thread has made */
+size_t ast_created_count();
 int ast_visit(ASTBase *node, VisitFn visitor, void *ctx);
 void ast_visit_data_clean(ASTBase *node);
 struct Scope *ast_nearest_scope(ASTBase *node);
@@ -323,6 +341,8 @@ bool ast_node_is_type_expression(ASTBase *node);
 ASTDeclaration* ast_ident_find_declaration(ASTIdent *ident);
 ASTBase *ast_ident_find_label(ASTIdent *name);
 bool ast_ident_is_type_name(ASTIdent *name);
+struct ASTBlock *ast_decl_func_block(ASTDeclFunc *fn);
+bool ast_decl_func_has_body(ASTDeclFunc *fn);
 ASTTypeExpression *ast_typename_resolve(ASTTypeName *name);
 ASTTypeExpression *ast_type_get_canonical_type(ASTTypeExpression *type);
 uint32_t ast_type_next_type_id();
@@ -39,8 +39,14 @@ CI_OP(CIO_DECLARE_FR_VERSION)
  */
 CI_OP(CIO_PUSH_U64)
 
-CI_OP(CIO_PUSH_NODE)  /* kind, sl_start */
-CI_OP(CIO_POP_NODE)   /* sl_end */
+/* 1:u8 kind
+ * ->u64 node (index into the image's node table)
+ *
+ * note: marks the start of the code for a node. The image's code spans say
+ *       where each node's code starts and ends
+ */
+CI_OP(CIO_PUSH_NODE)
+CI_OP(CIO_POP_NODE)
 
 /* ->u64 integer (the integer value as determined by the lexer or parser)
  *
@@ -59,15 +65,17 @@ CI_OP(CIO_NEW_IDENTIFIER)
  */
 CI_OP(CIO_NEW_BINDING)
 
-/* ->u64 kind (ASTKind value)
- * ->u64 source_id (index into the value table)
- * ->u64 start (offset into the source data)
- * ->u64 end (offset into the source data)
+/* ->u64 constant_id (index into the image's string constant table)
+ *
+ * <-u64 value_id (index into the value table)
+ */
+CI_OP(CIO_NEW_STRING_LITERAL)
+
+/* ->u64 node_index (index into the image's AST node table)
  *
  * <-u64 node_id (index in the value table)
  *
- * note: if a node already exists with the given parameters, 
- *       the existing ID will be returned
+ * note: a new node value is created every time this runs
  */
 CI_OP(CIO_NEW_AST_NODE)
 
@@ -75,10 +83,18 @@ CI_OP(CIO_NEW_AST_NODE)
 CI_OP(CIO_PUSH_IP)    /* no-args, pushes instruction pointer on the stack */
 CI_OP(CIO_JUMP)       /* no-args, jumps to the instruction at the address on the top of the stack */
 
+/* ->u64 condition_id (index into the value table)
+ * ->u64 address (offset into the code)
+ *
+ * jumps to address if the condition is zero, otherwise continues
+ */
+CI_OP(CIO_JUMP_UNLESS)
+
 /*
  * ->u64 lhs_value_id (index into the value table)
  * ->u64 op_id (index into the value table)
  * ->u64 rhs_value_id (index into the value table)
+ * ->u64 op_kind (TokenKind of the operator)
  *
  * <-u64 result_id (index into the value table)
  *
@@ -86,17 +102,59 @@ CI_OP(CIO_JUMP)       /* no-args, jumps to the instruction at the address on the
  */
 CI_OP(CIO_BINOP)
 
-/* ->u64 callable_id (index into the value table)
- * ->u64 arg_id_first (index into the value table)
+/* ->u64 arg_id_first (index into the value table)
  *     ...
  * ->u64 arg_id_last
  * ->u64 arg_count
- * ->864 callable_id (the same as the first)
+ * ->u64 function_id (index into the image's function table)
  *
  * <-u64 result_id (index into the value table)
  */
 CI_OP(CIO_CALL)
 
+/* ->u64 value_id (index into the value table)
+ *
+ * <-u64 value_id (the same value, now owned by the caller)
+ *
+ * note: returns to the instruction after the CIO_CALL that made the frame
+ */
+CI_OP(CIO_RETURN)
+
+/* Variables */
+
+/* ->u64 global_id (index of the global slot)
+ *
+ * <-u64 value_id (index into the value table)
+ */
+CI_OP(CIO_LOAD_GLOBAL)
+
+/* ->u64 value_id (index into the value table)
+ * ->u64 global_id (index of the global slot)
+ *
+ * <-u64 value_id (the global's value, now a copy of the stored one)
+ */
+CI_OP(CIO_STORE_GLOBAL)
+
+/* ->u64 local_id (index of the slot in the current frame)
+ *
+ * <-u64 value_id (index into the value table)
+ */
+CI_OP(CIO_LOAD_LOCAL)
+
+/* ->u64 value_id (index into the value table)
+ * ->u64 local_id (index of the slot in the current frame)
+ *
+ * <-u64 value_id (the local's value, now a copy of the stored one)
+ */
+CI_OP(CIO_STORE_LOCAL)
+
+/* ->u64 value_id (index into the value table)
+ *
+ * note: the dropped value becomes the result of the interpretation if it's
+ *       the last one dropped
+ */
+CI_OP(CIO_DROP)
+
 /* must be last */
 CI_OP(CIO_LAST)
 
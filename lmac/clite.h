@@ -57,16 +57,58 @@ const char *diag_get_name(DiagKind kind);
 void diag_vfemit(DiagKind kind, int error, SourceLocation* loc, FILE *f, const char *fmt, va_list args);
 void diag_emit(DiagKind kind, int error, SourceLocation *loc, const char *fmt, ...);
 void diag_printf(DiagKind kind, SourceLocation* loc, const char *fmt, ...);
-extern int diag_errno;
-extern void *diag_exception_env;
+extern _Thread_local int diag_errno;
+extern _Thread_local void *diag_exception_env;
 
 Token lexer_next_token(Context *ctx);
-Token lexer_peek_token(Context *ctx);
-void lexer_put_back(Context *ctx, Token token);
+size_t lexer_token_count();
+size_t lexer_thread_token_count();
+void lexer_token_count_flush();
 Token lexer_lex_chunk(Context *ctx, char end_of_chunk_marker,
                       char chunk_marker_escape);
+bool lexer_skip_block(Context *ctx, SourceLocation *block);
+Token lexer_skip_conditional(Context *ctx, bool stop_at_else);
+
+/* The tokens after ctx->pos, without whitespace or comments. They come out of
+ * the context's lookahead, so looking at them again (or backing up over
+ * them) doesn't lex them again */
+Token lexer_take_token(Context *ctx);
+Token lexer_peek_token(Context *ctx, size_t depth);
+void lexer_put_back(Context *ctx, Token token);
+
+struct Lookahead *lexer_lookahead_create();
+void lexer_lookahead_destroy(struct Lookahead *la);
+
+/* Forgets the tokens. For when the text under them changes */
+void lexer_lookahead_flush(struct Lookahead *la);
 
+typedef struct {
+    /* Remember what backtracked rules did at each position so the next
+     * alternative doesn't parse the same prefix again */
+    bool memoize;
+    
+    /* Count what each rule's backtracking throws away (see
+     * parser_profile_report) */
+    bool profile;
+} ParserOptions;
+
+extern ParserOptions parser_options;
+
+struct ParseMemo;
 void parser_parse(Context *ctx);
+void parser_parse_lazy_body(ASTDeclFunc *fn);
+void parser_parse_bodies(Context *ctx, size_t thread_count);
+
+/* Replaces removed bytes at start (from the start of the file ctx parsed)
+ * with text and brings ctx->ast up to date, parsing as little as it can.
+ * Returns how many bytes of source it looked at again. Anything computed
+ * from the tree (analysis, images) has to be computed again */
+size_t parser_reparse(Context *ctx, size_t start, size_t removed, const char *text, size_t length);
+void parser_memo_stats(size_t *hits, size_t *misses);
+void parser_memo_destroy(struct ParseMemo *memo);
+
+/* Reports how often each rule backtracked and what that cost, worst first */
+void parser_profile_report();
 
 // AST Creation functions
 #define AST(_, name, type)                          \
@@ -74,9 +116,55 @@ type *ast_create_##name();
 #include "ast.def.h"
 
 void analyzer_analyze(ASTBase *ast);
+typedef struct {
+    /* Remember what pure functions returned for each set of arguments and
+     * reuse it. Only pays off for programs that repeat calls, so it's off
+     * unless asked for (the other memo options turn it on) */
+    bool memoize;
+    
+    /* Print memoization hit/miss counts after interpreting */
+    bool memo_stats;
+
+    /* Load and save memoized results in the build cache */
+    bool memo_cache;
+
+    /* Compile pure functions to a native shared object in the build cache
+     * and call them through it once it's there
+     */
+    bool aot;
+
+    /* Sample the VM while it runs and report where the time went */
+    bool profile;
+
+    /* Always assemble, even code the tree walker could evaluate */
+    bool bytecode_only;
+} InterpOptions;
+
+extern InterpOptions interp_options;
+
 bool interp_interpret(ASTBase *node, ASTBase **result);
+bool interp_interpret_units(ASTBase **units, size_t count);
+int interp_run(ASTBase *node);
+void interp_tier_stats(size_t *walked, size_t *promoted, size_t *assembled);
+void *interp_snapshot_heap(ASTBase *node, Scope *scope, size_t *size);
+void interp_preload(Scope *scope, const void *heap, size_t size);
+
+struct CIImage;
+void interp_share();
+struct CIImage *interp_assemble(ASTBase *node);
+int interp_execute(struct CIImage *image, FILE *result_out);
+void interp_image_destroy(struct CIImage *image);
+
 void codegen_generate(FILE *f, ASTBase *ast);
+void codegen_generate_functions(FILE *f, ASTDeclFunc **fns, size_t count);
 int run_cmd(const char *action, const char *fmt, ...);
 int run_compile(Context *ctx, bool run_program);
+int run_fast_start(Context *ctx);
+const char *run_cache_dir();
+uint64_t run_hash(const uint8_t *data, size_t length);
+bool run_build_in_background(const char *source, size_t source_size,
+                             const char *cc_flags, const char *out_file);
+
+int serve_listen(const char *socket_path, Scope *image_scope, size_t thread_count);
 
 #endif
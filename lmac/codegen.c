@@ -18,6 +18,9 @@ int cg_visitor(ASTBase *node, VisitPhase phase, void *ctx);
 typedef struct {
     FILE *f;
     bool explicit_parens;
+
+    /* Emit function declarations without their bodies */
+    bool prototypes_only;
 } CGContext;
 
 #define CG_VISIT_FN(kind, type) int cg_visit_##kind(type *node, VisitPhase phase, CGContext *ctx)
@@ -36,9 +39,9 @@ void cg_emit_srcline(CGContext *ctx, ASTBase *node) {
     
     // TODO(bloggins): sometimes line numbers are off (probably a problem
     // with parsed_source_location or other SourceLocation operations)
-    uint32_t line = node->location.line;
-    const char *filename = (node->location.ctx && node->location.ctx->file) ?
-        node->location.ctx->file : NULL;
+    uint32_t line = source_location_line(node->location);
+    SourceFile *source = source_manager_lookup(node->location.start);
+    const char *filename = source ? source->name : NULL;
     
     if (filename == NULL || filename[0] == 0 || filename[0] == '\n') {
         // TODO(bloggins): It's a bug that we have to worry about this
@@ -60,7 +63,9 @@ CG_VISIT_FN(AST_TYPE_NAME, ASTTypeName) {
         assert(false && "should never get to post visit");
     }
     
-    if (node->resolved_type == NULL) {
+    // Names that nothing has looked at yet (like the locals of a function
+    // the interpreter compiles) get resolved here
+    if (node->resolved_type == NULL && ast_typename_resolve(node) == NULL) {
         diag_emit(DIAG_FATAL, ERR_CODEGEN, &AST_BASE(node)->location, "type name %s "
                     "was never resolved", spelling_cstring(node->name->base.location.spelling));
     }
@@ -214,9 +219,9 @@ CG_VISIT_FN(AST_DECL_FUNC, ASTDeclFunc) {
         List_FOREACH(ASTDeclaration *, param, node->params, {
             if (!first_param) {
                 CG(", ");
-                first_param = false;
             }
             CGVISIT(param);
+            first_param = false;
         });
         
         if (node->has_varargs) {
@@ -225,8 +230,8 @@ CG_VISIT_FN(AST_DECL_FUNC, ASTDeclFunc) {
         
         CG(")");
         
-        if (node->block != NULL) {
-            CGVISIT(node->block);
+        if (ast_decl_func_has_body(node) && !ctx->prototypes_only) {
+            CGVISIT(ast_decl_func_block(node));
         } else {
             CG(";"); CGNL();
         }
@@ -543,3 +548,23 @@ void codegen_generate(FILE *f, ASTBase *ast) {
     ast_visit(ast, cg_visitor, &cgctx);
     ast_visit_data_clean(ast);
 }
+
+void codegen_generate_functions(FILE *f, ASTDeclFunc **fns, size_t count) {
+    CGContext cgctx = {};
+    cgctx.f = f;
+    
+    fprintf(f, "// This is a generated file. Do not edit\n");
+    fprintf(f, "#include <stdint.h>\n");
+    
+    // Prototypes first so the functions can call each other in any order
+    cgctx.prototypes_only = true;
+    for (size_t idx = 0; idx < count; idx++) {
+        ast_visit((ASTBase*)fns[idx], cg_visitor, &cgctx);
+    }
+    
+    cgctx.prototypes_only = false;
+    for (size_t idx = 0; idx < count; idx++) {
+        ast_visit((ASTBase*)fns[idx], cg_visitor, &cgctx);
+        ast_visit_data_clean((ASTBase*)fns[idx]);
+    }
+}
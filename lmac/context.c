@@ -7,22 +7,206 @@
 //
 
 #include "clite.h"
-#include <unistd.h>
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+#define INCLUDE_CACHE_INITIAL_CAPACITY  16
+
+void default_dealloc(CTTypeInfo *type_info, CTRuntimeClass *runtime_class, void *obj);
+
+#pragma mark Include Cache
+
+static size_t include_cache_hash(dev_t device, ino_t inode) {
+    uint64_t h = ((uint64_t)device * 0x9E3779B97F4A7C15ull) ^ (uint64_t)inode;
+    h ^= h >> 29;
+    h *= 0xBF58476D1CE4E5B9ull;
+    return (size_t)(h ^ (h >> 32));
+}
+
+/* The slot for a file, or the empty slot it would go in */
+static IncludeCacheEntry *include_cache_slot(IncludeCache *cache, dev_t device, ino_t inode) {
+    size_t mask = cache->capacity - 1;
+    size_t idx = include_cache_hash(device, inode) & mask;
+    while (true) {
+        IncludeCacheEntry *entry = &cache->entries[idx];
+        if (entry->path == NULL || (entry->device == device && entry->inode == inode)) {
+            return entry;
+        }
+        
+        idx = (idx + 1) & mask;
+    }
+}
+
+static void include_cache_grow(IncludeCache *cache) {
+    IncludeCacheEntry *old = cache->entries;
+    size_t old_capacity = cache->capacity;
+    
+    cache->capacity = old_capacity ? old_capacity * 2 : INCLUDE_CACHE_INITIAL_CAPACITY;
+    cache->entries = calloc(cache->capacity, sizeof(IncludeCacheEntry));
+    for (size_t idx = 0; idx < old_capacity; idx++) {
+        if (old[idx].path != NULL) {
+            *include_cache_slot(cache, old[idx].device, old[idx].inode) = old[idx];
+        }
+    }
+    
+    free(old);
+}
+
+static void include_cache_destroy(IncludeCache *cache) {
+    for (size_t idx = 0; idx < cache->capacity; idx++) {
+        free(cache->entries[idx].path);
+        free(cache->entries[idx].guard);
+    }
+    
+    for (size_t idx = 0; idx < cache->directory_count; idx++) {
+        HeaderDirectory *dir = &cache->directories[idx];
+        for (size_t name_idx = 0; name_idx < dir->name_capacity; name_idx++) {
+            free(dir->names[name_idx]);
+        }
+        free(dir->names);
+        free(dir->path);
+    }
+    
+    for (size_t idx = 0; idx < cache->lookup_capacity; idx++) {
+        free(cache->lookups[idx].name);
+        free(cache->lookups[idx].path);
+    }
+    
+    free(cache->directories);
+    free(cache->lookups);
+    free(cache->entries);
+    free(cache);
+}
+
+#pragma mark Header Search
+
+/* FNV-1a */
+static size_t header_hash(const char *name, size_t length) {
+    uint64_t h = 0xCBF29CE484222325ull;
+    for (size_t idx = 0; idx < length; idx++) {
+        h ^= (uint8_t)name[idx];
+        h *= 0x100000001B3ull;
+    }
+    
+    return (size_t)h;
+}
+
+/* The slot for a name, or the empty slot it would go in */
+static char **header_directory_slot(HeaderDirectory *dir, const char *name, size_t length) {
+    size_t mask = dir->name_capacity - 1;
+    size_t idx = header_hash(name, length) & mask;
+    while (true) {
+        char *entry = dir->names[idx];
+        if (entry == NULL || (!strncmp(entry, name, length) && entry[length] == 0)) {
+            return &dir->names[idx];
+        }
+        
+        idx = (idx + 1) & mask;
+    }
+}
+
+static void header_directory_read(HeaderDirectory *dir) {
+    size_t count = 0;
+    dir->name_capacity = INCLUDE_CACHE_INITIAL_CAPACITY;
+    dir->names = calloc(dir->name_capacity, sizeof(char*));
+    
+    DIR *d = opendir(dir->path);
+    if (d == NULL) {
+        // Nothing will be found here, which is what we want
+        return;
+    }
+    
+    struct dirent *dent = NULL;
+    while ((dent = readdir(d)) != NULL) {
+        if ((count + 1) * 2 > dir->name_capacity) {
+            char **old = dir->names;
+            size_t old_capacity = dir->name_capacity;
+            
+            dir->name_capacity *= 2;
+            dir->names = calloc(dir->name_capacity, sizeof(char*));
+            for (size_t idx = 0; idx < old_capacity; idx++) {
+                if (old[idx] != NULL) {
+                    *header_directory_slot(dir, old[idx], strlen(old[idx])) = old[idx];
+                }
+            }
+            free(old);
+        }
+        
+        char **slot = header_directory_slot(dir, dent->d_name, strlen(dent->d_name));
+        if (*slot == NULL) {
+            *slot = strdup(dent->d_name);
+            count++;
+        }
+    }
+    
+    closedir(d);
+}
+
+/* A search directory's names. Each directory is only read once */
+static HeaderDirectory *header_directory_get(IncludeCache *cache, const char *path) {
+    for (size_t idx = 0; idx < cache->directory_count; idx++) {
+        if (!strcmp(cache->directories[idx].path, path)) {
+            return &cache->directories[idx];
+        }
+    }
+    
+    cache->directories = realloc(cache->directories,
+                                 (cache->directory_count + 1) * sizeof(HeaderDirectory));
+    HeaderDirectory *dir = &cache->directories[cache->directory_count++];
+    *dir = (HeaderDirectory){};
+    dir->path = strdup(path);
+    header_directory_read(dir);
+    
+    return dir;
+}
+
+static HeaderLookup *header_lookup_slot(IncludeCache *cache, const char *name, bool system_include) {
+    size_t mask = cache->lookup_capacity - 1;
+    size_t idx = (header_hash(name, strlen(name)) + system_include) & mask;
+    while (true) {
+        HeaderLookup *lookup = &cache->lookups[idx];
+        if (lookup->name == NULL ||
+            (lookup->system == system_include && !strcmp(lookup->name, name))) {
+            return lookup;
+        }
+        
+        idx = (idx + 1) & mask;
+    }
+}
+
+static void header_lookup_grow(IncludeCache *cache) {
+    HeaderLookup *old = cache->lookups;
+    size_t old_capacity = cache->lookup_capacity;
+    
+    cache->lookup_capacity = old_capacity ? old_capacity * 2 : INCLUDE_CACHE_INITIAL_CAPACITY;
+    cache->lookups = calloc(cache->lookup_capacity, sizeof(HeaderLookup));
+    for (size_t idx = 0; idx < old_capacity; idx++) {
+        if (old[idx].name != NULL) {
+            *header_lookup_slot(cache, old[idx].name, old[idx].system) = old[idx];
+        }
+    }
+    
+    free(old);
+}
 
 #pragma mark CT VTABLE Overrides
 
 void Context_dump(CTTypeInfo *type_info, CTRuntimeClass *runtime_class, FILE *f, Context *ctx) {
     fprintf(f, "<Context 0x%x>\n", (unsigned int)ctx);
     const char *indent = "    ";
-    fprintf(f, "%sFile: %s\n", indent, ctx->file);
-    if (ctx->pos < (ctx->buf + ctx->buf_size - 1)) {
-        fprintf(f, "%sLine: %d\n", indent, ctx->line);
+    if (ctx->source == NULL) {
+        fprintf(f, "%sNO SOURCE\n", indent);
+        return;
+    }
+    
+    fprintf(f, "%sFile: %s\n", indent, ctx->source->name);
+    if (ctx->pos < (ctx->source->buf + ctx->source->size - 1)) {
+        fprintf(f, "%sLine: %d\n", indent, source_manager_line(context_offset(ctx, ctx->pos)));
         fprintf(f, "%sAround:\n", indent);
     
         Spelling sp_ctx = {};
-        sp_ctx.ctx = ctx;
-        sp_ctx.start = ctx->pos;
-        sp_ctx.end = ctx->pos;
+        sp_ctx.start = context_offset(ctx, ctx->pos);
         
         spelling_line_fprint(f, sp_ctx);
     } else {
@@ -30,10 +214,59 @@ void Context_dump(CTTypeInfo *type_info, CTRuntimeClass *runtime_class, FILE *f,
     }
 }
 
+void Context_pointers(CTTypeInfo *type_info, CTRuntimeClass *runtime_class, void *writer, Context *ctx) {
+    // NOTE(bloggins): The source file is a CT object and adds its own text
+    List_FOREACH(char *, hpath, ctx->system_header_paths, {
+        ct_image_add_blob(writer, hpath, strlen(hpath) + 1);
+    })
+    
+    ct_image_add_pointer(writer, &ctx->source);
+    ct_image_add_pointer(writer, &ctx->system_header_paths);
+    ct_image_add_pointer(writer, &ctx->pos);
+    ct_image_add_pointer(writer, &ctx->active_scope);
+    ct_image_add_pointer(writer, &ctx->pp_defines);
+    ct_image_add_pointer(writer, &ctx->ast);
+    
+    // The lookahead, include cache and parse memo are put back by thaw
+}
+
+void Context_dealloc(CTTypeInfo *type_info, CTRuntimeClass *runtime_class, Context *ctx) {
+    if (ctx->owns_include_cache && ctx->include_cache != NULL) {
+        include_cache_destroy(ctx->include_cache);
+    }
+    
+    if (ctx->parse_memo != NULL) {
+        // The parse was cut short by an error
+        parser_memo_destroy(ctx->parse_memo);
+    }
+    
+    if (ctx->lookahead != NULL) {
+        lexer_lookahead_destroy(ctx->lookahead);
+    }
+    
+    default_dealloc(type_info, runtime_class, ctx);
+}
+
+void Context_thaw(CTTypeInfo *type_info, CTRuntimeClass *runtime_class, Context *ctx) {
+    // The cache isn't in the image. Anything included after the image is
+    // loaded starts a new one
+    ctx->include_cache = NULL;
+    ctx->owns_include_cache = false;
+    ctx->parse_memo = NULL;
+    ctx->lookahead = lexer_lookahead_create();
+}
+
 #pragma mark normal functions
 
+_Thread_local Context *g_thread_context = NULL;
+
 Context *context_create() {
-    return ct_create(CT_TYPE_Context, 0);
+    Context *ctx = ct_create(CT_TYPE_Context, 0);
+    
+    // NOTE(bloggins): Not made when it's first needed, since snapshots taken
+    // before that would put it back to NULL
+    ctx->lookahead = lexer_lookahead_create();
+    return ctx;
 }
 
 Scope *context_scope_push(Context *ctx) {
@@ -60,27 +293,141 @@ Scope *context_scope_pop(Context *ctx) {
 
 void context_load_file(Context *ctx, const char *filename) {
     assert(filename);
-    assert(!ctx->file && "context shouldn't already have a file");
+    assert(!ctx->source && "context shouldn't already have a file");
     
-    if (access(filename, R_OK) == -1) {
+    SourceFile *source = source_manager_load(filename);
+    if (source == NULL) {
         diag_emit(DIAG_ERROR, ERR_FILE_NOT_FOUND, NULL, "input file not found (%s)", filename);
     }
     
-    // TODO(bloggins): this is probably not the most memory efficient thing we could do
-    //                  (mmap it)
-    FILE *fp = fopen(filename, "rb");
-    fseek(fp, 0, SEEK_END);
-    long fsize = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
+    context_load_source(ctx, source);
+}
+
+void context_load_source(Context *ctx, SourceFile *source) {
+    assert(source);
+    assert(!ctx->source && "context shouldn't already have a file");
+    
+    ctx->source = source;
+    ctx->pos = source->buf;
+    
+    source->ctx = ctx;
+}
+
+void context_rewind(Context *ctx) {
+    assert(ctx->source && "context doesn't have a file");
+    
+    ctx->pos = ctx->source->buf;
+    lexer_lookahead_flush(ctx->lookahead);
+    ctx->ast = NULL;
+    ctx->pp_defines = NULL;
+    ctx->pp_open_groups = 0;
+    ctx->pragma_once = false;
+    ctx->pp_conditional = false;
+    ctx->last_error = 0;
+    
+    // NOTE(bloggins): The contexts of the headers we included still point at
+    // the old cache (their lazy bodies might include things), so it can't be
+    // freed. Headers are read again into a new one.
+    ctx->include_cache = NULL;
+    ctx->owns_include_cache = false;
+}
+
+IncludeCache *context_include_cache(Context *ctx) {
+    if (ctx->include_cache == NULL) {
+        ctx->include_cache = calloc(1, sizeof(IncludeCache));
+        ctx->owns_include_cache = true;
+    }
+    
+    return ctx->include_cache;
+}
+
+IncludeCacheEntry *context_include_find(Context *ctx, struct stat *st) {
+    IncludeCache *cache = ctx->include_cache;
+    if (cache == NULL || cache->count == 0) {
+        return NULL;
+    }
+    
+    IncludeCacheEntry *entry = include_cache_slot(cache, st->st_dev, st->st_ino);
+    if (entry->path == NULL || entry->mtime != st->st_mtime) {
+        // Never seen, or changed since we saw it
+        return NULL;
+    }
+    
+    return entry;
+}
+
+IncludeCacheEntry *context_include_add(Context *ctx, const char *path, struct stat *st) {
+    IncludeCache *cache = context_include_cache(ctx);
+    
+    // Keep the table at most half full so probes stay short
+    if ((cache->count + 1) * 2 > cache->capacity) {
+        include_cache_grow(cache);
+    }
+    
+    IncludeCacheEntry *entry = include_cache_slot(cache, st->st_dev, st->st_ino);
+    if (entry->path == NULL) {
+        cache->count++;
+    } else {
+        free(entry->path);
+        free(entry->guard);
+    }
+    
+    *entry = (IncludeCacheEntry){};
+    entry->path = strdup(path);
+    entry->device = st->st_dev;
+    entry->inode = st->st_ino;
+    entry->mtime = st->st_mtime;
+    
+    return entry;
+}
+
+const char *context_find_header(Context *ctx, const char *name, bool system_include,
+                                struct stat *st) {
+    IncludeCache *cache = context_include_cache(ctx);
+    size_t search_count = list_count(ctx->system_header_paths);
+    
+    if ((cache->lookup_count + 1) * 2 > cache->lookup_capacity) {
+        header_lookup_grow(cache);
+    }
+    
+    HeaderLookup *lookup = header_lookup_slot(cache, name, system_include);
+    if (lookup->name == NULL) {
+        lookup->name = strdup(name);
+        lookup->system = system_include;
+        cache->lookup_count++;
+    } else if (lookup->path != NULL || lookup->searched == search_count) {
+        *st = lookup->st;
+        return lookup->path;
+    }
+    
+    char *path = NULL;
+    if (system_include && name[0] != '/') {
+        // Only names the directory actually has are worth a stat. For
+        // "sys/types.h" that's "sys"
+        size_t component_length = strcspn(name, "/");
+        List_FOREACH(char *, hpath, ctx->system_header_paths, {
+            HeaderDirectory *dir = header_directory_get(cache, hpath);
+            if (*header_directory_slot(dir, name, component_length) == NULL) {
+                continue;
+            }
+            
+            asprintf(&path, "%s/%s", hpath, name);
+            if (stat(path, &lookup->st) == 0 && S_ISREG(lookup->st.st_mode)) {
+                break;
+            }
+            
+            free(path);
+            path = NULL;
+        })
+    }
+    
+    if (path == NULL && stat(name, &lookup->st) == 0 && S_ISREG(lookup->st.st_mode)) {
+        path = strdup(name);
+    }
     
-    ctx->buf = (uint8_t *)malloc(fsize + 1);
-    fread(ctx->buf, fsize, 1, fp);
-    fclose(fp);
+    lookup->path = path;
+    lookup->searched = search_count;
     
-    // Ensure null-termination
-    ctx->file = filename;
-    ctx->buf[fsize] = 0;
-    ctx->buf_size = fsize;
-    ctx->pos = ctx->buf;
-    ctx->line = 1;
+    *st = lookup->st;
+    return path;
 }
@@ -12,32 +12,100 @@
 #include "ast.h"
 #include "scope.h"
 
+#include <sys/stat.h>
+
+/* A header that's been included. Keyed by the file's identity, so the same
+ * header reached by two paths is still one header */
+typedef struct IncludeCacheEntry {
+    char *path;
+    dev_t device;
+    ino_t inode;
+    time_t mtime;
+    
+    /* The header's top level, reused when it's included again */
+    ASTTopLevel *ast;
+    
+    /* The macro an #ifndef around the whole header checks, if there is one */
+    char *guard;
+    
+    /* The header said #pragma once */
+    bool once;
+    
+    /* The header has #if, #ifdef or #ifndef groups, so what it declares
+     * depends on what's defined when it's included */
+    bool conditional;
+} IncludeCacheEntry;
+
+/* The names in a system header directory, read once */
+typedef struct HeaderDirectory {
+    char *path;
+    
+    /* Open addressing set of names */
+    size_t name_capacity;
+    char **names;
+} HeaderDirectory;
+
+/* Where an #include name led */
+typedef struct HeaderLookup {
+    char *name;
+    bool system;
+    
+    /* NULL if the header wasn't found */
+    char *path;
+    struct stat st;
+    
+    /* How many system header paths there were when we looked. A #pragma can
+     * add more, and a header we couldn't find might be in one of them */
+    size_t searched;
+} HeaderLookup;
+
+/* Every header included while compiling one file. Open addressing on the
+ * file's identity */
+typedef struct IncludeCache {
+    size_t count;
+    size_t capacity;
+    IncludeCacheEntry *entries;
+    
+    size_t directory_count;
+    HeaderDirectory *directories;
+    
+    /* Open addressing on the include name */
+    size_t lookup_count;
+    size_t lookup_capacity;
+    HeaderLookup *lookups;
+} IncludeCache;
+
 /*
  * Compiler Context
+ *
+ * A cursor over one source file. The source manager owns the text.
  */
 typedef struct Context {
     /* must be first in struct */
     int magic;
     
-    const char *file;
+    SourceFile *source;
     List *system_header_paths;
     
-    /* The entire contents of the current translation unit */
-    uint8_t *buf;
-    size_t buf_size;
-    
-    /* Current position indicators */
+    /* Current position. Lines come from the source file's line table */
     uint8_t *pos;
-    uint32_t line;
     
     struct {
         bool allow_toplevel_expressions;
+        
+        /* Function bodies are skipped over and only parsed when something
+         * asks for them (see ast_decl_func_block). The context has to live
+         * as long as the AST does */
+        bool lazy_bodies;
     } parse_mode;
     
     struct {
         bool lex_keywords_as_identifiers;
     } lex_mode;
     
+    /* The tokens the lexer saw last. Shared with the context's snapshots */
+    struct Lookahead *lookahead;
+    
     /* TODO(bloggins): Turn this into a list and control error termination
      * better */
     int last_error;
@@ -45,6 +113,31 @@ typedef struct Context {
     Scope *active_scope;
     List *pp_defines;
     
+    /* How many #if groups the cursor is in. The groups that aren't taken are
+     * skipped without being parsed, so these are all taken */
+    size_t pp_open_groups;
+    
+    /* Shared by a file's context and the contexts of everything it includes.
+     * The context that made it frees it */
+    IncludeCache *include_cache;
+    bool owns_include_cache;
+    
+    /* The file said #pragma once */
+    bool pragma_once;
+    
+    /* The file has an #if, #ifdef or #ifndef */
+    bool pp_conditional;
+    
+    /* What each memoized rule did at each position. Only while parsing */
+    struct ParseMemo *parse_memo;
+    
+    /* How much had been lexed and made when a snapshot was taken. Only
+     * with ParserOptions.profile */
+    struct {
+        size_t tokens;
+        size_t nodes;
+    } profile_mark;
+    
     /* Parsed AST */
     ASTBase *ast;
 } Context;
@@ -53,5 +146,43 @@ Context *context_create();
 Scope *context_scope_push(Context *ctx);
 Scope *context_scope_pop(Context *ctx);
 void context_load_file(Context *ctx, const char *filename);
+void context_load_source(Context *ctx, SourceFile *source);
+
+/* Puts the cursor back at the start of its file and forgets what parsing it
+ * did (defines, included headers), so the file can be parsed again */
+void context_rewind(Context *ctx);
+
+IncludeCache *context_include_cache(Context *ctx);
+IncludeCacheEntry *context_include_find(Context *ctx, struct stat *st);
+IncludeCacheEntry *context_include_add(Context *ctx, const char *path, struct stat *st);
+
+/* Finds the file an #include names, searching the system header paths for
+ * system includes. Returns NULL if there isn't one. The path belongs to the
+ * include cache */
+const char *context_find_header(Context *ctx, const char *name, bool system_include,
+                                struct stat *st);
+
+/* Converts between the cursor's pointers and source manager offsets */
+static inline SourceOffset context_offset(Context *ctx, const uint8_t *p) {
+    return ctx->source->base + (SourceOffset)(p - ctx->source->buf);
+}
+
+static inline uint8_t *context_pointer(Context *ctx, SourceOffset offset) {
+    return ctx->source->buf + (offset - ctx->source->base);
+}
+
+/* A copy of a file's context that this thread is parsing with. It stands in
+ * for the file's own (see parser_parse_bodies) */
+extern _Thread_local Context *g_thread_context;
+
+/* The context that parsed a location, if there is one */
+static inline Context *context_for_location(SourceLocation sl) {
+    SourceFile *source = source_manager_lookup(sl.start);
+    if (g_thread_context != NULL && source == g_thread_context->source) {
+        return g_thread_context;
+    }
+    
+    return source ? source->ctx : NULL;
+}
 
 #endif
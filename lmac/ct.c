@@ -16,7 +16,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #define VT_STDARGS  CTTypeInfo *type_info, CTRuntimeClass *runtime_class
 #define VT_STDCALL type_info, runtime_class
@@ -28,7 +33,10 @@ VTABLE_FN(ct_type_name, void, dealloc, (VT_STDCALL, obj), void * obj)\
 VTABLE_FN(ct_type_name, void, init, (VT_STDCALL, obj), void * obj)\
 VTABLE_FN(ct_type_name, void, retain, (VT_STDCALL, obj), void * obj)\
 VTABLE_FN(ct_type_name, void, release, (VT_STDCALL, obj), void * obj)\
-VTABLE_FN(ct_type_name, void, dump, (VT_STDCALL, f, obj), void *f, void *obj)
+VTABLE_FN(ct_type_name, void, dump, (VT_STDCALL, f, obj), void *f, void *obj)\
+VTABLE_FN(ct_type_name, void, pointers, (VT_STDCALL, writer, obj), void *writer, void *obj)\
+VTABLE_FN(ct_type_name, void, layout, (VT_STDCALL, describer), void *describer)\
+VTABLE_FN(ct_type_name, void, thaw, (VT_STDCALL, obj), void *obj)
 
 #pragma mark Default VTABLE prototypes
 
@@ -105,6 +113,9 @@ typedef struct CTInstancePool {
 
 static CTInstancePool *global_pool = NULL;
 
+/* Where this thread's objects go instead of global_pool (see ct_arena_begin) */
+static _Thread_local CTInstancePool *thread_arena = NULL;
+
 CTInstancePool *ct_pool_create(CTInstance *instance) {
     // TODO(bloggins): create chunks of space for this at a time
     CTInstancePool *pool = (CTInstancePool*)calloc(1, sizeof(CTInstancePool));
@@ -128,6 +139,7 @@ void ct_pool_insert(CTInstancePool *last, CTInstancePool *pool) {
     
     CTInstancePool *first = last->next;
     last->next = pool;
+    first->prev = pool;
     pool->next = first;
     pool->prev = last;
 }
@@ -184,6 +196,18 @@ void default_rtinit(CTTypeInfo *type_info, CTRuntimeClass *runtime_class) {
     if (runtime_class->dump_fn == NULL) {
         runtime_class->dump_fn = (CTDumpFn)default_dump;
     }
+    
+    if (runtime_class->pointers_fn == NULL) {
+        runtime_class->pointers_fn = default_pointers;
+    }
+    
+    if (runtime_class->layout_fn == NULL) {
+        runtime_class->layout_fn = default_layout;
+    }
+    
+    if (runtime_class->thaw_fn == NULL) {
+        runtime_class->thaw_fn = default_thaw;
+    }
 }
 
 void *default_alloc(CTTypeInfo *type_info, CTRuntimeClass *runtime_class, size_t extra_bytes) {
@@ -199,15 +223,19 @@ void *default_alloc(CTTypeInfo *type_info, CTRuntimeClass *runtime_class, size_t
     instance->runtime_class = runtime_class;
     instance->instance_size = instance_size;
     
-    // TODO(bloggins): alloc different instance pools?
-    if (global_pool == NULL) {
-        global_pool = ct_pool_create(NULL); /* null will mark the start of the pool */
-        global_pool->next = global_pool;
-        global_pool->prev = global_pool;
+    CTInstancePool *head = thread_arena;
+    if (head == NULL) {
+        if (global_pool == NULL) {
+            global_pool = ct_pool_create(NULL); /* null will mark the start of the pool */
+            global_pool->next = global_pool;
+            global_pool->prev = global_pool;
+        }
+        
+        head = global_pool;
     }
     
     CTInstancePool *pool = ct_pool_create(instance);
-    ct_pool_insert(global_pool->prev, pool);
+    ct_pool_insert(head->prev, pool);
     
     void *obj = ((uint8_t*)instance + sizeof(CTInstance));
     runtime_class->retain_fn(type_info, runtime_class, obj);
@@ -279,6 +307,28 @@ void default_dump(CTTypeInfo *type_info, CTRuntimeClass *runtime_class, void *f,
             (unsigned int)obj, CT_INSTANCE(obj)->refcount);
 }
 
+void default_pointers(CTTypeInfo *type_info, CTRuntimeClass *runtime_class, void *writer, void *obj) {
+    assert(writer);
+    assert(obj);
+    
+    // NOTE(bloggins): A type that doesn't say where its pointers are doesn't
+    // have any, as far as images are concerned
+}
+
+void default_layout(CTTypeInfo *type_info, CTRuntimeClass *runtime_class, void *describer) {
+    assert(describer);
+    
+    // Most types only come in one shape
+    void *probe = calloc(1, type_info->type_base_size);
+    ct_image_describe(describer, probe, type_info->type_base_size);
+    free(probe);
+}
+
+void default_thaw(CTTypeInfo *type_info, CTRuntimeClass *runtime_class, void *obj) {
+    assert(obj);
+    assert(CT_INSTANCE(obj)->magic == CTI_MAGIC);
+}
+
 #pragma Overridable Functions
 
 // NOTE(bloggins): These define the default implementation of
@@ -403,6 +453,66 @@ void ct_autorelease() {
     }
 }
 
+void *ct_arena_begin() {
+    assert(!thread_arena && "thread already has an arena");
+    
+    // Like global_pool, the null instance marks the start
+    thread_arena = ct_pool_create(NULL);
+    thread_arena->next = thread_arena;
+    thread_arena->prev = thread_arena;
+    
+    return thread_arena;
+}
+
+void ct_arena_end() {
+    thread_arena = NULL;
+}
+
+void ct_arena_merge(void *arena) {
+    CTInstancePool *head = arena;
+    assert(head && !head->instance);
+    
+    // Into this thread's own arena if it has one (like a service request)
+    CTInstancePool *into = thread_arena != NULL ? thread_arena : global_pool;
+    assert(into && "arenas are merged into an existing pool");
+    
+    if (head->next != head) {
+        // Splice the arena's objects onto the end of the pool
+        CTInstancePool *first = head->next;
+        CTInstancePool *last = head->prev;
+        CTInstancePool *into_last = into->prev;
+        
+        into_last->next = first;
+        first->prev = into_last;
+        last->next = into;
+        into->prev = last;
+    }
+    
+    free(head);
+}
+
+void ct_arena_release(void *arena) {
+    CTInstancePool *head = arena;
+    assert(head && !head->instance);
+    assert(head != thread_arena && "arena is still in use");
+    
+    CTInstancePool *pool = head->next;
+    while (pool != head) {
+        CTInstance *instance = pool->instance;
+        CTInstancePool *next = pool->next;
+        if (instance->refcount > 1) {
+            // Retained by something that outlives the arena. Its last
+            // release frees it
+            ct_pool_remove(instance);
+        }
+        
+        instance->runtime_class->release_fn(instance->type_info, instance->runtime_class, CT_OBJ(instance));
+        pool = next;
+    }
+    
+    free(head);
+}
+
 void ct_dump(void *obj) {
     if (obj == NULL) {
         fprintf(stderr, "<NULL>\n");
@@ -417,6 +527,462 @@ void ct_dump(void *obj) {
     instance->runtime_class->dump_fn(instance->type_info, instance->runtime_class, stderr, obj);
 }
 
+#pragma mark Images
+
+// IMAGE FORMAT:
+//
+// An image is a copy of every CT object reachable from a root object, plus
+// any other memory those objects point to (their "blobs", like source
+// buffers). It is meant to be mmap'd back in.
+//
+// Each type says where its pointers are from its pointers function (see
+// CTPointersFn). Those fields are stored as offsets from the start of the
+// image and recorded in the relocation table. A reported pointer to anything
+// that isn't in the image is a bug in the type, so it asserts. Every other
+// field is copied exactly, which is how integers that happen to look like
+// heap addresses survive, and thaw clears or rebuilds the ones that can't be
+// copied.
+//
+// Images only load into a build with the same CT_IMAGE_VERSION and the same
+// layout hash. The hash covers the size of every shape of every type and where
+// its pointers are (see CTLayoutFn), so a build whose structs or pointers
+// functions changed refuses old images instead of misreading them.
+//
+// @0:
+// CTImageHeader
+//
+// @objects_offset: [(* object_count)]
+// CTInstance (type_info holds the CTTypeID, pool and runtime_class are NULL)
+// [uint8_t] instance data
+//
+// @blobs_offset:
+// [uint8_t] blob data
+//
+// @extra_offset:
+// [uint8_t] extra data (extra_size)
+//
+// @relocations_offset: [(* relocation_count)]
+// uint64_t offset of a pointer to relocate
+//
+// @instances_offset: [(* object_count)]
+// uint64_t offset of each CTInstance
+
+#define CT_IMAGE_MAGIC      0x31474d49434d4cull   /* "LMCIMG1" */
+
+/* Bump when the format itself (the header, how objects are laid out in the
+ * file or relocated) changes */
+#define CT_IMAGE_VERSION    2
+#define CT_IMAGE_ALIGN      16
+
+/* Image objects must never be freed */
+#define CT_IMAGE_REFCOUNT   (1ull << 62)
+
+typedef struct {
+    uint64_t magic;
+    uint64_t version;
+    uint64_t layout_hash;
+    uint64_t size;
+
+    uint64_t root_offset;
+
+    uint64_t object_count;
+    uint64_t objects_offset;
+    uint64_t blobs_offset;
+
+    uint64_t extra_offset;
+    uint64_t extra_size;
+
+    uint64_t relocation_count;
+    uint64_t relocations_offset;
+    uint64_t instances_offset;
+} CTImageHeader;
+
+typedef struct {
+    uint8_t *start;
+    uint8_t *end;
+
+    CTInstance *instance;   /* NULL for blobs */
+    bool reachable;
+    uint64_t image_offset;  /* of the start */
+} CTImageRange;
+
+typedef struct {
+    size_t object_count;
+    CTImageRange *objects;  /* sorted by address */
+
+    size_t blob_count;
+    CTImageRange *blobs;
+
+    size_t worklist_count;
+    CTImageRange **worklist;
+
+    /* The object whose pointers are being reported */
+    CTImageRange *reporting;
+
+    /* Once everything is laid out, reported pointers are relocated into copy
+     * (the reporting object's place in the image) instead of marked */
+    bool copying;
+    uint8_t *copy;
+
+    size_t relocation_count;
+    uint64_t *relocations;
+
+    /* Set while working out the layout hash. Reported pointers go into the
+     * hash instead of the image */
+    bool describing;
+    CTTypeInfo *describing_type;
+    uint64_t layout_hash;
+} CTImageWriter;
+
+static void ct_image_hash(uint64_t *hash, const void *data, size_t size) {
+    // FNV-1a
+    for (size_t idx = 0; idx < size; idx++) {
+        *hash ^= ((const uint8_t*)data)[idx];
+        *hash *= 0x100000001b3ull;
+    }
+}
+
+static inline uint64_t ct_image_align(uint64_t offset) {
+    return (offset + CT_IMAGE_ALIGN - 1) & ~(uint64_t)(CT_IMAGE_ALIGN - 1);
+}
+
+static int ct_image_range_compare(const void *a, const void *b) {
+    const CTImageRange *r1 = a;
+    const CTImageRange *r2 = b;
+    return (r1->start > r2->start) - (r1->start < r2->start);
+}
+
+/* Finds the object or blob that contains ptr */
+static CTImageRange *ct_image_find(CTImageWriter *w, uint8_t *ptr) {
+    size_t lo = 0, hi = w->object_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        CTImageRange *r = &w->objects[mid];
+        if (ptr < r->start) {
+            hi = mid;
+        } else if (ptr >= r->end) {
+            lo = mid + 1;
+        } else {
+            return r;
+        }
+    }
+
+    // Blobs can be pointed to one past the end (like an end-of-buffer pointer)
+    for (size_t idx = 0; idx < w->blob_count; idx++) {
+        CTImageRange *r = &w->blobs[idx];
+        if (ptr >= r->start && ptr <= r->end) {
+            return r;
+        }
+    }
+
+    return NULL;
+}
+
+static void ct_image_mark(CTImageWriter *w, CTImageRange *r) {
+    if (r == NULL || r->reachable || r->instance == NULL) {
+        return;
+    }
+
+    r->reachable = true;
+    w->worklist = realloc(w->worklist, (w->worklist_count + 1) * sizeof(CTImageRange*));
+    w->worklist[w->worklist_count++] = r;
+}
+
+void ct_image_add_blob(void *writer, const void *blob, size_t size) {
+    CTImageWriter *w = writer;
+    if (blob == NULL || w->describing) {
+        return;
+    }
+
+    for (size_t idx = 0; idx < w->blob_count; idx++) {
+        if (w->blobs[idx].start == blob) {
+            return;
+        }
+    }
+
+    assert(!w->copying && "blobs must be reported the same way every time");
+    w->blobs = realloc(w->blobs, (w->blob_count + 1) * sizeof(CTImageRange));
+    CTImageRange *r = &w->blobs[w->blob_count++];
+    memset(r, 0, sizeof(CTImageRange));
+    r->start = (uint8_t*)blob;
+    r->end = (uint8_t*)blob + size;
+    r->reachable = true;
+}
+
+void ct_image_add_pointer(void *writer, const void *field) {
+    CTImageWriter *w = writer;
+    CTImageRange *r = w->reporting;
+    assert(r);
+    assert((uint8_t*)field >= r->start && (uint8_t*)field + sizeof(void*) <= r->end &&
+           "pointers must be fields of the object reporting them");
+
+    if (w->describing) {
+        uint64_t offset = (uint8_t*)field - r->start;
+        ct_image_hash(&w->layout_hash, &offset, sizeof(offset));
+        return;
+    }
+
+    uint8_t *ptr = *(uint8_t**)field;
+    if (ptr == NULL) {
+        return;
+    }
+
+    CTImageRange *target = ct_image_find(w, ptr);
+    if (!w->copying) {
+        ct_image_mark(w, target);
+        return;
+    }
+
+    assert(target && target->reachable && "pointer to memory that can't go in an image");
+
+    size_t word = (uint8_t*)field - r->start;
+    *(uint64_t*)(w->copy + word) = target->image_offset + (ptr - target->start);
+
+    w->relocations = realloc(w->relocations, (w->relocation_count + 1) * sizeof(uint64_t));
+    w->relocations[w->relocation_count++] = r->image_offset + word;
+}
+
+void ct_image_describe(void *describer, void *probe, size_t size) {
+    CTImageWriter *w = describer;
+    assert(w->describing);
+
+    CTImageRange r = {};
+    r.start = probe;
+    r.end = (uint8_t*)probe + size;
+    ct_image_hash(&w->layout_hash, &size, sizeof(size));
+
+    CTTypeInfo *type_info = w->describing_type;
+    w->reporting = &r;
+    type_info->runtime_class->pointers_fn(type_info, type_info->runtime_class, w, probe);
+    w->reporting = NULL;
+}
+
+/* Hashes every type's name and shapes (see CTLayoutFn) */
+static uint64_t ct_image_layout_hash() {
+    CTImageWriter w = {};
+    w.describing = true;
+    w.layout_hash = 0xcbf29ce484222325ull;
+
+    uint64_t instance_size = sizeof(CTInstance);
+    ct_image_hash(&w.layout_hash, &instance_size, sizeof(instance_size));
+
+    for (CTTypeID type = CT_TYPE_ID_INVALID + 1; type < CT_TYPE_CTLast; type++) {
+        CTTypeInfo *type_info = &CT_TYPE_INFO[type];
+        ct_image_hash(&w.layout_hash, type_info->type_name, strlen(type_info->type_name));
+
+        w.describing_type = type_info;
+        type_info->runtime_class->layout_fn(type_info, type_info->runtime_class, &w);
+    }
+
+    return w.layout_hash;
+}
+
+static void ct_image_report(CTImageWriter *w, CTImageRange *r) {
+    CTInstance *inst = r->instance;
+    w->reporting = r;
+    inst->runtime_class->pointers_fn(inst->type_info, inst->runtime_class, w, r->start);
+    w->reporting = NULL;
+}
+
+bool ct_image_write(const char *path, void *root, const void *extra, size_t extra_size) {
+    assert(path);
+    assert(root);
+    assert(global_pool);
+
+    CTImageWriter w = {};
+
+    // Every live object is a candidate
+    for (CTInstancePool *pool = global_pool->next; pool->instance; pool = pool->next) {
+        w.objects = realloc(w.objects, (w.object_count + 1) * sizeof(CTImageRange));
+        CTImageRange *r = &w.objects[w.object_count++];
+        memset(r, 0, sizeof(CTImageRange));
+        r->instance = pool->instance;
+        r->start = CT_OBJ(pool->instance);
+        r->end = r->start + pool->instance->instance_size;
+    }
+    qsort(w.objects, w.object_count, sizeof(CTImageRange), ct_image_range_compare);
+
+    // Find everything reachable from the root
+    CTImageRange *root_range = ct_image_find(&w, root);
+    assert(root_range && root_range->instance && "root must be a CT object");
+    ct_image_mark(&w, root_range);
+
+    while (w.worklist_count > 0) {
+        ct_image_report(&w, w.worklist[--w.worklist_count]);
+    }
+
+    // Lay out the image
+    CTImageHeader header = {};
+    header.magic = CT_IMAGE_MAGIC;
+    header.version = CT_IMAGE_VERSION;
+    header.layout_hash = ct_image_layout_hash();
+    header.objects_offset = ct_image_align(sizeof(CTImageHeader));
+
+    uint64_t offset = header.objects_offset;
+    for (size_t idx = 0; idx < w.object_count; idx++) {
+        CTImageRange *r = &w.objects[idx];
+        if (r->reachable) {
+            r->image_offset = offset + sizeof(CTInstance);
+            offset = ct_image_align(r->image_offset + (r->end - r->start));
+            header.object_count++;
+        }
+    }
+
+    header.blobs_offset = offset;
+    for (size_t idx = 0; idx < w.blob_count; idx++) {
+        CTImageRange *r = &w.blobs[idx];
+        r->image_offset = offset;
+        offset = ct_image_align(offset + (r->end - r->start) + 1);
+    }
+
+    header.extra_offset = offset;
+    header.extra_size = extra_size;
+    offset = ct_image_align(offset + extra_size);
+
+    // Copy everything in, relocating pointers as we go
+    uint8_t *image = calloc(1, offset);
+    uint64_t *instances = calloc(header.object_count, sizeof(uint64_t));
+    size_t instance_idx = 0;
+
+    w.copying = true;
+    for (size_t idx = 0; idx < w.object_count; idx++) {
+        CTImageRange *r = &w.objects[idx];
+        if (!r->reachable) {
+            continue;
+        }
+
+        CTInstance *inst = (CTInstance*)(image + r->image_offset - sizeof(CTInstance));
+        instances[instance_idx++] = (uint8_t*)inst - image;
+
+        inst->magic = CTI_MAGIC;
+        inst->type_info = (CTTypeInfo*)(uintptr_t)r->instance->type_info->type_id;
+        inst->runtime_class = NULL;
+        inst->pool = NULL;
+        inst->refcount = CT_IMAGE_REFCOUNT;
+        inst->instance_size = r->instance->instance_size;
+        inst->instance_data = NULL;
+
+        w.copy = image + r->image_offset;
+        memcpy(w.copy, r->start, r->end - r->start);
+        ct_image_report(&w, r);
+    }
+    header.relocation_count = w.relocation_count;
+
+    for (size_t idx = 0; idx < w.blob_count; idx++) {
+        CTImageRange *r = &w.blobs[idx];
+        memcpy(image + r->image_offset, r->start, r->end - r->start);
+    }
+
+    if (extra_size > 0) {
+        memcpy(image + header.extra_offset, extra, extra_size);
+    }
+
+    header.root_offset = root_range->image_offset;
+    header.relocations_offset = offset;
+    header.instances_offset = offset + header.relocation_count * sizeof(uint64_t);
+    header.size = header.instances_offset + header.object_count * sizeof(uint64_t);
+    memcpy(image, &header, sizeof(CTImageHeader));
+
+    FILE *f = fopen(path, "wb");
+    bool ok = (f != NULL);
+    if (ok) {
+        ok = fwrite(image, offset, 1, f) == 1 &&
+             (header.relocation_count == 0 ||
+              fwrite(w.relocations, header.relocation_count * sizeof(uint64_t), 1, f) == 1) &&
+             (header.object_count == 0 ||
+              fwrite(instances, header.object_count * sizeof(uint64_t), 1, f) == 1);
+        ok = (fclose(f) == 0) && ok;
+    }
+
+    free(image);
+    free(w.relocations);
+    free(instances);
+    free(w.objects);
+    free(w.blobs);
+    free(w.worklist);
+
+    return ok;
+}
+
+void *ct_image_load(const char *path, const void **extra, size_t *extra_size, const char **error) {
+    const char *unused_error;
+    if (error == NULL) {
+        error = &unused_error;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        *error = "it can't be opened";
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(CTImageHeader)) {
+        close(fd);
+        *error = "it isn't an image";
+        return NULL;
+    }
+
+    // Private so relocation only dirties the pages it touches
+    uint8_t *image = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) {
+        *error = "it can't be mapped";
+        return NULL;
+    }
+
+    // Nothing in an image can be trusted until these all check out
+    CTImageHeader *header = (CTImageHeader*)image;
+    *error = NULL;
+    if (header->magic != CT_IMAGE_MAGIC) {
+        *error = "it isn't an image";
+    } else if (header->version != CT_IMAGE_VERSION) {
+        *error = "it's in a different image format; make it again with lmac snapshot";
+    } else if (header->layout_hash != ct_image_layout_hash()) {
+        *error = "it was made by a build with different object layouts; "
+                 "make it again with lmac snapshot";
+    } else if (header->size != (uint64_t)st.st_size) {
+        *error = "it's truncated";
+    }
+
+    if (*error != NULL) {
+        munmap(image, st.st_size);
+        return NULL;
+    }
+
+    uint64_t *relocations = (uint64_t*)(image + header->relocations_offset);
+    for (uint64_t idx = 0; idx < header->relocation_count; idx++) {
+        *(uint64_t*)(image + relocations[idx]) += (uint64_t)image;
+    }
+
+    uint64_t *instances = (uint64_t*)(image + header->instances_offset);
+    for (uint64_t idx = 0; idx < header->object_count; idx++) {
+        CTInstance *inst = (CTInstance*)(image + instances[idx]);
+        CTTypeID type = (CTTypeID)(uintptr_t)inst->type_info;
+        assert(inst->magic == CTI_MAGIC);
+        assert(type > CT_TYPE_ID_INVALID && type < CT_TYPE_CTLast);
+
+        inst->type_info = &CT_TYPE_INFO[type];
+        inst->runtime_class = inst->type_info->runtime_class;
+    }
+
+    // Only thaw once every object is usable, since thawing can look at others
+    for (uint64_t idx = 0; idx < header->object_count; idx++) {
+        CTInstance *inst = (CTInstance*)(image + instances[idx]);
+        inst->runtime_class->thaw_fn(inst->type_info, inst->runtime_class, CT_OBJ(inst));
+    }
+
+    if (extra != NULL) {
+        *extra = image + header->extra_offset;
+    }
+
+    if (extra_size != NULL) {
+        *extra_size = header->extra_size;
+    }
+
+    return image + header->root_offset;
+}
+
 __attribute__((constructor(2)))
 static void __ct_initialize() {
     #   define CT_TYPE(type_name) \
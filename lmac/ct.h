@@ -60,6 +60,20 @@ typedef void (*CTReleaseFn)(struct CTTypeInfo *type_info, struct CTRuntimeClass
 /* file_handle is normally a FILE*  */
 typedef void (*CTDumpFn)(struct CTTypeInfo *type_info, struct CTRuntimeClass *runtime_class, void *file_handle, void *obj);
 
+/* called when an image is written. The object reports each of its fields that
+ * point at other CT objects with ct_image_add_pointer, and any non-CT memory
+ * they point at with ct_image_add_blob. Everything else is copied as-is, so
+ * thaw has to fix up whatever can't be */
+typedef void (*CTPointersFn)(struct CTTypeInfo *type_info, struct CTRuntimeClass *runtime_class, void *writer, void *obj);
+
+/* called to work out whether an image was made with this build's object
+ * layouts. The type passes ct_image_describe a probe of each shape its
+ * objects come in */
+typedef void (*CTLayoutFn)(struct CTTypeInfo *type_info, struct CTRuntimeClass *runtime_class, void *describer);
+
+/* called when an object is loaded from an image, after pointers are relocated */
+typedef void (*CTThawFn)(struct CTTypeInfo *type_info, struct CTRuntimeClass *runtime_class, void *obj);
+
 /*                          */
 /* End VTABLE               */
 /*                          */
@@ -79,6 +93,9 @@ typedef struct CTRuntimeClass {
     CTRetainFn retain_fn;
     CTReleaseFn release_fn;
     CTDumpFn dump_fn;
+    CTPointersFn pointers_fn;
+    CTLayoutFn layout_fn;
+    CTThawFn thaw_fn;
 } CTRuntimeClass;
 
 typedef struct CTTypeInfo {
@@ -13,6 +13,8 @@
 #define lmac_ct_api_h
 
 #include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
 
 typedef uint64_t CTTypeID;
 typedef void (*CTTypeInit)(CTTypeID type_id);
@@ -24,4 +26,31 @@ void ct_release(void *obj);
 void ct_autorelease(void /* multiple pools in the future? */);
 void ct_dump(void *obj);
 
+/* Objects a thread creates between ct_arena_begin and ct_arena_end go in an
+ * arena of the thread's own instead of the shared pool, so threads don't
+ * have to take turns. ct_arena_merge moves an arena's objects to the pool
+ * the calling thread creates objects in (from one thread at a time).
+ * ct_arena_release is ct_autorelease for just an arena's objects, which
+ * frees them without waiting for everything else. */
+void *ct_arena_begin(void);
+void ct_arena_end(void);
+void ct_arena_merge(void *arena);
+void ct_arena_release(void *arena);
+
+/* Images are relocatable snapshots of a graph of CT objects. extra is copied
+ * as-is and handed back by ct_image_load. Types say where their pointers are
+ * (field is the address of one) from their pointers function. */
+void ct_image_add_pointer(void *writer, const void *field);
+void ct_image_add_blob(void *writer, const void *blob, size_t size);
+
+/* Adds a shape of object to the layout an image is checked against: its size
+ * and where its pointers function says its pointers are. probe is zeroed apart
+ * from whatever the type tells its shapes apart by */
+void ct_image_describe(void *describer, void *probe, size_t size);
+bool ct_image_write(const char *path, void *root, const void *extra, size_t extra_size);
+
+/* Returns NULL and says why in error if the image can't be loaded (including
+ * when it was made by a build with different object layouts) */
+void *ct_image_load(const char *path, const void **extra, size_t *extra_size, const char **error);
+
 #endif
@@ -19,6 +19,7 @@ CT_TYPE(List)
 CT_TYPE(ASTBase)
 // TODO(bloggins): other AST types
 CT_TYPE(Context)
+CT_TYPE(SourceFile)
 CT_TYPE(Scope)
 
 /* must be last */
@@ -16,8 +16,9 @@ global_variable const char *g_diag_kind_names[] = {
 #   include "diag.def.h"
 };
 
-void *diag_exception_env = NULL;
-int diag_errno = 0;
+// Each thread has its own place to go when there's an error
+_Thread_local void *diag_exception_env = NULL;
+_Thread_local int diag_errno = 0;
 
 const char *diag_get_name(DiagKind kind) {
     return g_diag_kind_names[kind];
@@ -32,11 +33,12 @@ void diag_vfprintf(FILE *f, DiagKind kind, SourceLocation *loc, const char *fmt,
     fprintf(f, "%s", diag_get_name(kind));
     if (loc != NULL) {
         const char *file_name = "<unknown file>";
-        if (loc->file != NULL) {
-            file_name = loc->file;
+        SourceFile *source = source_manager_lookup(loc->start);
+        if (source != NULL && source->name != NULL) {
+            file_name = source->name;
         }
         
-        fprintf(f, " (%s: line %d)", file_name, loc->line);
+        fprintf(f, " (%s: line %d)", file_name, source_location_line(*loc));
     }
     fprintf(f, ": ");
     vfprintf(f, fmt, args);
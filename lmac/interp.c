@@ -90,8 +90,32 @@
 // because the environment may not have the appropriate symbols, functions, etc.
 // defined.
 
+// FOREIGN FUNCTIONS:
+//
+// Function declarations without a body (like the printf in tests/c_prelude.h)
+// are bound to the symbol of the same name in the host process with dlsym the
+// first time they're called. Each declaration gets a call stub picked by its
+// signature (fixed parameter count and whether it takes varargs) when it's
+// assembled, so calling printf doesn't need cc at all.
+
+// SHARED IMAGES:
+//
+// interp_share() assembles the preloaded functions of a snapshot once. Images
+// assembled after that extend the shared one instead of assembling their own
+// copy, so a service can run lots of requests against the same headers. The
+// shared image is never written to after interp_share() returns (foreign
+// symbols are bound up front), so any number of VMs can run it at once.
+
 #include "clite.h"
 
+#include <dlfcn.h>
+#include <unistd.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <libgen.h>
+#include <sys/time.h>
+
 #define CI_ERROR(sl, ...)                                              \
 diag_emit(DIAG_ERROR, ERR_INTERPRET, sl, __VA_ARGS__);
 
@@ -99,26 +123,33 @@ diag_emit(DIAG_ERROR, ERR_INTERPRET, sl, __VA_ARGS__);
 
 typedef struct ByteStream {
     uint8_t *data;
-    
+
     size_t length;
     off_t current_offset;
-    
+
 } ByteStream;
 
-void stream_append(ByteStream *stream, uint8_t *data, size_t length) {
+void stream_append(ByteStream *stream, const uint8_t *data, size_t length) {
 #   define CHUNK_SIZE 4096
     assert(stream);
     assert(data);
-    
-    if (stream->current_offset == stream->length) {
+
+    while (stream->current_offset + length > stream->length) {
         stream->length += CHUNK_SIZE;
         stream->data = realloc(stream->data, stream->length);
     }
-    
-    for (size_t idx = 0; idx < length; idx++) {
-        stream->data[stream->current_offset] = data[idx];
-        ++stream->current_offset;
-    }
+
+    memcpy(stream->data + stream->current_offset, data, length);
+    stream->current_offset += length;
+}
+
+/* Overwrites a u64 that was already appended (used to fix up jump targets) */
+void stream_patch_u64(ByteStream *stream, off_t offset, uint64_t value) {
+    assert(stream);
+    assert(offset + sizeof(uint64_t) <= stream->current_offset);
+
+    // TODO(bloggins): This depends on the endianess of the host processor. BAD!
+    memcpy(stream->data + offset, &value, sizeof(uint64_t));
 }
 
 #pragma mark CIValue, CIValueArray
@@ -126,30 +157,30 @@ void stream_append(ByteStream *stream, uint8_t *data, size_t length) {
 typedef enum {
     /* must be the first so 0 maps to void */
     CIV_VOID,
-    
+
     /* index pointer to another value */
     CIV_VALUE_REF,
-    
+
     /* plain ol' data */
     CIV_POD_CHAR,
     CIV_POD_INTEGER,
     CIV_POD_STRING,
-    
+
     /* value literals (not the same as pod values because they could be retinterpreted in the environment) */
     CIV_CHAR_LITERAL,
     CIV_INTEGER_LITERAL,
     CIV_STRING_LITERAL,
-    
+
     /* compiled code */
     CIV_CODE,
-    
+
     CIV_IDENTIFIER,
     CIV_BINDING,
     CIV_BINOP,
     CIV_CALL,
-    
+
     CIV_AST_NODE,
-    
+
     /* must be the last */
     CIV_LAST,
 } CIValueKind;
@@ -163,39 +194,39 @@ typedef struct CIValue {
     union {
         struct {
             bool is_pod;
-            
+
             char char_value;
             uint64_t int_value;
             const char *str_value;
         } simple_value;
-        
+
         ValueTableIndex ref_id;
-        
+
         struct {
             IdentifierIndex name_index;
             ByteStream code;
         } code_value;
-        
+
         IdentifierIndex identifier_id;
-        
+
         struct {
             uint64_t constraint_index;
             IdentifierIndex name_index;
             ValueTableIndex value_index;
         } binding_value;
-        
+
         struct {
             ValueTableIndex op_index;
-            
+
             ValueTableIndex lhs_index;
             ValueTableIndex rhs_index;
         } binop_value;
-        
+
         struct {
             ValueTableIndex callable_index;
             ValueTableIndex arglist_index;
         } call_value;
-        
+
         struct {
             ASTKind kind;
             ValueTableIndex source_index;
@@ -205,13 +236,239 @@ typedef struct CIValue {
     };
 } CIValue;
 
-void ci_value_fprint(FILE *f, Context *ctx, CIValue *value) {
+static inline bool ci_value_is_integer(const CIValue *v) {
+    return v->kind == CIV_POD_INTEGER || v->kind == CIV_INTEGER_LITERAL;
+}
+
+static inline bool ci_value_is_string(const CIValue *v) {
+    return v->kind == CIV_POD_STRING || v->kind == CIV_STRING_LITERAL;
+}
+
+typedef struct {
+    size_t count;
+    size_t capacity;
+    CIValue *values;
+} CIValueTable;
+
+ValueTableIndex values_new(CIValueTable *table, CIValue *v) {
+    assert(table);
+    assert(v);
+
+    if (table->count == table->capacity) {
+        table->capacity = table->capacity ? table->capacity * 2 : 256;
+        table->values = realloc(table->values, table->capacity * sizeof(CIValue));
+    }
+
+    table->values[table->count++] = *v;
+
+    return table->count - 1;
+}
+
+#pragma mark FR Image
+
+/* An entry in the image's AST node table. CIO_NEW_AST_NODE refers to these
+ * by index so the VM doesn't have to search for an existing node value
+ */
+typedef struct {
+    ASTKind kind;
+    uint64_t source_index;
+    uint64_t start;
+    uint64_t end;
+} CINodeInfo;
+
+/* The code an AST node was assembled to. The profiler uses these to find the
+ * nodes (and so the source lines) an instruction belongs to
+ */
+typedef struct {
+    uint64_t start;
+    uint64_t end;
+    uint64_t node;
+} CICodeSpan;
+
+/* Operands that hold a code offset or an index into one of the image's
+ * tables. The linker rewrites them when it merges images (see ci_link)
+ */
+typedef enum {
+    CI_RELOC_CODE,
+    CI_RELOC_FUNCTION,
+    CI_RELOC_CONSTANT,
+    CI_RELOC_NODE,
+    CI_RELOC_GLOBAL,
+} CIRelocKind;
+
+typedef struct {
+    /* Where the u64 operand is in the code */
+    uint64_t offset;
+    CIRelocKind kind;
+} CIReloc;
+
+/* Foreign call stubs get the symbol and CI_FFI_MAX_ARGS arguments */
+#define CI_FFI_MAX_ARGS 8
+typedef intptr_t (*CIForeignStub)(void *fn, intptr_t *args);
+
+typedef struct {
+    const char *name;
+    ASTDeclFunc *decl;
+
+    uint32_t param_count;
+    bool has_varargs;
+
+    /* How to turn a foreign return value back into a CIValue */
+    bool returns_void;
+    bool returns_string;
+    bool returns_signed;
+    uint8_t return_bits;
+
+    /* Functions with a body */
+    uint64_t entry;
+    uint32_t local_count;
+
+    /* Pure functions only depend on their arguments, so calls to them can be
+     * memoized. A function is pure when it doesn't touch globals and only
+     * calls other pure functions.
+     */
+    bool is_pure;
+    bool touches_globals;
+    size_t callee_count;
+    uint64_t *callees;
+
+    /* Foreign functions (declarations without a body). Functions declared
+     * with () get their stub picked for each call
+     */
+    bool is_foreign;
+    bool is_unprototyped;
+    CIForeignStub stub;
+    void *symbol;
+
+    /* Functions with lazy bodies are only assembled once something calls
+     * them (see ci_assemble_deferred)
+     */
+    bool is_deferred;
+    bool is_called;
+
+    /* Set when a native version of the function was loaded (see
+     * ci_aot_bind). It's called like a foreign function
+     */
+    void *native;
+} CIFunction;
+
+typedef struct CIImage {
+    ByteStream code;
+
+    /* Source index -> the file in the source manager */
+    size_t source_count;
+    SourceFile **sources;
+
+    size_t node_count;
+    CINodeInfo *nodes;
+
+    /* String constants (already unescaped) */
+    size_t constant_count;
+    char **constants;
+
+    size_t function_count;
+    CIFunction *functions;
+
+    /* Inner nodes come before the nodes around them */
+    size_t span_count;
+    CICodeSpan *spans;
+
+    size_t reloc_count;
+    CIReloc *relocs;
+
+    size_t global_count;
+
+    /* The first globals come from a snapshot (see interp_preload) */
+    size_t preload_count;
+
+    /* An image can extend a shared image that is never modified (see
+     * interp_share). Function, node, constant and source indices below the
+     * base's counts refer to the base's tables, and base functions run from
+     * the base's code.
+     */
+    struct CIImage *base;
+} CIImage;
+
+#define CI_ARRAY_APPEND(array, count, item)                                 \
+do {                                                                        \
+    if (((count) & ((count) - 1)) == 0) {                                   \
+        /* count is a power of two (or zero), so we're full */             \
+        size_t new_cap = (count) ? (count) * 2 : 8;                         \
+        (array) = realloc((array), new_cap * sizeof(*(array)));             \
+    }                                                                       \
+    (array)[(count)++] = (item);                                            \
+} while(0)
+
+static inline size_t ci_image_function_count(CIImage *image) {
+    return (image->base ? image->base->function_count : 0) + image->function_count;
+}
+
+static inline CIFunction *ci_image_function(CIImage *image, uint64_t idx) {
+    if (image->base != NULL) {
+        if (idx < image->base->function_count) {
+            return &image->base->functions[idx];
+        }
+        idx -= image->base->function_count;
+    }
+
+    assert(idx < image->function_count);
+    return &image->functions[idx];
+}
+
+/* The code that the function with the given index runs from */
+static inline ByteStream *ci_image_code(CIImage *image, uint64_t fn_idx) {
+    if (image->base != NULL && fn_idx < image->base->function_count) {
+        return &image->base->code;
+    }
+
+    return &image->code;
+}
+
+static inline CINodeInfo *ci_image_node(CIImage *image, uint64_t idx) {
+    if (image->base != NULL) {
+        if (idx < image->base->node_count) {
+            return &image->base->nodes[idx];
+        }
+        idx -= image->base->node_count;
+    }
+
+    assert(idx < image->node_count);
+    return &image->nodes[idx];
+}
+
+static inline const char *ci_image_constant(CIImage *image, uint64_t idx) {
+    if (image->base != NULL) {
+        if (idx < image->base->constant_count) {
+            return image->base->constants[idx];
+        }
+        idx -= image->base->constant_count;
+    }
+
+    assert(idx < image->constant_count);
+    return image->constants[idx];
+}
+
+static inline SourceFile *ci_image_source(CIImage *image, uint64_t idx) {
+    if (image->base != NULL) {
+        if (idx < image->base->source_count) {
+            return image->base->sources[idx];
+        }
+        idx -= image->base->source_count;
+    }
+
+    assert(idx < image->source_count);
+    return image->sources[idx];
+}
+
+void ci_value_fprint(FILE *f, CIImage *image, CIValue *value) {
     const CIValue *v = value;
     switch (v->kind) {
         case CIV_VOID: break;
         case CIV_CHAR_LITERAL: fprintf(f, "%c", v->simple_value.char_value); break;
         case CIV_INTEGER_LITERAL: fprintf(f, "%llu", v->simple_value.int_value); break;
+        case CIV_POD_INTEGER: fprintf(f, "%lld", (int64_t)v->simple_value.int_value); break;
         case CIV_STRING_LITERAL: fprintf(f, "%s", v->simple_value.str_value); break;
+        case CIV_POD_STRING: fprintf(f, "\"%s\"", v->simple_value.str_value); break;
         case CIV_BINDING: {
             fprintf(f, "(constraint: %llu, name: %llu, value: %llu)",
                     v->binding_value.constraint_index,
@@ -229,47 +486,145 @@ void ci_value_fprint(FILE *f, Context *ctx, CIValue *value) {
         } break;
         case CIV_AST_NODE: {
             fprintf(f, "(ast_kind: %s, source: ", ast_get_kind_name(v->ast_node_value.kind));
-            // TODO(bloggins): We need to serialize this in the FR data as a source constant!
-            
+
+            const uint8_t *buf = ci_image_source(image, v->ast_node_value.source_index)->buf;
+
             int print_count = 0;
             for (uint64_t idx = v->ast_node_value.start; idx < v->ast_node_value.end; idx++) {
-                char c = ctx->buf[idx];
+                char c = buf[idx];
                 if (c == '\n' || c == '\r') {
                     c = '$';
                 }
-                
+
                 fprintf(f, "%c", c);
                 if (++print_count == 30) {
                     // That's enough to get the gist
                     fprintf(f, " // ...");
                     break;
                 }
-                
-                fprintf(f, ")");
             }
+            fprintf(f, ")");
         } break;
         default: assert(false && "unrecognized value kind");
     }
 }
 
-typedef struct {
-    /* low number so we run into it sooner rather than later and are forced
-     * to use a better data structure.
-     */
-#   define CI_MAX_VALUES    128
+#pragma mark Foreign Function Interface
 
-    size_t count;
-    CIValue values[CI_MAX_VALUES];
-} CIValueTable;
+// Stubs for calling foreign functions. Every argument is passed as an
+// intptr_t, which covers the integer and pointer arguments the interpreter can
+// produce. Variadic functions MUST be called through a variadic prototype with
+// the right number of fixed parameters (arm64 passes varargs on the stack and
+// x86_64 needs %al set), so those stubs pass all CI_FFI_MAX_ARGS arguments
+// and the callee only reads what it needs.
 
-ValueTableIndex values_new(CIValueTable *table, CIValue *v) {
-    assert(table);
-    assert(v);
-    assert((table->count < CI_MAX_VALUES) && "time for a new data structure");
+#define FFI_P0 void
+#define FFI_P1 intptr_t
+#define FFI_P2 FFI_P1, intptr_t
+#define FFI_P3 FFI_P2, intptr_t
+#define FFI_P4 FFI_P3, intptr_t
+#define FFI_P5 FFI_P4, intptr_t
+#define FFI_P6 FFI_P5, intptr_t
+#define FFI_P7 FFI_P6, intptr_t
+#define FFI_P8 FFI_P7, intptr_t
 
-    table->values[table->count++] = *v;
-    
-    return table->count - 1;
+#define FFI_A0
+#define FFI_A1 a[0]
+#define FFI_A2 FFI_A1, a[1]
+#define FFI_A3 FFI_A2, a[2]
+#define FFI_A4 FFI_A3, a[3]
+#define FFI_A5 FFI_A4, a[4]
+#define FFI_A6 FFI_A5, a[5]
+#define FFI_A7 FFI_A6, a[6]
+#define FFI_A8 FFI_A7, a[7]
+
+#define FFI_FIXED(n)                                                        \
+static intptr_t ci_ffi_fixed_##n(void *fn, intptr_t *a) {                   \
+    return ((intptr_t (*)(FFI_P##n))fn)(FFI_A##n);                          \
+}
+
+#define FFI_VARARGS(n)                                                      \
+static intptr_t ci_ffi_varargs_##n(void *fn, intptr_t *a) {                 \
+    return ((intptr_t (*)(FFI_P##n, ...))fn)(FFI_A8);                       \
+}
+
+FFI_FIXED(0) FFI_FIXED(1) FFI_FIXED(2) FFI_FIXED(3) FFI_FIXED(4)
+FFI_FIXED(5) FFI_FIXED(6) FFI_FIXED(7) FFI_FIXED(8)
+
+FFI_VARARGS(1) FFI_VARARGS(2) FFI_VARARGS(3) FFI_VARARGS(4)
+FFI_VARARGS(5) FFI_VARARGS(6) FFI_VARARGS(7)
+
+static CIForeignStub g_ffi_fixed_stubs[CI_FFI_MAX_ARGS + 1] = {
+    ci_ffi_fixed_0, ci_ffi_fixed_1, ci_ffi_fixed_2, ci_ffi_fixed_3,
+    ci_ffi_fixed_4, ci_ffi_fixed_5, ci_ffi_fixed_6, ci_ffi_fixed_7,
+    ci_ffi_fixed_8
+};
+
+/* No varargs stub with 0 fixed params (C requires one) or 8 (no room left) */
+static CIForeignStub g_ffi_varargs_stubs[CI_FFI_MAX_ARGS] = {
+    NULL, ci_ffi_varargs_1, ci_ffi_varargs_2, ci_ffi_varargs_3,
+    ci_ffi_varargs_4, ci_ffi_varargs_5, ci_ffi_varargs_6, ci_ffi_varargs_7
+};
+
+#undef FFI_FIXED
+#undef FFI_VARARGS
+
+intptr_t ci_ffi_arg(CIFunction *fn, CIValue *v, size_t arg_idx) {
+    if (ci_value_is_integer(v)) {
+        return (intptr_t)v->simple_value.int_value;
+    } else if (ci_value_is_string(v)) {
+        return (intptr_t)v->simple_value.str_value;
+    } else if (v->kind == CIV_CHAR_LITERAL || v->kind == CIV_POD_CHAR) {
+        return (intptr_t)v->simple_value.char_value;
+    }
+
+    CI_ERROR(NULL, "argument %zu of foreign function '%s' doesn't have a "
+             "value that can be passed to C", arg_idx + 1, fn->name);
+    return 0;
+}
+
+void *ci_ffi_bind(CIFunction *fn) {
+    if (fn->symbol != NULL) {
+        return fn->symbol;
+    }
+
+    // NOTE(bloggins): Functions can be shared between threads (see
+    // interp_share), so only write the symbol once it's known
+    void *symbol = dlsym(RTLD_DEFAULT, fn->name);
+    if (symbol == NULL) {
+        SourceLocation *sl = fn->decl ? &AST_BASE(fn->decl)->location : NULL;
+        CI_ERROR(sl, "can't find foreign function '%s' in the running process", fn->name);
+    }
+
+    fn->symbol = symbol;
+    return symbol;
+}
+
+CIValue ci_ffi_result(CIFunction *fn, intptr_t raw) {
+    CIValue v = {};
+    if (fn->returns_void) {
+        v.kind = CIV_VOID;
+    } else if (fn->returns_string) {
+        v.kind = CIV_POD_STRING;
+        v.simple_value.is_pod = true;
+        v.simple_value.str_value = (const char *)raw;
+    } else {
+        // Only the low bits of the return register are defined
+        uint64_t bits = (uint64_t)raw;
+        if (fn->return_bits < 64) {
+            uint64_t mask = (1ull << fn->return_bits) - 1;
+            bits &= mask;
+            if (fn->returns_signed && (bits & (1ull << (fn->return_bits - 1)))) {
+                bits |= ~mask;
+            }
+        }
+
+        v.kind = CIV_POD_INTEGER;
+        v.simple_value.is_pod = true;
+        v.simple_value.int_value = bits;
+    }
+
+    return v;
 }
 
 #pragma mark Opcodes
@@ -310,211 +665,3386 @@ static inline void asm_push_node(ByteStream *stream, ASTKind kind) {
     ASM_OP_1U8(CIO_PUSH_NODE, (uint8_t)kind);
 }
 
-#pragma mark Byte Code Decoder
+typedef enum {
+    CI_SYM_GLOBAL,
+    CI_SYM_LOCAL,
+    CI_SYM_FUNCTION,
+    CI_SYM_LABEL,
+} CISymbolKind;
 
-static inline uint64_t decode_u64(uint8_t **ip) {
-    // TODO(bloggins): relies on endianess of the host processor!
-    uint64_t result = *(uint64_t*)*ip;
-    *ip += sizeof(uint64_t);
-    
-    return result;
-}
+/* Attached to declarations (as visit_data) while they are being assembled */
+typedef struct {
+    CISymbolKind kind;
+    uint64_t index;
+} CISymbol;
 
-#pragma mark Visitor Overrides
-// *** OVERRIDES GO HERE ***
+/* A jump to a label that may not have been assembled yet */
+typedef struct {
+    off_t patch_offset;
+    ASTBase *label;
+} CIFixup;
 
-// Defined in interp_default.c
-#define AST(kind, name, type)                                                   \
-int ci_visit_AST_##kind(type *node, VisitPhase phase, struct ByteStream *stream);
-#include "ast.def.h"
-#undef AST
+typedef struct CIAssembler {
+    CIImage *image;
+    ByteStream *stream;
 
-#define CI_VISITOR(kind, type) int ci_visit_##kind(type *node, VisitPhase phase, ByteStream *stream)
+    /* The function being assembled, or NULL at the top level */
+    CIFunction *function;
+    uint64_t function_index;
 
+    size_t fixup_count;
+    CIFixup *fixups;
 
-CI_VISITOR(AST_TOPLEVEL, ASTTopLevel) {
-    // TODO(bloggins): This is a hack because we don't yet support nested contexts
-    // that resolve to different source files, so all our current SourceLocation offsets
-    // MUST map to our top-level context
-    static int tl_count = 0;
-    
-    if (phase == VISIT_PRE) {
-        ++tl_count;
-        if (tl_count != 1) {
-            diag_emit(DIAG_ERROR, ERR_INTERPRET, NULL, "nested top levels (e.g. from #include) are not supported yet");
+    /* Spans of the nodes being assembled (ended when they're popped) */
+    size_t open_span_count;
+    CICodeSpan *open_spans;
+
+    /* Functions whose bodies haven't been assembled yet */
+    size_t deferred_count;
+    uint64_t *deferred;
+} CIAssembler;
+
+uint64_t ci_source_index(CIImage *image, SourceFile *source) {
+    assert(source);
+    size_t first = 0;
+    if (image->base != NULL) {
+        first = image->base->source_count;
+        for (size_t idx = 0; idx < first; idx++) {
+            if (image->base->sources[idx] == source) {
+                return idx;
+            }
         }
-    } else {
-        --tl_count;
     }
-    
-    return VISIT_OK;
-}
 
-CI_VISITOR(AST_STMT_DECL, ASTStmtDecl) {
-    return VISIT_OK;
-}
+    for (size_t idx = 0; idx < image->source_count; idx++) {
+        if (image->sources[idx] == source) {
+            return first + idx;
+        }
+    }
 
-CI_VISITOR(AST_STMT_EXPR, ASTStmtExpr) {
-    return VISIT_OK;
+    CI_ARRAY_APPEND(image->sources, image->source_count, source);
+    return first + image->source_count - 1;
 }
 
-CI_VISITOR(AST_BLOCK, ASTBlock) {
-    return VISIT_OK;
-}
+uint64_t ci_node_index(CIImage *image, ASTBase *node) {
+    SourceFile *source = source_manager_lookup(node->location.start);
+    assert(source);
 
-CI_VISITOR(AST_DECL_FUNC, ASTDeclFunc) {
-    return VISIT_OK;
+    CINodeInfo info;
+    info.kind = node->kind;
+    info.source_index = ci_source_index(image, source);
+    info.start = node->location.start - source->base;
+    info.end = info.start + node->location.length;
+    assert (info.start <= info.end);
+
+    CI_ARRAY_APPEND(image->nodes, image->node_count, info);
+    return (image->base ? image->base->node_count : 0) + image->node_count - 1;
 }
 
-CI_VISITOR(AST_DECL_VAR, ASTDeclVar) {
-    
-    if (phase == VISIT_POST) {
-        // TODO(bloggins): Tell it what the identifier is!
-        asm_single_op(stream, CIO_NEW_IDENTIFIER);
-        
-        if (node->expression == NULL) {
-            // Push a void value on to signify that we're value-less
-            asm_push_u64(stream, 0);
+/* The string a literal stands for. The caller owns the result */
+char *ci_string_unescape(Spelling sp) {
+    const char *raw = spelling_cstring(sp);
+    char *str = malloc(strlen(raw) + 1);
+
+    // NOTE(bloggins): Spellings are stored exactly as typed, so this is where
+    // escapes finally get processed
+    char *out = str;
+    for (const char *p = raw; *p; p++) {
+        if (*p != '\\' || p[1] == 0) {
+            *out++ = *p;
+            continue;
+        }
+
+        switch (*(++p)) {
+            case 'n': *out++ = '\n'; break;
+            case 't': *out++ = '\t'; break;
+            case 'r': *out++ = '\r'; break;
+            case '0': *out++ = '\0'; break;
+            default: *out++ = *p; break;
         }
-        
-        asm_single_op(stream, CIO_NEW_BINDING);
     }
-    
-    return VISIT_OK;
-}
+    *out = 0;
 
-CI_VISITOR(AST_OPERATOR, ASTOperator) {
-    
-    if (phase == VISIT_PRE) {
-        assert(AST_BASE(node)->location.ctx);
-        uint64_t start = AST_BASE(node)->location.range_start - AST_BASE(node)->location.ctx->buf;
-        uint64_t end = AST_BASE(node)->location.range_end - AST_BASE(node)->location.ctx->buf;
-        assert (start <= end);
-        
-        asm_push_u64(stream, AST_BASE(node)->kind);
-        asm_push_u64(stream, 0); /* source data index */
-        asm_push_u64(stream, start);
-        asm_push_u64(stream, end);
-        asm_single_op(stream, CIO_NEW_AST_NODE);
-    }
-    
-    return VISIT_OK;
+    return str;
 }
 
-CI_VISITOR(AST_EXPR_EMPTY, ASTExprEmpty) {
-    if (phase == VISIT_PRE) {
-        
-    }
-    
-    return VISIT_OK;
+uint64_t ci_string_constant(CIImage *image, Spelling sp) {
+    char *str = ci_string_unescape(sp);
+    CI_ARRAY_APPEND(image->constants, image->constant_count, str);
+    return (image->base ? image->base->constant_count : 0) + image->constant_count - 1;
 }
 
-CI_VISITOR(AST_EXPR_NUMBER, ASTExprNumber) {
-    
-    if (phase == VISIT_PRE) {
-        asm_push_u64(stream, node->number);
-        asm_single_op(stream, CIO_NEW_INTEGER_LITERAL);
-    }
-    
-    return VISIT_OK;
+CISymbol *ci_symbol_create(ASTBase *decl, CISymbolKind kind, uint64_t index) {
+    assert(decl->visit_data == NULL && "declaration assembled twice");
+
+    CISymbol *sym = calloc(1, sizeof(CISymbol));
+    sym->kind = kind;
+    sym->index = index;
+    decl->visit_data = sym;
+
+    return sym;
 }
 
-CI_VISITOR(AST_EXPR_IDENT, ASTExprIdent) {
-    if (phase == VISIT_POST) {
-        //uint64_t start = node->base.location.range_start - node->base.location.ctx->buf;
-        //uint64_t end = node->base.location.range_end - node->base.location.ctx->buf;
-        //asm_new_source_location(stream, start, end);
-        // TODO(bloggins): This should probably be CIO_IDENTIFIER_LITERAL!
-        asm_single_op(stream, CIO_NEW_IDENTIFIER);
+CISymbol *ci_symbol_lookup(ASTIdent *ident) {
+    ASTDeclaration *decl = ast_ident_find_declaration(ident);
+    if (decl == NULL) {
+        return NULL;
     }
-    
-    return VISIT_OK;
+
+    return (CISymbol*)AST_BASE(decl)->visit_data;
 }
 
-CI_VISITOR(AST_EXPR_BINARY, ASTExprBinary) {
-    if (node->op->op.kind != TOK_PLUS) {
-        diag_emit(DIAG_ERROR, ERR_INTERPRET, NULL, "only addition supported right now");
+void ci_function_classify_return(CIFunction *fn, ASTTypeExpression *type) {
+    ASTTypeExpression *canonical = ast_type_get_canonical_type(type);
+
+    fn->return_bits = 64;
+    fn->returns_signed = true;
+
+    if (canonical == NULL) {
+        return;
     }
 
-    if (phase == VISIT_POST) {
-        asm_single_op(stream, CIO_BINOP);
+    if (AST_IS(canonical, AST_TYPE_POINTER)) {
+        ASTTypeExpression *to = ast_type_get_canonical_type(((ASTTypePointer*)canonical)->pointer_to);
+        if (to != NULL && AST_IS(to, AST_TYPE_CONSTANT) &&
+            (((ASTTypeConstant*)to)->bit_flags & BIT_FLAG_CHAR)) {
+            fn->returns_string = true;
+        }
+    } else if (AST_IS(canonical, AST_TYPE_CONSTANT)) {
+        ASTTypeConstant *c = (ASTTypeConstant*)canonical;
+        if (c->base.type_id == TYPE_FLAG_UNIT) {
+            fn->returns_void = true;
+        } else if (c->bit_size > 0 && c->bit_size < 64) {
+            fn->return_bits = (uint8_t)c->bit_size;
+            fn->returns_signed = (c->bit_flags & BIT_FLAG_SIGNED) != 0;
+        }
     }
-    
-    return VISIT_OK;
 }
 
-CI_VISITOR(AST_EXPR_CALL, ASTExprCall) {
-    if (phase == VISIT_POST) {
-        size_t arg_count = list_count(node->args);
-        asm_push_u64(stream, arg_count);
-        asm_single_op(stream, CIO_CALL);
-    }
-    
-    return VISIT_OK;
+/* Pushes an operand the linker has to rewrite */
+static inline void asm_push_reloc(CIAssembler *as, uint64_t value, CIRelocKind kind) {
+    CIReloc reloc;
+    reloc.offset = as->stream->current_offset + 1;
+    reloc.kind = kind;
+    CI_ARRAY_APPEND(as->image->relocs, as->image->reloc_count, reloc);
+
+    asm_push_u64(as->stream, value);
 }
 
+/* Emits a jump whose target isn't known yet. Returns the offset to patch */
+static inline off_t asm_jump_placeholder(CIAssembler *as, CIOp jump_op) {
+    ByteStream *stream = as->stream;
+    asm_push_reloc(as, 0, CI_RELOC_CODE);
+    off_t patch_offset = stream->current_offset - sizeof(uint64_t);
+    asm_single_op(stream, jump_op);
 
-CI_VISITOR(AST_IDENT, ASTIdent) {
-    
-    return VISIT_OK;
+    return patch_offset;
 }
 
-CI_VISITOR(AST_TYPE_CONSTANT, ASTTypeConstant) {
-    return VISIT_OK;
+static inline void asm_patch_here(ByteStream *stream, off_t patch_offset) {
+    stream_patch_u64(stream, patch_offset, stream->current_offset);
 }
 
-// *** END OVERRIDES SECTION ***
+static inline void asm_push_integer(ByteStream *stream, int64_t value) {
+    asm_push_u64(stream, value);
+    asm_single_op(stream, CIO_NEW_INTEGER_LITERAL);
+}
 
-#pragma mark Visitor Routine
+static inline void asm_push_variable(CIAssembler *as, CISymbol *sym) {
+    if (sym->kind == CI_SYM_GLOBAL) {
+        asm_push_reloc(as, sym->index, CI_RELOC_GLOBAL);
+    } else {
+        asm_push_u64(as->stream, sym->index);
+    }
+}
 
-VisitFn visitors[] = {
-#   define AST(kind, name, type) (VisitFn)ci_visit_AST_##kind,
-#   include "ast.def.h"
-};
-#undef AST
+static inline void asm_load(CIAssembler *as, CISymbol *sym) {
+    asm_push_variable(as, sym);
+    asm_single_op(as->stream, sym->kind == CI_SYM_LOCAL ? CIO_LOAD_LOCAL : CIO_LOAD_GLOBAL);
+}
 
+static inline void asm_store(CIAssembler *as, CISymbol *sym) {
+    asm_push_variable(as, sym);
+    asm_single_op(as->stream, sym->kind == CI_SYM_LOCAL ? CIO_STORE_LOCAL : CIO_STORE_GLOBAL);
+}
 
-int ci_visit(ASTBase *node, VisitPhase phase, ByteStream* stream) {
-    
-    if (phase == VISIT_PRE) {
-        assert(node->location.ctx);
-        uint64_t start = node->location.range_start - node->location.ctx->buf;
-        uint64_t end = node->location.range_end - node->location.ctx->buf;
-        assert (start <= end);
-        
-        asm_push_u64(stream, node->kind);
-        asm_push_u64(stream, 0); /* source data index */
-        asm_push_u64(stream, start);
-        asm_push_u64(stream, end);
-        asm_single_op(stream, CIO_NEW_AST_NODE);
-        
-        asm_push_node(stream, node->kind);
+static inline bool ci_symbol_is_variable(CISymbol *sym) {
+    return sym != NULL && (sym->kind == CI_SYM_GLOBAL || sym->kind == CI_SYM_LOCAL);
+}
+
+/* Remember what the function being assembled depends on for ci_find_pure_functions() */
+static inline void ci_note_access(CIAssembler *as, CISymbol *sym) {
+    if (as->function == NULL) {
+        return;
     }
-    
-    int res = visitors[node->kind](node, phase, stream);
-    
-    if (res == VISIT_OK && phase == VISIT_POST) {
-        asm_single_op(stream, CIO_POP_NODE);
+
+    if (sym->kind == CI_SYM_GLOBAL) {
+        as->function->touches_globals = true;
+    } else if (sym->kind == CI_SYM_FUNCTION) {
+        CIFunction *fn = as->function;
+        CI_ARRAY_APPEND(fn->callees, fn->callee_count, sym->index);
     }
-    
-    return res;
 }
 
-#pragma mark Public API
+#pragma mark Byte Code Decoder
 
-bool interp_interpret(ASTBase *node, ASTBase **result) {
-    
-    ByteStream *stream = calloc(1, sizeof(ByteStream));
-    
-    asm_push_u64(stream, 1);
-    ASM_OP(CIO_DECLARE_FR_VERSION);
-    
-    ast_visit(node, (VisitFn)ci_visit, stream);
-    ast_visit_data_clean(node);
-    
-    asm_single_op(stream, CIO_HALT);
-    
-#   if 0
+static inline uint64_t decode_u64(uint8_t **ip) {
+    // TODO(bloggins): relies on endianess of the host processor!
+    uint64_t result = *(uint64_t*)*ip;
+    *ip += sizeof(uint64_t);
+
+    return result;
+}
+
+#pragma mark Visitor Overrides
+// *** OVERRIDES GO HERE ***
+
+// Defined in interp_default.c
+#define AST(kind, name, type)                                                   \
+int ci_visit_AST_##kind(type *node, VisitPhase phase, struct CIAssembler *as);
+#include "ast.def.h"
+#undef AST
+
+#define CI_VISITOR(kind, type) int ci_visit_##kind(type *node, VisitPhase phase, CIAssembler *as)
+
+int ci_visit(ASTBase *node, VisitPhase phase, CIAssembler *as);
+#define CI_VISIT(node) ast_visit((ASTBase*)(node), (VisitFn)ci_visit, as)
+
+CI_VISITOR(AST_TOPLEVEL, ASTTopLevel) {
+    // Every node records its own source (see ci_node_index), so a top level
+    // from another file is assembled like any other block of declarations
+    return VISIT_OK;
+}
+
+CI_VISITOR(AST_STMT_DECL, ASTStmtDecl) {
+    return VISIT_OK;
+}
+
+CI_VISITOR(AST_STMT_EXPR, ASTStmtExpr) {
+    if (phase == VISIT_POST) {
+        asm_single_op(as->stream, CIO_DROP);
+    }
+
+    return VISIT_OK;
+}
+
+CI_VISITOR(AST_BLOCK, ASTBlock) {
+    return VISIT_OK;
+}
+
+static void ci_assemble_body(CIAssembler *as, ASTDeclFunc *node, uint64_t fn_idx) {
+    if (as->function != NULL) {
+        CI_ERROR(&AST_BASE(node)->location, "nested functions are not supported");
+    }
+
+    // Function bodies are assembled inline, so the code that runs at the top
+    // level has to jump over them
+    CIImage *image = as->image;
+    ByteStream *stream = as->stream;
+    off_t skip_patch = asm_jump_placeholder(as, CIO_JUMP);
+
+    as->function = ci_image_function(image, fn_idx);
+    as->function_index = fn_idx;
+    as->function->entry = stream->current_offset;
+
+    // Parameters are the first locals of the frame
+    List_FOREACH(ASTDeclaration*, param, node->params, {
+        ci_symbol_create((ASTBase*)param, CI_SYM_LOCAL, as->function->local_count++);
+    })
+
+    CI_VISIT(ast_decl_func_block(node));
+
+    // Falling off the end returns void
+    asm_push_u64(stream, 0);
+    asm_single_op(stream, CIO_RETURN);
+
+    for (size_t idx = 0; idx < as->fixup_count; idx++) {
+        CIFixup *fixup = &as->fixups[idx];
+        CISymbol *label = (CISymbol*)fixup->label->visit_data;
+        assert(label && label->kind == CI_SYM_LABEL);
+
+        stream_patch_u64(stream, fixup->patch_offset, label->index);
+    }
+    as->fixup_count = 0;
+
+    as->function = NULL;
+    asm_patch_here(stream, skip_patch);
+}
+
+/* Assembles the lazy bodies something calls. They can call others, so it
+ * keeps going until nothing new is called. With all, every body is assembled
+ * (another unit might call them)
+ */
+static void ci_assemble_deferred(CIAssembler *as, bool all) {
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (size_t idx = 0; idx < as->deferred_count; idx++) {
+            uint64_t fn_idx = as->deferred[idx];
+            CIFunction *fn = ci_image_function(as->image, fn_idx);
+
+            // ci_image_finish calls main
+            if (!fn->is_deferred ||
+                !(all || fn->is_called || !strcmp(fn->name, "main"))) {
+                continue;
+            }
+
+            fn->is_deferred = false;
+            ci_assemble_body(as, fn->decl, fn_idx);
+            changed = true;
+        }
+    }
+}
+
+CI_VISITOR(AST_DECL_FUNC, ASTDeclFunc) {
+    if (phase == VISIT_POST) {
+        return VISIT_OK;
+    }
+
+    CIImage *image = as->image;
+
+    CIFunction fn = {};
+    fn.name = strdup(spelling_cstring(AST_BASE(node->base.name)->location.spelling));
+    fn.decl = node;
+    fn.param_count = (uint32_t)list_count(node->params);
+    fn.has_varargs = node->has_varargs;
+    fn.is_foreign = !ast_decl_func_has_body(node);
+    fn.is_unprototyped = fn.param_count == 0 && !fn.has_varargs;
+    ci_function_classify_return(&fn, node->type);
+
+    if (fn.is_foreign) {
+        if (fn.param_count > CI_FFI_MAX_ARGS ||
+            (fn.has_varargs && fn.param_count >= CI_FFI_MAX_ARGS)) {
+            CI_ERROR(&AST_BASE(node)->location, "foreign function '%s' has too "
+                     "many parameters (at most %d are supported)", fn.name,
+                     CI_FFI_MAX_ARGS);
+        }
+
+        if (fn.has_varargs && fn.param_count == 0) {
+            CI_ERROR(&AST_BASE(node)->location, "foreign function '%s' needs "
+                     "a named parameter before '...'", fn.name);
+        }
+
+        fn.stub = fn.has_varargs ? g_ffi_varargs_stubs[fn.param_count] :
+                                   g_ffi_fixed_stubs[fn.param_count];
+    }
+
+    CI_ARRAY_APPEND(image->functions, image->function_count, fn);
+    uint64_t fn_idx = ci_image_function_count(image) - 1;
+    if (as->function != NULL) {
+        // A prototype inside a function body can move the function table
+        as->function = ci_image_function(image, as->function_index);
+    }
+    ci_symbol_create((ASTBase*)node, CI_SYM_FUNCTION, fn_idx);
+
+    if (fn.is_foreign) {
+        return VISIT_HANDLED;
+    }
+
+    if (node->block == NULL && as->function == NULL) {
+        // Not parsed yet. It waits to see if anything calls it
+        ci_image_function(image, fn_idx)->is_deferred = true;
+        CI_ARRAY_APPEND(as->deferred, as->deferred_count, fn_idx);
+        return VISIT_HANDLED;
+    }
+
+    ci_assemble_body(as, node, fn_idx);
+    return VISIT_HANDLED;
+}
+
+CI_VISITOR(AST_DECL_VAR, ASTDeclVar) {
+    if (ast_node_is_type_definition((ASTBase*)node) ||
+        (node->type->type_id & TYPE_FLAG_KIND)) {
+        // Types are resolved by the parser, nothing to run here
+        return VISIT_HANDLED;
+    }
+
+    if (phase == VISIT_PRE) {
+        if (as->function != NULL) {
+            ci_symbol_create((ASTBase*)node, CI_SYM_LOCAL, as->function->local_count++);
+        } else {
+            ci_symbol_create((ASTBase*)node, CI_SYM_GLOBAL, as->image->global_count++);
+        }
+    } else if (node->expression != NULL) {
+        asm_store(as, (CISymbol*)AST_BASE(node)->visit_data);
+        asm_single_op(as->stream, CIO_DROP);
+    } else if (as->function != NULL) {
+        // Locals are reused when a function is called again, so make sure
+        // they start from zero each time like the globals do
+        asm_push_integer(as->stream, 0);
+        asm_store(as, (CISymbol*)AST_BASE(node)->visit_data);
+        asm_single_op(as->stream, CIO_DROP);
+    }
+
+    return VISIT_OK;
+}
+
+CI_VISITOR(AST_OPERATOR, ASTOperator) {
+
+    if (phase == VISIT_PRE) {
+        asm_push_reloc(as, ci_node_index(as->image, AST_BASE(node)), CI_RELOC_NODE);
+        asm_single_op(as->stream, CIO_NEW_AST_NODE);
+    }
+
+    return VISIT_OK;
+}
+
+CI_VISITOR(AST_EXPR_EMPTY, ASTExprEmpty) {
+    if (phase == VISIT_PRE) {
+        asm_push_u64(as->stream, 0); /* void */
+    }
+
+    return VISIT_OK;
+}
+
+CI_VISITOR(AST_EXPR_NUMBER, ASTExprNumber) {
+
+    if (phase == VISIT_PRE) {
+        asm_push_u64(as->stream, node->number);
+        asm_single_op(as->stream, CIO_NEW_INTEGER_LITERAL);
+    }
+
+    return VISIT_OK;
+}
+
+CI_VISITOR(AST_EXPR_STRING, ASTExprString) {
+    if (phase == VISIT_PRE) {
+        uint64_t constant = ci_string_constant(as->image, AST_BASE(node)->location.spelling);
+        asm_push_reloc(as, constant, CI_RELOC_CONSTANT);
+        asm_single_op(as->stream, CIO_NEW_STRING_LITERAL);
+    }
+
+    return VISIT_OK;
+}
+
+CI_VISITOR(AST_EXPR_PAREN, ASTExprParen) {
+    return VISIT_OK;
+}
+
+CI_VISITOR(AST_EXPR_CAST, ASTExprCast) {
+    // TODO(bloggins): Truncate to the cast type
+    return VISIT_OK;
+}
+
+CI_VISITOR(AST_EXPR_IDENT, ASTExprIdent) {
+    if (phase == VISIT_POST) {
+        CISymbol *sym = ci_symbol_lookup(node->name);
+        if (ci_symbol_is_variable(sym)) {
+            ci_note_access(as, sym);
+            asm_load(as, sym);
+        } else {
+            // We don't know what this is (yet), so it stays symbolic
+            // TODO(bloggins): This should probably be CIO_IDENTIFIER_LITERAL!
+            asm_single_op(as->stream, CIO_NEW_IDENTIFIER);
+        }
+    }
+
+    return VISIT_OK;
+}
+
+CI_VISITOR(AST_EXPR_BINARY, ASTExprBinary) {
+    TokenKind op = node->op->op.kind;
+
+    if (op == TOK_EQUALS) {
+        if (phase == VISIT_POST) {
+            return VISIT_OK;
+        }
+
+        CISymbol *sym = NULL;
+        if (AST_IS(node->left, AST_EXPR_IDENT)) {
+            sym = ci_symbol_lookup(((ASTExprIdent*)node->left)->name);
+        }
+
+        if (!ci_symbol_is_variable(sym)) {
+            CI_ERROR(&AST_BASE(node)->location, "can only assign to variables");
+        }
+
+        CI_VISIT(node->right);
+        ci_note_access(as, sym);
+        asm_store(as, sym);
+
+        return VISIT_HANDLED;
+    }
+
+    if (op == TOK_AMP_AMP || op == TOK_PIPE_PIPE) {
+        if (phase == VISIT_POST) {
+            return VISIT_OK;
+        }
+
+        // Short circuit. The result is always 0 or 1, like in C
+        ByteStream *stream = as->stream;
+        off_t short_patch, false_patch, end_patch;
+
+        CI_VISIT(node->left);
+        if (op == TOK_AMP_AMP) {
+            short_patch = asm_jump_placeholder(as, CIO_JUMP_UNLESS);
+            CI_VISIT(node->right);
+            false_patch = asm_jump_placeholder(as, CIO_JUMP_UNLESS);
+            asm_push_integer(stream, 1);
+            end_patch = asm_jump_placeholder(as, CIO_JUMP);
+
+            asm_patch_here(stream, short_patch);
+            asm_patch_here(stream, false_patch);
+            asm_push_integer(stream, 0);
+        } else {
+            off_t rhs_patch = asm_jump_placeholder(as, CIO_JUMP_UNLESS);
+            asm_push_integer(stream, 1);
+            short_patch = asm_jump_placeholder(as, CIO_JUMP);
+
+            asm_patch_here(stream, rhs_patch);
+            CI_VISIT(node->right);
+            false_patch = asm_jump_placeholder(as, CIO_JUMP_UNLESS);
+            asm_push_integer(stream, 1);
+            end_patch = asm_jump_placeholder(as, CIO_JUMP);
+
+            asm_patch_here(stream, false_patch);
+            asm_push_integer(stream, 0);
+            asm_patch_here(stream, short_patch);
+        }
+        asm_patch_here(stream, end_patch);
+
+        return VISIT_HANDLED;
+    }
+
+    if (phase == VISIT_POST) {
+        asm_push_u64(as->stream, op);
+        asm_single_op(as->stream, CIO_BINOP);
+    }
+
+    return VISIT_OK;
+}
+
+CI_VISITOR(AST_EXPR_CALL, ASTExprCall) {
+    if (phase == VISIT_POST) {
+        return VISIT_OK;
+    }
+
+    CISymbol *sym = NULL;
+    if (AST_IS(node->callable, AST_EXPR_IDENT)) {
+        sym = ci_symbol_lookup(((ASTExprIdent*)node->callable)->name);
+    }
+
+    if (sym == NULL || sym->kind != CI_SYM_FUNCTION) {
+        CI_ERROR(&AST_BASE(node)->location, "'%s' is not a function I can call",
+                 spelling_cstring(AST_BASE(node->callable)->location.spelling));
+    }
+
+    CIFunction *fn = ci_image_function(as->image, sym->index);
+    fn->is_called = true;
+    size_t arg_count = list_count(node->args);
+
+    // Functions declared with () take whatever they're given, like in C
+    if (!fn->is_unprototyped && (arg_count < fn->param_count ||
+                          (arg_count > fn->param_count && !fn->has_varargs))) {
+        CI_ERROR(&AST_BASE(node)->location, "'%s' takes %u argument(s) but was "
+                 "given %zu", fn->name, fn->param_count, arg_count);
+    }
+
+    if (fn->is_foreign && arg_count > CI_FFI_MAX_ARGS) {
+        CI_ERROR(&AST_BASE(node)->location, "too many arguments to foreign "
+                 "function '%s' (at most %d are supported)", fn->name,
+                 CI_FFI_MAX_ARGS);
+    }
+
+    List_FOREACH(ASTExpression*, arg, node->args, {
+        CI_VISIT(arg);
+    })
+
+    ci_note_access(as, sym);
+    asm_push_u64(as->stream, arg_count);
+    asm_push_reloc(as, sym->index, CI_RELOC_FUNCTION);
+    asm_single_op(as->stream, CIO_CALL);
+
+    return VISIT_HANDLED;
+}
+
+
+CI_VISITOR(AST_STMT_IF, ASTStmtIf) {
+    if (phase == VISIT_POST) {
+        return VISIT_OK;
+    }
+
+    ByteStream *stream = as->stream;
+
+    CI_VISIT(node->condition);
+    off_t false_patch = asm_jump_placeholder(as, CIO_JUMP_UNLESS);
+    CI_VISIT(node->stmt_true);
+
+    if (node->stmt_false == NULL) {
+        asm_patch_here(stream, false_patch);
+    } else {
+        off_t end_patch = asm_jump_placeholder(as, CIO_JUMP);
+        asm_patch_here(stream, false_patch);
+        CI_VISIT(node->stmt_false);
+        asm_patch_here(stream, end_patch);
+    }
+
+    return VISIT_HANDLED;
+}
+
+CI_VISITOR(AST_STMT_RETURN, ASTStmtReturn) {
+    if (phase == VISIT_PRE) {
+        if (as->function == NULL) {
+            CI_ERROR(&AST_BASE(node)->location, "can't return from outside a function");
+        }
+    } else {
+        if (node->expression == NULL) {
+            asm_push_u64(as->stream, 0);
+        }
+
+        asm_single_op(as->stream, CIO_RETURN);
+    }
+
+    return VISIT_OK;
+}
+
+CI_VISITOR(AST_STMT_LABELED, ASTStmtLabeled) {
+    if (phase == VISIT_PRE) {
+        if (as->function == NULL) {
+            CI_ERROR(&AST_BASE(node)->location, "labels must be inside a function");
+        }
+
+        ci_symbol_create((ASTBase*)node, CI_SYM_LABEL, as->stream->current_offset);
+    }
+
+    return VISIT_OK;
+}
+
+CI_VISITOR(AST_STMT_JUMP, ASTStmtJump) {
+    if (phase == VISIT_POST) {
+        return VISIT_OK;
+    }
+
+    if (node->keyword.kind != TOK_KW_GOTO) {
+        CI_ERROR(&AST_BASE(node)->location, "'%s' is not supported by the interpreter",
+                 spelling_cstring(node->keyword.location.spelling));
+    }
+
+    ASTBase *label = ast_ident_find_label(node->label);
+    if (label == NULL) {
+        CI_ERROR(&AST_BASE(node)->location, "can't find label '%s'",
+                 spelling_cstring(AST_BASE(node->label)->location.spelling));
+    }
+
+    // Labels can come later in the function, so they're patched at the end
+    CIFixup fixup;
+    fixup.patch_offset = asm_jump_placeholder(as, CIO_JUMP);
+    fixup.label = label;
+    CI_ARRAY_APPEND(as->fixups, as->fixup_count, fixup);
+
+    return VISIT_HANDLED;
+}
+
+CI_VISITOR(AST_IDENT, ASTIdent) {
+
+    return VISIT_OK;
+}
+
+CI_VISITOR(AST_TYPE_CONSTANT, ASTTypeConstant) {
+    return VISIT_OK;
+}
+
+CI_VISITOR(AST_TYPE_NAME, ASTTypeName) {
+    return VISIT_OK;
+}
+
+CI_VISITOR(AST_TYPE_POINTER, ASTTypePointer) {
+    return VISIT_OK;
+}
+
+CI_VISITOR(AST_PP_PRAGMA, ASTPPPragma) {
+    return VISIT_OK;
+}
+
+CI_VISITOR(AST_PP_DEFINITION, ASTPPDefinition) {
+    return VISIT_OK;
+}
+
+CI_VISITOR(AST_PP_IF, ASTPPIf) {
+    return VISIT_OK;
+}
+
+// *** END OVERRIDES SECTION ***
+
+#pragma mark Visitor Routine
+
+VisitFn visitors[] = {
+#   define AST(kind, name, type) (VisitFn)ci_visit_AST_##kind,
+#   include "ast.def.h"
+};
+#undef AST
+
+
+int ci_visit(ASTBase *node, VisitPhase phase, CIAssembler *as) {
+    ByteStream *stream = as->stream;
+
+    if (phase == VISIT_PRE) {
+        CICodeSpan span = {};
+        span.start = stream->current_offset;
+        span.node = ci_node_index(as->image, node);
+        CI_ARRAY_APPEND(as->open_spans, as->open_span_count, span);
+
+        asm_push_reloc(as, span.node, CI_RELOC_NODE);
+        asm_push_node(stream, node->kind);
+    }
+
+    int res = visitors[node->kind](node, phase, as);
+
+    // Nodes that handle their own children don't get a post visit, so they
+    // are popped right away
+    if ((res == VISIT_OK && phase == VISIT_POST) ||
+        (res == VISIT_HANDLED && phase == VISIT_PRE)) {
+        asm_single_op(stream, CIO_POP_NODE);
+
+        assert(as->open_span_count > 0);
+        CICodeSpan span = as->open_spans[--as->open_span_count];
+        span.end = stream->current_offset;
+        CI_ARRAY_APPEND(as->image->spans, as->image->span_count, span);
+    }
+
+    return res;
+}
+
+#pragma mark Preloaded Declarations
+
+// SNAPSHOTS:
+//
+// A snapshot image (see lmac snapshot) holds a parsed top level and the heap
+// blob made by interp_snapshot_heap. The blob has the value of each global in
+// the snapshot's top-level scope when the top level finished running, so
+// loading it with interp_preload gives later code the same globals without
+// running (or parsing) anything again.
+//
+// @0:
+// uint64_t magic;
+// uint64_t count;
+//
+// @16: [(* count)]
+// uint64_t decl_index; (= position in the scope's declarations list)
+// uint64_t kind; (= CIValueKind)
+// uint64_t int_value; (= also used for chars)
+// uint64_t str_offset; (= from the start of the blob, for strings)
+//
+// [char] string data
+
+#define CI_HEAP_MAGIC 0x31504145484943ull    /* "CIHEAP1" */
+
+typedef struct {
+    uint64_t decl_index;
+    uint64_t kind;
+    uint64_t int_value;
+    uint64_t str_offset;
+} CIHeapEntry;
+
+typedef struct {
+    ASTDeclaration *decl;
+    CIValue value;
+} CIPreloadedGlobal;
+
+global_variable Scope *g_preload_scope;
+global_variable size_t g_preload_count;
+global_variable CIPreloadedGlobal *g_preload_globals;
+
+/* The preloaded functions, assembled once and shared by every image
+ * assembled after interp_share()
+ */
+global_variable CIImage *g_shared_image;
+
+#pragma mark Memoization
+
+InterpOptions interp_options;
+
+/* Marks every function that only depends on its arguments as pure */
+void ci_find_pure_functions(CIImage *image) {
+    for (size_t idx = 0; idx < image->function_count; idx++) {
+        CIFunction *fn = &image->functions[idx];
+        fn->is_pure = !fn->is_foreign && !fn->is_deferred && !fn->touches_globals;
+    }
+
+    // Calling an impure function makes the caller impure too. Keep going
+    // until that stops changing anything (recursion makes this a fixed point)
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (size_t idx = 0; idx < image->function_count; idx++) {
+            CIFunction *fn = &image->functions[idx];
+            if (!fn->is_pure) {
+                continue;
+            }
+
+            for (size_t c = 0; c < fn->callee_count; c++) {
+                if (!ci_image_function(image, fn->callees[c])->is_pure) {
+                    fn->is_pure = false;
+                    changed = true;
+                    break;
+                }
+            }
+        }
+    }
+}
+
+#define CI_MEMO_MAX_ARGS CI_FFI_MAX_ARGS
+
+typedef struct {
+    uint64_t function_index;
+    uint32_t arg_count;
+    CIValue args[CI_MEMO_MAX_ARGS];
+} CIMemoKey;
+
+typedef struct {
+    bool used;
+    uint64_t hash;
+    CIMemoKey key;
+    CIValue result;
+} CIMemoEntry;
+
+/* The table is emptied when it gets this full, so a program that never
+ * repeats a call doesn't keep every result it ever computed */
+#define CI_MEMO_MAX_ENTRIES     4096
+
+/* Each function's lookups are counted in windows this long. A function that
+ * hits less than one time in CI_MEMO_MIN_HIT_RATE over a window isn't
+ * memoized any more */
+#define CI_MEMO_WINDOW          256
+#define CI_MEMO_MIN_HIT_RATE    8
+
+typedef struct {
+    uint32_t lookups;
+    uint32_t hits;
+    bool given_up;
+} CIMemoFunction;
+
+typedef struct {
+    size_t count;
+    size_t capacity;
+    CIMemoEntry *entries;
+
+    uint64_t hits;
+    uint64_t misses;
+
+    /* Indexed by function. Made on the first lookup */
+    CIMemoFunction *functions;
+    size_t given_up_count;
+} CIMemoTable;
+
+/* Only plain values can be compared, so only they can be memoized */
+static inline bool ci_memo_value_ok(const CIValue *v) {
+    return v->kind == CIV_VOID || ci_value_is_integer(v) || ci_value_is_string(v) ||
+           v->kind == CIV_CHAR_LITERAL || v->kind == CIV_POD_CHAR;
+}
+
+static inline bool ci_memo_value_equal(const CIValue *v1, const CIValue *v2) {
+    if (ci_value_is_integer(v1) && ci_value_is_integer(v2)) {
+        return v1->simple_value.int_value == v2->simple_value.int_value;
+    } else if (ci_value_is_string(v1) && ci_value_is_string(v2)) {
+        return !strcmp(v1->simple_value.str_value, v2->simple_value.str_value);
+    } else if (v1->kind == v2->kind) {
+        return v1->kind == CIV_VOID ||
+               v1->simple_value.char_value == v2->simple_value.char_value;
+    }
+
+    return false;
+}
+
+uint64_t ci_memo_hash(const CIMemoKey *key) {
+    // FNV-1a over the callee and the argument values
+    uint64_t hash = 0xcbf29ce484222325ull;
+#   define HASH_BYTE(b) { hash ^= (uint8_t)(b); hash *= 0x100000001b3ull; }
+#   define HASH_U64(v) { uint64_t x = (v); for (int i = 0; i < 8; i++) { HASH_BYTE(x >> (i*8)); } }
+
+    HASH_U64(key->function_index);
+    HASH_U64(key->arg_count);
+    for (uint32_t idx = 0; idx < key->arg_count; idx++) {
+        const CIValue *v = &key->args[idx];
+        if (ci_value_is_string(v)) {
+            for (const char *c = v->simple_value.str_value; *c; c++) {
+                HASH_BYTE(*c);
+            }
+        } else if (ci_value_is_integer(v)) {
+            HASH_U64(v->simple_value.int_value);
+        } else {
+            HASH_U64(v->simple_value.char_value);
+        }
+    }
+
+#   undef HASH_U64
+#   undef HASH_BYTE
+    return hash;
+}
+
+CIMemoEntry *ci_memo_find(CIMemoTable *table, const CIMemoKey *key, uint64_t hash) {
+    if (table->capacity == 0) {
+        return NULL;
+    }
+
+    size_t mask = table->capacity - 1;
+    for (size_t idx = hash & mask; ; idx = (idx + 1) & mask) {
+        CIMemoEntry *entry = &table->entries[idx];
+        if (!entry->used) {
+            return entry;
+        }
+
+        if (entry->hash != hash || entry->key.function_index != key->function_index ||
+            entry->key.arg_count != key->arg_count) {
+            continue;
+        }
+
+        bool equal = true;
+        for (uint32_t a = 0; a < key->arg_count && equal; a++) {
+            equal = ci_memo_value_equal(&entry->key.args[a], &key->args[a]);
+        }
+
+        if (equal) {
+            return entry;
+        }
+    }
+}
+
+/* Whether calls to the function are still worth looking up */
+bool ci_memo_wanted(CIMemoTable *table, size_t function_count, uint64_t function_index) {
+    if (table->functions == NULL) {
+        table->functions = calloc(function_count, sizeof(CIMemoFunction));
+    }
+
+    return !table->functions[function_index].given_up;
+}
+
+/* Counts a lookup, and gives up on the function if its window ended with too
+ * few hits */
+void ci_memo_count(CIMemoTable *table, uint64_t function_index, bool hit) {
+    CIMemoFunction *fn = &table->functions[function_index];
+    if (hit) {
+        table->hits++;
+        fn->hits++;
+    } else {
+        table->misses++;
+    }
+
+    if (++fn->lookups == CI_MEMO_WINDOW) {
+        fn->given_up = fn->hits * CI_MEMO_MIN_HIT_RATE < fn->lookups;
+        table->given_up_count += fn->given_up;
+        fn->lookups = 0;
+        fn->hits = 0;
+    }
+}
+
+void ci_memo_insert(CIMemoTable *table, const CIMemoKey *key, const CIValue *result) {
+    if (table->count == CI_MEMO_MAX_ENTRIES) {
+        memset(table->entries, 0, table->capacity * sizeof(CIMemoEntry));
+        table->count = 0;
+    }
+
+    if ((table->count + 1) * 4 > table->capacity * 3) {
+        CIMemoTable grown = *table;
+        grown.count = 0;
+        grown.capacity = table->capacity ? table->capacity * 2 : 64;
+        grown.entries = calloc(grown.capacity, sizeof(CIMemoEntry));
+
+        for (size_t idx = 0; idx < table->capacity; idx++) {
+            CIMemoEntry *old = &table->entries[idx];
+            if (old->used) {
+                *ci_memo_find(&grown, &old->key, old->hash) = *old;
+                grown.count++;
+            }
+        }
+
+        free(table->entries);
+        *table = grown;
+    }
+
+    uint64_t hash = ci_memo_hash(key);
+    CIMemoEntry *entry = ci_memo_find(table, key, hash);
+    if (!entry->used) {
+        entry->used = true;
+        entry->hash = hash;
+        entry->key = *key;
+        table->count++;
+    }
+    entry->result = *result;
+}
+
+#pragma mark Memoization Cache File
+
+// Results can be saved next to the other cached build products and reused by
+// later builds. Only integer arguments and results are saved. The file name is
+// a hash of the source of every pure function, so changing any of them starts
+// a fresh cache.
+//
+// Each line is: <function name> <arg count> [<arg>...] <result>
+
+char *ci_memo_cache_path(CIImage *image) {
+    ByteStream sources = {};
+    for (size_t idx = 0; idx < ci_image_function_count(image); idx++) {
+        CIFunction *fn = ci_image_function(image, idx);
+        if (!fn->is_pure) {
+            continue;
+        }
+
+        SourceLocation *sl = &AST_BASE(fn->decl)->location;
+        stream_append(&sources, source_manager_pointer(sl->start), sl->length);
+    }
+
+    char *path = NULL;
+    if (sources.current_offset > 0) {
+        asprintf(&path, "%s/memo-%016llx", run_cache_dir(),
+                 run_hash(sources.data, sources.current_offset));
+    }
+
+    free(sources.data);
+    return path;
+}
+
+void ci_memo_load(CIMemoTable *table, CIImage *image) {
+    char *path = ci_memo_cache_path(image);
+    FILE *f = path ? fopen(path, "r") : NULL;
+    free(path);
+    if (f == NULL) {
+        return;
+    }
+
+    char name[256];
+    uint32_t arg_count;
+    while (fscanf(f, "%255s %u", name, &arg_count) == 2) {
+        CIMemoKey key = {};
+        size_t function_count = ci_image_function_count(image);
+        key.function_index = function_count;
+        key.arg_count = arg_count;
+        for (size_t idx = 0; idx < function_count; idx++) {
+            CIFunction *fn = ci_image_function(image, idx);
+            if (fn->is_pure && !strcmp(fn->name, name)) {
+                key.function_index = idx;
+                break;
+            }
+        }
+
+        if (arg_count > CI_MEMO_MAX_ARGS) {
+            break;
+        }
+
+        CIValue result = {};
+        bool ok = true;
+        for (uint32_t idx = 0; idx <= arg_count && ok; idx++) {
+            CIValue *v = (idx < arg_count) ? &key.args[idx] : &result;
+            v->kind = CIV_POD_INTEGER;
+            v->simple_value.is_pod = true;
+            ok = (fscanf(f, "%lld", (int64_t*)&v->simple_value.int_value) == 1);
+        }
+
+        if (!ok) {
+            break;
+        }
+
+        if (key.function_index < function_count) {
+            ci_memo_insert(table, &key, &result);
+        }
+    }
+
+    fclose(f);
+}
+
+void ci_memo_save(CIMemoTable *table, CIImage *image) {
+    char *path = ci_memo_cache_path(image);
+    if (path == NULL) {
+        return;
+    }
+
+    char *tmp_path = NULL;
+    asprintf(&tmp_path, "%s.%d", path, getpid());
+    FILE *f = fopen(tmp_path, "w");
+    if (f == NULL) {
+        free(tmp_path);
+        free(path);
+        return;
+    }
+
+    for (size_t idx = 0; idx < table->capacity; idx++) {
+        CIMemoEntry *entry = &table->entries[idx];
+        if (!entry->used || !ci_value_is_integer(&entry->result)) {
+            continue;
+        }
+
+        bool all_integers = true;
+        for (uint32_t a = 0; a < entry->key.arg_count; a++) {
+            all_integers = all_integers && ci_value_is_integer(&entry->key.args[a]);
+        }
+        if (!all_integers) {
+            continue;
+        }
+
+        fprintf(f, "%s %u", ci_image_function(image, entry->key.function_index)->name,
+                entry->key.arg_count);
+        for (uint32_t a = 0; a < entry->key.arg_count; a++) {
+            fprintf(f, " %lld", (int64_t)entry->key.args[a].simple_value.int_value);
+        }
+        fprintf(f, " %lld\n", (int64_t)entry->result.simple_value.int_value);
+    }
+
+    fclose(f);
+    rename(tmp_path, path);
+
+    free(tmp_path);
+    free(path);
+}
+
+#pragma mark Native Functions
+
+// Pure functions that only take and return integers can be compiled ahead of
+// time (see InterpOptions.aot). The code generator lowers them back to C, cc
+// builds them into a shared object in the build cache, and calls to them go
+// through the same stubs as calls to foreign functions. The file name is a
+// hash of the generated C, so changing any of them builds a new one. Until
+// that shows up (or if there's no cc) the interpreter runs them.
+
+static bool ci_aot_type_ok(ASTTypeExpression *type) {
+    ASTTypeExpression *canonical = ast_type_get_canonical_type(type);
+    if (canonical == NULL || !AST_IS(canonical, AST_TYPE_CONSTANT)) {
+        return false;
+    }
+
+    ASTTypeConstant *c = (ASTTypeConstant*)canonical;
+    return c->base.type_id != TYPE_FLAG_UNIT && !(c->base.type_id & TYPE_FLAG_KIND) &&
+           !(c->bit_flags & BIT_FLAG_FP) && c->bit_size > 0 && c->bit_size <= 64;
+}
+
+static bool ci_aot_function_ok(CIFunction *fn) {
+    if (!fn->is_pure || fn->is_foreign || fn->has_varargs ||
+        fn->param_count > CI_FFI_MAX_ARGS ||
+        fn->returns_void || fn->returns_string || !ci_aot_type_ok(fn->decl->type)) {
+        return false;
+    }
+
+    List_FOREACH(ASTDeclaration*, param, fn->decl->params, {
+        if (!AST_IS(param, AST_DECL_VAR) || !ci_aot_type_ok(((ASTDeclVar*)param)->type)) {
+            return false;
+        }
+    })
+
+    return true;
+}
+
+void ci_aot_bind(CIImage *image) {
+    if (image->function_count == 0) {
+        return;
+    }
+
+    // Functions of a shared image are never written to, so only this image's
+    // functions (and only ones that just call each other) are compiled
+    size_t first = image->base ? image->base->function_count : 0;
+    bool *ok = calloc(image->function_count, sizeof(bool));
+    for (size_t idx = 0; idx < image->function_count; idx++) {
+        ok[idx] = ci_aot_function_ok(&image->functions[idx]);
+    }
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (size_t idx = 0; idx < image->function_count; idx++) {
+            CIFunction *fn = &image->functions[idx];
+            for (size_t c = 0; c < fn->callee_count && ok[idx]; c++) {
+                if (fn->callees[c] < first || !ok[fn->callees[c] - first]) {
+                    ok[idx] = false;
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    size_t count = 0;
+    ASTDeclFunc **decls = calloc(image->function_count, sizeof(ASTDeclFunc*));
+    for (size_t idx = 0; idx < image->function_count; idx++) {
+        if (ok[idx]) {
+            decls[count++] = image->functions[idx].decl;
+        }
+    }
+
+    if (count > 0) {
+        char *source = NULL;
+        size_t source_size = 0;
+        FILE *fsource = open_memstream(&source, &source_size);
+        codegen_generate_functions(fsource, decls, count);
+        fclose(fsource);
+
+        char *so_file = NULL;
+        asprintf(&so_file, "%s/aot-%016llx.so", run_cache_dir(),
+                 run_hash((uint8_t*)source, source_size));
+
+        void *handle = dlopen(so_file, RTLD_NOW | RTLD_LOCAL);
+        if (handle == NULL) {
+            run_build_in_background(source, source_size,
+                                    "-std=c11 -O2 -shared -fPIC", so_file);
+        } else {
+            for (size_t idx = 0; idx < image->function_count; idx++) {
+                CIFunction *fn = &image->functions[idx];
+                if (ok[idx]) {
+                    fn->native = dlsym(handle, fn->name);
+                }
+            }
+        }
+
+        free(so_file);
+        free(source);
+    }
+
+    free(decls);
+    free(ok);
+}
+
+#pragma mark Virtual Machine
+
+#define CI_STACK_SIZE 4096
+
+typedef struct {
+    uint64_t function_index;
+    ByteStream *return_code;
+    uint64_t return_offset;
+
+    /* Locals are the values from here to value_base + local_count. Anything
+     * after them belongs to the statement that is running.
+     */
+    ValueTableIndex value_base;
+    uint32_t local_count;
+
+    /* Set when the result should go in the memo table */
+    bool memoize;
+    CIMemoKey memo_key;
+} CIFrame;
+
+typedef struct {
+    CIImage *image;
+
+    uint64_t stack[CI_STACK_SIZE];
+    uint16_t sp;
+
+    size_t frame_count;
+    size_t frame_capacity;
+    CIFrame *frames;
+
+    CIValueTable values;
+    ValueTableIndex global_base;
+
+    /* The last value dropped by a statement */
+    ValueTableIndex result;
+
+    CIMemoTable memo;
+
+    /* What the profiler's signal handler looks at (see ci_profile_start) */
+    bool profiling;
+    uint8_t * volatile profile_ip;
+    ByteStream * volatile profile_code;
+    volatile sig_atomic_t frames_moving;
+} CIVM;
+
+void ci_vm_init(CIVM *vm, CIImage *image) {
+    memset(vm, 0, sizeof(CIVM));
+    vm->image = image;
+    vm->sp = 1; // 0th is a stack underflow
+
+    CIValue v = {};
+    v.kind = CIV_VOID;
+    ValueTableIndex void_idx = values_new(&vm->values, &v);
+    assert(void_idx == 0);
+
+    // Globals start out zeroed, just like C's static storage, unless they
+    // were preloaded from a snapshot
+    vm->global_base = vm->values.count;
+    for (size_t idx = 0; idx < image->global_count; idx++) {
+        CIValue g = {};
+        g.kind = CIV_POD_INTEGER;
+        g.simple_value.is_pod = true;
+        if (idx < image->preload_count) {
+            g = g_preload_globals[idx].value;
+        }
+        values_new(&vm->values, &g);
+    }
+
+    // NOTE(bloggins): AST node values are made when CIO_NEW_AST_NODE runs
+    // instead of up front, so a VM only pays for the nodes it actually uses
+    // (and nothing for the nodes of a shared image)
+}
+
+void ci_vm_destroy(CIVM *vm) {
+    free(vm->values.values);
+    vm->values.values = NULL;
+
+    free(vm->frames);
+    vm->frames = NULL;
+
+    free(vm->memo.entries);
+    vm->memo.entries = NULL;
+
+    free(vm->memo.functions);
+    vm->memo.functions = NULL;
+}
+
+CIFrame *ci_vm_push_frame(CIVM *vm) {
+    if (vm->frame_count == vm->frame_capacity) {
+        vm->frames_moving = 1;
+        vm->frame_capacity = vm->frame_capacity ? vm->frame_capacity * 2 : 64;
+        vm->frames = realloc(vm->frames, vm->frame_capacity * sizeof(CIFrame));
+        vm->frames_moving = 0;
+    }
+
+    return &vm->frames[vm->frame_count++];
+}
+
+/* Returns false when the interpreter can't apply op (including division by
+ * zero) without touching result
+ */
+bool ci_binop_try(CIValue *v1, CIValue *v2, TokenKind op, CIValue *result) {
+    int64_t lhs = (int64_t)v1->simple_value.int_value;
+    int64_t rhs = (int64_t)v2->simple_value.int_value;
+    int64_t res = 0;
+
+    switch (op) {
+        case TOK_PLUS: res = lhs + rhs; break;
+        case TOK_MINUS: res = lhs - rhs; break;
+        case TOK_STAR: res = lhs * rhs; break;
+        case TOK_FORWARDSLASH:
+        case TOK_PERCENT: {
+            if (rhs == 0) {
+                return false;
+            }
+            res = (op == TOK_PERCENT) ? lhs % rhs : lhs / rhs;
+        } break;
+        case TOK_2LANGLE: res = lhs << rhs; break;
+        case TOK_2RANGLE: res = lhs >> rhs; break;
+        case TOK_LANGLE: res = lhs < rhs; break;
+        case TOK_RANGLE: res = lhs > rhs; break;
+        case TOK_LANGLE_EQUALS: res = lhs <= rhs; break;
+        case TOK_RANGLE_EQUALS: res = lhs >= rhs; break;
+        case TOK_EQUALS_EQUALS: res = lhs == rhs; break;
+        case TOK_BANG_EQUALS: res = lhs != rhs; break;
+        case TOK_AMP: res = lhs & rhs; break;
+        case TOK_PIPE: res = lhs | rhs; break;
+        case TOK_CARET: res = lhs ^ rhs; break;
+        case TOK_AMP_AMP: res = lhs && rhs; break;
+        case TOK_PIPE_PIPE: res = lhs || rhs; break;
+        default: return false;
+    }
+
+    CIValue v = {};
+    v.kind = CIV_POD_INTEGER;
+    v.simple_value.is_pod = true;
+    v.simple_value.int_value = (uint64_t)res;
+    *result = v;
+    return true;
+}
+
+CIValue ci_binop(CIValue *v1, CIValue *v2, TokenKind op) {
+    CIValue v;
+    if (!ci_binop_try(v1, v2, op, &v)) {
+        if ((op == TOK_FORWARDSLASH || op == TOK_PERCENT) &&
+            v2->simple_value.int_value == 0) {
+            CI_ERROR(NULL, "division by zero");
+        }
+
+        CI_ERROR(NULL, "operator %s is not supported by the interpreter",
+                 token_get_name(op));
+    }
+
+    return v;
+}
+
+void ci_vm_execute(CIVM *vm, uint64_t entry) {
+    CIImage *image = vm->image;
+
+    // The code that is running. Calls switch to the base's code when they go
+    // to a function from a shared image
+    ByteStream *stream = &image->code;
+    CIValueTable *value_table = &vm->values;
+
+    uint64_t *stack = vm->stack;
+    uint16_t sp = vm->sp;
+#   define PUSH(v) {                                                            \
+        if (sp >= CI_STACK_SIZE) {                                              \
+            diag_emit(DIAG_ERROR, ERR_INTERPRET, NULL, "stack overflow");       \
+        }                                                                       \
+        stack[sp++] = (v);                                                      \
+    }
+#   define POP()   stack[--sp]
+
+    uint8_t *ip = stream->data + entry;
+    bool profiling = vm->profiling;
+    vm->profile_code = stream;
+
+#   define LOOKUP_VALUE(idx) (&value_table->values[(idx)])
+
+    // Interpreter
+    // TODO(bloggins): Direct thread this with computed gotos
+    while (*ip != CIO_HALT) {
+        if (profiling) {
+            vm->profile_ip = ip;
+        }
+
+        switch (*ip) {
+            case CIO_HALT: assert(false && "how did we get here?");
+            case CIO_DECLARE_FR_VERSION: {
+                ++ip;
+
+                uint64_t version = POP();
+                assert((version == 1) && "unsupported FR bytecode version");
+            } break;
+            case CIO_PUSH_U64: {
+                ++ip;
+
+                uint64_t value = decode_u64(&ip);
+                PUSH(value);
+            } break;
+            case CIO_PUSH_NODE: {
+                /* ASTKind kind = * */ ++ip;
+                POP();  // Node index from push node
+
+                ++ip;
+            } break;
+            case CIO_POP_NODE: {
+                ++ip;
+            } break;
+            case CIO_DROP: {
+                ++ip;
+
+                ValueTableIndex value_id = POP();
+                assert(value_id < value_table->count);
+
+                if (vm->frame_count == 0) {
+                    vm->result = value_id;
+                } else {
+                    // Nothing outlives a statement except the locals, so its
+                    // temporaries can go
+                    CIFrame *frame = &vm->frames[vm->frame_count - 1];
+                    value_table->count = frame->value_base + frame->local_count;
+                }
+            } break;
+            case CIO_BINOP: {
+                TokenKind op_kind = (TokenKind)POP();
+                ValueTableIndex v2_idx = POP();
+                ValueTableIndex op_idx = POP();
+                ValueTableIndex v1_idx = POP();
+
+                assert(v1_idx < value_table->count);
+                assert(op_idx < value_table->count);
+                assert(v2_idx < value_table->count);
+
+                CIValue *v1 = LOOKUP_VALUE(v1_idx);
+                CIValue *v2 = LOOKUP_VALUE(v2_idx);
+                assert(v1);
+                assert(v2);
+
+                CIValue v;
+                if (ci_value_is_integer(v1) && ci_value_is_integer(v2)) {
+                    // TODO(bloggins): we can't keep making new values like this!
+                    // For most literal values we can probably get away with tagging
+                    // the high bits and using the literal bits.
+                    //
+                    // Or... tie values to scope so we can throw them away when
+                    // we no longer need them. That's probably the better answer.
+                    v = ci_binop(v1, v2, op_kind);
+                } else {
+                    // We don't really know how to operate on these values so
+                    // we'll emit an unresolved value
+                    v.kind = CIV_BINOP;
+                    v.binop_value.lhs_index = v1_idx;
+                    v.binop_value.op_index = op_idx;
+                    v.binop_value.rhs_index = v2_idx;
+                }
+
+                ValueTableIndex idx = values_new(value_table, &v);
+                PUSH(idx);
+
+                ++ip;
+            } break;
+            case CIO_PUSH_IP: {
+                ++ip;
+                PUSH(ip - stream->data);
+            } break;
+            case CIO_CALL: {
+                ++ip;
+
+                uint64_t fn_idx = POP();
+                uint64_t argcount = POP();
+                assert(fn_idx < ci_image_function_count(image));
+                assert(argcount <= sp - 1);
+
+                CIFunction *fn = ci_image_function(image, fn_idx);
+                uint64_t *arg_ids = &stack[sp - argcount];
+
+                CIMemoKey memo_key;
+                bool memoize = interp_options.memoize && fn->is_pure &&
+                               argcount <= CI_MEMO_MAX_ARGS &&
+                               ci_memo_wanted(&vm->memo, ci_image_function_count(image), fn_idx);
+                if (memoize) {
+                    memo_key.function_index = fn_idx;
+                    memo_key.arg_count = (uint32_t)argcount;
+                    for (uint64_t idx = 0; idx < argcount && memoize; idx++) {
+                        memo_key.args[idx] = *LOOKUP_VALUE(arg_ids[idx]);
+                        memoize = ci_memo_value_ok(&memo_key.args[idx]);
+                    }
+                }
+
+                if (memoize) {
+                    CIMemoEntry *entry = ci_memo_find(&vm->memo, &memo_key, ci_memo_hash(&memo_key));
+                    bool hit = entry != NULL && entry->used;
+                    ci_memo_count(&vm->memo, fn_idx, hit);
+                    if (hit) {
+                        sp -= argcount;
+
+                        CIValue v = entry->result;
+                        PUSH(v.kind == CIV_VOID ? 0 : values_new(value_table, &v));
+                        break;
+                    }
+                }
+
+                if (fn->native != NULL) {
+                    intptr_t args[CI_FFI_MAX_ARGS] = {};
+                    for (uint64_t idx = 0; idx < argcount; idx++) {
+                        args[idx] = ci_ffi_arg(fn, LOOKUP_VALUE(arg_ids[idx]), idx);
+                    }
+                    sp -= argcount;
+
+                    CIValue v = ci_ffi_result(fn, g_ffi_fixed_stubs[fn->param_count](fn->native, args));
+                    if (memoize) {
+                        ci_memo_insert(&vm->memo, &memo_key, &v);
+                    }
+
+                    PUSH(values_new(value_table, &v));
+                    break;
+                }
+
+                if (!fn->is_foreign) {
+                    // Arguments are copied into the parameter slots and the
+                    // rest of the locals start out zeroed
+                    ValueTableIndex value_base = value_table->count;
+                    for (uint32_t idx = 0; idx < fn->local_count; idx++) {
+                        CIValue v = {};
+                        if (idx < fn->param_count && idx < argcount) {
+                            v = *LOOKUP_VALUE(arg_ids[idx]);
+                        } else {
+                            v.kind = CIV_POD_INTEGER;
+                            v.simple_value.is_pod = true;
+                        }
+                        values_new(value_table, &v);
+                    }
+                    sp -= argcount;
+
+                    // The frames and the code don't agree until the call is
+                    // made, so the profiler drops samples taken in between.
+                    // Everything before this is charged to the call site
+                    vm->profile_ip = NULL;
+                    atomic_signal_fence(memory_order_seq_cst);
+
+                    CIFrame *frame = ci_vm_push_frame(vm);
+                    frame->memoize = memoize;
+                    if (memoize) {
+                        frame->memo_key = memo_key;
+                    }
+                    frame->function_index = fn_idx;
+                    frame->return_code = stream;
+                    frame->return_offset = ip - stream->data;
+                    frame->value_base = value_base;
+                    frame->local_count = fn->local_count;
+
+                    stream = ci_image_code(image, fn_idx);
+                    vm->profile_code = stream;
+                    ip = stream->data + fn->entry;
+                    atomic_signal_fence(memory_order_seq_cst);
+                    break;
+                }
+
+                intptr_t args[CI_FFI_MAX_ARGS] = {};
+                for (uint64_t idx = 0; idx < argcount; idx++) {
+                    args[idx] = ci_ffi_arg(fn, LOOKUP_VALUE(arg_ids[idx]), idx);
+                }
+                sp -= argcount;
+
+                void *symbol = ci_ffi_bind(fn);
+                CIForeignStub stub = fn->is_unprototyped ? g_ffi_fixed_stubs[argcount] : fn->stub;
+                CIValue v = ci_ffi_result(fn, stub(symbol, args));
+                PUSH(v.kind == CIV_VOID ? 0 : values_new(value_table, &v));
+            } break;
+            case CIO_RETURN: {
+                if (vm->frame_count == 0) {
+                    diag_emit(DIAG_ERROR, ERR_INTERPRET, NULL, "return without a call");
+                }
+
+                ValueTableIndex value_id = POP();
+                assert(value_id < value_table->count);
+                CIValue v = *LOOKUP_VALUE(value_id);
+
+                CIFrame *frame = &vm->frames[vm->frame_count - 1];
+                value_table->count = frame->value_base;
+
+                if (frame->memoize && ci_memo_value_ok(&v)) {
+                    ci_memo_insert(&vm->memo, &frame->memo_key, &v);
+                }
+
+                PUSH(v.kind == CIV_VOID ? 0 : values_new(value_table, &v));
+
+                // As with a call, only the frame switch itself is dropped
+                vm->profile_ip = NULL;
+                atomic_signal_fence(memory_order_seq_cst);
+
+                vm->frame_count--;
+                stream = frame->return_code;
+                vm->profile_code = stream;
+                ip = stream->data + frame->return_offset;
+                atomic_signal_fence(memory_order_seq_cst);
+            } break;
+            case CIO_JUMP_UNLESS: {
+                uint64_t ip_offset = POP();
+                ValueTableIndex cond_id = POP();
+                assert(cond_id < value_table->count);
+
+                CIValue *cond = LOOKUP_VALUE(cond_id);
+                if (!ci_value_is_integer(cond)) {
+                    diag_emit(DIAG_ERROR, ERR_INTERPRET, NULL, "condition doesn't "
+                              "have a value the interpreter can test");
+                }
+
+                if (cond->simple_value.int_value == 0) {
+                    uint8_t *ptr = stream->data + ip_offset;
+                    assert((ptr < stream->data + stream->current_offset) && "illegal jump address");
+                    ip = ptr;
+                } else {
+                    ++ip;
+                }
+            } break;
+            case CIO_JUMP: {
+                uint64_t ip_offset = POP();
+                uint8_t *ptr = stream->data + ip_offset;
+                assert((ptr < stream->data + stream->current_offset) && "illegal jump address");
+                ip = ptr;
+            } break;
+            case CIO_NEW_INTEGER_LITERAL: {
+                CIValue v;
+                v.kind = CIV_INTEGER_LITERAL;
+                v.simple_value.is_pod = false;
+                v.simple_value.int_value = POP();
+                ValueTableIndex idx = values_new(value_table, &v);
+
+                PUSH(idx);
+                ++ip;
+            } break;
+            case CIO_NEW_STRING_LITERAL: {
+                uint64_t constant = POP();
+
+                CIValue v;
+                v.kind = CIV_STRING_LITERAL;
+                v.simple_value.is_pod = false;
+                v.simple_value.str_value = ci_image_constant(image, constant);
+                ValueTableIndex idx = values_new(value_table, &v);
+
+                PUSH(idx);
+                ++ip;
+            } break;
+            case CIO_NEW_IDENTIFIER: {
+                CIValue v;
+                v.kind = CIV_IDENTIFIER;
+                ValueTableIndex idx = values_new(value_table, &v);
+                value_table->values[idx].identifier_id = idx;
+
+                PUSH(idx);
+                ++ip;
+            } break;
+            case CIO_NEW_BINDING: {
+                ++ip;
+
+                uint64_t value_id = POP();
+                uint64_t name_id = POP();
+                uint64_t constraint_id = POP();
+
+                CIValue v;
+                v.kind = CIV_BINDING;
+                v.binding_value.constraint_index = constraint_id;
+                v.binding_value.name_index = name_id;
+                v.binding_value.value_index = value_id;
+
+                PUSH(values_new(value_table, &v));
+
+            } break;
+            case CIO_NEW_AST_NODE: {
+                ++ip;
+
+                uint64_t node = POP();
+                CINodeInfo *info = ci_image_node(image, node);
+
+                CIValue v = {};
+                v.kind = CIV_AST_NODE;
+                v.ast_node_value.kind = info->kind;
+                v.ast_node_value.source_index = info->source_index;
+                v.ast_node_value.start = info->start;
+                v.ast_node_value.end = info->end;
+
+                PUSH(values_new(value_table, &v));
+            } break;
+            case CIO_LOAD_GLOBAL: {
+                ++ip;
+
+                uint64_t global = POP();
+                assert(global < image->global_count);
+                PUSH(vm->global_base + global);
+            } break;
+            case CIO_LOAD_LOCAL: {
+                ++ip;
+
+                uint64_t local = POP();
+                assert(vm->frame_count > 0);
+                CIFrame *frame = &vm->frames[vm->frame_count - 1];
+                assert(local < frame->local_count);
+                PUSH(frame->value_base + local);
+            } break;
+            case CIO_STORE_LOCAL: {
+                ++ip;
+
+                uint64_t local = POP();
+                ValueTableIndex value_id = POP();
+                assert(vm->frame_count > 0);
+                CIFrame *frame = &vm->frames[vm->frame_count - 1];
+                assert(local < frame->local_count);
+                assert(value_id < value_table->count);
+
+                ValueTableIndex slot = frame->value_base + local;
+                value_table->values[slot] = value_table->values[value_id];
+                PUSH(slot);
+            } break;
+            case CIO_STORE_GLOBAL: {
+                ++ip;
+
+                uint64_t global = POP();
+                ValueTableIndex value_id = POP();
+                assert(global < image->global_count);
+                assert(value_id < value_table->count);
+
+                ValueTableIndex slot = vm->global_base + global;
+                value_table->values[slot] = value_table->values[value_id];
+                PUSH(slot);
+            } break;
+            default: {
+                uint8_t op = *ip;
+                const char *opcode = "unknown";
+                if (op < CIO_LAST) {
+                    opcode = g_opcode_names[op];
+                }
+                diag_emit(DIAG_ERROR, ERR_INTERPRET, NULL, "unrecognized opcode %s\n", opcode);
+            }
+        }
+
+        if (sp < 1) {
+            diag_emit(DIAG_ERROR, ERR_INTERPRET, NULL, "stack underflow");
+        }
+    }
+
+    vm->sp = sp;
+
+#   undef PUSH
+#   undef POP
+#   undef LOOKUP_VALUE
+}
+
+#pragma mark Profiler
+
+// PROFILER:
+//
+// With InterpOptions.profile, a SIGPROF timer samples the running VM every
+// millisecond of CPU time. A sample is the instruction pointer plus the
+// return address of every frame, so it's the call stack with a code offset
+// in each function. Once the VM is done the offsets are mapped back to the
+// innermost AST node whose code contains them (see CICodeSpan) and from
+// there to a source line.
+//
+// The report on stderr is flat: samples per function (self and total) and
+// per line. The same samples are written as folded stacks (one
+// "frame;frame;frame count" line per stack) to <file>.folded for flame graph
+// tools.
+
+#define CI_PROFILE_INTERVAL_USEC 1000
+#define CI_PROFILE_MAX_SAMPLES 16384
+#define CI_PROFILE_MAX_DEPTH 32
+#define CI_PROFILE_TOP_LEVEL UINT32_MAX
+
+typedef struct {
+    /* CI_PROFILE_TOP_LEVEL for code outside of any function */
+    uint32_t function_index;
+
+    /* Into the code the function runs from */
+    uint32_t offset;
+} CIProfileLocation;
+
+typedef struct {
+    /* Outermost first. Stacks deeper than CI_PROFILE_MAX_DEPTH lose their
+     * outermost frames
+     */
+    uint32_t depth;
+    bool truncated;
+    CIProfileLocation locations[CI_PROFILE_MAX_DEPTH];
+} CIProfileSample;
+
+typedef struct {
+    CIVM *vm;
+
+    volatile size_t sample_count;
+    volatile size_t dropped_count;
+    CIProfileSample *samples;
+
+    struct sigaction old_action;
+} CIProfiler;
+
+/* Only touched by the signal handler while a profile is running */
+global_variable CIProfiler * volatile g_profiler;
+
+static void ci_profile_signal(int sig) {
+    CIProfiler *p = g_profiler;
+    if (p == NULL) {
+        return;
+    }
+
+    CIVM *vm = p->vm;
+    uint8_t *ip = vm->profile_ip;
+    ByteStream *code = vm->profile_code;
+    if (ip == NULL || code == NULL || vm->frames_moving ||
+        p->sample_count == CI_PROFILE_MAX_SAMPLES) {
+        p->dropped_count++;
+        return;
+    }
+
+    // Frame N was called from frame N - 1 (or the top level for the first
+    // one) and the instruction pointer is in the last frame
+    size_t frame_count = vm->frame_count;
+    size_t total = frame_count + 1;
+    size_t depth = total < CI_PROFILE_MAX_DEPTH ? total : CI_PROFILE_MAX_DEPTH;
+    size_t first = total - depth;
+
+    CIProfileSample *sample = &p->samples[p->sample_count];
+    sample->depth = (uint32_t)depth;
+    sample->truncated = first > 0;
+    for (size_t idx = first; idx < total; idx++) {
+        CIProfileLocation *loc = &sample->locations[idx - first];
+        loc->function_index = idx == 0 ? CI_PROFILE_TOP_LEVEL :
+            (uint32_t)vm->frames[idx - 1].function_index;
+
+        if (idx == frame_count) {
+            loc->offset = (uint32_t)(ip - code->data);
+        } else {
+            // Step back into the call instruction
+            loc->offset = (uint32_t)vm->frames[idx].return_offset - 1;
+        }
+    }
+
+    p->sample_count++;
+}
+
+void ci_profile_start(CIProfiler *p, CIVM *vm) {
+    memset(p, 0, sizeof(CIProfiler));
+    p->vm = vm;
+    p->samples = calloc(CI_PROFILE_MAX_SAMPLES, sizeof(CIProfileSample));
+
+    vm->profiling = true;
+    g_profiler = p;
+
+    struct sigaction action = {};
+    action.sa_handler = ci_profile_signal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGPROF, &action, &p->old_action);
+
+    struct itimerval timer = {};
+    timer.it_interval.tv_usec = CI_PROFILE_INTERVAL_USEC;
+    timer.it_value.tv_usec = CI_PROFILE_INTERVAL_USEC;
+    setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+void ci_profile_stop(CIProfiler *p) {
+    struct itimerval timer = {};
+    setitimer(ITIMER_PROF, &timer, NULL);
+    sigaction(SIGPROF, &p->old_action, NULL);
+
+    g_profiler = NULL;
+    p->vm->profiling = false;
+}
+
+/* A source line, as the key for per-line counts */
+typedef struct {
+    uint32_t source_index;
+    uint32_t line;
+} CIProfileLine;
+
+/* Lines of every byte of an image's code (0 where no node covers it) */
+typedef struct {
+    ByteStream *code;
+    CIProfileLine *lines;
+} CIProfileLineMap;
+
+void ci_profile_map_lines(CIProfileLineMap *map, CIImage *owner, CIImage *image) {
+    map->code = &owner->code;
+    map->lines = calloc(owner->code.current_offset + 1, sizeof(CIProfileLine));
+
+    // Outer nodes go first so the inner ones paint over them
+    for (size_t idx = owner->span_count; idx > 0; idx--) {
+        CICodeSpan *span = &owner->spans[idx - 1];
+        CINodeInfo *info = ci_image_node(image, span->node);
+        SourceFile *source = ci_image_source(image, info->source_index);
+
+        CIProfileLine line;
+        line.source_index = (uint32_t)info->source_index;
+        line.line = source_manager_line(source->base + info->start);
+
+        for (uint64_t offset = span->start; offset < span->end; offset++) {
+            map->lines[offset] = line;
+        }
+    }
+}
+
+static const char *ci_profile_function_name(CIImage *image, uint32_t function_index) {
+    if (function_index == CI_PROFILE_TOP_LEVEL) {
+        return "<top level>";
+    }
+
+    if (function_index >= ci_image_function_count(image)) {
+        return "<unknown>";
+    }
+
+    return ci_image_function(image, function_index)->name;
+}
+
+static const char *ci_profile_file_name(CIImage *image, uint32_t source_index) {
+    SourceFile *source = ci_image_source(image, source_index);
+    return source->name ? source->name : "<unknown file>";
+}
+
+static int ci_profile_compare_lines(const void *a, const void *b) {
+    const CIProfileLine *l1 = a;
+    const CIProfileLine *l2 = b;
+    if (l1->source_index != l2->source_index) {
+        return l1->source_index < l2->source_index ? -1 : 1;
+    }
+
+    return l1->line < l2->line ? -1 : (l1->line > l2->line);
+}
+
+static int ci_profile_compare_strings(const void *a, const void *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+typedef struct {
+    size_t self;
+    size_t total;
+} CIProfileCount;
+
+void ci_profile_report(CIProfiler *p, CIImage *image) {
+    size_t sample_count = p->sample_count;
+    size_t function_count = ci_image_function_count(image);
+
+    CIProfileLineMap maps[2] = {};
+    ci_profile_map_lines(&maps[0], image, image);
+    if (image->base != NULL) {
+        ci_profile_map_lines(&maps[1], image->base, image);
+    }
+
+    // The last slot is for the top level
+    CIProfileCount *function_counts = calloc(function_count + 1, sizeof(CIProfileCount));
+    CIProfileLine *leaf_lines = calloc(sample_count + 1, sizeof(CIProfileLine));
+    char **stacks = calloc(sample_count + 1, sizeof(char*));
+
+    for (size_t s = 0; s < sample_count; s++) {
+        CIProfileSample *sample = &p->samples[s];
+
+        char *stack = NULL;
+        size_t stack_size = 0;
+        FILE *fstack = open_memstream(&stack, &stack_size);
+        if (sample->truncated) {
+            fprintf(fstack, "...;");
+        }
+
+        for (uint32_t d = 0; d < sample->depth; d++) {
+            CIProfileLocation *loc = &sample->locations[d];
+            bool is_leaf = (d == sample->depth - 1);
+
+            size_t slot = loc->function_index == CI_PROFILE_TOP_LEVEL ||
+                          loc->function_index >= function_count ?
+                          function_count : loc->function_index;
+
+            // Recursive functions still only count once per sample
+            bool seen = false;
+            for (uint32_t e = 0; e < d && !seen; e++) {
+                seen = sample->locations[e].function_index == loc->function_index;
+            }
+            if (!seen) {
+                function_counts[slot].total++;
+            }
+
+            fprintf(fstack, "%s%s", d > 0 ? ";" : "",
+                    ci_profile_function_name(image, loc->function_index));
+
+            if (is_leaf) {
+                function_counts[slot].self++;
+
+                ByteStream *code = (slot == function_count) ? &image->code :
+                                   ci_image_code(image, slot);
+                CIProfileLineMap *map = (code == &image->code) ? &maps[0] : &maps[1];
+                if (map->lines != NULL && loc->offset < code->current_offset) {
+                    leaf_lines[s] = map->lines[loc->offset];
+                }
+
+                if (leaf_lines[s].line != 0) {
+                    fprintf(fstack, ";%s:%u", basename((char*)ci_profile_file_name(image, leaf_lines[s].source_index)),
+                            leaf_lines[s].line);
+                }
+            }
+        }
+
+        fclose(fstack);
+        stacks[s] = stack;
+    }
+
+    fprintf(stderr, "\nprofile: %zu samples, %d us apart", sample_count,
+            CI_PROFILE_INTERVAL_USEC);
+    if (p->dropped_count > 0) {
+        fprintf(stderr, " (%zu dropped)", (size_t)p->dropped_count);
+    }
+    fprintf(stderr, "\n\n");
+
+    if (sample_count > 0) {
+        fprintf(stderr, "%8s %8s %8s  %s\n", "self", "total", "self%", "function");
+        for (size_t idx = 0; idx <= function_count; idx++) {
+            CIProfileCount *c = &function_counts[idx];
+            if (c->total == 0) {
+                continue;
+            }
+
+            fprintf(stderr, "%8zu %8zu %7.1f%%  %s\n", c->self, c->total,
+                    100.0 * c->self / sample_count,
+                    ci_profile_function_name(image, idx == function_count ?
+                                             CI_PROFILE_TOP_LEVEL : (uint32_t)idx));
+        }
+
+        fprintf(stderr, "\n%8s %8s  %s\n", "self", "self%", "line");
+        qsort(leaf_lines, sample_count, sizeof(CIProfileLine), ci_profile_compare_lines);
+        for (size_t idx = 0; idx < sample_count;) {
+            size_t run = 1;
+            while (idx + run < sample_count &&
+                   !ci_profile_compare_lines(&leaf_lines[idx], &leaf_lines[idx + run])) {
+                run++;
+            }
+
+            CIProfileLine *line = &leaf_lines[idx];
+            if (line->line == 0) {
+                fprintf(stderr, "%8zu %7.1f%%  <unknown>\n", run, 100.0 * run / sample_count);
+            } else {
+                fprintf(stderr, "%8zu %7.1f%%  %s:%u\n", run, 100.0 * run / sample_count,
+                        ci_profile_file_name(image, line->source_index), line->line);
+            }
+            idx += run;
+        }
+    }
+
+    // Folded stacks go next to wherever we were run from
+    const char *file = image->source_count > 0 && image->sources[0]->name ?
+                       image->sources[0]->name : "lmac";
+    char *folded_file = NULL;
+    asprintf(&folded_file, "%s.folded", basename((char*)file));
+
+    FILE *f = fopen(folded_file, "w");
+    if (f == NULL) {
+        fprintf(stderr, "\ncan't write folded stacks to %s\n", folded_file);
+    } else {
+        qsort(stacks, sample_count, sizeof(char*), ci_profile_compare_strings);
+        for (size_t idx = 0; idx < sample_count;) {
+            size_t run = 1;
+            while (idx + run < sample_count && !strcmp(stacks[idx], stacks[idx + run])) {
+                run++;
+            }
+
+            fprintf(f, "%s %zu\n", stacks[idx], run);
+            idx += run;
+        }
+        fclose(f);
+
+        fprintf(stderr, "\nfolded stacks written to %s\n", folded_file);
+    }
+
+    for (size_t idx = 0; idx < sample_count; idx++) {
+        free(stacks[idx]);
+    }
+    free(stacks);
+    free(leaf_lines);
+    free(function_counts);
+    free(maps[0].lines);
+    free(maps[1].lines);
+    free(folded_file);
+}
+
+#pragma mark Tree Walker
+
+// TIERS:
+//
+// Assembling costs more than running for most one-shot code (a repl line like
+// "1 + 2" or a #run expression), so interp_interpret first tries to evaluate
+// the AST directly. The tree walker only takes code it can evaluate without
+// side effects: literals, arithmetic, locals, ifs and calls to functions made
+// of those. Anything else (gotos, globals, foreign calls, symbolic values)
+// goes to the bytecode tier like before.
+//
+// Every walked call counts against the function. Once a function has been
+// called CI_WALK_HOT_CALLS times the code is hot and the walk is thrown away
+// and the whole thing is assembled instead. That's safe because nothing the
+// walker accepts can have been seen by anyone yet. Counts for preloaded
+// functions are kept between walks, so a hot function from an image goes
+// straight to bytecode the next time it's called.
+
+#define CI_WALK_HOT_CALLS 64
+#define CI_WALK_MAX_DEPTH 256
+
+typedef struct {
+    ASTDeclaration *decl;
+    CIValue value;
+} CIWalkLocal;
+
+typedef struct {
+    ASTDeclFunc *decl;
+    size_t local_count;
+    CIWalkLocal *locals;
+} CIWalkFrame;
+
+typedef struct {
+    ASTDeclFunc *decl;
+    bool checked;
+    bool walkable;
+
+    /* Calls across every walk (preloaded functions) or just this one */
+    uint32_t calls;
+    uint32_t *preloaded_calls;
+} CIWalkFunction;
+
+typedef struct {
+    ASTDeclFunc *decl;
+    uint32_t calls;
+} CIWalkCount;
+
+typedef struct {
+    /* NULL at the top level */
+    CIWalkFrame *frame;
+    size_t depth;
+
+    bool returning;
+    CIValue return_value;
+
+    /* Set when the walk has to be thrown away for the bytecode tier */
+    bool promoted;
+
+    size_t function_count;
+    CIWalkFunction *functions;
+
+    /* Unescaped string literals, freed with the walker */
+    size_t string_count;
+    char **strings;
+
+    CIValue result;
+} CIWalker;
+
+/* State for the pass that checks code is walkable before any of it runs */
+typedef struct {
+    CIWalker *walker;
+    ASTDeclFunc *function;
+    bool ok;
+} CIWalkCheck;
+
+global_variable size_t g_walk_count_count;
+global_variable CIWalkCount *g_walk_counts;
+
+global_variable size_t g_tier_walked;
+global_variable size_t g_tier_promoted;
+global_variable size_t g_tier_assembled;
+
+bool ci_walk_function_ok(CIWalker *w, ASTDeclFunc *decl);
+
+static bool ci_walk_is_preloaded(ASTDeclFunc *decl) {
+    if (g_preload_scope == NULL) {
+        return false;
+    }
+
+    List_FOREACH(ASTDeclaration*, d, g_preload_scope->declarations, {
+        if (d == (ASTDeclaration*)decl) {
+            return true;
+        }
+    })
+
+    return false;
+}
+
+CIWalkFunction *ci_walk_function(CIWalker *w, ASTDeclFunc *decl) {
+    for (size_t idx = 0; idx < w->function_count; idx++) {
+        if (w->functions[idx].decl == decl) {
+            return &w->functions[idx];
+        }
+    }
+
+    CIWalkFunction fn = {};
+    fn.decl = decl;
+    if (ci_walk_is_preloaded(decl)) {
+        size_t idx = 0;
+        while (idx < g_walk_count_count && g_walk_counts[idx].decl != decl) {
+            idx++;
+        }
+
+        if (idx == g_walk_count_count) {
+            CIWalkCount count = { decl, 0 };
+            CI_ARRAY_APPEND(g_walk_counts, g_walk_count_count, count);
+        }
+        fn.preloaded_calls = &g_walk_counts[idx].calls;
+    }
+
+    CI_ARRAY_APPEND(w->functions, w->function_count, fn);
+    return &w->functions[w->function_count - 1];
+}
+
+static inline uint32_t *ci_walk_calls(CIWalkFunction *fn) {
+    return fn->preloaded_calls ? fn->preloaded_calls : &fn->calls;
+}
+
+/* The function a local or parameter belongs to, or NULL for globals */
+static ASTDeclFunc *ci_walk_owner(ASTBase *decl) {
+    for (ASTBase *node = decl->parent; node != NULL; node = node->parent) {
+        if (AST_IS(node, AST_DECL_FUNC)) {
+            return (ASTDeclFunc*)node;
+        }
+    }
+
+    return NULL;
+}
+
+static CIPreloadedGlobal *ci_walk_preloaded_global(ASTDeclaration *decl) {
+    for (size_t idx = 0; idx < g_preload_count; idx++) {
+        if (g_preload_globals[idx].decl == decl) {
+            return &g_preload_globals[idx];
+        }
+    }
+
+    return NULL;
+}
+
+static bool ci_walk_is_local(CIWalkCheck *check, ASTExpression *expr) {
+    if (!AST_IS(expr, AST_EXPR_IDENT)) {
+        return false;
+    }
+
+    ASTDeclaration *decl = ast_ident_find_declaration(((ASTExprIdent*)expr)->name);
+    return decl != NULL && AST_IS(decl, AST_DECL_VAR) && check->function != NULL &&
+           ci_walk_owner((ASTBase*)decl) == check->function;
+}
+
+/* Decides whether the call node can be walked. The callee has to be walkable
+ * too and not hot yet
+ */
+static bool ci_walk_call_ok(CIWalker *w, ASTExprCall *call) {
+    if (!AST_IS(call->callable, AST_EXPR_IDENT)) {
+        return false;
+    }
+
+    ASTDeclaration *decl = ast_ident_find_declaration(((ASTExprIdent*)call->callable)->name);
+    if (decl == NULL || !AST_IS(decl, AST_DECL_FUNC)) {
+        return false;
+    }
+
+    ASTDeclFunc *fn_decl = (ASTDeclFunc*)decl;
+    size_t param_count = list_count(fn_decl->params);
+    size_t arg_count = list_count(call->args);
+    if (!ast_decl_func_has_body(fn_decl) || fn_decl->has_varargs ||
+        (param_count != arg_count && param_count != 0)) {
+        return false;
+    }
+
+    CIWalkFunction *fn = ci_walk_function(w, fn_decl);
+    if (*ci_walk_calls(fn) >= CI_WALK_HOT_CALLS) {
+        return false;
+    }
+
+    return ci_walk_function_ok(w, fn_decl);
+}
+
+int ci_walk_check_visitor(ASTBase *node, VisitPhase phase, CIWalkCheck *check) {
+    if (!check->ok) {
+        return VISIT_HANDLED;
+    }
+
+    if (phase == VISIT_POST) {
+        return VISIT_OK;
+    }
+
+    bool ok = true;
+    switch (node->kind) {
+        case AST_DECL_FUNC: {
+            ASTDeclFunc *decl = (ASTDeclFunc*)node;
+            if (decl->block != NULL) {
+                // Bodies that don't get called still have to be walkable, or
+                // errors the assembler would report go missing. Lazy bodies
+                // are the exception: they're checked if something calls them
+                ok = check->function == NULL && ci_walk_function_ok(check->walker, decl);
+            }
+            check->ok = ok;
+            return VISIT_HANDLED;
+        }
+        case AST_DECL_VAR: {
+            ASTDeclVar *decl = (ASTDeclVar*)node;
+            if (ast_node_is_type_definition(node) || (decl->type->type_id & TYPE_FLAG_KIND)) {
+                return VISIT_HANDLED;
+            }
+
+            // Globals live in the value table, so they're left to the VM
+            ok = check->function != NULL;
+        } break;
+        case AST_EXPR_IDENT: {
+            ASTDeclaration *decl = ast_ident_find_declaration(((ASTExprIdent*)node)->name);
+            ok = ci_walk_is_local(check, (ASTExpression*)node) ||
+                 (decl != NULL && ci_walk_preloaded_global(decl) != NULL);
+        } break;
+        case AST_EXPR_BINARY: {
+            ASTExprBinary *binop = (ASTExprBinary*)node;
+            if (binop->op->op.kind == TOK_EQUALS) {
+                ok = ci_walk_is_local(check, binop->left);
+            }
+        } break;
+        case AST_EXPR_CALL: {
+            ASTExprCall *call = (ASTExprCall*)node;
+            check->ok = ci_walk_call_ok(check->walker, call);
+            List_FOREACH(ASTBase*, arg, call->args, {
+                ast_visit(arg, (VisitFn)ci_walk_check_visitor, check);
+            })
+            return VISIT_HANDLED;
+        }
+        case AST_STMT_RETURN: {
+            ok = check->function != NULL;
+        } break;
+        case AST_STMT_LABELED:
+        case AST_STMT_JUMP: {
+            ok = false;
+        } break;
+        default: break;
+    }
+
+    check->ok = ok;
+    return ok ? VISIT_OK : VISIT_HANDLED;
+}
+
+bool ci_walk_function_ok(CIWalker *w, ASTDeclFunc *decl) {
+    CIWalkFunction *fn = ci_walk_function(w, decl);
+    if (!fn->checked) {
+        // Recursive calls see the function as walkable while it's checked
+        fn->checked = true;
+        fn->walkable = true;
+
+        CIWalkCheck check = {};
+        check.walker = w;
+        check.function = decl;
+        check.ok = true;
+        ast_visit((ASTBase*)ast_decl_func_block(decl), (VisitFn)ci_walk_check_visitor, &check);
+
+        // The function table can move while the body is checked
+        fn = ci_walk_function(w, decl);
+        fn->walkable = check.ok;
+    }
+
+    return fn->walkable;
+}
+
+static CIValue ci_walk_integer(CIValueKind kind, int64_t value) {
+    CIValue v = {};
+    v.kind = kind;
+    v.simple_value.is_pod = (kind == CIV_POD_INTEGER);
+    v.simple_value.int_value = (uint64_t)value;
+    return v;
+}
+
+static CIWalkLocal *ci_walk_local(CIWalker *w, ASTDeclaration *decl) {
+    CIWalkFrame *frame = w->frame;
+    for (size_t idx = 0; idx < frame->local_count; idx++) {
+        if (frame->locals[idx].decl == decl) {
+            return &frame->locals[idx];
+        }
+    }
+
+    // Like the VM, locals start out as zero
+    CIWalkLocal local = { decl, ci_walk_integer(CIV_POD_INTEGER, 0) };
+    CI_ARRAY_APPEND(frame->locals, frame->local_count, local);
+    return &frame->locals[frame->local_count - 1];
+}
+
+bool ci_walk_stmt(CIWalker *w, ASTBase *node);
+
+bool ci_walk_expr(CIWalker *w, ASTBase *node, CIValue *out) {
+    switch (node->kind) {
+        case AST_EXPR_EMPTY: {
+            *out = (CIValue){};
+        } return true;
+        case AST_EXPR_NUMBER: {
+            *out = ci_walk_integer(CIV_INTEGER_LITERAL, ((ASTExprNumber*)node)->number);
+        } return true;
+        case AST_EXPR_STRING: {
+            char *str = ci_string_unescape(node->location.spelling);
+            CI_ARRAY_APPEND(w->strings, w->string_count, str);
+
+            *out = (CIValue){};
+            out->kind = CIV_STRING_LITERAL;
+            out->simple_value.str_value = str;
+        } return true;
+        case AST_EXPR_PAREN: {
+            return ci_walk_expr(w, (ASTBase*)((ASTExprParen*)node)->inner, out);
+        }
+        case AST_EXPR_CAST: {
+            return ci_walk_expr(w, (ASTBase*)((ASTExprCast*)node)->expr, out);
+        }
+        case AST_EXPR_IDENT: {
+            ASTDeclaration *decl = ast_ident_find_declaration(((ASTExprIdent*)node)->name);
+            CIPreloadedGlobal *global = ci_walk_preloaded_global(decl);
+            *out = global ? global->value : ci_walk_local(w, decl)->value;
+        } return true;
+        case AST_EXPR_BINARY: {
+            ASTExprBinary *binop = (ASTExprBinary*)node;
+            TokenKind op = binop->op->op.kind;
+
+            CIValue lhs, rhs;
+            if (op == TOK_EQUALS) {
+                if (!ci_walk_expr(w, (ASTBase*)binop->right, &rhs)) {
+                    return false;
+                }
+
+                ASTExprIdent *ident = (ASTExprIdent*)binop->left;
+                ci_walk_local(w, ast_ident_find_declaration(ident->name))->value = rhs;
+                *out = rhs;
+                return true;
+            }
+
+            if (!ci_walk_expr(w, (ASTBase*)binop->left, &lhs)) {
+                return false;
+            }
+
+            if (op == TOK_AMP_AMP || op == TOK_PIPE_PIPE) {
+                if (!ci_value_is_integer(&lhs)) {
+                    return false;
+                }
+
+                bool left_true = lhs.simple_value.int_value != 0;
+                if (left_true == (op == TOK_PIPE_PIPE)) {
+                    *out = ci_walk_integer(CIV_INTEGER_LITERAL, left_true);
+                    return true;
+                }
+
+                if (!ci_walk_expr(w, (ASTBase*)binop->right, &rhs) ||
+                    !ci_value_is_integer(&rhs)) {
+                    return false;
+                }
+
+                *out = ci_walk_integer(CIV_INTEGER_LITERAL, rhs.simple_value.int_value != 0);
+                return true;
+            }
+
+            // Symbolic results and errors are the VM's business
+            return ci_walk_expr(w, (ASTBase*)binop->right, &rhs) &&
+                   ci_value_is_integer(&lhs) && ci_value_is_integer(&rhs) &&
+                   ci_binop_try(&lhs, &rhs, op, out);
+        }
+        case AST_EXPR_CALL: {
+            ASTExprCall *call = (ASTExprCall*)node;
+            ASTDeclFunc *decl = (ASTDeclFunc*)ast_ident_find_declaration(((ASTExprIdent*)call->callable)->name);
+
+            uint32_t *calls = ci_walk_calls(ci_walk_function(w, decl));
+            if (++*calls >= CI_WALK_HOT_CALLS || w->depth == CI_WALK_MAX_DEPTH) {
+                w->promoted = true;
+                return false;
+            }
+
+            CIWalkFrame frame = {};
+            frame.decl = decl;
+
+            List *param_node = decl->params;
+            bool ok = true;
+            List_FOREACH(ASTBase*, arg, call->args, {
+                CIValue v;
+                if (ok && !ci_walk_expr(w, arg, &v)) {
+                    ok = false;
+                }
+
+                if (ok && param_node != NULL) {
+                    CIWalkLocal local;
+                    local.decl = (ASTDeclaration*)param_node->item;
+                    local.value = v;
+                    CI_ARRAY_APPEND(frame.locals, frame.local_count, local);
+                    param_node = param_node->next;
+                }
+            })
+
+            if (ok) {
+                CIWalkFrame *caller = w->frame;
+                w->frame = &frame;
+                w->depth++;
+
+                ok = ci_walk_stmt(w, (ASTBase*)ast_decl_func_block(decl));
+                *out = w->returning ? w->return_value : (CIValue){};
+
+                w->returning = false;
+                w->depth--;
+                w->frame = caller;
+            }
+
+            free(frame.locals);
+            return ok;
+        }
+        default:
+            return false;
+    }
+}
+
+bool ci_walk_stmt(CIWalker *w, ASTBase *node) {
+    switch (node->kind) {
+        case AST_TOPLEVEL: {
+            List_FOREACH(ASTBase*, stmt, ((ASTTopLevel*)node)->definitions, {
+                if (!ci_walk_stmt(w, stmt)) {
+                    return false;
+                }
+            })
+        } return true;
+        case AST_BLOCK: {
+            List_FOREACH(ASTBase*, stmt, ((ASTBlock*)node)->statements, {
+                if (!ci_walk_stmt(w, stmt)) {
+                    return false;
+                }
+
+                if (w->returning) {
+                    break;
+                }
+            })
+        } return true;
+        case AST_STMT_EXPR: {
+            CIValue v;
+            if (!ci_walk_expr(w, (ASTBase*)((ASTStmtExpr*)node)->expression, &v)) {
+                return false;
+            }
+
+            if (w->frame == NULL) {
+                w->result = v;
+            }
+        } return true;
+        case AST_STMT_DECL: {
+            return ci_walk_stmt(w, (ASTBase*)((ASTStmtDecl*)node)->declaration);
+        }
+        case AST_DECL_VAR: {
+            ASTDeclVar *decl = (ASTDeclVar*)node;
+            if (ast_node_is_type_definition(node) || (decl->type->type_id & TYPE_FLAG_KIND)) {
+                return true;
+            }
+
+            CIValue v = ci_walk_integer(CIV_INTEGER_LITERAL, 0);
+            if (decl->expression != NULL && !ci_walk_expr(w, (ASTBase*)decl->expression, &v)) {
+                return false;
+            }
+
+            ci_walk_local(w, (ASTDeclaration*)decl)->value = v;
+        } return true;
+        case AST_STMT_IF: {
+            ASTStmtIf *stmt = (ASTStmtIf*)node;
+            CIValue cond;
+            if (!ci_walk_expr(w, (ASTBase*)stmt->condition, &cond) ||
+                !ci_value_is_integer(&cond)) {
+                return false;
+            }
+
+            ASTBase *branch = cond.simple_value.int_value ? stmt->stmt_true : stmt->stmt_false;
+            return branch == NULL || ci_walk_stmt(w, branch);
+        }
+        case AST_STMT_RETURN: {
+            ASTStmtReturn *stmt = (ASTStmtReturn*)node;
+            w->return_value = (CIValue){};
+            if (stmt->expression != NULL &&
+                !ci_walk_expr(w, (ASTBase*)stmt->expression, &w->return_value)) {
+                return false;
+            }
+
+            w->returning = true;
+        } return true;
+        default:
+            // Function declarations and directives don't do anything
+            return true;
+    }
+}
+
+/* The main the bytecode tier would call after the top level (see
+ * ci_assemble_end)
+ */
+static ASTDeclFunc *ci_walk_find_main(ASTTopLevel *toplevel) {
+    List *lists[2] = {
+        (g_preload_scope && !g_shared_image) ? g_preload_scope->declarations : NULL,
+        toplevel->definitions
+    };
+
+    for (size_t idx = 0; idx < 2; idx++) {
+        List_FOREACH(ASTBase*, def, lists[idx], {
+            if (AST_IS(def, AST_STMT_DECL)) {
+                def = (ASTBase*)((ASTStmtDecl*)def)->declaration;
+            }
+
+            if (AST_IS(def, AST_DECL_FUNC) && ast_decl_func_has_body((ASTDeclFunc*)def) &&
+                spelling_streq(AST_BASE(((ASTDeclFunc*)def)->base.name)->location.spelling, "main")) {
+                return (ASTDeclFunc*)def;
+            }
+        })
+    }
+
+    return NULL;
+}
+
+/* Tries to evaluate node with the tree walker. Returns false (having done
+ * nothing anyone can see) if it has to go to the bytecode tier
+ */
+bool ci_walk(ASTBase *node, FILE *result_out) {
+    if (!AST_IS(node, AST_TOPLEVEL)) {
+        return false;
+    }
+
+    CIWalker w = {};
+    CIWalkCheck check = {};
+    check.walker = &w;
+    check.ok = true;
+    ast_visit(node, (VisitFn)ci_walk_check_visitor, &check);
+
+    ASTDeclFunc *main_decl = ci_walk_find_main((ASTTopLevel*)node);
+    if (main_decl != NULL && (list_count(main_decl->params) != 0 ||
+                              !ci_walk_function_ok(&w, main_decl))) {
+        check.ok = false;
+    }
+
+    bool ok = check.ok && ci_walk_stmt(&w, node);
+    if (ok && main_decl != NULL) {
+        CIWalkFrame frame = {};
+        frame.decl = main_decl;
+        w.frame = &frame;
+
+        ok = ci_walk_stmt(&w, (ASTBase*)ast_decl_func_block(main_decl));
+        w.result = w.returning ? w.return_value : (CIValue){};
+
+        free(frame.locals);
+        w.frame = NULL;
+    }
+
+    if (ok) {
+        ci_value_fprint(result_out, NULL, &w.result);
+        g_tier_walked++;
+    } else if (w.promoted) {
+        g_tier_promoted++;
+    }
+
+    for (size_t idx = 0; idx < w.string_count; idx++) {
+        free(w.strings[idx]);
+    }
+    free(w.strings);
+    free(w.functions);
+
+    return ok;
+}
+
+#pragma mark Linker
+
+// LINKING:
+//
+// Each file (translation unit) can be assembled to its own image with
+// ci_assemble_unit and the images merged with ci_link. Every operand that
+// refers to a code offset or a table index was recorded as a relocation when
+// it was assembled (see asm_push_reloc), so the linker copies each image's
+// code after the ones before it and rewrites those operands:
+//
+// - Code offsets move by where the image's code ended up
+// - Sources are merged by file, so a header included by several files is
+//   one source in the linked image
+// - Constants and node entries that are the same in several images are kept
+//   once
+// - Functions are merged by name. A definition satisfies the prototypes of
+//   the same name in the other images. The same definition coming from a
+//   header that several files include is kept once; two different
+//   definitions of a name are an error
+// - Globals belong to their image, so each image's globals just move up
+//
+// NOTE(bloggins): Bodies of duplicate definitions stay in the code (they're
+// jumped over like every body) but nothing calls them.
+
+typedef struct {
+    size_t capacity;
+    size_t count;
+    uint64_t *hashes;
+
+    /* Index + 1 of the entry in the linked image, or 0 for an empty slot */
+    uint64_t *indices;
+} CILinkTable;
+
+typedef bool (*CILinkEqualFn)(CIImage *image, uint64_t index, const void *key);
+
+static void ci_link_table_grow(CILinkTable *table) {
+    CILinkTable grown = {};
+    grown.capacity = table->capacity ? table->capacity * 2 : 64;
+    grown.count = table->count;
+    grown.hashes = calloc(grown.capacity, sizeof(uint64_t));
+    grown.indices = calloc(grown.capacity, sizeof(uint64_t));
+
+    for (size_t idx = 0; idx < table->capacity; idx++) {
+        if (table->indices[idx] == 0) {
+            continue;
+        }
+
+        size_t slot = table->hashes[idx] & (grown.capacity - 1);
+        while (grown.indices[slot] != 0) {
+            slot = (slot + 1) & (grown.capacity - 1);
+        }
+        grown.hashes[slot] = table->hashes[idx];
+        grown.indices[slot] = table->indices[idx];
+    }
+
+    free(table->hashes);
+    free(table->indices);
+    *table = grown;
+}
+
+/* Returns the index of an entry equal to key, or adds next_index for it and
+ * returns that
+ */
+static uint64_t ci_link_table_intern(CILinkTable *table, CIImage *image, uint64_t hash,
+                                     const void *key, CILinkEqualFn equal,
+                                     uint64_t next_index, bool *added) {
+    if (2 * (table->count + 1) > table->capacity) {
+        ci_link_table_grow(table);
+    }
+
+    size_t slot = hash & (table->capacity - 1);
+    while (table->indices[slot] != 0) {
+        uint64_t index = table->indices[slot] - 1;
+        if (table->hashes[slot] == hash && equal(image, index, key)) {
+            *added = false;
+            return index;
+        }
+        slot = (slot + 1) & (table->capacity - 1);
+    }
+
+    table->hashes[slot] = hash;
+    table->indices[slot] = next_index + 1;
+    table->count++;
+
+    *added = true;
+    return next_index;
+}
+
+static void ci_link_table_destroy(CILinkTable *table) {
+    free(table->hashes);
+    free(table->indices);
+}
+
+static bool ci_link_constant_equal(CIImage *image, uint64_t index, const void *key) {
+    return !strcmp(image->constants[index], (const char *)key);
+}
+
+static bool ci_link_node_equal(CIImage *image, uint64_t index, const void *key) {
+    const CINodeInfo *a = &image->nodes[index];
+    const CINodeInfo *b = key;
+    return a->kind == b->kind && a->source_index == b->source_index &&
+           a->start == b->start && a->end == b->end;
+}
+
+static bool ci_link_same_source(SourceFile *a, SourceFile *b) {
+    return a == b || (a->name != NULL && b->name != NULL && !strcmp(a->name, b->name));
+}
+
+/* Whether two functions are the same definition from the same file */
+static bool ci_link_same_definition(CIFunction *a, CIFunction *b) {
+    SourceLocation *la = &AST_BASE(a->decl)->location;
+    SourceLocation *lb = &AST_BASE(b->decl)->location;
+
+    SourceFile *sa = source_manager_lookup(la->start);
+    SourceFile *sb = source_manager_lookup(lb->start);
+
+    return ci_link_same_source(sa, sb) && la->start - sa->base == lb->start - sb->base;
+}
+
+static CIFunction *ci_link_find_function(CIImage *image, const char *name, bool definition) {
+    for (size_t idx = 0; idx < image->function_count; idx++) {
+        CIFunction *fn = &image->functions[idx];
+        if (fn->is_foreign != definition && !strcmp(fn->name, name)) {
+            return fn;
+        }
+    }
+
+    return NULL;
+}
+
+static CIFunction ci_link_copy_function(CIFunction *fn) {
+    CIFunction copy = *fn;
+    copy.name = strdup(fn->name);
+    copy.callees = NULL;
+    if (fn->callee_count > 0) {
+        copy.callees = malloc(fn->callee_count * sizeof(uint64_t));
+        memcpy(copy.callees, fn->callees, fn->callee_count * sizeof(uint64_t));
+    }
+
+    return copy;
+}
+
+/* Merges images made by ci_assemble_unit into a new image. The images are
+ * left alone. The result still has to be finished with ci_image_finish
+ */
+CIImage *ci_link(CIImage **images, size_t count) {
+    CIImage *linked = calloc(1, sizeof(CIImage));
+    ByteStream *stream = &linked->code;
+
+    CILinkTable constant_table = {};
+    CILinkTable node_table = {};
+
+    uint64_t **function_maps = calloc(count, sizeof(uint64_t*));
+    uint64_t *code_bases = calloc(count, sizeof(uint64_t));
+
+    // Definitions first, so any image's prototypes can be pointed at them
+    for (size_t u = 0; u < count; u++) {
+        CIImage *image = images[u];
+        if (image->base != NULL || image->preload_count > 0) {
+            CI_ERROR(NULL, "images made on top of a snapshot can't be linked");
+        }
+
+        code_bases[u] = stream->current_offset;
+        stream_append(stream, image->code.data, image->code.current_offset);
+
+        function_maps[u] = calloc(image->function_count + 1, sizeof(uint64_t));
+        for (size_t idx = 0; idx < image->function_count; idx++) {
+            CIFunction *fn = &image->functions[idx];
+            if (fn->is_foreign) {
+                continue;
+            }
+
+            CIFunction *existing = ci_link_find_function(linked, fn->name, true);
+            if (existing != NULL && !ci_link_same_definition(existing, fn)) {
+                CI_ERROR(&AST_BASE(fn->decl)->location, "'%s' is defined in more "
+                         "than one file", fn->name);
+            }
+
+            if (existing != NULL) {
+                function_maps[u][idx] = existing - linked->functions;
+                continue;
+            }
+
+            CIFunction copy = ci_link_copy_function(fn);
+            copy.entry += code_bases[u];
+            CI_ARRAY_APPEND(linked->functions, linked->function_count, copy);
+            function_maps[u][idx] = linked->function_count - 1;
+        }
+    }
+
+    // Prototypes without a definition anywhere stay foreign, once per name
+    for (size_t u = 0; u < count; u++) {
+        CIImage *image = images[u];
+        for (size_t idx = 0; idx < image->function_count; idx++) {
+            CIFunction *fn = &image->functions[idx];
+            if (!fn->is_foreign) {
+                continue;
+            }
+
+            CIFunction *existing = ci_link_find_function(linked, fn->name, true);
+            if (existing == NULL) {
+                existing = ci_link_find_function(linked, fn->name, false);
+            }
+
+            if (existing != NULL) {
+                function_maps[u][idx] = existing - linked->functions;
+                continue;
+            }
+
+            CIFunction copy = ci_link_copy_function(fn);
+            CI_ARRAY_APPEND(linked->functions, linked->function_count, copy);
+            function_maps[u][idx] = linked->function_count - 1;
+        }
+    }
+
+    for (size_t u = 0; u < count; u++) {
+        CIImage *image = images[u];
+        uint64_t code_base = code_bases[u];
+        uint64_t global_base = linked->global_count;
+        linked->global_count += image->global_count;
+
+        uint64_t *source_map = calloc(image->source_count + 1, sizeof(uint64_t));
+        for (size_t idx = 0; idx < image->source_count; idx++) {
+            SourceFile *source = image->sources[idx];
+            size_t found = 0;
+            while (found < linked->source_count &&
+                   !ci_link_same_source(linked->sources[found], source)) {
+                found++;
+            }
+
+            if (found == linked->source_count) {
+                CI_ARRAY_APPEND(linked->sources, linked->source_count, source);
+            }
+            source_map[idx] = found;
+        }
+
+        uint64_t *constant_map = calloc(image->constant_count + 1, sizeof(uint64_t));
+        for (size_t idx = 0; idx < image->constant_count; idx++) {
+            const char *str = image->constants[idx];
+            bool added = false;
+            constant_map[idx] = ci_link_table_intern(&constant_table, linked,
+                                                     run_hash((const uint8_t*)str, strlen(str)),
+                                                     str, ci_link_constant_equal,
+                                                     linked->constant_count, &added);
+            if (added) {
+                char *copy = strdup(str);
+                CI_ARRAY_APPEND(linked->constants, linked->constant_count, copy);
+            }
+        }
+
+        uint64_t *node_map = calloc(image->node_count + 1, sizeof(uint64_t));
+        for (size_t idx = 0; idx < image->node_count; idx++) {
+            CINodeInfo info = image->nodes[idx];
+            info.source_index = source_map[info.source_index];
+
+            // Hash the fields, not the padding between them
+            uint64_t key[4] = { info.kind, info.source_index, info.start, info.end };
+            bool added = false;
+            node_map[idx] = ci_link_table_intern(&node_table, linked,
+                                                 run_hash((const uint8_t*)key, sizeof(key)),
+                                                 &info, ci_link_node_equal,
+                                                 linked->node_count, &added);
+            if (added) {
+                CI_ARRAY_APPEND(linked->nodes, linked->node_count, info);
+            }
+        }
+
+        for (size_t idx = 0; idx < image->reloc_count; idx++) {
+            CIReloc reloc = image->relocs[idx];
+            reloc.offset += code_base;
+
+            uint64_t *operand = (uint64_t*)(stream->data + reloc.offset);
+            switch (reloc.kind) {
+                case CI_RELOC_CODE: *operand += code_base; break;
+                case CI_RELOC_FUNCTION: *operand = function_maps[u][*operand]; break;
+                case CI_RELOC_CONSTANT: *operand = constant_map[*operand]; break;
+                case CI_RELOC_NODE: *operand = node_map[*operand]; break;
+                case CI_RELOC_GLOBAL: *operand += global_base; break;
+            }
+
+            CI_ARRAY_APPEND(linked->relocs, linked->reloc_count, reloc);
+        }
+
+        for (size_t idx = 0; idx < image->span_count; idx++) {
+            CICodeSpan span = image->spans[idx];
+            span.start += code_base;
+            span.end += code_base;
+            span.node = node_map[span.node];
+            CI_ARRAY_APPEND(linked->spans, linked->span_count, span);
+        }
+
+        free(source_map);
+        free(constant_map);
+        free(node_map);
+    }
+
+    // Callees were only known to be pointing at the right functions once
+    // every image's functions were in
+    for (size_t u = 0; u < count; u++) {
+        CIImage *image = images[u];
+        for (size_t idx = 0; idx < image->function_count; idx++) {
+            CIFunction *fn = &image->functions[idx];
+            CIFunction *copy = &linked->functions[function_maps[u][idx]];
+            if (fn->is_foreign || copy->entry != fn->entry + code_bases[u]) {
+                // Not the image this copy came from
+                continue;
+            }
+
+            for (size_t c = 0; c < copy->callee_count; c++) {
+                copy->callees[c] = function_maps[u][fn->callees[c]];
+            }
+        }
+    }
+
+    for (size_t u = 0; u < count; u++) {
+        free(function_maps[u]);
+    }
+    free(function_maps);
+    free(code_bases);
+    ci_link_table_destroy(&constant_table);
+    ci_link_table_destroy(&node_table);
+
+    return linked;
+}
+
+#pragma mark Public API
+
+void ci_assemble_begin(CIAssembler *as) {
+    memset(as, 0, sizeof(CIAssembler));
+    as->image = calloc(1, sizeof(CIImage));
+    as->stream = &as->image->code;
+    ByteStream *stream = as->stream;
+
+    asm_push_u64(stream, 1);
+    ASM_OP(CIO_DECLARE_FR_VERSION);
+
+    if (g_preload_scope == NULL) {
+        return;
+    }
+
+    // Preloaded globals get the first slots so they line up with
+    // g_preload_globals. Preloaded functions are assembled like any other.
+    for (size_t idx = 0; idx < g_preload_count; idx++) {
+        ci_symbol_create((ASTBase*)g_preload_globals[idx].decl, CI_SYM_GLOBAL,
+                         as->image->global_count++);
+    }
+    as->image->preload_count = g_preload_count;
+
+    if (g_shared_image != NULL) {
+        as->image->base = g_shared_image;
+        for (size_t idx = 0; idx < g_shared_image->function_count; idx++) {
+            ci_symbol_create((ASTBase*)g_shared_image->functions[idx].decl,
+                             CI_SYM_FUNCTION, idx);
+        }
+        return;
+    }
+
+    List_FOREACH(ASTDeclaration*, decl, g_preload_scope->declarations, {
+        if (AST_IS(decl, AST_DECL_FUNC)) {
+            CI_VISIT(decl);
+        }
+    })
+}
+
+void ci_image_destroy(CIImage *image) {
+    free(image->code.data);
+    free(image->sources);
+    free(image->nodes);
+
+    for (size_t idx = 0; idx < image->constant_count; idx++) {
+        free(image->constants[idx]);
+    }
+    free(image->constants);
+
+    for (size_t idx = 0; idx < image->function_count; idx++) {
+        free((char*)image->functions[idx].name);
+        free(image->functions[idx].callees);
+    }
+    free(image->functions);
+    free(image->spans);
+    free(image->relocs);
+
+    free(image);
+}
+
+/* Removes the symbols the assembler attached to declarations */
+void ci_assemble_clean(ASTBase *node) {
+    if (node != NULL) {
+        ast_visit_data_clean(node);
+    }
+
+    if (g_preload_scope != NULL) {
+        List_FOREACH(ASTDeclaration*, decl, g_preload_scope->declarations, {
+            ast_visit_data_clean((ASTBase*)decl);
+        })
+    }
+}
+
+/* Ends an assembly but leaves the image open, so it can still be linked with
+ * others (see ci_link)
+ */
+CIImage *ci_assemble_end_unit(CIAssembler *as, ASTBase *node) {
+    ci_assemble_clean(node);
+    free(as->fixups);
+    free(as->open_spans);
+    free(as->deferred);
+
+    return as->image;
+}
+
+/* Finding pure functions, loading native code and calling main all need every
+ * function the image will ever have, so they wait until the image is done
+ */
+void ci_image_finish(CIImage *image) {
+    ByteStream *stream = &image->code;
+
+    ci_find_pure_functions(image);
+    if (interp_options.aot) {
+        ci_aot_bind(image);
+    }
+
+    // A whole program runs main once the top level has been set up. Its
+    // return value is the result of the interpretation
+    size_t first = image->base ? image->base->function_count : 0;
+    for (size_t idx = 0; idx < image->function_count; idx++) {
+        CIFunction *fn = &image->functions[idx];
+        if (!fn->is_foreign && !strcmp(fn->name, "main")) {
+            asm_push_u64(stream, 0);
+            asm_push_u64(stream, first + idx);
+            asm_single_op(stream, CIO_CALL);
+            asm_single_op(stream, CIO_DROP);
+            break;
+        }
+    }
+
+    asm_single_op(stream, CIO_HALT);
+}
+
+CIImage *ci_assemble_end(CIAssembler *as, ASTBase *node) {
+    CIImage *image = ci_assemble_end_unit(as, node);
+    ci_image_finish(image);
+
+    return image;
+}
+
+/* With all_bodies, lazy bodies nothing calls are assembled too */
+static CIImage *ci_assemble_tree(ASTBase *node, bool all_bodies) {
+    CIAssembler as;
+    ci_assemble_begin(&as);
+
+    // Preloaded declarations outlive this assembly, so they can't keep
+    // symbols from it if there's an error
+    void *outer_exception_env = diag_exception_env;
+    jmp_buf diag_exception;
+    diag_exception_env = diag_exception;
+
+    int res = ERR_NONE;
+    if ((res = setjmp(diag_exception))) {
+        diag_exception_env = outer_exception_env;
+        ci_assemble_clean(node);
+        ci_image_destroy(as.image);
+        free(as.fixups);
+        free(as.open_spans);
+        free(as.deferred);
+
+        assert(outer_exception_env && "nowhere to report the error");
+        longjmp(outer_exception_env, res);
+    }
+
+    ast_visit(node, (VisitFn)ci_visit, &as);
+    ci_assemble_deferred(&as, all_bodies);
+    diag_exception_env = outer_exception_env;
+
+    return ci_assemble_end_unit(&as, node);
+}
+
+CIImage *ci_assemble_unit(ASTBase *node) {
+    // Other units can call anything
+    return ci_assemble_tree(node, true);
+}
+
+CIImage *ci_assemble(ASTBase *node) {
+    CIImage *image = ci_assemble_tree(node, false);
+    ci_image_finish(image);
+
+    return image;
+}
+
+void ci_run(CIVM *vm, CIImage *image) {
+    ci_vm_init(vm, image);
+
+    if (interp_options.memo_cache) {
+        ci_memo_load(&vm->memo, image);
+    }
+
+    CIProfiler profiler;
+    if (interp_options.profile) {
+        ci_profile_start(&profiler, vm);
+    }
+
+    ci_vm_execute(vm, 0);
+
+    if (interp_options.profile) {
+        ci_profile_stop(&profiler);
+        ci_profile_report(&profiler, image);
+        free(profiler.samples);
+    }
+
+    if (interp_options.memo_cache) {
+        ci_memo_save(&vm->memo, image);
+    }
+
+    if (interp_options.memo_stats) {
+        fprintf(stderr, "memo: %llu hits, %llu misses, %zu entries, gave up on %zu functions\n",
+                vm->memo.hits, vm->memo.misses, vm->memo.count, vm->memo.given_up_count);
+    }
+}
+
+int interp_run(ASTBase *node) {
+    CIImage *image = ci_assemble(node);
+
+    CIVM vm;
+    ci_run(&vm, image);
+
+    CIValue *result = &vm.values.values[vm.result];
+    int exit_code = ci_value_is_integer(result) ? (int)result->simple_value.int_value : 0;
+
+    ci_vm_destroy(&vm);
+    return exit_code;
+}
+
+void *interp_snapshot_heap(ASTBase *node, Scope *scope, size_t *size) {
+    assert(g_preload_scope == NULL && "can't snapshot on top of a snapshot");
+
+    CIAssembler as;
+    ci_assemble_begin(&as);
+    ast_visit(node, (VisitFn)ci_visit, &as);
+    ci_assemble_deferred(&as, true);
+
+    // Find the globals while they still have their symbols
+    size_t count = 0;
+    CIHeapEntry *entries = NULL;
+    uint64_t *global_ids = NULL;
+    uint64_t decl_index = 0;
+    List_FOREACH(ASTDeclaration*, decl, scope->declarations, {
+        CISymbol *sym = (CISymbol*)AST_BASE(decl)->visit_data;
+        if (sym != NULL && sym->kind == CI_SYM_GLOBAL) {
+            entries = realloc(entries, (count + 1) * sizeof(CIHeapEntry));
+            global_ids = realloc(global_ids, (count + 1) * sizeof(uint64_t));
+            entries[count].decl_index = decl_index;
+            global_ids[count] = sym->index;
+            count++;
+        }
+        decl_index++;
+    })
+
+    CIImage *image = ci_assemble_end(&as, node);
+
+    CIVM vm;
+    ci_run(&vm, image);
+
+    ByteStream strings = {};
+    uint64_t strings_offset = 2 * sizeof(uint64_t) + count * sizeof(CIHeapEntry);
+    for (size_t idx = 0; idx < count; idx++) {
+        CIValue *v = &vm.values.values[vm.global_base + global_ids[idx]];
+        CIHeapEntry *entry = &entries[idx];
+
+        entry->kind = CIV_VOID;
+        entry->int_value = 0;
+        entry->str_offset = 0;
+        if (ci_value_is_integer(v)) {
+            entry->kind = v->kind;
+            entry->int_value = v->simple_value.int_value;
+        } else if (v->kind == CIV_CHAR_LITERAL || v->kind == CIV_POD_CHAR) {
+            entry->kind = v->kind;
+            entry->int_value = v->simple_value.char_value;
+        } else if (ci_value_is_string(v)) {
+            entry->kind = v->kind;
+            entry->str_offset = strings_offset + strings.current_offset;
+            stream_append(&strings, (uint8_t*)v->simple_value.str_value,
+                          strlen(v->simple_value.str_value) + 1);
+        }
+    }
+
+    // Anything else (like AST nodes) is tied to this process, so it's void
+    ByteStream blob = {};
+    uint64_t header[2] = { CI_HEAP_MAGIC, count };
+    stream_append(&blob, (uint8_t*)header, sizeof(header));
+    if (count > 0) {
+        stream_append(&blob, (uint8_t*)entries, count * sizeof(CIHeapEntry));
+    }
+    if (strings.current_offset > 0) {
+        stream_append(&blob, strings.data, strings.current_offset);
+    }
+
+    ci_vm_destroy(&vm);
+    free(strings.data);
+    free(entries);
+    free(global_ids);
+
+    *size = blob.current_offset;
+    return blob.data;
+}
+
+void interp_preload(Scope *scope, const void *heap, size_t size) {
+    assert(scope);
+
+    const uint64_t *header = heap;
+    if (size < 2 * sizeof(uint64_t) || header[0] != CI_HEAP_MAGIC) {
+        diag_emit(DIAG_ERROR, ERR_INTERPRET, NULL, "snapshot has no interpreter heap");
+    }
+
+    size_t count = header[1];
+    const CIHeapEntry *entries = (const CIHeapEntry*)(header + 2);
+
+    g_preload_scope = scope;
+    g_preload_count = 0;
+    g_preload_globals = calloc(count, sizeof(CIPreloadedGlobal));
+
+    size_t entry_idx = 0;
+    uint64_t decl_index = 0;
+    List_FOREACH(ASTDeclaration*, decl, scope->declarations, {
+        if (entry_idx < count && entries[entry_idx].decl_index == decl_index) {
+            const CIHeapEntry *entry = &entries[entry_idx++];
+            CIPreloadedGlobal *global = &g_preload_globals[g_preload_count++];
+            global->decl = decl;
+
+            CIValue *v = &global->value;
+            v->kind = (CIValueKind)entry->kind;
+            v->simple_value.is_pod = (v->kind == CIV_POD_INTEGER ||
+                                      v->kind == CIV_POD_STRING ||
+                                      v->kind == CIV_POD_CHAR);
+            if (ci_value_is_string(v)) {
+                v->simple_value.str_value = (const char *)heap + entry->str_offset;
+            } else if (v->kind == CIV_CHAR_LITERAL || v->kind == CIV_POD_CHAR) {
+                v->simple_value.char_value = (char)entry->int_value;
+            } else {
+                v->simple_value.int_value = entry->int_value;
+            }
+        }
+        decl_index++;
+    })
+
+    if (entry_idx != count) {
+        diag_emit(DIAG_ERROR, ERR_INTERPRET, NULL, "snapshot heap doesn't match its declarations");
+    }
+}
+
+void interp_share() {
+    assert(g_preload_scope && "nothing to share without a snapshot");
+    assert(g_shared_image == NULL && "already shared");
+
+    CIAssembler as;
+    ci_assemble_begin(&as);
+    CIImage *image = ci_assemble_end(&as, NULL);
+
+    for (size_t idx = 0; idx < image->function_count; idx++) {
+        CIFunction *fn = &image->functions[idx];
+        if (fn->is_foreign) {
+            // Missing symbols are reported when they're called
+            fn->symbol = dlsym(RTLD_DEFAULT, fn->name);
+        }
+    }
+
+    g_shared_image = image;
+}
+
+CIImage *interp_assemble(ASTBase *node) {
+    return ci_assemble(node);
+}
+
+int interp_execute(CIImage *image, FILE *result_out) {
+    CIVM vm;
+    memset(&vm, 0, sizeof(CIVM));
+
+    // Errors end this run, not whoever called us
+    void *outer_exception_env = diag_exception_env;
+    jmp_buf diag_exception;
+    diag_exception_env = diag_exception;
+
+    int res = ERR_NONE;
+    if ((res = setjmp(diag_exception)) == ERR_NONE) {
+        ci_run(&vm, image);
+        ci_value_fprint(result_out, image, &vm.values.values[vm.result]);
+    }
+
+    diag_exception_env = outer_exception_env;
+    ci_vm_destroy(&vm);
+
+    return res;
+}
+
+void interp_tier_stats(size_t *walked, size_t *promoted, size_t *assembled) {
+    *walked = g_tier_walked;
+    *promoted = g_tier_promoted;
+    *assembled = g_tier_assembled;
+}
+
+void interp_image_destroy(CIImage *image) {
+    assert(image != g_shared_image && "the shared image lives forever");
+    ci_image_destroy(image);
+}
+
+/* Runs an assembled image and prints its result */
+bool ci_interpret_image(CIImage *image) {
+#   if 0
+    ByteStream *stream = &image->code;
     fprintf(stderr, "OPCODES: [");
     for (size_t idx = 0; idx < stream->current_offset; idx++) {
         fprintf(stderr, "0x%X, ", stream->data[idx]);
@@ -523,211 +4053,14 @@ bool interp_interpret(ASTBase *node, ASTBase **result) {
 #   endif
 
     // "VM"
-    uint64_t stack[256] = {};
-    uint16_t sp = 1; // 0th is a stack underflow
-#   define PUSH(v) stack[sp++] = (v)
-#   define POP()   stack[--sp]
-    
-    uint8_t *ip = stream->data;
+    CIVM vm;
+    ci_run(&vm, image);
 
-    CIValueTable value_table = {};
-    CIValue v;
-    v.kind = CIV_VOID;
-    ValueTableIndex void_idx = values_new(&value_table, &v);
-    assert(void_idx == 0);
-    
-#   define LOOKUP_VALUE(idx) (&value_table.values[(idx)])
-    
-    // Interpreter
-    // TODO(bloggins): Direct thread this with computed gotos
-    while (*ip != CIO_HALT) {
-        switch (*ip) {
-            case CIO_HALT: assert(false && "how did we get here?");
-            case CIO_DECLARE_FR_VERSION: {
-                ++ip;
-                
-                uint64_t version = POP();
-                assert((version == 1) && "unsupported FR bytecode version");
-            } break;
-            case CIO_PUSH_U64: {
-                ++ip;
-                
-                uint64_t value = decode_u64(&ip);
-                PUSH(value);
-            } break;
-            case CIO_PUSH_NODE: {
-                /* ASTKind kind = * */ ++ip;
-                POP();  // Node index from push node
-                
-                ++ip;
-            } break;
-            case CIO_POP_NODE: {
-                ++ip;
-            } break;
-            case CIO_BINOP: {
-                ValueTableIndex v2_idx = POP();
-                ValueTableIndex op_idx = POP();
-                ValueTableIndex v1_idx = POP();
-                
-                assert(v1_idx < value_table.count);
-                assert(op_idx < value_table.count);
-                assert(v2_idx < value_table.count);
-                
-                CIValue *v1 = LOOKUP_VALUE(v1_idx);
-                CIValue *op = LOOKUP_VALUE(op_idx);
-                CIValue *v2 = LOOKUP_VALUE(v2_idx);
-                assert(v1);
-                assert(op);
-                assert(v2);
-                
-                if (v1->kind == CIV_POD_INTEGER && v2->kind == CIV_POD_INTEGER) {
-                    // TODO(bloggins): we can't keep making new values like this!
-                    // For most literal values we can probably get away with tagging
-                    // the high bits and using the literal bits.
-                    //
-                    // Or... tie values to scope so we can throw them away when
-                    // we no longer need them. That's probably the better answer.
-                    CIValue v;
-                    v.kind = CIV_POD_INTEGER;
-                    v.simple_value.int_value = v1->simple_value.int_value + v2->simple_value.int_value;
-                    ValueTableIndex idx = values_new(&value_table, &v);
-                    PUSH(idx);
-                } else {
-                    // We don't really know how to add this type so we'll emit an
-                    // unresolved value
-                    CIValue v;
-                    v.kind = CIV_BINOP;
-                    v.binop_value.lhs_index = v1_idx;
-                    v.binop_value.op_index = op_idx;
-                    v.binop_value.rhs_index = v2_idx;
-                    
-                    ValueTableIndex idx = values_new(&value_table, &v);
-                    PUSH(idx);
-                }
-                
-                ++ip;
-            } break;
-            case CIO_PUSH_IP: {
-                ++ip;
-                PUSH(ip - stream->data);
-            } break;
-            case CIO_CALL: {
-                ++ip;
-                
-                // TODO(bloggins): Push these into a Scope for the call
-                uint64_t argcount = POP();
-                while (argcount--) {
-                    POP();
-                }
-                
-                PUSH(ip - stream->data);
-                
-                // Jump to function handler
-                diag_emit(DIAG_ERROR, ERR_INTERPRET, NULL, "can't call functions yet (sorry) :-(\n");
-               
-            } break;
-            case CIO_JUMP: {
-                uint64_t ip_offset = POP();
-                uint8_t *ptr = stream->data + ip_offset;
-                assert((ptr < stream->data + stream->current_offset) && "illegal jump address");
-            } break;
-            case CIO_NEW_INTEGER_LITERAL: {
-                CIValue v;
-                v.kind = CIV_INTEGER_LITERAL;
-                v.simple_value.is_pod = false;
-                v.simple_value.int_value = POP();
-                ValueTableIndex idx = values_new(&value_table, &v);
-                
-                PUSH(idx);
-                ++ip;
-            } break;
-            case CIO_NEW_IDENTIFIER: {
-                CIValue v;
-                v.kind = CIV_IDENTIFIER;
-                ValueTableIndex idx = values_new(&value_table, &v);
-                value_table.values[idx].identifier_id = idx;
-                
-                PUSH(idx);
-                ++ip;
-            } break;
-            case CIO_NEW_BINDING: {
-                ++ip;
-                
-                uint64_t value_id = POP();
-                uint64_t name_id = POP();
-                uint64_t constraint_id = POP();
-                
-                CIValue v;
-                v.kind = CIV_BINDING;
-                v.binding_value.constraint_index = constraint_id;
-                v.binding_value.name_index = name_id;
-                v.binding_value.value_index = value_id;
-                
-                PUSH(values_new(&value_table, &v));
-                
-            } break;
-            case CIO_NEW_AST_NODE: {
-                ++ip;
-                
-                uint64_t end = POP();
-                uint64_t start = POP();
-                uint64_t source = POP();
-                uint64_t kind = POP();
-                
-                assert(start <= end);
-                assert(kind < AST_LAST);
-                
-                // TODO(bloggins): yeah... probably want to speed this up
-                ValueTableIndex node_idx = 0;
-                for (ValueTableIndex idx = 0; idx < value_table.count; idx++) {
-                    CIValue *candidate = LOOKUP_VALUE(idx);
-                    if (candidate->kind != CIV_AST_NODE) {
-                        continue;
-                    }
-                    
-                    if (candidate->ast_node_value.kind == kind &&
-                        candidate->ast_node_value.source_index == source &&
-                        candidate->ast_node_value.start == start &&
-                        candidate->ast_node_value.end == end) {
-                        node_idx = idx;
-                        break;
-                    }
-                }
-                
-                if (node_idx == 0) {
-                    CIValue v;
-                    v.kind = CIV_AST_NODE;
-                    v.ast_node_value.source_index = 0;
-                    v.ast_node_value.start = start;
-                    v.ast_node_value.end = end;
-                    v.ast_node_value.kind = (ASTKind)kind;
-                    
-                    node_idx = values_new(&value_table, &v);
-                }
-                PUSH(node_idx);
-            } break;
-            default: {
-                uint8_t op = *ip;
-                const char *opcode = "unknown";
-                if (op < CIO_LAST) {
-                    opcode = g_opcode_names[op];
-                }
-                diag_emit(DIAG_ERROR, ERR_INTERPRET, NULL, "unrecognized opcode %s\n", opcode);
-            }
-        }
-        
-        if (sp < 1) {
-            diag_emit(DIAG_ERROR, ERR_INTERPRET, NULL, "stack underflow");
-        } else if (sp > 256) {
-            diag_emit(DIAG_ERROR, ERR_INTERPRET, NULL, "stack overflow");
-        }
-    }
-    
     // DEBUG - Print value table
     /*
-    for (size_t i = 0; i < value_table.count; i++) {
-        CIValue *v = &value_table.values[i];
-        
+    for (size_t i = 0; i < vm.values.count; i++) {
+        CIValue *v = &vm.values.values[i];
+
         const char *type_name = "unknown";
         switch (v->kind) {
             case CIV_VOID: type_name = "void"; break;
@@ -740,18 +4073,53 @@ bool interp_interpret(ASTBase *node, ASTBase **result) {
             case CIV_AST_NODE: type_name = "ast"; break;
             case CIV_LAST: default: assert(false && "unrecognized value kind");
         }
-        
+
         fprintf(stderr, "%zu: <%s> ", i, type_name);
-        
-        ci_value_fprint(stderr, node->location.ctx, v);
+
+        ci_value_fprint(stderr, image, v);
         fprintf(stderr, "\n");
     }
     */
-    
-    // Hopefully the last value will be main result of the interpretation
-    ci_value_fprint(stderr, node->location.ctx, &value_table.values[value_table.count - 1]);
+
+    // The value of the last statement is the main result of the interpretation
+    ci_value_fprint(stderr, image, &vm.values.values[vm.result]);
     fprintf(stderr, "\n");
-    
+
+    ci_vm_destroy(&vm);
+
     return true;
 }
 
+bool interp_interpret(ASTBase *node, ASTBase **result) {
+    // The other options are all about the VM
+    bool walk = !(interp_options.bytecode_only || interp_options.memoize ||
+                  interp_options.memo_stats || interp_options.memo_cache || interp_options.aot ||
+                  interp_options.profile);
+    if (walk && ci_walk(node, stderr)) {
+        fprintf(stderr, "\n");
+        return true;
+    }
+
+    g_tier_assembled++;
+    return ci_interpret_image(ci_assemble(node));
+}
+
+bool interp_interpret_units(ASTBase **units, size_t count) {
+    if (g_preload_scope != NULL) {
+        CI_ERROR(NULL, "can't link several files on top of an image");
+    }
+
+    CIImage **images = calloc(count, sizeof(CIImage*));
+    for (size_t idx = 0; idx < count; idx++) {
+        images[idx] = ci_assemble_unit(units[idx]);
+    }
+
+    CIImage *image = ci_link(images, count);
+    for (size_t idx = 0; idx < count; idx++) {
+        ci_image_destroy(images[idx]);
+    }
+    free(images);
+
+    ci_image_finish(image);
+    return ci_interpret_image(image);
+}
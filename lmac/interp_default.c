@@ -8,13 +8,13 @@
 
 #include "clite.h"
 
-struct ByteStream;
+struct CIAssembler;
 
 // Weakly-linked default visitor functions for the interpreter. They can be
 // overridden in the interp.c file to provide node-specific functionality
 
 #define AST(kindname, name, type)                                                   \
-int __attribute__((weak)) ci_visit_AST_##kindname(type *node, VisitPhase phase, struct ByteStream *stream) {  \
+int __attribute__((weak)) ci_visit_AST_##kindname(type *node, VisitPhase phase, struct CIAssembler *as) {  \
 fprintf(stderr, "don't know how to interpret node kind %s\n", ast_get_kind_name(AST_BASE(node)->kind)); \
 exit(ERR_INTERPRET); \
 }
@@ -14,13 +14,15 @@
 // This lexer should support unicode and UTF-8 encoding
 // http://en.wikipedia.org/wiki/Punycode for UTF-8 identifiers?
 
+/* Every token lexed, including the ones lexed again after backtracking.
+ * Threads count their own and add them to the total when they're done */
+global_variable _Thread_local size_t g_lexed_token_count;
+global_variable _Atomic size_t g_lexed_token_total;
+
 SourceLocation lexed_source_location(Context *ctx) {
     SourceLocation sl = {0};
-    sl.file = ctx->file;
-    sl.line = ctx->line;
-    sl.ctx = ctx;
-    sl.range_start = ctx->pos;
-    sl.range_end = ctx->pos + 1;
+    sl.start = context_offset(ctx, ctx->pos);
+    sl.length = 1;
     
     return sl;
 }
@@ -30,7 +32,6 @@ void lex_singleline_comment(Context *ctx) {
         // Gobble the comment to EOL or EOI
         char c = (char)*(++ctx->pos);
         if (c == '\n' || c == 0) {
-            ctx->line++;
             break;
         }
     }
@@ -40,10 +41,7 @@ void lex_multiline_comment(Context *ctx) {
     for (;;) {
         // Gobble the comment to next '*/'
         char c = (char)*(++ctx->pos);
-        if (c == '\n') {
-            // TODO(bloggins): We're doing this in too many places. Abstract to a macro
-            ctx->line++;
-        } else if (c == '*') {
+        if (c == '*') {
             if ((char)*(++ctx->pos) == '/') {
                 break;
             }
@@ -99,7 +97,11 @@ Token lexer_lex_chunk(Context *ctx, char end_of_chunk_marker, char chunk_marker_
     bool in_escape = false;
     for (;;) {
         char ch = (char)*(ctx->pos++);
-        if (!in_escape && (ch == chunk_marker_escape)) {
+        if (ch == 0) {
+            // A chunk can end with the input (like an #endif on the last line)
+            --ctx->pos;
+            break;
+        } else if (!in_escape && (ch == chunk_marker_escape)) {
             // NOTE(bloggins): We read this in unprocessed because we always
             // store the EXACT spelling. Code that uses the spelling will need
             // to do the work to remove the escape character
@@ -111,29 +113,139 @@ Token lexer_lex_chunk(Context *ctx, char end_of_chunk_marker, char chunk_marker_
         }
     }
     
-    t.location.range_end = ctx->pos;
+    t.location.length = context_offset(ctx, ctx->pos) - t.location.start;
     t.kind = TOK_CHUNK;
     return t;
 }
 
-Token lexer_peek_token(Context *ctx) {
-    uint8_t *saved_pos = ctx->pos;
-    Token t = lexer_next_token(ctx);
+/* Steps over the block at the cursor without lexing it, for bodies that are
+ * parsed later. It only has to know enough to not be fooled by braces in
+ * strings and comments. Returns false, with the cursor where it
+ * was, if there's no block here or it has a preprocessor directive (which
+ * has to happen in order with everything around it).
+ */
+bool lexer_skip_block(Context *ctx, SourceLocation *block) {
+    uint8_t *p = ctx->pos;
+    while (isspace(*p)) {
+        p++;
+    }
     
-    ctx->pos = saved_pos;
+    if (*p != '{') {
+        return false;
+    }
+    
+    uint8_t *start = p;
+    size_t depth = 0;
+    for (;; p++) {
+        p += strcspn((const char*)p, "{}\"/#");
+        switch (*p) {
+            case 0:
+            case '#':
+                return false;
+            case '{':
+                depth++;
+                break;
+            case '}':
+                if (--depth == 0) {
+                    ctx->pos = p + 1;
+                    block->start = context_offset(ctx, start);
+                    block->length = (uint32_t)(ctx->pos - start);
+                    return true;
+                }
+                break;
+            case '"':
+                // Like parse_expr_string, no escapes (yet)
+                p = (uint8_t*)strchr((const char*)p + 1, '"');
+                if (p == NULL) {
+                    return false;
+                }
+                break;
+            case '/':
+                if (p[1] == '/') {
+                    p += strcspn((const char*)p, "\n");
+                    if (*p == 0) {
+                        return false;
+                    }
+                } else if (p[1] == '*') {
+                    p = (uint8_t*)strstr((const char*)p + 2, "*/");
+                    if (p == NULL) {
+                        return false;
+                    }
+                    p++;
+                }
+                break;
+        }
+    }
+}
+
+/* Steps over the lines of a conditional group that isn't taken, starting at
+ * the beginning of a line. Only lines that start with '#' are looked at (to
+ * keep track of the groups nested in this one), so nothing in between gets
+ * lexed. Stops after the name of the #endif that ends the group, or of its
+ * #else or #elif if stop_at_else, and returns the name. Returns TOK_END if
+ * the file ends first.
+ */
+Token lexer_skip_conditional(Context *ctx, bool stop_at_else) {
+    // NOTE(bloggins): Like a real preprocessor we don't care what's in a
+    // skipped group, but unlike one we don't know about comments either, so a
+    // '#' starting a line of a block comment counts as a directive
+    uint8_t *end = ctx->source->buf + ctx->source->size;
+    size_t depth = 0;
+    
+    Token t = {};
+    for (uint8_t *p = ctx->pos; p < end; ) {
+        p += strspn((const char*)p, " \t");
+        if (*p == '#') {
+            p += strspn((const char*)p + 1, " \t") + 1;
+            uint8_t *name = p;
+            while (isalpha(*p)) {
+                p++;
+            }
+            
+            size_t length = p - name;
+            bool found = false;
+            if (length >= 2 && memcmp(name, "if", 2) == 0) {
+                // #if, #ifdef and #ifndef
+                depth++;
+            } else if (length == 5 && memcmp(name, "endif", 5) == 0) {
+                found = depth == 0;
+                depth = found ? 0 : depth - 1;
+            } else if (length == 4 && depth == 0 && stop_at_else) {
+                found = memcmp(name, "else", 4) == 0 || memcmp(name, "elif", 4) == 0;
+            }
+            
+            if (found) {
+                ctx->pos = p;
+                t.kind = TOK_IDENT;
+                t.location.start = context_offset(ctx, name);
+                t.location.length = (uint32_t)length;
+                return t;
+            }
+        }
+        
+        // On to the next line, past any lines continued from this one
+        uint8_t *newline = memchr(p, '\n', end - p);
+        while (newline != NULL && newline > ctx->source->buf && newline[-1] == '\\') {
+            newline = memchr(newline + 1, '\n', end - newline - 1);
+        }
+        
+        p = newline != NULL ? newline + 1 : end;
+    }
+    
+    ctx->pos = end;
+    t.kind = TOK_END;
+    t.location.start = context_offset(ctx, end);
     return t;
 }
 
 Token lexer_next_token_no_state(Context *ctx) {
     assert(ctx);
+    g_lexed_token_count++;
     
     Token t = {};
     t.kind = TOK_UNKOWN;
-    t.location.file = ctx->file;
-    t.location.line = ctx->line;
-    t.location.ctx = ctx;
-    t.location.range_start = ctx->pos;
-    t.location.range_end = ctx->pos;
+    t.location.start = context_offset(ctx, ctx->pos);
+    t.location.length = 0;
     
     if (*(ctx->pos) == 0) {
         t.kind = TOK_END;
@@ -269,7 +381,6 @@ Token lexer_next_token_no_state(Context *ctx) {
             break;
         case '\n':
             t.kind = TOK_WS;
-            ctx->line++;
             break;
             
         default:
@@ -286,7 +397,7 @@ Token lexer_next_token_no_state(Context *ctx) {
     ctx->pos++;
     
 finish:
-    t.location.range_end = ctx->pos;
+    t.location.length = context_offset(ctx, ctx->pos) - t.location.start;
     
     // NOTE(bloggins): We do this here because we need the token to have
     // a complete SourceLocation for proper spelling
@@ -294,6 +405,10 @@ finish:
         maybe_lex_keyword(ctx, &t);
     }
     
+    if (t.kind == TOK_IDENT && scope_type_name_known(t.location.spelling)) {
+        t.flags |= TOKEN_FLAG_TYPE_NAME;
+    }
+    
     return t;
 }
 
@@ -313,7 +428,178 @@ Token lexer_next_token(Context *ctx) {
 #endif
 }
 
+size_t lexer_token_count() {
+    return g_lexed_token_total + g_lexed_token_count;
+}
+
+size_t lexer_thread_token_count() {
+    return g_lexed_token_count;
+}
+
+void lexer_token_count_flush() {
+    g_lexed_token_total += g_lexed_token_count;
+    g_lexed_token_count = 0;
+}
+
+#pragma mark Lookahead
+
+// NOTE(bloggins): The parser looks at the next token a lot more often than it
+// takes it, and it backs up a few tokens every time an alternative doesn't
+// pan out. The lookahead remembers the last few tokens it lexed (and where
+// each one started and ended) so going over them again doesn't lex them
+// again. It's keyed on the position, so anything that moves ctx->pos on its
+// own (snapshots, chunks, skipped blocks) finds its place in it or starts it
+// over.
+
+/* Must be a power of two */
+#define LOOKAHEAD_SIZE  8
+
+typedef struct {
+    /* Where lexing started, before the whitespace and comments */
+    uint8_t *from;
+    uint8_t *start;
+    uint8_t *to;
+    Token token;
+} LookaheadEntry;
+
+typedef struct Lookahead {
+    LookaheadEntry entries[LOOKAHEAD_SIZE];
+    
+    /* Entries first up to next are lexed. cursor is the one at ctx->pos.
+     * They only go up and are masked to index entries */
+    size_t first;
+    size_t next;
+    size_t cursor;
+    
+    /* What the tokens were lexed with */
+    bool keywords_as_identifiers;
+    size_t type_names_generation;
+} Lookahead;
+
+Lookahead *lexer_lookahead_create() {
+    return calloc(1, sizeof(Lookahead));
+}
+
+void lexer_lookahead_destroy(Lookahead *la) {
+    free(la);
+}
+
+void lexer_lookahead_flush(Lookahead *la) {
+    la->first = la->next = la->cursor = 0;
+}
+
+static LookaheadEntry *lookahead_entry(Lookahead *la, size_t n) {
+    return &la->entries[n & (LOOKAHEAD_SIZE - 1)];
+}
+
+static bool lookahead_entry_at(Lookahead *la, size_t n, uint8_t *pos) {
+    LookaheadEntry *e = lookahead_entry(la, n);
+    return e->from == pos || e->start == pos;
+}
+
+/* Points the cursor at the entry at ctx->pos, if there is one */
+static void lookahead_seek(Context *ctx, Lookahead *la) {
+    if (la->keywords_as_identifiers != ctx->lex_mode.lex_keywords_as_identifiers ||
+        la->type_names_generation != scope_type_names_generation()) {
+        // The same text would lex differently now
+        lexer_lookahead_flush(la);
+        la->keywords_as_identifiers = ctx->lex_mode.lex_keywords_as_identifiers;
+        la->type_names_generation = scope_type_names_generation();
+        return;
+    }
+    
+    if (la->cursor < la->next && lookahead_entry_at(la, la->cursor, ctx->pos)) {
+        return;
+    }
+    
+    if (la->first == la->next) {
+        return;
+    }
+    
+    // Whoever skipped the whitespace after the last token (the parse memo
+    // does) might back up over it again, so the next token starts at the end
+    // of the last one
+    uint8_t *p = lookahead_entry(la, la->next - 1)->to;
+    while (p < ctx->pos && isspace(*p)) {
+        p++;
+    }
+    
+    if (p == ctx->pos) {
+        la->cursor = la->next;
+        return;
+    }
+    
+    for (size_t n = la->first; n < la->next; n++) {
+        if (lookahead_entry_at(la, n, ctx->pos)) {
+            la->cursor = n;
+            return;
+        }
+    }
+    
+    lexer_lookahead_flush(la);
+}
+
+/* Lexes the token after the last entry (or at ctx->pos if there aren't any
+ * from the cursor on). Leaves ctx->pos alone */
+static void lookahead_fill(Context *ctx, Lookahead *la) {
+    uint8_t *saved_pos = ctx->pos;
+    uint8_t *from = ctx->pos;
+    if (la->first < la->next) {
+        from = lookahead_entry(la, la->next - 1)->to;
+    }
+    
+    if (la->cursor < la->next) {
+        ctx->pos = from;
+    }
+    
+    if (la->next - la->first == LOOKAHEAD_SIZE) {
+        assert(la->first < la->cursor && "lookahead is too deep");
+        la->first++;
+    }
+    
+    LookaheadEntry *e = lookahead_entry(la, la->next++);
+    e->from = from;
+    
+    // TODO(bloggins): figure out how to incorporate comments and ws in generated
+    // code
+    do {
+        e->start = ctx->pos;
+        e->token = lexer_next_token(ctx);
+    } while (e->token.kind == TOK_WS || e->token.kind == TOK_COMMENT);
+    
+    e->to = ctx->pos;
+    ctx->pos = saved_pos;
+}
+
+Token lexer_take_token(Context *ctx) {
+    Lookahead *la = ctx->lookahead;
+    lookahead_seek(ctx, la);
+    if (la->cursor == la->next) {
+        lookahead_fill(ctx, la);
+    }
+    
+    LookaheadEntry *e = lookahead_entry(la, la->cursor++);
+    ctx->pos = e->to;
+    return e->token;
+}
+
+Token lexer_peek_token(Context *ctx, size_t depth) {
+    assert(depth < LOOKAHEAD_SIZE && "can't look that far ahead");
+    
+    Lookahead *la = ctx->lookahead;
+    lookahead_seek(ctx, la);
+    while (la->next - la->cursor <= depth) {
+        lookahead_fill(ctx, la);
+    }
+    
+    return lookahead_entry(la, la->cursor + depth)->token;
+}
+
 void lexer_put_back(Context *ctx, Token token) {
-    ctx->line = token.location.line;
-    ctx->pos = token.location.range_start;
+    ctx->pos = context_pointer(ctx, token.location.start);
+    
+    Lookahead *la = ctx->lookahead;
+    if (la->cursor > la->first && lookahead_entry(la, la->cursor - 1)->start == ctx->pos) {
+        la->cursor--;
+    }
 }
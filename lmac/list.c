@@ -34,6 +34,13 @@ void List_dump(void *type_info, void *runtime_class, FILE *f, List *list) {
     })
 }
 
+void List_pointers(void *type_info, void *runtime_class, void *writer, List *list) {
+    // NOTE(bloggins): Items that aren't CT objects (like strings) are added as
+    // blobs by whatever owns the list
+    ct_image_add_pointer(writer, &list->item);
+    ct_image_add_pointer(writer, &list->next);
+}
+
 #pragma normal functions
 
 void list_append(List **list, void *item) {
@@ -68,4 +75,26 @@ size_t list_count(List *list) {
     })
     
     return idx;
-}
\ No newline at end of file
+}
+void list_replace(List *list, void *item, void *replacement) {
+    assert(replacement && "replacement is NULL");
+    
+    for (; list != NULL; list = list->next) {
+        if (list->item == item) {
+            list->item = replacement;
+            return;
+        }
+    }
+    
+    assert(false && "item isn't in the list");
+}
+
+void list_remove(List **list, void *item) {
+    for (List **l = list; *l != NULL; l = &(*l)->next) {
+        if ((*l)->item == item) {
+            // The node goes back with everything else on ct_autorelease
+            *l = (*l)->next;
+            return;
+        }
+    }
+}
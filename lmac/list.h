@@ -38,4 +38,10 @@ void list_append(List **list, void *item);
 
 size_t list_count(List *list);
 
+/* Puts replacement where item was */
+void list_replace(List *list, void *item, void *replacement);
+
+/* Takes the first occurrence of item out of the list, if it's there */
+void list_remove(List **list, void *item);
+
 #endif
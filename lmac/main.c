@@ -10,6 +10,8 @@
 
 #include <unistd.h>
 #include <setjmp.h>
+#include <libgen.h>
+#include <time.h>
 
 typedef struct {
     int indent_level;
@@ -31,6 +33,39 @@ int print_visitor(ASTBase *node, VisitPhase phase, void *ctx) {
     return VISIT_OK;
 }
 
+int count_visitor(ASTBase *node, VisitPhase phase, void *ctx) {
+    if (phase == VISIT_PRE) {
+        ++*(size_t*)ctx;
+    }
+    
+    return VISIT_OK;
+}
+
+/* Reports how much memory the parsed source takes up */
+void print_source_stats(ASTBase *ast) {
+    size_t node_count = 0;
+    ast_visit(ast, count_visitor, &node_count);
+    
+    size_t file_count, source_bytes, line_count, line_table_bytes;
+    source_manager_stats(&file_count, &source_bytes, &line_count, &line_table_bytes);
+    
+    fprintf(stderr, "source: %zu files, %zu bytes, %zu lines (%zu bytes of line tables)\n",
+            file_count, source_bytes, line_count, line_table_bytes);
+    fprintf(stderr, "tokens: %zu lexed, %zu bytes each (%zu per cache line)\n",
+            lexer_token_count(), sizeof(Token), (size_t)64 / sizeof(Token));
+    fprintf(stderr, "nodes: %zu, %zu bytes of node headers (%zu bytes each, %zu of it location)\n",
+            node_count, node_count * sizeof(ASTBase), sizeof(ASTBase), sizeof(SourceLocation));
+}
+
+/* Reports how long parsing took and how much backtracking was saved */
+void print_parse_stats(double usec) {
+    size_t hits, misses;
+    parser_memo_stats(&hits, &misses);
+    
+    fprintf(stderr, "parse: %.1f us, %zu tokens lexed, memo %s (%zu hits, %zu misses)\n",
+            usec, lexer_token_count(), parser_options.memoize ? "on" : "off", hits, misses);
+}
+
 void exit_handler() {
     if (diag_errno > 0) {
         // Comment out to stop breaking on error
@@ -43,10 +78,65 @@ void exit_handler() {
 #endif
 }
 
-int do_repl() {
+/* Loads a snapshot image. Returns the image's top-level scope, or NULL and
+ * why in error */
+Scope *load_image(const char *image_file, const char **error) {
+    const void *heap = NULL;
+    size_t heap_size = 0;
+    Context *image_ctx = ct_image_load(image_file, &heap, &heap_size, error);
+    if (image_ctx == NULL) {
+        return NULL;
+    } else if (image_ctx->active_scope == NULL) {
+        *error = "it has no top-level scope";
+        return NULL;
+    }
+    
+    interp_preload(image_ctx->active_scope, heap, heap_size);
+    scope_type_names_import(image_ctx->active_scope);
+    return image_ctx->active_scope;
+}
+
+int do_snapshot(Context *ctx) {
+    // Declarations live in the top level's own scope, not the builtins
+    // scope above it
+    Scope *top_scope = AST_BASE(ctx->ast)->scope;
+    assert(top_scope && "top level should have a scope");
+    
+    size_t heap_size = 0;
+    void *heap = interp_snapshot_heap(ctx->ast, top_scope, &heap_size);
+    
+    char *image_file = NULL;
+    asprintf(&image_file, "%s.image", basename((char*)ctx->source->name));
+    
+    // The image keeps the top-level scope so later code can look into it
+    ctx->active_scope = top_scope;
+    bool ok = ct_image_write(image_file, ctx, heap, heap_size);
+    ctx->active_scope = NULL;
+    
+    if (!ok) {
+        diag_emit(DIAG_ERROR, ERR_CT, NULL, "can't write image %s", image_file);
+    }
+    
+    free(image_file);
+    free(heap);
+    return ERR_NONE;
+}
+
+static double elapsed_usec(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e6 + (now.tv_nsec - start->tv_nsec) / 1e3;
+}
+
+int do_repl(Scope *image_scope, bool show_latency, bool lazy_bodies) {
     FILE *f_in = stdin;
     FILE *f_out = stdout;
     
+    // With --latency, each line reports how long it took to parse and
+    // evaluate, and the totals are printed at the end
+    size_t timed_lines = 0;
+    double total_usec = 0;
+    
     fprintf(f_out, "Cx REPL v.whatever\n");
     fprintf(f_out, "\n");
     
@@ -77,16 +167,22 @@ int do_repl() {
         // Be nice to them
         user_input[chars_read-1] = ';';
         
+        struct timespec line_start;
+        clock_gettime(CLOCK_MONOTONIC, &line_start);
+        
         Context *ctx = context_create();
         context_scope_push(ctx);
         //ctx->active_scope = outer_scope;
-        ctx->file = "<repl>";
+        
+        // NOTE(bloggins): Don't add the line's scope as a child of the image
+        // scope. The image lives forever and the line doesn't.
+        ctx->active_scope->parent = image_scope;
         ctx->parse_mode.allow_toplevel_expressions = true;
+        ctx->parse_mode.lazy_bodies = lazy_bodies;
         
-        ctx->line = 1;
-        ctx->buf = (uint8_t*)user_input;
-        ctx->buf_size = chars_read;
-        ctx->pos = ctx->buf;
+        // The line is freed below, after the CT objects pointing into it
+        context_load_source(ctx, source_manager_add("<repl>", (uint8_t*)user_input,
+                                                    chars_read, false));
         
         // TODO: use setjmp/longjmp so we can quickly error after parsing problems
         // but not quit the repl
@@ -100,6 +196,13 @@ int do_repl() {
         if (result != NULL) {
             ct_dump(result);
         }
+        
+        if (show_latency) {
+            double usec = elapsed_usec(&line_start);
+            fprintf(stderr, "(%.1f us)\n", usec);
+            total_usec += usec;
+            timed_lines++;
+        }
     
     repl_error:
         ct_autorelease();
@@ -107,12 +210,64 @@ int do_repl() {
         free(user_input);
     }
     
+    if (show_latency && timed_lines > 0) {
+        size_t walked, promoted, assembled;
+        interp_tier_stats(&walked, &promoted, &assembled);
+        fprintf(stderr, "latency: %zu lines, %.1f us per line (%zu walked, "
+                "%zu promoted, %zu assembled)\n", timed_lines,
+                total_usec / timed_lines, walked, promoted, assembled);
+    }
+    
     return ERR_NONE;
 }
 
+/* Parses each file on its own and links the results, like a C program made
+ * of several translation units
+ */
+int do_interpret_files(const char **files, size_t count, Scope *image_scope) {
+    ASTBase **units = calloc(count, sizeof(ASTBase*));
+    for (size_t idx = 0; idx < count; idx++) {
+        Context *ctx = context_create();
+        context_load_file(ctx, files[idx]);
+        
+        Scope *top_scope = context_scope_push(ctx);
+        top_scope->parent = image_scope;
+        
+        parser_parse(ctx);
+        ctx->active_scope = NULL;
+        units[idx] = ctx->ast;
+    }
+    
+    bool ok = interp_interpret_units(units, count);
+    free(units);
+    
+    return ok;
+}
+
 int main(int argc, const char * argv[]) {
     if (argc < 2) {
-        fprintf(stderr, "Usage: lmac [build | run | interpret | repl] <file>\n");
+        fprintf(stderr, "Usage: lmac [build | run | interpret | repl | snapshot] [options] <file>\n");
+        fprintf(stderr, "       lmac interpret [options] <file> <file>...\n");
+        fprintf(stderr, "       lmac serve [options] <socket>\n");
+        fprintf(stderr, "Options:\n");
+        fprintf(stderr, "  --fast-start   (run) interpret while the native binary builds in the background\n");
+        fprintf(stderr, "  --memoize      reuse what pure functions returned for the same arguments\n");
+        fprintf(stderr, "  --memo-stats   report how often calls to pure functions were memoized\n");
+        fprintf(stderr, "  --memo-cache   keep memoized results in the build cache for later builds\n");
+        fprintf(stderr, "  --aot          compile pure functions to native code in the build cache\n");
+        fprintf(stderr, "  --profile      report where the interpreter spent its time\n");
+        fprintf(stderr, "  --bytecode-only assemble everything instead of walking cold code\n");
+        fprintf(stderr, "  --source-stats report how much memory the parsed source takes up\n");
+        fprintf(stderr, "  --parse-stats  report how long parsing took\n");
+        fprintf(stderr, "  --no-parse-memo reparse after backtracking instead of remembering\n");
+        fprintf(stderr, "  --parse-profile report what each grammar rule's backtracking threw away\n");
+        fprintf(stderr, "  --eager-bodies (interpret, repl) parse function bodies nothing calls\n");
+        fprintf(stderr, "  --parse-threads <n> parse function bodies on n threads\n");
+        fprintf(stderr, "  --edit <offset>:<length>:<text> replace length bytes at offset with text\n"
+                        "                 after parsing and parse again (as little as possible)\n");
+        fprintf(stderr, "  --latency      (repl) time each line and report the average\n");
+        fprintf(stderr, "  --image <file> (interpret, repl, serve) start from an image made by snapshot\n");
+        fprintf(stderr, "  --threads <n>  (serve) number of requests to run at once\n");
         return ERR_USAGE;
     }
     
@@ -120,6 +275,8 @@ int main(int argc, const char * argv[]) {
     const int ACTION_RUN = 1;
     const int ACTION_INTERPRET = 2;
     const int ACTION_REPL = 3;
+    const int ACTION_SNAPSHOT = 4;
+    const int ACTION_SERVE = 5;
     
     const char *action_str = argv[1];
     int action;
@@ -136,11 +293,108 @@ int main(int argc, const char * argv[]) {
     } else if (!strcmp(action_str, "repl")) {
         action = ACTION_REPL;
         needs_file = false;
+    } else if (!strcmp(action_str, "snapshot")) {
+        action = ACTION_SNAPSHOT;
+        needs_file = true;
+    } else if (!strcmp(action_str, "serve")) {
+        action = ACTION_SERVE;
+        needs_file = false;
     } else {
         diag_printf(DIAG_FATAL, NULL, "unknown action '%s'", action_str);
         return ERR_USAGE;
     }
     
+    // Options come before the file
+    bool fast_start = false;
+    bool show_latency = false;
+    bool source_stats = false;
+    bool parse_stats = false;
+    bool eager_bodies = false;
+    long parse_threads = 0;
+    const char *edit = NULL;
+    unsigned long edit_offset = 0;
+    unsigned long edit_length = 0;
+    const char *image_file = NULL;
+    long thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+    int arg_idx = 2;
+    for (; arg_idx < argc && !strncmp(argv[arg_idx], "--", 2); arg_idx++) {
+        const char *option = argv[arg_idx];
+        if (!strcmp(option, "--fast-start") && action == ACTION_RUN) {
+            fast_start = true;
+        } else if (!strcmp(option, "--memoize")) {
+            interp_options.memoize = true;
+        } else if (!strcmp(option, "--memo-stats")) {
+            interp_options.memoize = true;
+            interp_options.memo_stats = true;
+        } else if (!strcmp(option, "--memo-cache")) {
+            interp_options.memoize = true;
+            interp_options.memo_cache = true;
+        } else if (!strcmp(option, "--aot")) {
+            interp_options.aot = true;
+        } else if (!strcmp(option, "--profile")) {
+            interp_options.profile = true;
+        } else if (!strcmp(option, "--bytecode-only")) {
+            interp_options.bytecode_only = true;
+        } else if (!strcmp(option, "--source-stats")) {
+            source_stats = true;
+        } else if (!strcmp(option, "--parse-stats")) {
+            parse_stats = true;
+        } else if (!strcmp(option, "--no-parse-memo")) {
+            parser_options.memoize = false;
+        } else if (!strcmp(option, "--parse-profile")) {
+            parser_options.profile = true;
+        } else if (!strcmp(option, "--eager-bodies")) {
+            eager_bodies = true;
+        } else if (!strcmp(option, "--parse-threads") && arg_idx + 1 < argc &&
+                   action != ACTION_REPL && action != ACTION_SERVE) {
+            parse_threads = strtol(argv[++arg_idx], NULL, 10);
+        } else if (!strcmp(option, "--edit") && arg_idx + 1 < argc &&
+                   action != ACTION_REPL && action != ACTION_SERVE) {
+            char *end = NULL;
+            edit_offset = strtoul(argv[++arg_idx], &end, 10);
+            if (*end == ':') {
+                edit_length = strtoul(end + 1, &end, 10);
+            }
+            
+            if (*end != ':') {
+                diag_printf(DIAG_FATAL, NULL, "--edit needs <offset>:<length>:<text>");
+                return ERR_USAGE;
+            }
+            edit = end + 1;
+        } else if (!strcmp(option, "--latency") && action == ACTION_REPL) {
+            show_latency = true;
+        } else if (!strcmp(option, "--image") && arg_idx + 1 < argc &&
+                   (action == ACTION_INTERPRET || action == ACTION_REPL ||
+                    action == ACTION_SERVE)) {
+            image_file = argv[++arg_idx];
+        } else if (!strcmp(option, "--threads") && arg_idx + 1 < argc &&
+                   action == ACTION_SERVE) {
+            thread_count = atol(argv[++arg_idx]);
+            if (thread_count < 1) {
+                diag_printf(DIAG_FATAL, NULL, "--threads needs a positive number");
+                return ERR_USAGE;
+            }
+        } else {
+            diag_printf(DIAG_FATAL, NULL, "unknown option '%s' for %s", option, action_str);
+            return ERR_USAGE;
+        }
+    }
+
+    if (action == ACTION_SERVE && argc != arg_idx + 1) {
+        diag_printf(DIAG_FATAL, NULL, "you must specify a socket to serve on");
+        return ERR_USAGE;
+    }
+    
+    Scope *image_scope = NULL;
+    if (image_file != NULL) {
+        const char *error = NULL;
+        image_scope = load_image(image_file, &error);
+        if (image_scope == NULL) {
+            diag_printf(DIAG_FATAL, NULL, "can't load image '%s': %s", image_file, error);
+            return ERR_CT;
+        }
+    }
+    
     atexit(exit_handler);
     
     jmp_buf diag_exception;
@@ -152,41 +406,88 @@ int main(int argc, const char * argv[]) {
     
     // Shortcut to the repl if that action is specified
     if (action == ACTION_REPL) {
-        res = do_repl();
+        res = do_repl(image_scope, show_latency, !eager_bodies);
+        goto finish;
+    }
+    
+    if (action == ACTION_SERVE) {
+        res = serve_listen(argv[arg_idx], image_scope, thread_count > 0 ? thread_count : 1);
+        goto finish;
+    }
+    
+    if (action == ACTION_INTERPRET && argc > arg_idx + 1) {
+        res = do_interpret_files(argv + arg_idx, argc - arg_idx, image_scope);
         goto finish;
     }
     
     // Make sure the file exists
     const char *file = NULL;
     if (needs_file) {
-        if (argc != 3) {
+        if (argc != arg_idx + 1) {
             diag_emit(DIAG_FATAL, ERR_USAGE, NULL, "you must specify a file when you %s", action_str);
         }
-        file = argv[2];
+        file = argv[arg_idx];
     }
     
     
     
     Context *ctx = context_create();
-    ctx->file = file;
-    
-    if (ctx->file != NULL) {
-        const char *filename = ctx->file;
-        ctx->file = NULL;
-        context_load_file(ctx, filename);
+    if (file != NULL) {
+        context_load_file(ctx, file);
     }
     
     // Initialize top scope, builtins, etc. here before parsing
-    context_scope_push(ctx);
+    Scope *top_scope = context_scope_push(ctx);
+    top_scope->parent = image_scope;
+    
+    // Only the interpreter can get by without every body. The context stays
+    // around (until the end) to parse them
+    ctx->parse_mode.lazy_bodies = action == ACTION_INTERPRET && !eager_bodies;
+    
+    // With threads, the top level is parsed first and then all of the bodies
+    // at once
+    if (parse_threads > 0) {
+        ctx->parse_mode.lazy_bodies = true;
+    }
+    
+    struct timespec parse_start;
+    clock_gettime(CLOCK_MONOTONIC, &parse_start);
     
     parser_parse(ctx);
+    if (parse_threads > 0) {
+        parser_parse_bodies(ctx, (size_t)parse_threads);
+    }
+    
+    if (parse_stats) {
+        print_parse_stats(elapsed_usec(&parse_start));
+    }
+    
+    if (edit != NULL) {
+        struct timespec reparse_start;
+        clock_gettime(CLOCK_MONOTONIC, &reparse_start);
+        
+        size_t reparsed = parser_reparse(ctx, edit_offset, edit_length, edit, strlen(edit));
+        if (parse_stats) {
+            fprintf(stderr, "reparse: %.1f us, %zu of %zu bytes\n", elapsed_usec(&reparse_start),
+                    reparsed, ctx->source->size);
+        }
+    }
     
     // Don't keep parse context around after the full parse tree is created
     ctx->active_scope = NULL;
     
-    if (action == ACTION_BUILD || action == ACTION_RUN) {
+    if (source_stats) {
+        print_source_stats(ctx->ast);
+    }
+    
+    if (action == ACTION_RUN && fast_start) {
+        analyzer_analyze(ctx->ast);
+        res = run_fast_start(ctx);
+    } else if (action == ACTION_BUILD || action == ACTION_RUN) {
         analyzer_analyze(ctx->ast);
         res = run_compile(ctx, action == ACTION_RUN);
+    } else if (action == ACTION_SNAPSHOT) {
+        res = do_snapshot(ctx);
     } else if (action == ACTION_INTERPRET) {
         ASTBase *result = NULL;
         res = interp_interpret(ctx->ast, &result);
@@ -198,6 +499,10 @@ int main(int argc, const char * argv[]) {
     }
 
 finish:
+    if (parser_options.profile) {
+        parser_profile_report();
+    }
+    
     ct_autorelease();
     return res;
 }
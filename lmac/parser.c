@@ -17,6 +17,9 @@
 #include <limits.h>
 #include <ctype.h>
 #include <stdarg.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 bool parse_declaration(Context *ctx, ASTDeclaration **result);
 
@@ -27,79 +30,163 @@ bool parse_stmt_compound(Context *ctx, ASTBlock **result);
 
 bool parse_expression(Context *ctx, ASTExpression **result);
 bool parse_expr_primary(Context *ctx, ASTExpression **result);
-bool parse_expr_postfix(Context *ctx, ASTExpression **result);
-bool parse_expr_unary(Context *ctx, ASTExpression **result);
-bool parse_expr_cast(Context *ctx, ASTExpression **result);
-bool parse_expr_multiplicative(Context *ctx, ASTExpression **result);
-bool parse_expr_additive(Context *ctx, ASTExpression **result);
-bool parse_expr_shift(Context *ctx, ASTExpression **result);
-bool parse_expr_relational(Context *ctx, ASTExpression **result);
-bool parse_expr_equality(Context *ctx, ASTExpression **result);
-bool parse_expr_and(Context *ctx, ASTExpression **result);
-bool parse_expr_exclusive_or(Context *ctx, ASTExpression **result);
-bool parse_expr_inclusive_or(Context *ctx, ASTExpression **result);
-bool parse_expr_logical_and(Context *ctx, ASTExpression **result);
-bool parse_expr_logical_or(Context *ctx, ASTExpression **result);
-bool parse_expr_conditional(Context *ctx, ASTExpression **result);
-bool parse_expr_assignment(Context *ctx, ASTExpression **result);
 
 bool parse_pp_directive(Context *ctx, ASTPPDirective **result);
 
 bool parse_type_expression(Context *ctx, ASTTypeExpression **result);
+bool parse_type_expression_unmemoized(Context *ctx, ASTTypeExpression **result);
 bool parse_type_constant(Context *ctx, ASTTypeConstant **result);
 bool parse_type_name(Context *ctx, ASTTypeName **result);
 
 
+ParserOptions parser_options = {
+    .memoize = true,
+};
+
+#pragma mark Backtracking Profile
+
+// NOTE(bloggins): With ParserOptions.profile, snapshots and restores are
+// counted against the rule that takes them, along with what each restore
+// threw away: the bytes the attempt got through, the tokens lexed for it and
+// the nodes it made. An attempt inside one that's thrown away counts
+// against both rules.
+
+#define PARSE_PROFILE_MAX_RULES 64
+
+typedef struct {
+    /* The rule's __func__ */
+    const char *rule;
+    
+    size_t tries;
+    size_t restores;
+    size_t bytes;
+    size_t tokens;
+    size_t nodes;
+} ParseProfileRule;
+
+typedef struct {
+    size_t count;
+    ParseProfileRule rules[PARSE_PROFILE_MAX_RULES];
+} ParseProfile;
+
+/* Threads count their own and add them to the total when they're done */
+global_variable _Thread_local ParseProfile g_parse_profile;
+global_variable ParseProfile g_parse_profile_total;
+global_variable pthread_mutex_t g_parse_profile_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static ParseProfileRule *parse_profile_rule(ParseProfile *profile, const char *rule) {
+    for (size_t idx = 0; idx < profile->count; idx++) {
+        if (profile->rules[idx].rule == rule) {
+            return &profile->rules[idx];
+        }
+    }
+    
+    assert(profile->count < PARSE_PROFILE_MAX_RULES && "too many rules to profile");
+    ParseProfileRule *r = &profile->rules[profile->count++];
+    r->rule = rule;
+    return r;
+}
+
+static void parse_profile_flush() {
+    pthread_mutex_lock(&g_parse_profile_lock);
+    for (size_t idx = 0; idx < g_parse_profile.count; idx++) {
+        ParseProfileRule *from = &g_parse_profile.rules[idx];
+        ParseProfileRule *to = parse_profile_rule(&g_parse_profile_total, from->rule);
+        to->tries += from->tries;
+        to->restores += from->restores;
+        to->bytes += from->bytes;
+        to->tokens += from->tokens;
+        to->nodes += from->nodes;
+    }
+    pthread_mutex_unlock(&g_parse_profile_lock);
+    
+    memset(&g_parse_profile, 0, sizeof(ParseProfile));
+}
+
+static int parse_profile_compare(const void *a, const void *b) {
+    const ParseProfileRule *r1 = a;
+    const ParseProfileRule *r2 = b;
+    if (r1->bytes != r2->bytes) {
+        return r1->bytes > r2->bytes ? -1 : 1;
+    }
+    
+    if (r1->tokens != r2->tokens) {
+        return r1->tokens > r2->tokens ? -1 : 1;
+    }
+    
+    return r1->nodes > r2->nodes ? -1 : (r1->nodes < r2->nodes);
+}
+
+void parser_profile_report() {
+    parse_profile_flush();
+    
+    ParseProfile *profile = &g_parse_profile_total;
+    qsort(profile->rules, profile->count, sizeof(ParseProfileRule), parse_profile_compare);
+    
+    size_t restores = 0;
+    fprintf(stderr, "\nparse profile: what restores threw away\n\n");
+    fprintf(stderr, "%10s %10s %10s %10s %10s  %s\n",
+            "tries", "restores", "bytes", "tokens", "nodes", "rule");
+    for (size_t idx = 0; idx < profile->count; idx++) {
+        ParseProfileRule *r = &profile->rules[idx];
+        fprintf(stderr, "%10zu %10zu %10zu %10zu %10zu  %s\n",
+                r->tries, r->restores, r->bytes, r->tokens, r->nodes, r->rule);
+        restores += r->restores;
+    }
+    
+    fprintf(stderr, "\n%zu restores in all, %zu tokens lexed\n", restores, lexer_token_count());
+}
+
 #pragma mark Parse Utility Functions
 
 #define IS_TOKEN_NONE(t) ((t).kind == TOK_NONE)
 
-Context snapshot(Context *ctx) {
+Context parse_snapshot(Context *ctx, const char *rule) {
     Context saved = *ctx;
     
+    if (parser_options.profile) {
+        parse_profile_rule(&g_parse_profile, rule)->tries++;
+        saved.profile_mark.tokens = lexer_thread_token_count();
+        saved.profile_mark.nodes = ast_created_count();
+    }
+    
     return saved;
 }
 
-void restore(Context *ctx, Context snapshot) {
+void parse_restore(Context *ctx, Context snapshot, const char *rule) {
+    if (parser_options.profile) {
+        ParseProfileRule *r = parse_profile_rule(&g_parse_profile, rule);
+        r->restores++;
+        r->bytes += ctx->pos > snapshot.pos ? ctx->pos - snapshot.pos : 0;
+        r->tokens += lexer_thread_token_count() - snapshot.profile_mark.tokens;
+        r->nodes += ast_created_count() - snapshot.profile_mark.nodes;
+    }
+    
     *ctx = snapshot;
 }
 
+#define snapshot(ctx)       parse_snapshot((ctx), __func__)
+#define restore(ctx, s)     parse_restore((ctx), (s), __func__)
+
 SourceLocation parsed_source_location(Context *ctx, Context snapshot) {
-    SourceLocation sl = {0};
-    sl.file = ctx->file;
-    sl.line = snapshot.line;
-    sl.ctx = ctx;
-    sl.range_start = snapshot.pos;
-    sl.range_end = ctx->pos;
+    return source_location_range(context_offset(ctx, snapshot.pos),
+                                 context_offset(ctx, ctx->pos));
+}
+
+static Token known_token(Token t) {
+    if (t.kind == TOK_UNKOWN) {
+        diag_emit(DIAG_FATAL, ERR_LEX, NULL, "unknown token '%s'", spelling_cstring(t.location.spelling));
+    }
     
-    return sl;
+    return t;
 }
 
 Token next_token(Context *ctx) {
-    // TODO(bloggins): figure out how to incorporate comments and ws in generated
-    // code
-    for (;;) {
-        Token t = lexer_next_token(ctx);
-        if (t.kind == TOK_WS || t.kind == TOK_COMMENT) {
-            continue;
-        }
-        
-        if (t.kind == TOK_UNKOWN) {
-            diag_emit(DIAG_FATAL, ERR_LEX, NULL, "unknown token '%s'", spelling_cstring(t.location.spelling));
-        }
-        
-        return t;
-    }
+    return known_token(lexer_take_token(ctx));
 }
 
 Token peek_token(Context *ctx) {
-    // TODO(bloggins): This is probably expensive
-    Context s = snapshot(ctx);
-    
-    Token t = next_token(ctx);
-    
-    restore(ctx, s);
-    return t;
+    return known_token(lexer_peek_token(ctx, 0));
 }
 
 Token accept_token(Context *ctx, TokenKind kind) {
@@ -163,6 +250,124 @@ ASTBase *expect_node(Context *ctx, ParseFn parser, const char *msg_fmt, ...) {
     return node;
 }
 
+#pragma mark Memoization
+
+// NOTE(bloggins): A packrat parser memoizes every rule. We only memoize the
+// rules alternatives start with, since those are the ones that get parsed
+// again after a backtrack. A rule is only safe to memoize if it doesn't
+// change anything but the position (no scopes, no declarations).
+
+typedef enum {
+    PARSE_RULE_NONE,
+    PARSE_RULE_TYPE_EXPRESSION,
+} ParseRule;
+
+typedef struct {
+    /* SOURCE_OFFSET_NONE if the slot is empty */
+    SourceOffset offset;
+    ParseRule rule;
+    
+    bool matched;
+    uint8_t *end;
+    ASTBase *node;
+} ParseMemoEntry;
+
+typedef struct ParseMemo {
+    size_t count;
+    size_t capacity;
+    ParseMemoEntry *entries;
+} ParseMemo;
+
+/* Counted per thread. Threads add theirs to the totals when they're done */
+global_variable _Thread_local size_t g_parse_memo_hits;
+global_variable _Thread_local size_t g_parse_memo_misses;
+global_variable _Atomic size_t g_parse_memo_total_hits;
+global_variable _Atomic size_t g_parse_memo_total_misses;
+
+static ParseMemoEntry *parse_memo_slot(ParseMemo *memo, ParseRule rule, SourceOffset offset) {
+    size_t mask = memo->capacity - 1;
+    size_t idx = ((size_t)offset * 0x9E3779B1u + rule) & mask;
+    while (true) {
+        ParseMemoEntry *entry = &memo->entries[idx];
+        if (entry->offset == SOURCE_OFFSET_NONE ||
+            (entry->offset == offset && entry->rule == rule)) {
+            return entry;
+        }
+        
+        idx = (idx + 1) & mask;
+    }
+}
+
+static void parse_memo_grow(ParseMemo *memo) {
+    ParseMemoEntry *old = memo->entries;
+    size_t old_capacity = memo->capacity;
+    
+    memo->capacity = old_capacity ? old_capacity * 2 : 256;
+    memo->entries = calloc(memo->capacity, sizeof(ParseMemoEntry));
+    for (size_t idx = 0; idx < old_capacity; idx++) {
+        if (old[idx].offset != SOURCE_OFFSET_NONE) {
+            *parse_memo_slot(memo, old[idx].rule, old[idx].offset) = old[idx];
+        }
+    }
+    
+    free(old);
+}
+
+/* Parses rule at the current position, or replays what it did the last time
+ * it was parsed here. If remember is false, a parse that wasn't already
+ * memoized isn't memoized now
+ */
+bool parse_memoized(Context *ctx, ParseRule rule, ParseFn parser, ASTBase **result,
+                    bool remember) {
+    ParseMemo *memo = ctx->parse_memo;
+    if (memo == NULL || result == NULL) {
+        // Nothing to replay without the node
+        return parser(ctx, result);
+    }
+    
+    // Alternatives don't always start at the same whitespace (a failed
+    // accept_token leaves us at the token it put back), so the key is past
+    // it. A comment in the way just costs a miss
+    while (isspace(*ctx->pos)) {
+        ctx->pos++;
+    }
+    
+    SourceOffset offset = context_offset(ctx, ctx->pos);
+    ParseMemoEntry *entry = parse_memo_slot(memo, rule, offset);
+    if (entry->offset != SOURCE_OFFSET_NONE) {
+        g_parse_memo_hits++;
+        if (!entry->matched) {
+            return false;
+        }
+        
+        ctx->pos = entry->end;
+        *result = entry->node;
+        return true;
+    }
+    
+    if (!remember) {
+        return parser(ctx, result);
+    }
+    
+    g_parse_memo_misses++;
+    bool matched = parser(ctx, result);
+    
+    // The parse may have memoized other things and moved the table
+    if ((memo->count + 1) * 2 > memo->capacity) {
+        parse_memo_grow(memo);
+    }
+    
+    entry = parse_memo_slot(memo, rule, offset);
+    entry->offset = offset;
+    entry->rule = rule;
+    entry->matched = matched;
+    entry->end = ctx->pos;
+    entry->node = matched ? *result : NULL;
+    memo->count++;
+    
+    return matched;
+}
+
 //
 // Parse routines
 //
@@ -175,7 +380,6 @@ bool parse_ident(Context *ctx, ASTIdent **result) {
     Token t = accept_token(ctx, TOK_IDENT);
     if (IS_TOKEN_NONE(t)) { goto fail_parse; }
     
-    assert(t.location.ctx);
     act_on_ident(t.location, result);
     return true;
     
@@ -188,454 +392,372 @@ fail_parse:
 /* ====== Expressions ====== */
 #pragma mark Expressions
 
-bool parse_next_expr_binary(Context *ctx, TokenKind allowed_ops[],
-    bool (*parse_expr_right)(Context *ctx, ASTExpression **right),
-                            ASTExpression **result) {
-    assert(result && "must pass a valid result pointer");
-    
-    Token t = peek_token(ctx);
-    if (!token_is_of_kind(t, allowed_ops)) {
-        return false;
-    }
-    
-    // Assume we have a binary expression
-    next_token(ctx);  // gobble gobble
-    
-    ASTExpression *left = *result;
-    ASTExpression *right = (ASTExpression*)expect_node(ctx, (ParseFn)parse_expr_right,
-                                       "expected expression");
-    
-    act_on_expr_binary(t.location, left, right, t, (ASTExprBinary**)result);
-    return true;
-}
+/* How tightly each binary operator binds, from tokens.def.h. 0 if the token
+ * isn't a binary operator */
+global_variable const uint8_t g_binding_power[] = {
+#   define TOKEN(kind, name, ...) [kind] = __VA_ARGS__ + 0,
+#   include "tokens.def.h"
+};
 
 /*
  expression
 	: assignment_expression
 	| expression ',' assignment_expression
- */
-bool parse_expression(Context *ctx, ASTExpression **result) {
-    return parse_expr_assignment(ctx, result);
-}
-
-/*
+ 
  assignment_expression
 	: conditional_expression
 	| unary_expression assignment_operator assignment_expression
+ 
+ conditional_expression
+	: logical_or_expression
+	| logical_or_expression '?' expression ':' conditional_expression
+ 
+ logical_or_expression ... multiplicative_expression
+	: cast_expression
+	| binary_expression <binary operator> binary_expression
+ 
+ cast_expression
+	: unary_expression
+	| '(' type_expression ')' cast_expression
+ 
+ unary_expression
+     : postfix_expression
+     | TOK_INC unary_expression
+     | TOK_DEC unary_expression
+     | unary_operator cast_expression
+     | TOK_KW_SIZEOF unary_expression
+     | TOK_KW_SIZEOF '(' type_name ')'
+     | TOK_KW_ALIGNOF '(' type_name ')'
+ 
+ postfix_expression
+     :primary_expression
+     | postfix_expression '[' expression ']'
+     | postfix_expression '(' ')'
+     | postfix_expression '(' argument_expression_list ')'
+     | postfix_expression '.' TOK_IDENT
+     | postfix_expression TOK_PTR TOK_IDENT
+     | postfix_expression TOK_INC
+     | postfix_expression TOK_DEC
+     | '(' type_name ')' '{' initializer_list '}'
+     | '(' type_name ')' '{' initializer_list ',' '}'
+ *
+ * NOTE(bloggins): Everything from here down to the primary expressions is
+ * one loop over a stack of what's still open (parens, calls, operators
+ * waiting on their right side), so nesting costs a frame on the heap
+ * instead of a dozen calls on the C stack. Every level of the C grammar from
+ * logical or down to multiplicative is the same rule with different
+ * operators: an operator takes its right side once the next operator binds
+ * no tighter than it does.
  */
-bool parse_expr_assignment(Context *ctx, ASTExpression **result) {
-    Context s = snapshot(ctx);
+
+typedef enum {
+    /* The expression parse_expression was asked for */
+    EXPR_FRAME_EXPRESSION,
     
-    // TODO(bloggins): This isn't exactly right, but parse_expr_conditional
-    // includes parsing a unitary expression so what we should really be doing
-    // is checking for something like is_unary and only proceeding further below
-    // if that's indeed the case. Otherwise, we're going to have to do the checking
-    // farther up in the semantic analyzer and test whether what we just parsed
-    // is a valid lvalue
-    ASTExpression *left = NULL;
-    if (!parse_expr_conditional(ctx, &left)) { return false; }
+    /* '(' expression ')' */
+    EXPR_FRAME_PAREN,
     
-    Token t = accept_token(ctx, TOK_EQUALS);
-    if (IS_TOKEN_NONE(t)) {
-        if (result != NULL) {
-            *result = left;
-        }
-        return true;
-    }
+    /* postfix_expression '(' argument_expression_list ')' */
+    EXPR_FRAME_CALL,
     
-    // We have an equals so we must be an assignment expression. Keep going
-    ASTExpression *right = (ASTExpression*)expect_node(ctx, (ParseFn)parse_expr_assignment, "expected expression after assignment");
-    act_on_expr_binary(parsed_source_location(ctx, s), left, right, t, (ASTExprBinary**)result);
+    /* unary_expression '=' assignment_expression */
+    EXPR_FRAME_ASSIGNMENT,
     
-    return true;
+    /* binary_expression <binary operator> binary_expression */
+    EXPR_FRAME_BINARY,
     
-}
-
-/*
- conditional_expression
-	: logical_or_expression
-	| logical_or_expression '?' expression ':' conditional_expression
- */
-bool parse_expr_conditional(Context *ctx, ASTExpression **result) {
-    return parse_expr_logical_or(ctx, result);
-}
+    /* '(' type_expression ')' cast_expression */
+    EXPR_FRAME_CAST,
+} ExprFrameKind;
 
-/*
- logical_or_expression
-	: logical_and_expression
-	| logical_or_expression TOK_PIPE_PIPE logical_and_expression
- */
-bool parse_expr_logical_or(Context *ctx, ASTExpression **result) {
-    if (!parse_expr_logical_and(ctx, result)) {
-        return false;
-    }
+typedef struct {
+    ExprFrameKind kind;
+    uint8_t binding_power;
     
-    TokenKind ops[] = {TOK_PIPE_PIPE, TOK_LAST};
-    while (parse_next_expr_binary(ctx, ops, parse_expr_logical_and, result)) {
-        // Keep going
-    }
+    /* The operator, or the call's '(' */
+    Token token;
     
-    return true;
-}
-
-/*
- logical_and_expression
-	: inclusive_or_expression
-	| logical_and_expression TOK_AMP_AMP inclusive_or_expression
- */
-bool parse_expr_logical_and(Context *ctx, ASTExpression **result) {
-    if (!parse_expr_inclusive_or(ctx, result)) {
-        return false;
-    }
+    /* The left side, the callable, or the parenthesized type */
+    ASTExpression *left;
+    List *args;
     
-    TokenKind ops[] = {TOK_AMP_AMP, TOK_LAST};
-    while (parse_next_expr_binary(ctx, ops, parse_expr_inclusive_or, result)) {
-        // Keep going
-    }
+    /* Where the frame's node starts (assignments, casts) */
+    uint8_t *start;
     
-    return true;
-}
+    /* Where the assignment_expression inside started */
+    uint8_t *inner_start;
+} ExprFrame;
 
-/*
- inclusive_or_expression
-	: exclusive_or_expression
-	| inclusive_or_expression TOK_PIPE exclusive_or_expression
- */
-bool parse_expr_inclusive_or(Context *ctx, ASTExpression **result) {
-    if (!parse_expr_exclusive_or(ctx, result)) {
-        return false;
-    }
-    
-    TokenKind ops[] = {TOK_PIPE, TOK_LAST};
-    while (parse_next_expr_binary(ctx, ops, parse_expr_exclusive_or, result)) {
-        // Keep going
+/* Shallow expressions don't touch the heap */
+#define EXPR_STACK_INLINE_SIZE  16
+
+typedef struct {
+    ExprFrame *frames;
+    size_t count;
+    size_t capacity;
+    ExprFrame inline_frames[EXPR_STACK_INLINE_SIZE];
+} ExprStack;
+
+/* The frame it returns is only good until the next push */
+static ExprFrame *expr_stack_push(ExprStack *stack, ExprFrameKind kind) {
+    if (stack->count == stack->capacity) {
+        stack->capacity *= 2;
+        if (stack->frames == stack->inline_frames) {
+            stack->frames = malloc(stack->capacity * sizeof(ExprFrame));
+            memcpy(stack->frames, stack->inline_frames, sizeof(stack->inline_frames));
+        } else {
+            stack->frames = realloc(stack->frames, stack->capacity * sizeof(ExprFrame));
+        }
     }
     
-    return true;
+    ExprFrame *frame = &stack->frames[stack->count++];
+    memset(frame, 0, sizeof(ExprFrame));
+    frame->kind = kind;
+    return frame;
 }
 
-/*
- exclusive_or_expression
-	: and_expression
-	| exclusive_or_expression TOK_CARET and_expression
- */
-bool parse_expr_exclusive_or(Context *ctx, ASTExpression **result) {
-    if (!parse_expr_and(ctx, result)) {
-        return false;
-    }
-    
-    TokenKind ops[] = {TOK_CARET, TOK_LAST};
-    while (parse_next_expr_binary(ctx, ops, parse_expr_and, result)) {
-        // Keep going
-    }
-    
-    return true;
+static bool expr_is_type_paren(ASTExpression *expr) {
+    return AST_IS(expr, AST_EXPR_PAREN) &&
+           ast_node_is_type_expression(AST_BASE(((ASTExprParen*)expr)->inner));
 }
 
-/*
- and_expression
-	: equality_expression
-	| and_expression TOK_AMP equality_expression
- */
-bool parse_expr_and(Context *ctx, ASTExpression **result) {
-    if (!parse_expr_equality(ctx, result)) {
-        return false;
-    }
+bool parse_expression(Context *ctx, ASTExpression **result) {
+    assert(result && "must pass a valid result pointer");
     
-    TokenKind ops[] = {TOK_AMP, TOK_LAST};
-    while (parse_next_expr_binary(ctx, ops, parse_expr_equality, result)) {
-        // Keep going
-    }
+    ExprStack stack = {};
+    stack.frames = stack.inline_frames;
+    stack.capacity = EXPR_STACK_INLINE_SIZE;
+    expr_stack_push(&stack, EXPR_FRAME_EXPRESSION)->inner_start = ctx->pos;
     
-    return true;
-}
-
-/*
- equality_expression
-	: relational_expression
-	| equality_expression TOK_EQUALS_EQUALS relational_expression
-	| equality_expression TOK_BANG_EQUALS relational_expression
- */
-bool parse_expr_equality(Context *ctx, ASTExpression **result) {
-    if (!parse_expr_relational(ctx, result)) {
-        return false;
+    bool matched = true;
+    ASTExpression *expr = NULL;
+    ExprFrame *top = NULL;
+    Token t = TOKEN_NONE;
+    uint8_t binding_power = 0;
+    
+operand:
+    // A unary expression, or the right side of whatever's on top
+    if (parse_expr_primary(ctx, &expr)) {
+        goto postfix;
+    }
+    
+    if (peek_token(ctx).kind == TOK_LPAREN) {
+        next_token(ctx);
+        expr_stack_push(&stack, EXPR_FRAME_PAREN)->inner_start = ctx->pos;
+        goto operand;
+    }
+    
+    top = &stack.frames[stack.count - 1];
+    switch (top->kind) {
+        case EXPR_FRAME_EXPRESSION:
+            matched = false;
+            goto finish;
+        case EXPR_FRAME_PAREN: {
+            SourceLocation sl = parsed_source_location(ctx, *ctx);
+            diag_emit(DIAG_ERROR, ERR_PARSE, &sl, "expected expression");
+            expr = NULL;
+            goto complete;
+        }
+        case EXPR_FRAME_CALL:
+            goto call;
+        case EXPR_FRAME_ASSIGNMENT: {
+            SourceLocation sl = parsed_source_location(ctx, *ctx);
+            diag_emit(DIAG_ERROR, ERR_PARSE, &sl, "expected expression after assignment");
+            expr = NULL;
+            goto assignment;
+        }
+        case EXPR_FRAME_BINARY: {
+            SourceLocation sl = parsed_source_location(ctx, *ctx);
+            diag_emit(DIAG_ERROR, ERR_PARSE, &sl, "expected expression");
+            act_on_expr_binary(top->token.location, top->left, NULL, top->token, (ASTExprBinary**)&expr);
+            stack.count--;
+            goto binary;
+        }
+        case EXPR_FRAME_CAST:
+            // Looks like it was just a regular parens expression
+            expr = top->left;
+            stack.count--;
+            goto cast;
     }
     
-    TokenKind ops[] = {TOK_EQUALS_EQUALS, TOK_BANG_EQUALS, TOK_LAST};
-    while (parse_next_expr_binary(ctx, ops, parse_expr_relational, result)) {
-        // Keep going
+postfix:
+    // TODO(bloggins): This is a hack to prevent casts from looking
+    // like function calls. If the expression on the left is a type
+    // expression, then don't treat it as indexable or callable or whatever.
+    //
+    // In the future, I'd like to do the opposite. I want to treat the TYPE
+    // as callable, indexible, etc. and implement casts that way. That also
+    // allows for overloadable casting in a cool way.
+    if (expr_is_type_paren(expr)) {
+        // If we got here we have what looks like a cast. So we should figure
+        // out if we have an expression after it. That will tell us for sure
+        top = expr_stack_push(&stack, EXPR_FRAME_CAST);
+        top->left = expr;
+        top->start = ctx->pos;
+        goto operand;
+    }
+    
+    t = peek_token(ctx);
+    if (t.kind == TOK_LPAREN) {
+        // Assume we have a callable
+        next_token(ctx);  // gobble gobble
+        
+        top = expr_stack_push(&stack, EXPR_FRAME_CALL);
+        top->token = t;
+        top->left = expr;
+        top->inner_start = ctx->pos;
+        goto operand;
+    }
+    
+cast:
+    for (top = &stack.frames[stack.count - 1]; top->kind == EXPR_FRAME_CAST; top--, stack.count--) {
+        ASTTypeExpression *type_expr = (ASTTypeExpression*)((ASTExprParen*)top->left)->inner;
+        SourceLocation sl = source_location_range(context_offset(ctx, top->start),
+                                                  context_offset(ctx, ctx->pos));
+        act_on_expr_cast(sl, type_expr, expr, (ASTExprCast**)&expr);
+    }
+    
+binary:
+    t = peek_token(ctx);
+    binding_power = g_binding_power[t.kind];
+    for (top = &stack.frames[stack.count - 1]; top->kind == EXPR_FRAME_BINARY; top--, stack.count--) {
+        if (binding_power > top->binding_power) {
+            break;
+        }
+        
+        act_on_expr_binary(top->token.location, top->left, expr, top->token, (ASTExprBinary**)&expr);
     }
     
-    return true;
-}
-
-/*
- relational_expression
-	: shift_expression
-	| relational_expression TOK_LANGLE shift_expression
-	| relational_expression TOK_RANGLE shift_expression
-	| relational_expression TOK_LANGLE_EQUALS shift_expression
-	| relational_expression TOK_RANGLE_EQUALS shift_expression
- */
-bool parse_expr_relational(Context *ctx, ASTExpression **result) {
-    if (!parse_expr_shift(ctx, result)) {
-        return false;
+    if (binding_power != 0) {
+        next_token(ctx);
+        
+        top = expr_stack_push(&stack, EXPR_FRAME_BINARY);
+        top->binding_power = binding_power;
+        top->token = t;
+        top->left = expr;
+        goto operand;
     }
     
-    TokenKind ops[] = {TOK_LANGLE, TOK_RANGLE, TOK_LANGLE_EQUALS,
-        TOK_RANGLE_EQUALS, TOK_LAST};
-    while (parse_next_expr_binary(ctx, ops, parse_expr_shift, result)) {
-        // Keep going
+    // TODO(bloggins): This isn't exactly right, the left side of an assignment
+    // should be a unary expression. Otherwise, we're going to have to do the
+    // checking farther up in the semantic analyzer and test whether what we
+    // just parsed is a valid lvalue
+    t = accept_token(ctx, TOK_EQUALS);
+    if (!IS_TOKEN_NONE(t)) {
+        uint8_t *start = top->inner_start;
+        
+        top = expr_stack_push(&stack, EXPR_FRAME_ASSIGNMENT);
+        top->token = t;
+        top->left = expr;
+        top->start = start;
+        top->inner_start = ctx->pos;
+        goto operand;
+    }
+    
+assignment:
+    for (top = &stack.frames[stack.count - 1]; top->kind == EXPR_FRAME_ASSIGNMENT; top--, stack.count--) {
+        SourceLocation sl = source_location_range(context_offset(ctx, top->start),
+                                                  context_offset(ctx, ctx->pos));
+        act_on_expr_binary(sl, top->left, expr, top->token, (ASTExprBinary**)&expr);
+    }
+    
+complete:
+    // expr is a whole assignment_expression
+    top = &stack.frames[stack.count - 1];
+    switch (top->kind) {
+        case EXPR_FRAME_EXPRESSION:
+            *result = expr;
+            goto finish;
+        case EXPR_FRAME_PAREN:
+            t = expect_token(ctx, TOK_RPAREN);
+            act_on_expr_paren(t.location, expr, (ASTExprParen**)&expr);
+            stack.count--;
+            goto postfix;
+        case EXPR_FRAME_CALL:
+            list_append(&top->args, expr);
+            if (!IS_TOKEN_NONE(accept_token(ctx, TOK_COMMA))) {
+                top->inner_start = ctx->pos;
+                goto operand;
+            }
+            goto call;
+        default:
+            assert(false && "operators should all have their right sides");
     }
     
-    return true;
-}
-
-/*
- shift_expression
-	: additive_expression
-	| shift_expression TOK_2LANGLE additive_expression
-	| shift_expression TOK_2RANGLE additive_expression
- */
-bool parse_expr_shift(Context *ctx, ASTExpression **result) {
-    if (!parse_expr_additive(ctx, result)) {
-        return false;
-    }
+call:
+    expect_token(ctx, TOK_RPAREN);
+    
+    top = &stack.frames[stack.count - 1];
+    act_on_expr_call(top->token.location, top->left, top->args, (ASTExprCall**)&expr);
+    stack.count--;
+    goto postfix;
     
-    TokenKind ops[] = {TOK_2LANGLE, TOK_2RANGLE, TOK_LAST};
-    while (parse_next_expr_binary(ctx, ops, parse_expr_additive, result)) {
-        // Keep going
+finish:
+    if (stack.frames != stack.inline_frames) {
+        free(stack.frames);
     }
     
-    return true;
+    return matched;
 }
 
-/*
- additive_expression
-	: multiplicative_expression
-	| additive_expression '+' multiplicative_expression
-	| additive_expression '-' multiplicative_expression
- */
-bool parse_expr_additive(Context *ctx, ASTExpression **result) {
-    // TODO(bloggins): extract this into parse_expr_binary(ctx, [valid_operator_kinds], result)
-    if (!parse_expr_multiplicative(ctx, result)) {
-        return false;
-    }
+bool parse_expr_string(Context *ctx, ASTExprString **result) {
+    Context s = snapshot(ctx);
+    
+    // TODO(bloggins): Handle escapes
+    if (IS_TOKEN_NONE(accept_token(ctx, TOK_DOUBLE_QUOTE))) { goto fail_parse; }
     
-    TokenKind ops[] = {TOK_PLUS, TOK_MINUS, TOK_LAST};
-    while (parse_next_expr_binary(ctx, ops, parse_expr_multiplicative, result)) {
-        // Keep going
+    uint8_t *range_start = ctx->pos;
+    while ((char)*(ctx->pos++) != '"') {
+        if ((char)*(ctx->pos) == '\n') {
+            SourceLocation sl = parsed_source_location(ctx, s);
+            diag_emit(DIAG_ERROR, ERR_PARSE, &sl, "unterminated string constant");
+        }
     }
+    uint8_t *range_end = ctx->pos;
     
+    SourceLocation sl = source_location_range(context_offset(ctx, range_start),
+                                              context_offset(ctx, range_end - 1));
+    act_on_expr_string(sl, result);
     return true;
+    
+fail_parse:
+    restore(ctx, s);
+    return false;
 }
 
-/*
- multiplicative_expression
-	: cast_expression
-	| multiplicative_expression '*' cast_expression
-	| multiplicative_expression '/' cast_expression
-	| multiplicative_expression '%' cast_expression
+/* primary_expression: 
+ type_expression
+ | TOK_IDENT
+ | constant 
+ | string
+ | '(' type_expression ')' | '(' expression ')' 
+ | generic_selection
+ | preprocessor expression
  */
-bool parse_expr_multiplicative(Context *ctx, ASTExpression **result) {
-    if (!parse_expr_cast(ctx, result)) {
-        return NULL;
-    }
+bool parse_expr_primary(Context *ctx, ASTExpression **result) {
+    Context s = snapshot(ctx);
     
-    TokenKind ops[] = {TOK_STAR, TOK_FORWARDSLASH, TOK_PERCENT, TOK_LAST};
-    while (parse_next_expr_binary(ctx, ops, parse_expr_cast, result)) {
-        // Keep going
+    // TODO(bloggins): Break these out
+    // At the start of a statement, the declaration that wasn't already
+    // tried for a type here. Operands further in never were, and aren't worth
+    // remembering
+    if (parse_memoized(ctx, PARSE_RULE_TYPE_EXPRESSION, (ParseFn)parse_type_expression_unmemoized,
+                       (ASTBase**)result, false)) {
+        return true;
     }
     
-    return true;
-}
-
-/*
- cast_expression
-	: unary_expression
-	| '(' type_expression ')' cast_expression
- *
- * NOTE(bloggins): We have to do a little more work because type expressions
- * look like ordinary expressions structurally.
- */
-bool parse_expr_cast(Context *ctx, ASTExpression **result) {
-    if (!parse_expr_unary(ctx, result)) {
-        return NULL;
-    }
-
-    // We can't make any parse decisions without the actual result.
-    // (note that this shows a dependency on parse context that we probably
-    // want to fix if we can)
-    if (result == NULL) {
-        SourceLocation sl = parsed_source_location(ctx, *ctx);
-        diag_emit(DIAG_FATAL, ERR_PARSE, &sl,
-                    "parse_expr_cast currently cannot parse correctly "
-                    "without AST construction");
-    }
-    
-    if (!AST_IS(*result, AST_EXPR_PAREN)) {
-        return true;
-    }
-    
-    ASTExprParen *paren = (ASTExprParen*)*result;
-    if (!ast_node_is_type_expression(AST_BASE(paren->inner))) {
-        // This is an ordinary non-type-expression
-        return true;
-    }
-    
-    // If we got here we have what looks like a cast. So we should figure out
-    // if we have an expression after it. That will tell us for sure
-    Context s = snapshot(ctx);
-    
-    ASTTypeExpression *type_expr = (ASTTypeExpression*)((ASTExprParen*)*result)->inner;
-    ASTExpression *next_expr = NULL;
-    if (!parse_expr_cast(ctx, &next_expr)) {
-        // Looks like it was just a regular parens expression
-        return true;
-    }
-    
-    act_on_expr_cast(parsed_source_location(ctx, s), type_expr, next_expr,
-                     (ASTExprCast**)result);
-    return true;
-}
-
-/*
- unary_expression
-     : postfix_expression
-     | TOK_INC unary_expression
-     | TOK_DEC unary_expression
-     | unary_operator cast_expression
-     | TOK_KW_SIZEOF unary_expression
-     | TOK_KW_SIZEOF '(' type_name ')'
-     | TOK_KW_ALIGNOF '(' type_name ')'
- */
-bool parse_expr_unary(Context *ctx, ASTExpression **result) {
-    return parse_expr_postfix(ctx, result);
-}
-
-/*
- postfix_expression
-     :primary_expression
-     | postfix_expression '[' expression ']'
-     | postfix_expression '(' ')'
-     | postfix_expression '(' argument_expression_list ')'
-     | postfix_expression '.' TOK_IDENT
-     | postfix_expression TOK_PTR TOK_IDENT
-     | postfix_expression TOK_INC
-     | postfix_expression TOK_DEC
-     | '(' type_name ')' '{' initializer_list '}'
-     | '(' type_name ')' '{' initializer_list ',' '}'
- */
-bool parse_expr_postfix(Context *ctx, ASTExpression **result) {
-    if (!parse_expr_primary(ctx, result)) {
-        return false;
-    }
-    
-    // TODO(bloggins): This is a hack to prevent casts from looking
-    // like function calls. If the expression on the left is a type
-    // expression, then don't treat it as indexable or callable or whatever.
-    //
-    // In the future, I'd like to do the opposite. I want to treat the TYPE
-    // as callable, indexible, etc. and implement casts that way. That also
-    // allows for overloadable casting in a cool way.
-    if (*result && AST_IS(*result, AST_EXPR_PAREN)) {
-        ASTExprParen *paren = (ASTExprParen*)*result;
-        if (ast_node_is_type_expression((ASTBase*)paren->inner)) {
-            return true;
-        }
-    }
-    
-    for (;;) {
-        Token t = peek_token(ctx);
-        if (t.kind == TOK_LPAREN) {
-            // Assume we have a callable
-            next_token(ctx);  // gobble gobble
-            
-            List *args = NULL;
-            for (;;) {
-                ASTExpression *expr = NULL;
-                if (!parse_expression(ctx, &expr)) {
-                    break;
-                }
-                
-                list_append(&args, expr);
-                
-                if (IS_TOKEN_NONE(accept_token(ctx, TOK_COMMA))) {
-                    break;
-                }
-            }
-            
-            expect_token(ctx, TOK_RPAREN);
-            
-            if (result != NULL) {
-                ASTExpression *callable = *result;
-                act_on_expr_call(t.location, callable, args, (ASTExprCall**)result);
-            }
-        } else {
-            break;
-        }
-    }
-    
-    return true;
-}
-
-bool parse_expr_string(Context *ctx, ASTExprString **result) {
-    Context s = snapshot(ctx);
-    
-    // TODO(bloggins): Handle escapes
-    if (IS_TOKEN_NONE(accept_token(ctx, TOK_DOUBLE_QUOTE))) { goto fail_parse; }
-    
-    uint8_t *range_start = ctx->pos;
-    while ((char)*(ctx->pos++) != '"') {
-        if ((char)*(ctx->pos) == '\n') {
-            SourceLocation sl = parsed_source_location(ctx, s);
-            diag_emit(DIAG_ERROR, ERR_PARSE, &sl, "unterminated string constant");
-        }
-    }
-    uint8_t *range_end = ctx->pos;
-    
-    SourceLocation sl = parsed_source_location(ctx, s);
-    sl.range_start = range_start;
-    sl.range_end = range_end - 1;
-    act_on_expr_string(sl, result);
-    return true;
-    
-fail_parse:
-    restore(ctx, s);
-    return false;
-}
-
-/* primary_expression: 
- type_expression
- | TOK_IDENT
- | constant 
- | string
- | '(' type_expression ')' | '(' expression ')' 
- | generic_selection
- | preprocessor expression
- */
-bool parse_expr_primary(Context *ctx, ASTExpression **result) {
-    Context s = snapshot(ctx);
-    
-    // TODO(bloggins): Break these out
-    if(parse_type_expression(ctx, (ASTTypeExpression**)result)) { return true; }
-    
     Token t = accept_token(ctx, TOK_IDENT);
     if (!IS_TOKEN_NONE(t)) {
-        assert(t.location.ctx);
         act_on_expr_ident(t.location, (ASTExprIdent**)result);
     } else if (!parse_expr_string(ctx, (ASTExprString**)result)) {
         t = accept_token(ctx, TOK_NUMBER);
         if (!IS_TOKEN_NONE(t)) {
-            int n = (int)strtol((char*)t.location.range_start, NULL, 10);
+            int n = (int)strtol((char*)context_pointer(ctx, t.location.start), NULL, 10);
             act_on_expr_number(t.location, n, (ASTExprNumber**)result);
         } else {
-            t = accept_token(ctx, TOK_LPAREN);
-            if (!IS_TOKEN_NONE(t)) {
-                ASTExpression *inner = (ASTExpression*)expect_node(ctx, (ParseFn)parse_expression, "expected expression");
-                t = expect_token(ctx, TOK_RPAREN);
-               
-                act_on_expr_paren(t.location, inner, (ASTExprParen**)result);
+            if (peek_token(ctx).kind == TOK_LPAREN) {
+                // parse_expression keeps parens on its own stack
+                goto fail_parse;
             } else {
                 if (!parse_type_expression(ctx, (ASTTypeExpression**)result)) {
                     // This is last because it's unlikely
@@ -674,7 +796,7 @@ fail_parse:
 // results in a type, then it would be allowed). For compile-time functions
 // that are guaranteed to terminate, look into "Total Functional Programming".
 
-bool parse_type_expression(Context *ctx, ASTTypeExpression **result) {
+bool parse_type_expression_unmemoized(Context *ctx, ASTTypeExpression **result) {
     if (!parse_type_constant(ctx, (ASTTypeConstant**)result) &&
         !parse_type_name(ctx, (ASTTypeName**)result)) {
         return false;
@@ -699,11 +821,24 @@ bool parse_type_expression(Context *ctx, ASTTypeExpression **result) {
     return true;
 }
 
+/* Every declaration starts with a type, and a function and a variable start
+ * the same way. So does a statement, which tries to be a declaration first */
+bool parse_type_expression(Context *ctx, ASTTypeExpression **result) {
+    return parse_memoized(ctx, PARSE_RULE_TYPE_EXPRESSION,
+                          (ParseFn)parse_type_expression_unmemoized, (ASTBase**)result, true);
+}
+
 bool parse_type_name(Context *ctx, ASTTypeName **result) {
     Context s = snapshot(ctx);
     
+    // Identifiers that were never declared as a type are turned away without
+    // looking through the scopes. That's nearly every identifier that starts
+    // a statement
+    Token t = next_token(ctx);
+    if (t.kind != TOK_IDENT || !(t.flags & TOKEN_FLAG_TYPE_NAME)) { goto fail_parse; }
+    
     ASTIdent *ident = NULL;
-    if (!parse_ident(ctx, &ident)) { goto fail_parse; }
+    act_on_ident(t.location, &ident);
     
     if (!ast_ident_is_type_name(ident)) { goto fail_parse; }
     
@@ -797,9 +932,9 @@ bool parse_type_constant(Context *ctx, ASTTypeConstant **result) {
         
         type_id |= ast_type_next_type_id();
         
-        SourceLocation sl = parsed_source_location(ctx, s);
         // Clean up the source location a bit so it starts right at the dollar sign
-        sl.range_start = tdollar.location.range_start;
+        SourceLocation sl = source_location_range(tdollar.location.start,
+                                                  context_offset(ctx, ctx->pos));
         
         if (bit_size > WORD_BIT) {
             diag_emit(DIAG_ERROR, ERR_PARSE, &sl, "invalid type size. %d is greater "
@@ -807,9 +942,9 @@ bool parse_type_constant(Context *ctx, ASTTypeConstant **result) {
         }
     }
     
-    SourceLocation sl = parsed_source_location(ctx, s);
     // Clean up the source location a bit so it starts right at the dollar sign
-    sl.range_start = tdollar.location.range_start;
+    SourceLocation sl = source_location_range(tdollar.location.start,
+                                              context_offset(ctx, ctx->pos));
 
     act_on_type_constant(sl, type_id, bit_flags, bit_size, result);
     return true;
@@ -918,7 +1053,9 @@ bool parse_decl_fn(Context *ctx, ASTDeclFunc **result) {
     
     /* Optional block to define the function */
     ASTBlock *block = NULL;
-    if (!parse_stmt_compound(ctx, &block)) {
+    SourceLocation lazy_body = {};
+    bool has_body = ctx->parse_mode.lazy_bodies && lexer_skip_block(ctx, &lazy_body);
+    if (!has_body && !parse_stmt_compound(ctx, &block)) {
         expect_token(ctx, TOK_SEMICOLON);
     } else {
         if (varargs_found) {
@@ -928,10 +1065,16 @@ bool parse_decl_fn(Context *ctx, ASTDeclFunc **result) {
         }
     }
     
+    Scope *params_scope = ctx->active_scope;
     context_scope_pop(ctx);
     act_on_decl_fn(parsed_source_location(ctx, s), ctx->active_scope,
                    type, name, params, varargs_found, block, result);
     
+    if (has_body) {
+        (*result)->lazy_body = lazy_body;
+        (*result)->lazy_scope = params_scope;
+    }
+    
     return true;
     
 fail_parse:
@@ -1076,23 +1219,79 @@ fail_parse:
     return false;
 }
 
+/* A block parse_stmt_compound hasn't found the end of */
+typedef struct {
+    uint8_t *start;
+    List *stmts;
+} BlockFrame;
+
+#define BLOCK_STACK_INLINE_SIZE 8
+
 bool parse_stmt_compound(Context *ctx, ASTBlock **result) {
     if (IS_TOKEN_NONE(accept_token(ctx, TOK_LBRACE))) { return false; }
     
-    Context s = snapshot(ctx);
-    List *stmts = NULL;
+    // NOTE(bloggins): A block right inside another one goes on a stack of
+    // the open ones instead of getting a call of its own, so blocks can nest
+    // as deep as there's memory for. Blocks under an if or a label still
+    // come through here again
+    BlockFrame inline_frames[BLOCK_STACK_INLINE_SIZE];
+    BlockFrame *frames = inline_frames;
+    size_t capacity = BLOCK_STACK_INLINE_SIZE;
+    size_t count = 0;
+    
+    ASTBlock *block = NULL;
+    ASTBase *stmt = NULL;
     
+open:
+    if (count == capacity) {
+        capacity *= 2;
+        if (frames == inline_frames) {
+            frames = malloc(capacity * sizeof(BlockFrame));
+            memcpy(frames, inline_frames, sizeof(inline_frames));
+        } else {
+            frames = realloc(frames, capacity * sizeof(BlockFrame));
+        }
+    }
+    
+    frames[count++] = (BlockFrame){ .start = ctx->pos };
     context_scope_push(ctx);
     
-    ASTBase *stmt = NULL;
-    while (parse_block_item(ctx, &stmt)) {
-        list_append(&stmts, stmt);
+items:
+    for (;;) {
+        if (peek_token(ctx).kind == TOK_LBRACE) {
+            next_token(ctx);
+            goto open;
+        }
+        
+        // Like at the top level, directives like #endif succeed without a node
+        stmt = NULL;
+        if (!parse_block_item(ctx, &stmt)) {
+            break;
+        }
+        
+        if (stmt != NULL) {
+            list_append(&frames[count - 1].stmts, stmt);
+        }
     }
     
     expect_token(ctx, TOK_RBRACE);
     
-    act_on_block(parsed_source_location(ctx, s), stmts, result);
+    BlockFrame *frame = &frames[--count];
+    SourceLocation sl = source_location_range(context_offset(ctx, frame->start),
+                                              context_offset(ctx, ctx->pos));
+    act_on_block(sl, frame->stmts, count > 0 ? &block : result);
     context_scope_pop(ctx);
+    
+    if (count > 0) {
+        stmt = (ASTBase*)block;
+        list_append(&frames[count - 1].stmts, stmt);
+        goto items;
+    }
+    
+    if (frames != inline_frames) {
+        free(frames);
+    }
+    
     return true;
 }
 
@@ -1150,13 +1349,17 @@ bool parse_end(Context *ctx) {
 bool parse_toplevel(Context *ctx, ASTTopLevel **result) {
     Context s = snapshot(ctx);
     List *stmts = NULL;
+    List *includes = NULL;
     
     Scope *scope = context_scope_push(ctx);
     
-    ASTBase *stmt = NULL;
-    while (parse_pp_directive(ctx, (ASTPPDirective**)&stmt) ||
-           parse_decl_external(ctx, (ASTDeclaration**)&stmt) ||
-           (ctx->parse_mode.allow_toplevel_expressions && parse_stmt_expression(ctx, (ASTStmtExpr**)&stmt))) {
+    // Directives like #endif succeed without a node, so stmt starts over
+    // each time around
+    for (ASTBase *stmt = NULL;
+         parse_pp_directive(ctx, (ASTPPDirective**)&stmt) ||
+         parse_decl_external(ctx, (ASTDeclaration**)&stmt) ||
+         (ctx->parse_mode.allow_toplevel_expressions && parse_stmt_expression(ctx, (ASTStmtExpr**)&stmt));
+         stmt = NULL) {
         // Not every successful parse contributes an AST node
         if (stmt == NULL) {
             continue;
@@ -1167,12 +1370,14 @@ bool parse_toplevel(Context *ctx, ASTTopLevel **result) {
             List_FOREACH(ASTBase *, node, ((ASTTopLevel*)stmt)->definitions, {
                 if (AST_IS(node, AST_STMT_DECL)) {
                     scope_declaration_add(scope, ((ASTStmtDecl*)node)->declaration);
-                } else {
+                } else if (node->kind > AST_DECL_BEGIN && node->kind < AST_DECL_END) {
                     scope_declaration_add(scope, (ASTDeclaration*)node);
                 }
             
                 list_append(&stmts, node);
             })
+            
+            list_append(&includes, stmt);
         } else {
             list_append(&stmts, stmt);
         }
@@ -1183,7 +1388,7 @@ bool parse_toplevel(Context *ctx, ASTTopLevel **result) {
         return false;
     }
     
-    act_on_toplevel(parsed_source_location(ctx, s), scope, stmts, result);
+    act_on_toplevel(parsed_source_location(ctx, s), scope, stmts, includes, result);
     
     // This is safe because there's yet another scope above this -
     // the compiler's builtins scope
@@ -1204,16 +1409,22 @@ bool parse_pp_pragma(Context *ctx, ASTPPPragma **result) {
     
     // This is a hack to make sure we only parse pragma directives on the line
     // the pragma was defined on.
-    uint32_t lineof_directive = ctx->line;
+    uint32_t lineof_directive = source_manager_line(context_offset(ctx, ctx->pos));
     
     // TODO(bloggins): This is not valid C syntax for pragma. We do this for
     // now until we have a more complete pre-processor.
     ASTIdent *arg1 = NULL;
-    if (!parse_ident(ctx, &arg1) || arg1->base.location.line != lineof_directive) {
+    if (!parse_ident(ctx, &arg1) || source_location_line(arg1->base.location) != lineof_directive) {
         SourceLocation sl = parsed_source_location(ctx, s);
         diag_emit(DIAG_ERROR, ERR_PARSE, &sl, "argument expected after pragma");
     }
     
+    if (spelling_streq(arg1->base.location.spelling, "once")) {
+        // Only means something to whoever included us
+        ctx->pragma_once = true;
+        return true;
+    }
+    
     if (!spelling_streq(arg1->base.location.spelling, "CLITE")) {
         SourceLocation sl = parsed_source_location(ctx, s);
         diag_emit(DIAG_ERROR, ERR_PARSE, &sl, "unsupported argument '%s' after pragma. Only 'CLITE' is supported",
@@ -1222,7 +1433,7 @@ bool parse_pp_pragma(Context *ctx, ASTPPPragma **result) {
     
     // This is the actual argument to be used for directives
     ASTIdent *arg2 = NULL;
-    if (!parse_ident(ctx, &arg2) || arg2->base.location.line != lineof_directive) {
+    if (!parse_ident(ctx, &arg2) || source_location_line(arg2->base.location) != lineof_directive) {
         SourceLocation sl = parsed_source_location(ctx, s);
         diag_emit(DIAG_ERROR, ERR_PARSE, &sl, "second argument expected after pragma");
     }
@@ -1257,7 +1468,7 @@ bool parse_pp_include(Context *ctx, ASTBase **result) {
             diag_emit(DIAG_ERROR, ERR_PARSE, &chunk.location, "syntax error after #include");
         }
         Spelling sp_chunk = chunk.location.spelling;
-        sp_chunk.end--; // Get rid of the '>'
+        sp_chunk.length--; // Get rid of the '>'
         include_file = strdup(spelling_cstring(sp_chunk));
         system_include = true;
     } else {
@@ -1294,14 +1505,78 @@ bool parse_pp_define(Context *ctx, ASTPPDefinition **result) {
     return true;
 }
 
+/* The condition of an #if or #elif, which for now is defined(X) or a number,
+ * maybe with a ! in front */
+static bool parse_pp_condition(Context *ctx) {
+    Context s = snapshot(ctx);
+    
+    //
+    // TODO(bloggins): just parse an expression and interpret it
+    //
+    
+    bool negate = !IS_TOKEN_NONE(accept_token(ctx, TOK_BANG));
+    bool holds = false;
+    
+    Token t = accept_token(ctx, TOK_NUMBER);
+    if (!IS_TOKEN_NONE(t)) {
+        holds = strtol((char*)context_pointer(ctx, t.location.start), NULL, 10) != 0;
+        return holds != negate;
+    }
+    
+    ASTIdent *kw = (ASTIdent*)expect_node(ctx, (ParseFn)parse_ident, "expected identifier");
+    if (kw == NULL || !spelling_streq(kw->base.location.spelling, "defined")) {
+        SourceLocation sl = parsed_source_location(ctx, s);
+        diag_emit(DIAG_ERROR, ERR_PARSE, &sl, "expected 'defined' (temporary restriction)");
+    }
+    
+    expect_token(ctx, TOK_LPAREN);
+    
+    ASTIdent *ident = (ASTIdent*)expect_node(ctx, (ParseFn)parse_ident,
+                                             "expected identifier after 'defined'");
+    
+    expect_token(ctx, TOK_RPAREN);
+    
+    act_on_pp_defined(parsed_source_location(ctx, s), ident, &holds);
+    return holds != negate;
+}
+
+/* Finishes the line of a conditional directive. If its group isn't taken,
+ * the groups after it are skipped until one is (an #else, or an #elif whose
+ * condition holds) or the #endif ends them all. Whatever group is taken gets
+ * parsed like anything else, and its #else, #elif or #endif skips the rest
+ */
+static void parse_pp_group(Context *ctx, SourceLocation sl, bool taken) {
+    ctx->pp_conditional = true;
+    while (true) {
+        lexer_lex_chunk(ctx, '\n', 0);
+        if (taken) {
+            ctx->pp_open_groups++;
+            return;
+        }
+        
+        Token t = lexer_skip_conditional(ctx, true);
+        if (t.kind == TOK_END) {
+            diag_emit(DIAG_ERROR, ERR_PARSE, &sl, "unterminated conditional directive");
+            return;
+        } else if (spelling_streq(t.location.spelling, "endif")) {
+            lexer_lex_chunk(ctx, '\n', 0);
+            return;
+        }
+        
+        taken = spelling_streq(t.location.spelling, "else") || parse_pp_condition(ctx);
+    }
+}
+
 bool parse_pp_ifdef(Context *ctx, ASTPPIf **result) {
     Context s = snapshot(ctx);
     
     ASTIdent *ident = NULL;
     if (!parse_ident(ctx, &ident)) { goto fail_parse; }
     
-    // TODO(bloggins): action
-    //act_on_pp_ifndef(parsed_source_location(ctx, s), ident, result);
+    SourceLocation sl = parsed_source_location(ctx, s);
+    bool defined = false;
+    act_on_pp_defined(sl, ident, &defined);
+    parse_pp_group(ctx, sl, defined);
     return true;
     
 fail_parse:
@@ -1316,7 +1591,12 @@ bool parse_pp_ifndef(Context *ctx, ASTPPIf **result) {
     ASTIdent *ident = NULL;
     if (!parse_ident(ctx, &ident)) { goto fail_parse; }
     
-    act_on_pp_ifndef(parsed_source_location(ctx, s), ident, result);
+    SourceLocation sl = parsed_source_location(ctx, s);
+    act_on_pp_ifndef(sl, ident, result);
+    
+    bool defined = false;
+    act_on_pp_defined(sl, ident, &defined);
+    parse_pp_group(ctx, sl, !defined);
     return true;
     
 fail_parse:
@@ -1327,42 +1607,45 @@ fail_parse:
 bool parse_pp_if(Context *ctx, ASTPPIf **result) {
     Context s = snapshot(ctx);
     
-    //
-    // TODO(bloggins): just parse an expression and interpret it
-    //
-    
-    accept_token(ctx, TOK_BANG);
-    
-    ASTIdent *kw = (ASTIdent*)expect_node(ctx, (ParseFn)parse_ident, "expected identifier");
-    if (!spelling_streq(kw->base.location.spelling, "defined")) {
-        SourceLocation sl = parsed_source_location(ctx, s);
-        diag_emit(DIAG_ERROR, ERR_PARSE, &sl, "expected 'defined' (temporary restriction)");
-    }
-    
-    expect_token(ctx, TOK_LPAREN);
-    
-    /*ASTIdent *ident = (ASTIdent*)*/expect_node(ctx, (ParseFn)parse_ident, "expected identifier after 'defined'");
-    
-    expect_token(ctx, TOK_RPAREN);
-    
-    lexer_lex_chunk(ctx, '\n', 0);
-    
-    
-    // TODO(bloggins): action
+    bool holds = parse_pp_condition(ctx);
+    parse_pp_group(ctx, parsed_source_location(ctx, s), holds);
     return true;
 }
 
+/* #else and #elif are only parsed at the end of a group that was taken, so
+ * everything up to the #endif is skipped */
 bool parse_pp_else(Context *ctx, ASTPPIf **result) {
+    // The end of the directive's name
+    SourceOffset name_end = context_offset(ctx, ctx->pos);
+    SourceLocation sl = source_location_range(name_end, name_end);
     lexer_lex_chunk(ctx, '\n', 0);
     
-    // TODO(bloggins): action
+    if (ctx->pp_open_groups == 0) {
+        diag_emit(DIAG_ERROR, ERR_PARSE, &sl, "#else or #elif without #if");
+        return true;
+    }
+    
+    if (lexer_skip_conditional(ctx, false).kind == TOK_END) {
+        diag_emit(DIAG_ERROR, ERR_PARSE, &sl, "unterminated conditional directive");
+        return true;
+    }
+    
+    lexer_lex_chunk(ctx, '\n', 0);
+    ctx->pp_open_groups--;
     return true;
 }
 
 bool parse_pp_endif(Context *ctx, ASTPPIf **result) {
+    SourceOffset name_end = context_offset(ctx, ctx->pos);
+    SourceLocation sl = source_location_range(name_end, name_end);
     lexer_lex_chunk(ctx, '\n', 0);
     
-    // TODO(bloggins): action
+    if (ctx->pp_open_groups == 0) {
+        diag_emit(DIAG_ERROR, ERR_PARSE, &sl, "#endif without #if");
+        return true;
+    }
+    
+    ctx->pp_open_groups--;
     return true;
 }
 
@@ -1371,8 +1654,8 @@ bool parse_pp_warning(Context *ctx, ASTPPDirective **result) {
     
     Token t = lexer_lex_chunk(ctx, '\n', '\\');
     SourceLocation sl = parsed_source_location(ctx, s);
-    sl.spelling.start = 0;
-    sl.spelling.end = 0;
+    sl.spelling.start = SOURCE_OFFSET_NONE;
+    sl.spelling.length = 0;
     
     // TODO(bloggins): move to action
     diag_emit(DIAG_WARNING, ERR_NONE, &sl, "%s", t.kind == TOK_CHUNK ?
@@ -1386,9 +1669,11 @@ bool parse_pp_directive(Context *ctx, ASTPPDirective **result) {
     // for right now preprocessor tokens will just be inserted into the AST
     Context s = snapshot(ctx);
     
+    // Read before anything can fail, since fail_parse puts it back
+    bool saved_lex_mode = ctx->lex_mode.lex_keywords_as_identifiers;
+    
     if (IS_TOKEN_NONE(accept_token(ctx, TOK_HASH))) { goto fail_parse; }
     
-    bool saved_lex_mode = ctx->lex_mode.lex_keywords_as_identifiers;
     ctx->lex_mode.lex_keywords_as_identifiers = true;
     
     ASTIdent *directive = NULL;
@@ -1410,7 +1695,8 @@ bool parse_pp_directive(Context *ctx, ASTPPDirective **result) {
         parse_fn = (PPParseFn*)parse_pp_ifndef;
     } else if (spelling_streq(directive_sp, "define")) {
         parse_fn = (PPParseFn*)parse_pp_define;
-    } else if (spelling_streq(directive_sp, "else")) {
+    } else if (spelling_streq(directive_sp, "else") ||
+               spelling_streq(directive_sp, "elif")) {
         parse_fn = (PPParseFn*)parse_pp_else;
     } else if (spelling_streq(directive_sp, "endif")) {
         parse_fn = (PPParseFn*)parse_pp_endif;
@@ -1448,12 +1734,665 @@ fail_parse:
 #pragma mark Public API
 
 void parser_parse(Context *ctx) {
+    if (parser_options.memoize && ctx->parse_memo == NULL) {
+        ctx->parse_memo = calloc(1, sizeof(ParseMemo));
+        parse_memo_grow(ctx->parse_memo);
+    }
+    
     if (!parse_toplevel(ctx, (ASTTopLevel**)&ctx->ast)) {
         exit(ERR_PARSE);
     }
     
+    if (ctx->pp_open_groups > 0) {
+        diag_emit(DIAG_ERROR, ERR_PARSE, NULL, "#if without #endif in %s", ctx->source->name);
+    }
+    
+    // Nothing parses this file again
+    if (ctx->parse_memo != NULL) {
+        parser_memo_destroy(ctx->parse_memo);
+        ctx->parse_memo = NULL;
+    }
+    
+    // Keeps the text alive in images, where nodes only have offsets into it
+    ((ASTTopLevel*)ctx->ast)->source = ctx->source;
+    
     // NOTE(bloggins): Sanity check
-    if (ctx->pos - ctx->buf < ctx->buf_size) {
-        diag_emit(DIAG_ERROR, ERR_PARSE, NULL, "unexpected end of input", ctx->file);
+    if (ctx->pos - ctx->source->buf < ctx->source->size) {
+        diag_emit(DIAG_ERROR, ERR_PARSE, NULL, "unexpected end of input", ctx->source->name);
+    }
+}
+
+static ParseMemo *parse_memo_create() {
+    if (!parser_options.memoize) {
+        return NULL;
+    }
+    
+    ParseMemo *memo = calloc(1, sizeof(ParseMemo));
+    parse_memo_grow(memo);
+    return memo;
+}
+
+/* Parses a body lexer_skip_block stepped over with ctx, in the scope it
+ * would have been parsed in to begin with */
+static void parse_lazy_body(Context *ctx, ASTDeclFunc *fn) {
+    ctx->pos = context_pointer(ctx, fn->lazy_body.start);
+    ctx->active_scope = fn->lazy_scope;
+    
+    ASTBlock *block = NULL;
+    if (!parse_stmt_compound(ctx, &block)) {
+        assert(false && "a skipped body should start with a brace");
+    }
+    
+    AST_BASE(block)->parent = (ASTBase*)fn;
+    fn->block = block;
+    fn->lazy_body = (SourceLocation){};
+    fn->lazy_scope = NULL;
+}
+
+void parser_parse_lazy_body(ASTDeclFunc *fn) {
+    Context *ctx = context_for_location(fn->lazy_body);
+    assert(ctx && "the context that skipped the body is gone");
+    
+    Context s = snapshot(ctx);
+    ctx->parse_memo = parse_memo_create();
+    
+    parse_lazy_body(ctx, fn);
+    
+    if (ctx->parse_memo != NULL) {
+        parser_memo_destroy(ctx->parse_memo);
+    }
+    
+    ctx->pos = s.pos;
+    ctx->active_scope = s.active_scope;
+    ctx->parse_memo = s.parse_memo;
+}
+
+#pragma mark Parallel Bodies
+
+// NOTE(bloggins): Once the top level is parsed, parsing a body only reads
+// what's outside of it. Everything it writes (its nodes, its scopes, the
+// idents that cache what they resolved to) is its own, so bodies can be
+// parsed on several threads at once. Each thread parses with its own copy
+// of the file's context and puts its CT objects in an arena of its own.
+
+#define PARSE_THREAD_STACK_SIZE (8 * 1024 * 1024)
+
+/* A worker's share of the bodies. It takes them from the front, and workers
+ * that run out steal half of what's left from the back */
+typedef struct {
+    pthread_mutex_t lock;
+    size_t head;
+    size_t tail;
+} BodyQueue;
+
+typedef struct {
+    ASTDeclFunc **fns;
+    size_t worker_count;
+    BodyQueue *queues;
+    
+    /* The first error a worker ran into. The others stop taking bodies */
+    _Atomic int error;
+} BodyPool;
+
+typedef struct {
+    BodyPool *pool;
+    size_t index;
+    pthread_t thread;
+    void *arena;
+} BodyWorker;
+
+static bool body_pool_take(BodyPool *pool, size_t worker, size_t *fn_idx) {
+    BodyQueue *own = &pool->queues[worker];
+    pthread_mutex_lock(&own->lock);
+    bool found = own->head < own->tail;
+    if (found) {
+        *fn_idx = own->head++;
+    }
+    pthread_mutex_unlock(&own->lock);
+    
+    if (found) {
+        return true;
+    }
+    
+    for (size_t n = 1; n < pool->worker_count; n++) {
+        BodyQueue *victim = &pool->queues[(worker + n) % pool->worker_count];
+        pthread_mutex_lock(&victim->lock);
+        size_t tail = victim->tail;
+        size_t mid = tail - (tail - victim->head + 1) / 2;
+        found = victim->head < tail;
+        if (found) {
+            victim->tail = mid;
+        }
+        pthread_mutex_unlock(&victim->lock);
+        
+        if (found) {
+            pthread_mutex_lock(&own->lock);
+            own->head = mid + 1;
+            own->tail = tail;
+            pthread_mutex_unlock(&own->lock);
+            
+            *fn_idx = mid;
+            return true;
+        }
     }
+    
+    return false;
+}
+
+static void *parse_bodies_worker(void *arg) {
+    BodyWorker *worker = arg;
+    BodyPool *pool = worker->pool;
+    
+    worker->arena = ct_arena_begin();
+    ParseMemo *memo = parse_memo_create();
+    struct Lookahead *lookahead = lexer_lookahead_create();
+    
+    jmp_buf diag_exception;
+    diag_exception_env = diag_exception;
+    int res = ERR_NONE;
+    if ((res = setjmp(diag_exception))) {
+        // It's been reported. Everyone else can stop
+        int none = ERR_NONE;
+        atomic_compare_exchange_strong(&pool->error, &none, res);
+    } else {
+        size_t fn_idx = 0;
+        while (pool->error == ERR_NONE && body_pool_take(pool, worker->index, &fn_idx)) {
+            ASTDeclFunc *fn = pool->fns[fn_idx];
+            
+            g_thread_context = NULL;
+            Context ctx = *context_for_location(fn->lazy_body);
+            
+            // Offsets are unique across files, so one memo does for all of
+            // this thread's bodies
+            ctx.parse_memo = memo;
+            ctx.lookahead = lookahead;
+            ctx.parse_mode.lazy_bodies = false;
+            
+            g_thread_context = &ctx;
+            parse_lazy_body(&ctx, fn);
+        }
+    }
+    
+    diag_exception_env = NULL;
+    g_thread_context = NULL;
+    
+    if (memo != NULL) {
+        parser_memo_destroy(memo);
+    }
+    
+    lexer_lookahead_destroy(lookahead);
+    lexer_token_count_flush();
+    if (parser_options.profile) {
+        parse_profile_flush();
+    }
+    
+    g_parse_memo_total_hits += g_parse_memo_hits;
+    g_parse_memo_total_misses += g_parse_memo_misses;
+    
+    scope_type_names_thread_done();
+    ct_arena_end();
+    return NULL;
+}
+
+static int parse_bodies_collect(ASTBase *node, VisitPhase phase, List **fns) {
+    if (phase == VISIT_PRE && AST_IS(node, AST_DECL_FUNC) &&
+        ((ASTDeclFunc*)node)->lazy_body.start != SOURCE_OFFSET_NONE) {
+        list_append(fns, node);
+    }
+    
+    return VISIT_OK;
+}
+
+static int parse_bodies_compare(const void *a, const void *b) {
+    uintptr_t pa = (uintptr_t)*(ASTDeclFunc**)a;
+    uintptr_t pb = (uintptr_t)*(ASTDeclFunc**)b;
+    return pa < pb ? -1 : pa > pb;
+}
+
+/* A header included twice shows up twice in the tree, but its functions
+ * can only be parsed once */
+static size_t parse_bodies_unique(ASTDeclFunc **fns, size_t count) {
+    qsort(fns, count, sizeof(ASTDeclFunc*), parse_bodies_compare);
+    
+    size_t unique = 0;
+    for (size_t idx = 0; idx < count; idx++) {
+        if (unique == 0 || fns[unique - 1] != fns[idx]) {
+            fns[unique++] = fns[idx];
+        }
+    }
+    
+    return unique;
+}
+
+void parser_parse_bodies(Context *ctx, size_t thread_count) {
+    List *fn_list = NULL;
+    ast_visit(ctx->ast, (VisitFn)parse_bodies_collect, &fn_list);
+    
+    size_t count = list_count(fn_list);
+    ASTDeclFunc **fns = calloc(count + 1, sizeof(ASTDeclFunc*));
+    count = 0;
+    List_FOREACH(ASTDeclFunc*, fn, fn_list, {
+        fns[count++] = fn;
+    })
+    count = parse_bodies_unique(fns, count);
+    
+    if (thread_count > count) {
+        thread_count = count;
+    }
+    
+    if (thread_count <= 1) {
+        for (size_t idx = 0; idx < count; idx++) {
+            parser_parse_lazy_body(fns[idx]);
+        }
+        
+        free(fns);
+        return;
+    }
+    
+    BodyPool pool = {};
+    pool.fns = fns;
+    pool.worker_count = thread_count;
+    pool.queues = calloc(thread_count, sizeof(BodyQueue));
+    BodyWorker *workers = calloc(thread_count, sizeof(BodyWorker));
+    for (size_t idx = 0; idx < thread_count; idx++) {
+        pthread_mutex_init(&pool.queues[idx].lock, NULL);
+        pool.queues[idx].head = idx * count / thread_count;
+        pool.queues[idx].tail = (idx + 1) * count / thread_count;
+        
+        workers[idx].pool = &pool;
+        workers[idx].index = idx;
+    }
+    
+    // Names of types declared in bodies stay with the thread that found them
+    scope_type_names_freeze(true);
+    
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, PARSE_THREAD_STACK_SIZE);
+    for (size_t idx = 0; idx < thread_count; idx++) {
+        if (pthread_create(&workers[idx].thread, &attr, parse_bodies_worker, &workers[idx]) != 0) {
+            diag_emit(DIAG_FATAL, ERR_PARSE, NULL, "can't start parsing threads");
+            exit(ERR_PARSE);
+        }
+    }
+    pthread_attr_destroy(&attr);
+    
+    for (size_t idx = 0; idx < thread_count; idx++) {
+        pthread_join(workers[idx].thread, NULL);
+        ct_arena_merge(workers[idx].arena);
+    }
+    
+    // Workers steal from each other's queues until the last one is done
+    for (size_t idx = 0; idx < thread_count; idx++) {
+        pthread_mutex_destroy(&pool.queues[idx].lock);
+    }
+    
+    scope_type_names_freeze(false);
+    
+    free(workers);
+    free(pool.queues);
+    free(fns);
+    
+    if (pool.error != ERR_NONE) {
+        // A worker already reported it
+        if (diag_exception_env != NULL) {
+            longjmp(diag_exception_env, pool.error);
+        }
+        
+        exit(pool.error);
+    }
+}
+
+#pragma mark Incremental Reparsing
+
+// NOTE(bloggins): Most edits land inside one function. The smallest block
+// around the edit (or the declaration, if it isn't inside a block) is parsed
+// again in the scope it was parsed in the first time and put in place of the
+// old one. Everything after the edit keeps its nodes and only has its offsets
+// moved. If the edit could change where the pieces around it start and end
+// (it's between declarations, the braces don't match up anymore, there's a
+// directive involved, or a type is declared, which the lexer needs to know
+// about from then on) the whole file is parsed again.
+
+typedef struct {
+    /* The edit, in offsets from before it */
+    SourceOffset start;
+    SourceOffset end;
+    
+    /* How far everything after the edit moves, and how far the whole file
+     * moves if it didn't have room to grow where it was */
+    int64_t delta;
+    int64_t base_delta;
+    
+    /* The file's offsets from before the edit */
+    SourceOffset file_start;
+    SourceOffset file_end;
+    
+    /* What's about to be parsed again. It's left alone */
+    ASTBase *replacement;
+} ReparseShift;
+
+static void reparse_shift_location(ReparseShift *shift, SourceLocation *sl) {
+    if (sl->start < shift->file_start || sl->start >= shift->file_end) {
+        return;
+    }
+    
+    if (sl->start >= shift->end) {
+        sl->start = (SourceOffset)(sl->start + shift->delta);
+    } else if (source_location_end(*sl) > shift->end) {
+        // Around the edit
+        sl->length = (uint32_t)(sl->length + shift->delta);
+    }
+    
+    sl->start = (SourceOffset)(sl->start + shift->base_delta);
+}
+
+static void reparse_shift_spelling(ReparseShift *shift, Spelling *spelling) {
+    SourceLocation sl = {};
+    sl.spelling = *spelling;
+    reparse_shift_location(shift, &sl);
+    *spelling = sl.spelling;
+}
+
+static int reparse_shift_visitor(ASTBase *node, VisitPhase phase, ReparseShift *shift) {
+    if (phase != VISIT_PRE) {
+        return VISIT_OK;
+    }
+    
+    if (node == shift->replacement) {
+        return VISIT_HANDLED;
+    }
+    
+    SourceLocation *sl = &node->location;
+    bool in_file = sl->start >= shift->file_start && sl->start < shift->file_end;
+    if (sl->start != SOURCE_OFFSET_NONE && !in_file) {
+        // From a header
+        return VISIT_HANDLED;
+    } else if (in_file && shift->base_delta == 0 && source_location_end(*sl) <= shift->start) {
+        // Nothing in here moves
+        return VISIT_HANDLED;
+    }
+    
+    reparse_shift_location(shift, sl);
+    
+    // The visitor doesn't go everywhere there's an offset
+    switch (node->kind) {
+        case AST_OPERATOR:
+            reparse_shift_location(shift, &((ASTOperator*)node)->op.location);
+            break;
+        case AST_STMT_JUMP:
+            reparse_shift_location(shift, &((ASTStmtJump*)node)->keyword.location);
+            break;
+        case AST_DECL_FUNC:
+            if (((ASTDeclFunc*)node)->lazy_body.start != SOURCE_OFFSET_NONE) {
+                reparse_shift_location(shift, &((ASTDeclFunc*)node)->lazy_body);
+            }
+            break;
+        case AST_TYPE_NAME:
+            reparse_shift_location(shift, &AST_BASE(((ASTTypeName*)node)->name)->location);
+            break;
+        case AST_PP_PRAGMA:
+            if (((ASTPPPragma*)node)->arg != NULL) {
+                reparse_shift_location(shift, &AST_BASE(((ASTPPPragma*)node)->arg)->location);
+            }
+            reparse_shift_spelling(shift, &((ASTPPPragma*)node)->rest);
+            break;
+        case AST_PP_DEFINITION:
+            reparse_shift_location(shift, &AST_BASE(((ASTPPDefinition*)node)->name)->location);
+            reparse_shift_spelling(shift, &((ASTPPDefinition*)node)->value);
+            break;
+        default:
+            break;
+    }
+    
+    return VISIT_OK;
+}
+
+static void reparse_replace(ASTBase *old, ASTBase *node) {
+    ASTBase *parent = old->parent;
+    node->parent = parent;
+    
+    switch (parent->kind) {
+        case AST_TOPLEVEL:
+            list_replace(((ASTTopLevel*)parent)->definitions, old, node);
+            break;
+        case AST_DECL_FUNC:
+            ((ASTDeclFunc*)parent)->block = (ASTBlock*)node;
+            break;
+        case AST_BLOCK:
+            list_replace(((ASTBlock*)parent)->statements, old, node);
+            break;
+        case AST_STMT_IF: {
+            ASTStmtIf *stmt_if = (ASTStmtIf*)parent;
+            if (stmt_if->stmt_true == old) {
+                stmt_if->stmt_true = node;
+            } else {
+                stmt_if->stmt_false = node;
+            }
+            break;
+        }
+        case AST_STMT_LABELED:
+            ((ASTStmtLabeled*)parent)->stmt = (ASTStatement*)node;
+            break;
+        default:
+            assert(false && "don't know how to replace this node's children");
+    }
+}
+
+/* The top level declaration the edit is inside of, or NULL if it isn't
+ * inside one that can be parsed on its own */
+static ASTBase *reparse_find_definition(ASTTopLevel *tl, ReparseShift *shift,
+                                        const char *text, size_t length) {
+    ASTBase *def = NULL;
+    List_FOREACH(ASTBase*, node, tl->definitions, {
+        SourceLocation sl = node->location;
+        if (def == NULL && sl.start < shift->start && shift->end < source_location_end(sl)) {
+            def = node;
+        }
+    })
+    
+    if (def == NULL) {
+        return NULL;
+    }
+    
+    ASTBase *decl = def;
+    if (AST_IS(def, AST_STMT_DECL)) {
+        decl = (ASTBase*)((ASTStmtDecl*)def)->declaration;
+    }
+    
+    if (!AST_IS(decl, AST_DECL_FUNC) && !AST_IS(decl, AST_DECL_VAR)) {
+        return NULL;
+    } else if (ast_node_is_type_definition(decl)) {
+        return NULL;
+    }
+    
+    // Directives have to happen in order with everything around them
+    if (memchr(source_manager_pointer(def->location.start), '#', def->location.length) ||
+        memchr(text, '#', length)) {
+        return NULL;
+    }
+    
+    return def;
+}
+
+static int reparse_find_block(ASTBase *node, VisitPhase phase, ReparseShift *shift) {
+    if (phase != VISIT_PRE) {
+        return VISIT_OK;
+    }
+    
+    SourceLocation sl = node->location;
+    if (sl.start > shift->start || source_location_end(sl) < shift->end) {
+        return VISIT_HANDLED;
+    }
+    
+    // A block starts after its '{' and ends after its '}'. The deepest one
+    // with the edit between them wins
+    if (AST_IS(node, AST_BLOCK) && shift->end < source_location_end(sl)) {
+        shift->replacement = node;
+    }
+    
+    return VISIT_OK;
+}
+
+/* Each of these returns how many bytes it looked at again, or 0 if the edit
+ * didn't leave the piece it tried where it was */
+
+static size_t reparse_lazy_body(Context *ctx, ASTDeclFunc *fn) {
+    // Nothing to parse, as long as it still ends in the same place
+    SourceLocation body = {};
+    ctx->pos = context_pointer(ctx, fn->lazy_body.start);
+    if (!lexer_skip_block(ctx, &body) || body.length != fn->lazy_body.length) {
+        return 0;
+    }
+    
+    return body.length;
+}
+
+static size_t reparse_block(Context *ctx, ASTBlock *old, ReparseShift *shift) {
+    SourceOffset lbrace = (SourceOffset)(AST_BASE(old)->location.start - 1 + shift->base_delta);
+    SourceOffset end = (SourceOffset)(source_location_end(AST_BASE(old)->location) +
+                                      shift->delta + shift->base_delta);
+    
+    // The braces are still there. Make sure they still go together before
+    // parsing what's between them
+    SourceLocation sl = {};
+    ctx->pos = context_pointer(ctx, lbrace);
+    if (!lexer_skip_block(ctx, &sl) || source_location_end(sl) != end) {
+        return 0;
+    }
+    
+    ctx->pos = context_pointer(ctx, lbrace);
+    ctx->active_scope = AST_BASE(old)->scope->parent;
+    
+    ASTBlock *block = NULL;
+    if (!parse_stmt_compound(ctx, &block) || ctx->pos != context_pointer(ctx, end)) {
+        return 0;
+    }
+    
+    reparse_replace((ASTBase*)old, (ASTBase*)block);
+    return sl.length;
+}
+
+/* sl is where the definition was before the edit */
+static size_t reparse_definition(Context *ctx, ASTTopLevel *tl, ASTBase *def, SourceLocation sl,
+                                 ReparseShift *shift) {
+    ASTDeclaration *decl = (ASTDeclaration*)def;
+    if (AST_IS(def, AST_STMT_DECL)) {
+        decl = ((ASTStmtDecl*)def)->declaration;
+    }
+    
+    SourceOffset start = (SourceOffset)(sl.start + shift->base_delta);
+    SourceOffset end = (SourceOffset)(source_location_end(sl) + shift->delta + shift->base_delta);
+    
+    scope_declaration_remove(tl->base.scope, decl);
+    ctx->pos = context_pointer(ctx, start);
+    ctx->active_scope = tl->base.scope;
+    
+    ASTBase *node = NULL;
+    if (!parse_decl_external(ctx, (ASTDeclaration**)&node) ||
+        node->location.start != start || source_location_end(node->location) != end) {
+        return 0;
+    }
+    
+    decl = (ASTDeclaration*)node;
+    if (AST_IS(node, AST_STMT_DECL)) {
+        decl = ((ASTStmtDecl*)node)->declaration;
+    }
+    
+    if (ast_node_is_type_definition((ASTBase*)decl)) {
+        return 0;
+    }
+    
+    reparse_replace(def, node);
+    return node->location.length;
+}
+
+size_t parser_reparse(Context *ctx, size_t start, size_t removed, const char *text, size_t length) {
+    ASTTopLevel *tl = (ASTTopLevel*)ctx->ast;
+    assert(tl && AST_IS(tl, AST_TOPLEVEL) && "the file hasn't been parsed yet");
+    
+    SourceFile *file = ctx->source;
+    if (start + removed > file->size) {
+        diag_emit(DIAG_ERROR, ERR_USAGE, NULL, "edit goes past the end of %s", file->name);
+    }
+    
+    ReparseShift shift = {};
+    shift.start = file->base + (SourceOffset)start;
+    shift.end = shift.start + (SourceOffset)removed;
+    shift.delta = (int64_t)length - (int64_t)removed;
+    shift.file_start = file->base;
+    shift.file_end = file->base + (SourceOffset)file->size + 1;
+    
+    // Find what to parse again while the offsets still match the tree
+    ASTBase *def = reparse_find_definition(tl, &shift, text, length);
+    ASTDeclFunc *fn = def && AST_IS(def, AST_DECL_FUNC) ? (ASTDeclFunc*)def : NULL;
+    
+    bool in_lazy_body = false;
+    ASTBlock *block = NULL;
+    if (fn != NULL && fn->lazy_body.start != SOURCE_OFFSET_NONE) {
+        in_lazy_body = shift.start > fn->lazy_body.start &&
+                       shift.end < source_location_end(fn->lazy_body);
+    } else if (fn != NULL && fn->block != NULL) {
+        ast_visit((ASTBase*)fn->block, (VisitFn)reparse_find_block, &shift);
+        block = (ASTBlock*)shift.replacement;
+        shift.replacement = NULL;
+    }
+    
+    source_manager_edit(file, start, removed, (const uint8_t*)text, length);
+    lexer_lookahead_flush(ctx->lookahead);
+    shift.base_delta = (int64_t)file->base - (int64_t)shift.file_start;
+    
+    // Everything but what's about to be parsed again moves first, since
+    // parsing looks at the declarations around it
+    SourceLocation def_location = {};
+    if (def != NULL) {
+        def_location = def->location;
+        shift.replacement = block != NULL ? (ASTBase*)block : in_lazy_body ? NULL : def;
+        ast_visit((ASTBase*)tl, (VisitFn)reparse_shift_visitor, &shift);
+    }
+    
+    Context s = snapshot(ctx);
+    ctx->parse_memo = parse_memo_create();
+    
+    size_t reparsed = 0;
+    if (in_lazy_body) {
+        reparsed = reparse_lazy_body(ctx, fn);
+    } else if (block != NULL) {
+        reparsed = reparse_block(ctx, block, &shift);
+    }
+    
+    if (reparsed == 0 && def != NULL) {
+        reparsed = reparse_definition(ctx, tl, def, def_location, &shift);
+    }
+    
+    if (ctx->parse_memo != NULL) {
+        parser_memo_destroy(ctx->parse_memo);
+    }
+    
+    // Where parser_parse leaves it. The old text is gone
+    ctx->pos = file->buf + file->size;
+    ctx->active_scope = s.active_scope;
+    ctx->parse_memo = s.parse_memo;
+    
+    if (reparsed > 0) {
+        return reparsed;
+    }
+    
+    // Start over in the scope the file was parsed in to begin with
+    context_rewind(ctx);
+    ctx->active_scope = tl->base.scope->parent;
+    parser_parse(ctx);
+    ctx->active_scope = s.active_scope;
+    
+    return file->size;
+}
+
+void parser_memo_stats(size_t *hits, size_t *misses) {
+    *hits = g_parse_memo_total_hits + g_parse_memo_hits;
+    *misses = g_parse_memo_total_misses + g_parse_memo_misses;
+}
+
+void parser_memo_destroy(ParseMemo *memo) {
+    free(memo->entries);
+    free(memo);
 }
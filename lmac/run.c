@@ -10,6 +10,9 @@
 
 #include <stdarg.h>
 #include <libgen.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <sys/syslimits.h>
 
 int run_cmd(const char *action, const char *fmt, ...) {
@@ -76,7 +79,7 @@ int run_compile(Context *ctx, bool run_program) {
         diag_emit(DIAG_ERROR, ERR_CC, NULL, "can't find c compiler (cc)");
     }
     
-    char *base_filename = strdup(basename((char*)ctx->file));
+    char *base_filename = strdup(basename((char*)ctx->source->name));
     char *out_file = NULL;
     asprintf(&out_file, "%s.c", base_filename);
     
@@ -107,3 +110,111 @@ int run_compile(Context *ctx, bool run_program) {
 }
 
 
+
+#pragma mark Fast Start
+
+const char *run_cache_dir() {
+    // TODO(bloggins): WARNING - not thread safe
+    static char path[PATH_MAX];
+    if (path[0] != 0) {
+        return path;
+    }
+
+    const char *tmp = getenv("TMPDIR");
+    if (tmp == NULL || tmp[0] == 0) {
+        tmp = "/tmp";
+    }
+
+    snprintf(path, PATH_MAX, "%s%slmac-cache", tmp,
+             tmp[strlen(tmp)-1] == '/' ? "" : "/");
+    if (mkdir(path, 0700) != 0 && access(path, W_OK) != 0) {
+        diag_emit(DIAG_ERROR, ERR_RUN, NULL, "can't create cache directory %s", path);
+    }
+
+    return path;
+}
+
+uint64_t run_hash(const uint8_t *data, size_t length) {
+    // FNV-1a
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= data[i];
+        hash *= 0x100000001b3ull;
+    }
+
+    return hash;
+}
+
+bool run_build_in_background(const char *source, size_t source_size,
+                             const char *cc_flags, const char *out_file) {
+    const char *cc_path = lookup_cmd("cc");
+    if (cc_path == NULL) {
+        return false;
+    }
+    
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid == -1) {
+        return false;
+    } else if (pid != 0) {
+        return true;
+    }
+    
+    char *c_file = NULL;
+    char *tmp_file = NULL;
+    asprintf(&c_file, "%s.%d.c", out_file, getpid());
+    asprintf(&tmp_file, "%s.%d", out_file, getpid());
+    
+    FILE *fout = fopen(c_file, "w");
+    if (fout != NULL) {
+        fwrite(source, 1, source_size, fout);
+        fclose(fout);
+        
+        // Renaming makes the finished file show up atomically
+        if (run_cmd("c-compile", "%s %s -o %s %s >/dev/null 2>&1",
+                    cc_path, cc_flags, tmp_file, c_file) == 0) {
+            rename(tmp_file, out_file);
+        }
+        unlink(c_file);
+        unlink(tmp_file);
+    }
+    
+    _exit(0);
+}
+
+int run_fast_start(Context *ctx) {
+    assert(ctx && "must have a valid context");
+    ct_retain(ctx);
+
+    // The generated C is the cache key, so anything that changes the native
+    // program also changes where we look for it
+    char *source = NULL;
+    size_t source_size = 0;
+    FILE *fsource = open_memstream(&source, &source_size);
+    codegen_generate(fsource, ctx->ast);
+    fclose(fsource);
+
+    char *bin_file = NULL;
+    asprintf(&bin_file, "%s/%016llx", run_cache_dir(),
+             run_hash((uint8_t*)source, source_size));
+
+    int res = 0;
+    if (access(bin_file, X_OK) == 0) {
+        res = run_cmd("run", "%s", bin_file);
+        res = WIFEXITED(res) ? WEXITSTATUS(res) : ERR_RUN;
+    } else {
+        // Build the native version in the background for next time. Until it
+        // shows up in the cache we interpret the program instead.
+        if (!run_build_in_background(source, source_size, "-std=c11 -O2", bin_file)) {
+            diag_emit(DIAG_INFO, ERR_NONE, NULL,
+                      "couldn't start a native build, so the program will keep being interpreted");
+        }
+        res = interp_run(ctx->ast);
+    }
+
+    free(bin_file);
+    free(source);
+
+    ct_release(ctx);
+    return res;
+}
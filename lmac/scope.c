@@ -14,6 +14,13 @@ void Scope_dump(CTTypeInfo *type_info, CTRuntimeClass *runtime_class, FILE *f, S
     scope_fdump(f, scope);
 }
 
+void Scope_pointers(CTTypeInfo *type_info, CTRuntimeClass *runtime_class, void *writer, Scope *scope) {
+    ct_image_add_pointer(writer, &scope->parent);
+    ct_image_add_pointer(writer, &scope->children);
+    ct_image_add_pointer(writer, &scope->declarations);
+    ct_image_add_pointer(writer, &scope->labels);
+}
+
 #pragma mark normal functions
 
 
@@ -53,6 +60,13 @@ void scope_declaration_add(Scope *scope, ASTDeclaration *decl) {
     list_append(&scope->declarations, decl);
 }
 
+void scope_declaration_remove(Scope *scope, ASTDeclaration *decl) {
+    assert(scope && "scope should not be null");
+    assert(decl && "declaration should not be null");
+    
+    list_remove(&scope->declarations, decl);
+}
+
 void scope_label_add(Scope *scope, ASTBase *labeled_node) {
     assert(scope && "scope should not be null");
     assert(labeled_node && "label should not be null");
@@ -91,6 +105,123 @@ ASTDeclaration *scope_lookup_declaration(Scope *scope, Spelling name, bool searc
     return NULL;
 }
 
+#pragma mark Type Names
+
+// NOTE(bloggins): This is the lexer hack. The lexer marks identifiers that
+// have been declared as a type so the parser doesn't have to look through the
+// scopes for every identifier that starts a statement. Names are never taken
+// out, so a marked identifier might still be shadowed or out of scope and
+// needs a real lookup. An unmarked one is never a type.
+
+typedef struct {
+    size_t count;
+    size_t capacity;
+    char **names;
+} TypeNameSet;
+
+global_variable TypeNameSet g_type_names;
+
+// NOTE(bloggins): While bodies are parsed on several threads (see
+// parser_parse_bodies), g_type_names is read only. A type declared in a body
+// can only be seen in that body, so its name goes in a set of the thread's
+// own instead, and is forgotten once the thread is done.
+global_variable bool g_type_names_frozen;
+global_variable _Thread_local TypeNameSet g_thread_type_names;
+
+/* Goes up every time this thread adds a name */
+global_variable _Thread_local size_t g_type_names_generation;
+
+/* FNV-1a */
+static size_t type_name_hash(const uint8_t *name, size_t length) {
+    uint64_t h = 0xCBF29CE484222325ull;
+    for (size_t idx = 0; idx < length; idx++) {
+        h ^= name[idx];
+        h *= 0x100000001B3ull;
+    }
+    
+    return (size_t)h;
+}
+
+static char **type_name_slot(TypeNameSet *set, const uint8_t *name, size_t length) {
+    size_t mask = set->capacity - 1;
+    size_t idx = type_name_hash(name, length) & mask;
+    while (true) {
+        char *entry = set->names[idx];
+        if (entry == NULL || (!strncmp(entry, (const char*)name, length) && entry[length] == 0)) {
+            return &set->names[idx];
+        }
+        
+        idx = (idx + 1) & mask;
+    }
+}
+
+static void type_name_set_add(TypeNameSet *set, Spelling name) {
+    if ((set->count + 1) * 2 > set->capacity) {
+        char **old = set->names;
+        size_t old_capacity = set->capacity;
+        
+        set->capacity = old_capacity ? old_capacity * 2 : 64;
+        set->names = calloc(set->capacity, sizeof(char*));
+        for (size_t idx = 0; idx < old_capacity; idx++) {
+            if (old[idx] != NULL) {
+                *type_name_slot(set, (const uint8_t*)old[idx], strlen(old[idx])) = old[idx];
+            }
+        }
+        free(old);
+    }
+    
+    const uint8_t *text = source_manager_pointer(name.start);
+    char **slot = type_name_slot(set, text, name.length);
+    if (*slot == NULL) {
+        *slot = strndup((const char*)text, name.length);
+        set->count++;
+    }
+}
+
+static bool type_name_set_contains(TypeNameSet *set, Spelling name) {
+    if (set->count == 0) {
+        return false;
+    }
+    
+    return *type_name_slot(set, source_manager_pointer(name.start), name.length) != NULL;
+}
+
+void scope_type_name_add(Spelling name) {
+    type_name_set_add(g_type_names_frozen ? &g_thread_type_names : &g_type_names, name);
+    g_type_names_generation++;
+}
+
+size_t scope_type_names_generation() {
+    return g_type_names_generation;
+}
+
+bool scope_type_name_known(Spelling name) {
+    return type_name_set_contains(&g_type_names, name) ||
+           (g_type_names_frozen && type_name_set_contains(&g_thread_type_names, name));
+}
+
+void scope_type_names_freeze(bool frozen) {
+    g_type_names_frozen = frozen;
+}
+
+void scope_type_names_thread_done() {
+    TypeNameSet *set = &g_thread_type_names;
+    for (size_t idx = 0; idx < set->capacity; idx++) {
+        free(set->names[idx]);
+    }
+    free(set->names);
+    memset(set, 0, sizeof(TypeNameSet));
+}
+
+/* For scopes that didn't come from the parser, like an image's */
+void scope_type_names_import(Scope *scope) {
+    List_FOREACH(ASTDeclaration*, decl, scope->declarations, {
+        if (ast_node_is_type_definition((ASTBase*)decl)) {
+            scope_type_name_add(decl->name->base.location.spelling);
+        }
+    })
+}
+
 void scope_dump(Scope *scope) {
     scope_fdump(stderr, scope);
 }
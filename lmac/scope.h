@@ -22,9 +22,24 @@ typedef struct Scope {
 Scope *scope_create();
 void scope_child_add(Scope *scope, Scope *child);
 void scope_declaration_add(Scope *scope, ASTDeclaration *decl);
+void scope_declaration_remove(Scope *scope, ASTDeclaration *decl);
 void scope_label_add(Scope *scope, ASTBase *label);
 ASTDeclaration *scope_lookup_declaration(Scope *scope, Spelling name, bool search_parents);
 
+/* Every name ever declared as a type, in any scope */
+void scope_type_name_add(Spelling name);
+bool scope_type_name_known(Spelling name);
+void scope_type_names_import(Scope *scope);
+
+/* Changes when this thread adds a name. Tokens lexed before it changed might
+ * not have the right marks */
+size_t scope_type_names_generation();
+
+/* While frozen, names declared on a thread only go in a set of the thread's
+ * own, which scope_type_names_thread_done throws away */
+void scope_type_names_freeze(bool frozen);
+void scope_type_names_thread_done();
+
 void scope_dump(Scope *scope);
 void scope_fdump(FILE *f, Scope *scope);
 
@@ -0,0 +1,270 @@
+//
+//  serve.c
+//  lmac
+//
+//  Created by Breckin Loggins on 12/12/14.
+//  Copyright (c) 2014 Breckin Loggins. All rights reserved.
+//
+
+// Interpreter service. Clients connect to a Unix domain socket, write the
+// source they want interpreted, and shut down their end for writing. They get
+// back a single line: "ok <value>" with the value of the last statement (or
+// what main returned), or "error <code>" (the diagnostics go to the service's
+// stderr).
+//
+// The declarations of the image the service was started with are parsed and
+// assembled once and shared by every request (see interp_share). Requests are
+// handled by a pool of threads, each request running in its own VM.
+//
+// NOTE(bloggins): The front end (lexer, parser, CT objects) isn't thread safe,
+// so parsing and assembling happen one request at a time. Only the VMs run
+// in parallel. Each request makes its CT objects in an arena of its own (see
+// ct_arena_begin), which is released as soon as the request is done.
+
+#include "clite.h"
+
+#include <setjmp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define SERVE_QUEUE_SIZE 64
+#define SERVE_THREAD_STACK_SIZE (8 * 1024 * 1024)
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+
+    /* Connections waiting for a thread */
+    int fds[SERVE_QUEUE_SIZE];
+    size_t head;
+    size_t count;
+} ServeQueue;
+
+global_variable ServeQueue g_serve_queue = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER
+};
+
+/* Held while a request is parsed and assembled */
+global_variable pthread_mutex_t g_front_end_lock = PTHREAD_MUTEX_INITIALIZER;
+
+global_variable Scope *g_serve_scope;
+
+#pragma mark Connection Queue
+
+void serve_queue_push(ServeQueue *q, int fd) {
+    pthread_mutex_lock(&q->lock);
+    while (q->count == SERVE_QUEUE_SIZE) {
+        pthread_cond_wait(&q->not_full, &q->lock);
+    }
+
+    q->fds[(q->head + q->count) % SERVE_QUEUE_SIZE] = fd;
+    q->count++;
+
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+int serve_queue_pop(ServeQueue *q) {
+    pthread_mutex_lock(&q->lock);
+    while (q->count == 0) {
+        pthread_cond_wait(&q->not_empty, &q->lock);
+    }
+
+    int fd = q->fds[q->head];
+    q->head = (q->head + 1) % SERVE_QUEUE_SIZE;
+    q->count--;
+
+    pthread_cond_signal(&q->not_full);
+    pthread_mutex_unlock(&q->lock);
+
+    return fd;
+}
+
+#pragma mark Requests
+
+/* Reads until the client shuts down its end. The result is NUL terminated */
+char *serve_read_request(int fd, size_t *size) {
+    size_t capacity = 4096;
+    size_t length = 0;
+    char *buf = malloc(capacity);
+
+    while (true) {
+        if (length + 1 == capacity) {
+            capacity *= 2;
+            buf = realloc(buf, capacity);
+        }
+
+        ssize_t n = read(fd, buf + length, capacity - length - 1);
+        if (n < 0) {
+            free(buf);
+            return NULL;
+        } else if (n == 0) {
+            break;
+        }
+
+        length += n;
+    }
+
+    buf[length] = 0;
+    *size = length;
+    return buf;
+}
+
+void serve_write_all(int fd, const char *data, size_t size) {
+    while (size > 0) {
+        ssize_t n = write(fd, data, size);
+        if (n <= 0) {
+            // The client went away. Nobody to tell
+            return;
+        }
+
+        data += n;
+        size -= n;
+    }
+}
+
+void serve_request(int fd) {
+    size_t source_size = 0;
+    char *source = serve_read_request(fd, &source_size);
+    if (source == NULL) {
+        close(fd);
+        return;
+    }
+
+    char *result = NULL;
+    size_t result_size = 0;
+    FILE *result_out = open_memstream(&result, &result_size);
+
+    struct CIImage * volatile image = NULL;
+    volatile bool locked = false;
+
+    // Including the request's SourceFile, so its offsets are handed back
+    // with everything else
+    void *arena = ct_arena_begin();
+
+    jmp_buf diag_exception;
+    diag_exception_env = diag_exception;
+    int res = ERR_NONE;
+    if ((res = setjmp(diag_exception))) {
+        goto respond;
+    }
+
+    pthread_mutex_lock(&g_front_end_lock);
+    locked = true;
+
+    Context *ctx = context_create();
+    context_scope_push(ctx);
+
+    // NOTE(bloggins): Like the repl, the request's scope isn't a child of the
+    // image scope because the image scope is shared and lives forever
+    ctx->active_scope->parent = g_serve_scope;
+    ctx->parse_mode.allow_toplevel_expressions = true;
+
+    context_load_source(ctx, source_manager_add("<request>", (uint8_t*)source,
+                                                source_size, false));
+
+    parser_parse(ctx);
+    image = interp_assemble(ctx->ast);
+
+    locked = false;
+    pthread_mutex_unlock(&g_front_end_lock);
+
+    res = interp_execute(image, result_out);
+
+respond:
+    diag_exception_env = NULL;
+    fclose(result_out);
+
+    char *response = NULL;
+    if (res == ERR_NONE) {
+        asprintf(&response, "ok %s\n", result);
+    } else {
+        asprintf(&response, "error %d\n", res);
+    }
+    serve_write_all(fd, response, strlen(response));
+    close(fd);
+
+    ct_arena_end();
+    if (image != NULL) {
+        interp_image_destroy(image);
+    }
+
+    if (!locked) {
+        pthread_mutex_lock(&g_front_end_lock);
+    }
+    ct_arena_release(arena);
+    pthread_mutex_unlock(&g_front_end_lock);
+
+    // The request's SourceFile pointed at its text until the arena went
+    free(source);
+    free(response);
+    free(result);
+}
+
+void *serve_thread(void *arg) {
+    while (true) {
+        serve_request(serve_queue_pop(&g_serve_queue));
+    }
+
+    return NULL;
+}
+
+#pragma mark Public API
+
+int serve_listen(const char *socket_path, Scope *image_scope, size_t thread_count) {
+    struct sockaddr_un addr = {};
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        diag_emit(DIAG_ERROR, ERR_USAGE, NULL, "socket path '%s' is too long", socket_path);
+    }
+
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        diag_emit(DIAG_ERROR, ERR_RUN, NULL, "can't create a socket");
+    }
+
+    unlink(socket_path);
+    if (bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        listen(listen_fd, SERVE_QUEUE_SIZE) < 0) {
+        diag_emit(DIAG_ERROR, ERR_RUN, NULL, "can't listen on '%s'", socket_path);
+    }
+
+    // Clients that hang up early shouldn't take the service down with them
+    signal(SIGPIPE, SIG_IGN);
+
+    g_serve_scope = image_scope;
+    if (image_scope != NULL) {
+        interp_share();
+    }
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, SERVE_THREAD_STACK_SIZE);
+    for (size_t idx = 0; idx < thread_count; idx++) {
+        pthread_t thread;
+        if (pthread_create(&thread, &attr, serve_thread, NULL) != 0) {
+            diag_emit(DIAG_ERROR, ERR_RUN, NULL, "can't start service threads");
+        }
+        pthread_detach(thread);
+    }
+    pthread_attr_destroy(&attr);
+
+    fprintf(stderr, "serving on %s with %zu threads\n", socket_path, thread_count);
+
+    while (true) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+
+        serve_queue_push(&g_serve_queue, fd);
+    }
+
+    return ERR_NONE;
+}
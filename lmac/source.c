@@ -0,0 +1,427 @@
+//
+//  source.c
+//  lmac
+//
+//  Created by Breckin Loggins on 12/20/14.
+//  Copyright (c) 2014 Breckin Loggins. All rights reserved.
+//
+
+#include "clite.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// NOTE(bloggins): Like the rest of the front end, the source manager isn't
+// thread safe. Files are only added and removed on one thread at a time.
+// Lookups can happen on several (see parser_parse_bodies) while nothing is
+// added.
+
+/* Every file the manager knows about, ordered by base offset */
+global_variable SourceFile **g_source_files;
+global_variable size_t g_source_file_count;
+
+/* Where the next file goes */
+global_variable SourceOffset g_source_next_base = 1;
+
+/* Most lookups are for the same file as the last one (on this thread) */
+global_variable _Thread_local SourceFile *g_source_last;
+
+void default_dealloc(CTTypeInfo *type_info, CTRuntimeClass *runtime_class, void *obj);
+
+#pragma mark Offset Space
+
+static inline SourceOffset source_file_end(SourceFile *file) {
+    // One past the NUL, which has an offset of its own
+    return file->base + (SourceOffset)file->size + 1;
+}
+
+/* Index of the first file whose base is past offset */
+static size_t source_manager_upper_bound(SourceOffset offset) {
+    size_t lo = 0;
+    size_t hi = g_source_file_count;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (g_source_files[mid]->base <= offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+static void source_manager_insert(SourceFile *file) {
+    size_t idx = source_manager_upper_bound(file->base);
+    assert((idx == 0 || source_file_end(g_source_files[idx - 1]) <= file->base) &&
+           (idx == g_source_file_count || source_file_end(file) <= g_source_files[idx]->base) &&
+           "source files can't share offsets");
+
+    g_source_files = realloc(g_source_files, (g_source_file_count + 1) * sizeof(SourceFile*));
+    memmove(g_source_files + idx + 1, g_source_files + idx,
+            (g_source_file_count - idx) * sizeof(SourceFile*));
+    g_source_files[idx] = file;
+    g_source_file_count++;
+
+    if (source_file_end(file) > g_source_next_base) {
+        g_source_next_base = source_file_end(file);
+    }
+}
+
+/* Where a file of size bytes can go. The first gap between files that's big
+ * enough, so offsets files leave behind get used again (a service's requests
+ * don't always finish in the order they started), otherwise the end.
+ * SOURCE_OFFSET_NONE if there's no room at all
+ */
+static SourceOffset source_manager_find_room(size_t size) {
+    SourceOffset gap_start = 1;
+    for (size_t idx = 0; idx < g_source_file_count; idx++) {
+        if ((uint64_t)gap_start + size + 1 <= g_source_files[idx]->base) {
+            return gap_start;
+        }
+
+        gap_start = source_file_end(g_source_files[idx]);
+    }
+
+    if ((uint64_t)g_source_next_base + size + 1 > UINT32_MAX) {
+        return SOURCE_OFFSET_NONE;
+    }
+
+    return g_source_next_base;
+}
+
+static void source_manager_remove(SourceFile *file) {
+    if (g_source_last == file) {
+        g_source_last = NULL;
+    }
+
+    size_t idx = source_manager_upper_bound(file->base);
+    if (idx == 0 || g_source_files[idx - 1] != file) {
+        return;
+    }
+    idx--;
+
+    memmove(g_source_files + idx, g_source_files + idx + 1,
+            (g_source_file_count - idx - 1) * sizeof(SourceFile*));
+    g_source_file_count--;
+
+    // Hand the offsets at the end back so a long running repl or service
+    // doesn't run out of them
+    if (idx == g_source_file_count) {
+        g_source_next_base = g_source_file_count > 0 ?
+            source_file_end(g_source_files[g_source_file_count - 1]) : 1;
+    }
+}
+
+#pragma mark Line Tables
+
+/* One pass over the file. memchr does the scanning a word (or vector) at a
+ * time, which is much faster than looking at each byte ourselves
+ */
+static void source_file_build_lines(SourceFile *file) {
+    size_t capacity = 64 + file->size / 32;
+    file->line_starts = malloc(capacity * sizeof(uint32_t));
+    file->line_starts[0] = 0;
+    file->line_count = 1;
+
+    const uint8_t *end = file->buf + file->size;
+    const uint8_t *p = file->buf;
+    while ((p = memchr(p, '\n', end - p)) != NULL) {
+        if (file->line_count == capacity) {
+            capacity *= 2;
+            file->line_starts = realloc(file->line_starts, capacity * sizeof(uint32_t));
+        }
+
+        p++;
+        file->line_starts[file->line_count++] = (uint32_t)(p - file->buf);
+    }
+}
+
+#pragma mark Loading
+
+/* Maps a regular file read-only. The mapping reserves at least one byte past
+ * the end of the file, and everything past the end reads as 0, so the lexer
+ * sees a NUL terminated buffer without a copy. If the file is an exact number
+ * of pages, the 0 comes from an anonymous page mapped after it.
+ */
+static uint8_t *source_map_file(int fd, size_t size, size_t *mapped_size) {
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    size_t length = (size + 1 + page_size - 1) / page_size * page_size;
+
+    uint8_t *buf = mmap(NULL, length, PROT_READ, MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (buf == MAP_FAILED) {
+        return NULL;
+    }
+
+    if (size > 0 && mmap(buf, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(buf, length);
+        return NULL;
+    }
+
+    *mapped_size = length;
+    return buf;
+}
+
+/* For pipes, terminals and anything else that can't be mapped */
+static uint8_t *source_read_fd(int fd, size_t *size) {
+    size_t capacity = 4096;
+    size_t length = 0;
+    uint8_t *buf = malloc(capacity);
+
+    while (true) {
+        if (length + 1 == capacity) {
+            capacity *= 2;
+            buf = realloc(buf, capacity);
+        }
+
+        ssize_t n = read(fd, buf + length, capacity - length - 1);
+        if (n < 0) {
+            free(buf);
+            return NULL;
+        } else if (n == 0) {
+            break;
+        }
+
+        length += n;
+    }
+
+    // Ensure null-termination
+    buf[length] = 0;
+    *size = length;
+    return buf;
+}
+
+#pragma mark CT VTABLE Overrides
+
+void SourceFile_dump(CTTypeInfo *type_info, CTRuntimeClass *runtime_class, FILE *f, SourceFile *file) {
+    fprintf(f, "<SourceFile %s [%u, %u)>", file->name ? file->name : "<unknown file>",
+            file->base, source_file_end(file));
+}
+
+void SourceFile_dealloc(CTTypeInfo *type_info, CTRuntimeClass *runtime_class, SourceFile *file) {
+    source_manager_remove(file);
+
+    free((char*)file->name);
+    free(file->line_starts);
+    if (file->owns_buf && file->mapped_size > 0) {
+        munmap(file->buf, file->mapped_size);
+    } else if (file->owns_buf) {
+        free(file->buf);
+    }
+
+    default_dealloc(type_info, runtime_class, file);
+}
+
+void SourceFile_pointers(CTTypeInfo *type_info, CTRuntimeClass *runtime_class, void *writer, SourceFile *file) {
+    if (file->name != NULL) {
+        ct_image_add_blob(writer, file->name, strlen(file->name) + 1);
+    }
+
+    if (file->buf != NULL) {
+        ct_image_add_blob(writer, file->buf, file->size + 1);
+    }
+
+    ct_image_add_pointer(writer, &file->name);
+    ct_image_add_pointer(writer, &file->buf);
+
+    // The line table and context are put back by thaw
+}
+
+void SourceFile_thaw(CTTypeInfo *type_info, CTRuntimeClass *runtime_class, SourceFile *file) {
+    // The image's nodes still have the offsets they were parsed at, so the
+    // file goes back where it was. Images are loaded before anything else is
+    // read, so the range is free.
+    file->owns_buf = false;
+    file->mapped_size = 0;
+    file->ctx = NULL;
+    source_file_build_lines(file);
+    source_manager_insert(file);
+}
+
+#pragma mark Public API
+
+SourceFile *source_manager_add(const char *name, uint8_t *buf, size_t size, bool owns_buf) {
+    assert(buf && buf[size] == 0 && "source buffers must be NUL terminated");
+
+    SourceOffset base = source_manager_find_room(size);
+    if (base == SOURCE_OFFSET_NONE) {
+        diag_emit(DIAG_ERROR, ERR_LEX, NULL, "too much source to keep track of (%s)",
+                  name ? name : "<unknown file>");
+    }
+
+    SourceFile *file = ct_create(CT_TYPE_SourceFile, 0);
+    file->name = name ? strdup(name) : NULL;
+    file->buf = buf;
+    file->size = size;
+    file->base = base;
+    file->owns_buf = owns_buf;
+
+    source_file_build_lines(file);
+    source_manager_insert(file);
+    return file;
+}
+
+SourceFile *source_manager_load(const char *path) {
+    assert(path);
+
+    bool is_stdin = !strcmp(path, "-");
+    int fd = is_stdin ? STDIN_FILENO : open(path, O_RDONLY);
+    if (fd == -1) {
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || S_ISDIR(st.st_mode)) {
+        if (!is_stdin) {
+            close(fd);
+        }
+        return NULL;
+    }
+
+    size_t size = 0;
+    size_t mapped_size = 0;
+    uint8_t *buf = NULL;
+    if (S_ISREG(st.st_mode)) {
+        // NOTE(bloggins): If the file shrinks while it's mapped, touching the
+        // missing pages is a SIGBUS. Nobody should be editing the input while
+        // we compile it.
+        size = (size_t)st.st_size;
+        buf = source_map_file(fd, size, &mapped_size);
+    }
+
+    if (buf == NULL) {
+        buf = source_read_fd(fd, &size);
+    }
+
+    if (!is_stdin) {
+        close(fd);
+    }
+
+    if (buf == NULL) {
+        return NULL;
+    }
+
+    SourceFile *file = source_manager_add(is_stdin ? "<stdin>" : path, buf, size, true);
+    file->mapped_size = mapped_size;
+    return file;
+}
+
+void source_manager_edit(SourceFile *file, size_t start, size_t removed,
+                         const uint8_t *text, size_t length) {
+    assert(start + removed <= file->size && "edit is past the end of the file");
+    
+    size_t size = file->size - removed + length;
+    uint8_t *buf = malloc(size + 1);
+    memcpy(buf, file->buf, start);
+    memcpy(buf + start, text, length);
+    memcpy(buf + start + length, file->buf + start + removed, file->size - start - removed);
+    buf[size] = 0;
+    
+    if (file->owns_buf && file->mapped_size > 0) {
+        munmap(file->buf, file->mapped_size);
+    } else if (file->owns_buf) {
+        free(file->buf);
+    }
+    
+    // Stay put if the file is the last one or there's room before the next
+    size_t idx = source_manager_upper_bound(file->base);
+    assert(idx > 0 && g_source_files[idx - 1] == file && "file isn't in the manager");
+    bool fits = idx == g_source_file_count ||
+                (uint64_t)file->base + size + 1 <= g_source_files[idx]->base;
+    
+    if (!fits) {
+        source_manager_remove(file);
+        if ((uint64_t)g_source_next_base + size + 1 > UINT32_MAX) {
+            diag_emit(DIAG_ERROR, ERR_LEX, NULL, "too much source to keep track of (%s)",
+                      file->name ? file->name : "<unknown file>");
+        }
+        
+        file->base = g_source_next_base;
+    }
+    
+    file->buf = buf;
+    file->size = size;
+    file->owns_buf = true;
+    file->mapped_size = 0;
+    
+    free(file->line_starts);
+    source_file_build_lines(file);
+    
+    if (!fits) {
+        source_manager_insert(file);
+        
+        // A file that's edited once usually is again. Leave it room to grow
+        // so everything in it doesn't have to move every time
+        if ((uint64_t)g_source_next_base + size / 4 <= UINT32_MAX) {
+            g_source_next_base += (SourceOffset)(size / 4);
+        }
+    } else if (idx == g_source_file_count && source_file_end(file) > g_source_next_base) {
+        g_source_next_base = source_file_end(file);
+    }
+}
+
+SourceFile *source_manager_lookup(SourceOffset offset) {
+    if (offset == SOURCE_OFFSET_NONE) {
+        return NULL;
+    }
+
+    SourceFile *last = g_source_last;
+    if (last != NULL && offset >= last->base && offset < source_file_end(last)) {
+        return last;
+    }
+
+    size_t idx = source_manager_upper_bound(offset);
+    if (idx == 0 || offset >= source_file_end(g_source_files[idx - 1])) {
+        return NULL;
+    }
+
+    g_source_last = g_source_files[idx - 1];
+    return g_source_last;
+}
+
+uint32_t source_manager_line(SourceOffset offset) {
+    SourceFile *file = source_manager_lookup(offset);
+    if (file == NULL) {
+        return 0;
+    }
+
+    // The last line starting at or before the offset
+    uint32_t local = offset - file->base;
+    size_t lo = 0;
+    size_t hi = file->line_count;
+    while (hi - lo > 1) {
+        size_t mid = (lo + hi) / 2;
+        if (file->line_starts[mid] <= local) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return (uint32_t)lo + 1;
+}
+
+void source_manager_stats(size_t *file_count, size_t *source_bytes,
+                          size_t *line_count, size_t *line_table_bytes) {
+    *file_count = g_source_file_count;
+    *source_bytes = 0;
+    *line_count = 0;
+    *line_table_bytes = 0;
+
+    for (size_t idx = 0; idx < g_source_file_count; idx++) {
+        SourceFile *file = g_source_files[idx];
+
+        *source_bytes += file->size;
+        *line_count += file->line_count;
+        *line_table_bytes += file->line_count * sizeof(uint32_t);
+    }
+}
+
+const uint8_t *source_manager_pointer(SourceOffset offset) {
+    SourceFile *file = source_manager_lookup(offset);
+    assert(file && "offset isn't in any source file");
+
+    return file->buf + (offset - file->base);
+}
@@ -0,0 +1,86 @@
+//
+//  source.h
+//  lmac
+//
+//  Created by Breckin Loggins on 12/20/14.
+//  Copyright (c) 2014 Breckin Loggins. All rights reserved.
+//
+
+// The source manager. Every buffer of source text the compiler reads (files,
+// headers, repl lines, service requests, #run chunks) gets its own range in
+// one 32-bit offset space, so a single offset is enough to say which file and
+// which byte a token came from.
+
+#ifndef lmac_source_h
+#define lmac_source_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+typedef uint32_t SourceOffset;
+
+/* Offset 0 isn't in any file. A zeroed location is "nowhere" */
+#define SOURCE_OFFSET_NONE  0
+
+struct Context;
+
+typedef struct SourceFile {
+    const char *name;
+
+    /* NUL terminated. buf[size] has an offset of its own so the end of the
+     * file can be pointed at */
+    uint8_t *buf;
+    size_t size;
+
+    /* buf[idx] is at offset base + idx */
+    SourceOffset base;
+
+    /* Whether the manager frees buf when the file is released */
+    bool owns_buf;
+
+    /* If buf is a read-only mapping of the file, the mapping's length */
+    size_t mapped_size;
+
+    /* Offset (from buf) of the start of each line. Built when the file is
+     * added */
+    uint32_t *line_starts;
+    size_t line_count;
+
+    /* The context parsing (or that parsed) the file */
+    struct Context *ctx;
+} SourceFile;
+
+/* Adds a buffer to the source manager. buf[size] must be 0. Files are CT
+ * objects and leave the manager when they're released
+ */
+SourceFile *source_manager_add(const char *name, uint8_t *buf, size_t size, bool owns_buf);
+
+/* Maps a file into the source manager ("-" is stdin). Pipes and other
+ * files that can't be mapped are read instead. Returns NULL if it can't be
+ * read
+ */
+SourceFile *source_manager_load(const char *path);
+
+/* Replaces removed bytes at start (counted from the start of the file) with
+ * text. The file keeps its base if it has room to grow, otherwise it moves to
+ * the end of the offset space. Offsets into the file from before the edit are
+ * up to the caller to fix
+ */
+void source_manager_edit(SourceFile *file, size_t start, size_t removed,
+                         const uint8_t *text, size_t length);
+
+/* The file an offset belongs to, or NULL */
+SourceFile *source_manager_lookup(SourceOffset offset);
+
+/* The byte at an offset */
+const uint8_t *source_manager_pointer(SourceOffset offset);
+
+/* The 1-based line an offset is on, or 0 if it isn't in a file */
+uint32_t source_manager_line(SourceOffset offset);
+
+/* How much the manager is holding on to */
+void source_manager_stats(size_t *file_count, size_t *source_bytes,
+                          size_t *line_count, size_t *line_table_bytes);
+
+#endif
@@ -8,25 +8,32 @@
 
 #include "clite.h"
 
+static inline const char *spelling_text(Spelling spelling) {
+    return (const char *)source_manager_pointer(spelling.start);
+}
+
 size_t spelling_strlen(Spelling spelling) {
-    return (spelling.end - spelling.start);
+    return spelling.length;
 }
 
 bool spelling_streq(Spelling spelling, const char *str) {
     size_t sp_len = spelling_strlen(spelling);
     if (sp_len != strlen(str)) {
         return false;
+    } else if (sp_len == 0) {
+        return true;
     }
     
+    const char *text = spelling_text(spelling);
     const char *c = str;
     while (*c) {
         size_t off = c - str;
-        if (spelling.start + off > spelling.end) {
+        if (off > spelling.length) {
             // Ran off the end of the token, can't be equal
             return false;
         }
         
-        char tc = (char)*(spelling.start + off);
+        char tc = text[off];
         if (*c != tc) {
             return false;
         }
@@ -39,7 +46,7 @@ bool spelling_streq(Spelling spelling, const char *str) {
 }
 
 bool spelling_equal(Spelling spelling1, Spelling spelling2) {
-    if (spelling1.start == spelling2.start && spelling1.end == spelling2.end) {
+    if (spelling1.start == spelling2.start && spelling1.length == spelling2.length) {
         // Trivially equal
         return true;
     }
@@ -49,10 +56,14 @@ bool spelling_equal(Spelling spelling1, Spelling spelling2) {
     
     if (sp1_len != sp2_len) {
         return false;
+    } else if (sp1_len == 0) {
+        return true;
     }
     
+    const char *text1 = spelling_text(spelling1);
+    const char *text2 = spelling_text(spelling2);
     for (int i = 0; i < sp1_len; i++) {
-        if (spelling1.start[i] != spelling2.start[i]) {
+        if (text1[i] != text2[i]) {
             return false;
         }
     }
@@ -64,7 +75,12 @@ void spelling_fprint(FILE *f, Spelling spelling) {
     // TODO(bloggins):
     //  1. Break this out into sprintf, asprintf, etc. functions
     //  2. Control whether to escape or not
-    for (char *cp = (char*)spelling.start; cp < (char*)spelling.end; cp++) {
+    if (spelling_strlen(spelling) == 0) {
+        return;
+    }
+    
+    const char *text = spelling_text(spelling);
+    for (const char *cp = text; cp < text + spelling_strlen(spelling); cp++) {
         if (*cp == '\n') {
             fprintf(f, "\\n");
         } else if (*cp == '\t') {
@@ -76,58 +92,41 @@ void spelling_fprint(FILE *f, Spelling spelling) {
 }
 
 void spelling_line_fprint(FILE *f, Spelling spelling) {
-    if (spelling.start == NULL || spelling.end == NULL) {
+    SourceOffset end = spelling.start + spelling.length;
+    SourceFile *file = source_manager_lookup(end);
+    if (spelling.start == SOURCE_OFFSET_NONE || file == NULL) {
         return;
     }
     
-    const char *buf = (const char *)spelling.ctx->buf;
-    
-    const char *line_begin = (const char *)spelling.end;
-    const char *line_end = (const char *)spelling.end;
-    
-    if (*line_begin == '\n') {
-        --line_begin;
-    }
-    
-    while (line_begin != buf && *line_begin != '\n') {
-        if (--line_begin <= buf) {
-            line_begin = buf;
-            break;
-        }
-    }
-    
-    while (*line_end != '\n') {
-        if (++line_end >= (buf + spelling.ctx->buf_size)) {
-            line_end = buf + spelling.ctx->buf_size - 1;
-            break;
-        }
+    // The line the end of the spelling is on, without its newline
+    uint32_t line = source_manager_line(end);
+    size_t line_begin = file->line_starts[line - 1];
+    size_t line_end = line < file->line_count ? file->line_starts[line] - 1 : file->size;
+    size_t line_length = line_end - line_begin;
+    size_t column = (end - file->base) - line_begin;
+    
+    fwrite(file->buf + line_begin, 1, line_length, f);
+    fputc('\n', f);
+    
+    // Underline up to the end of the spelling. There's no caret if it ends
+    // on the newline
+    char *marker = malloc(line_length + 2);
+    size_t marker_length = column < line_length ? column : line_length;
+    memset(marker, '~', marker_length);
+    if (column < line_length) {
+        marker[marker_length++] = '^';
     }
+    marker[marker_length++] = '\n';
     
-    if (*line_begin == '\n') ++line_begin;
-    if (*line_end == '\n') --line_end;
-    assert(line_end >= line_begin);
-    
-    // TODO(bloggins): Slow
-    for (const char *ch = line_begin; ch <= line_end; ch++) {
-        fputc(*ch, f);
-    }
-    fprintf(f, "\n");
-    
-    for (const char *ch = line_begin; ch <= line_end; ch++) {
-        if (ch == (const char *)spelling.end) {
-            fputc('^', f);
-            break;
-        } else {
-            fputc('~', f);
-        }
-    }
-    fprintf(f, "\n");
+    fwrite(marker, 1, marker_length, f);
+    free(marker);
 }
 
 const char *spelling_cstring(Spelling spelling) {
-    // TODO(bloggins): This is not thread safe!
-    static char *cstr = NULL;
-    static size_t cstr_len = 0;
+    // One buffer per thread, so bodies parsed on other threads don't write
+    // over it
+    static _Thread_local char *cstr = NULL;
+    static _Thread_local size_t cstr_len = 0;
     
     size_t sp_len = spelling_strlen(spelling);
     if (sp_len == 0) {
@@ -143,9 +142,7 @@ const char *spelling_cstring(Spelling spelling) {
     }
    
     cstr_len = sp_len;
-    for (int i = 0; i < cstr_len; i++) {
-        cstr[i] = (char)spelling.start[i];
-    }
+    memcpy(cstr, spelling_text(spelling), cstr_len);
     cstr[cstr_len] = 0;
     return cstr;
 }
@@ -0,0 +1,33 @@
+// Pure functions that only deal in integers get compiled to native code with
+// lmac interpret --aot. The first run interprets them while cc builds them in
+// the background, later runs call the native versions.
+
+#include "tests/c_prelude.h"
+
+int mix(int total, int i) {
+    return total + i % 7;
+}
+
+int sum(int n, int step) {
+    int total = 0;
+    int i = 0;
+
+top:
+    if (i < n) {
+        total = mix(total, i);
+        i = i + step;
+        goto top;
+    }
+
+    return total;
+}
+
+int main() {
+    printf("sum = %d\n", sum(100000, 1));
+
+    if (sum(14, 1) == 42) {
+        return 0;
+    }
+
+    return 1;
+}
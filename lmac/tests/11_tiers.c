@@ -0,0 +1,33 @@
+// lmac interpret walks the AST of cold code instead of assembling it. Calls
+// count against the function they call, and once one of them gets hot the
+// walk is dropped and the program runs as bytecode instead. Both tiers have to
+// agree: this returns 0 either way (compare with interpret --bytecode-only).
+
+#include "tests/c_prelude.h"
+
+int square(int x) {
+    int y = x * x;
+    return y;
+}
+
+int fib(int n) {
+    if (n < 2) {
+        return n;
+    }
+
+    return fib(n - 1) + fib(n - 2);
+}
+
+int main() {
+    // Cold: only a couple of calls
+    if (square(9) != 81 || fib(5) != 5) {
+        return 1;
+    }
+
+    // Hot: fib gets promoted here, so the whole program runs as bytecode
+    if (fib(15) != 610) {
+        return 2;
+    }
+
+    return 0;
+}
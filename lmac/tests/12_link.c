@@ -0,0 +1,23 @@
+// Files can be interpreted together and linked like translation units:
+//
+//   lmac interpret tests/12_link.c tests/12_link_more.c
+//
+// twice comes from a header both files include, so the linked image keeps
+// one copy of it. quad is only declared here and is defined in the other
+// file. Returns 0.
+
+#include "tests/12_link.h"
+
+int quad(int x);
+
+int main() {
+    if (twice(21) != 42) {
+        return 1;
+    }
+
+    if (quad(5) != 20) {
+        return 2;
+    }
+
+    return 0;
+}
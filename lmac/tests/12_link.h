@@ -0,0 +1,12 @@
+//
+//  12_link.h
+//  lmac
+//
+//  Shared by tests/12_link.c and tests/12_link_more.c
+//
+
+#include "tests/c_prelude.h"
+
+int twice(int x) {
+    return x * 2;
+}
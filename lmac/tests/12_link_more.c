@@ -0,0 +1,7 @@
+// The other half of tests/12_link.c
+
+#include "tests/12_link.h"
+
+int quad(int x) {
+    return twice(twice(x));
+}
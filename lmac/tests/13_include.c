@@ -0,0 +1,14 @@
+// A header is only read once per compile. Including a header again after its
+// include guard is defined (or after it said #pragma once) adds nothing, so
+// the second includes below don't redeclare anything. Returns 0.
+
+#include "tests/c_prelude.h"
+#include "tests/13_include.h"
+#include "tests/13_include_once.h"
+
+#include "tests/13_include.h"
+#include "tests/13_include_once.h"
+
+int main() {
+    return thrice(half(4)) - 6;
+}
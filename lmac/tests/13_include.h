@@ -0,0 +1,16 @@
+//
+//  13_include.h
+//  lmac
+//
+//  Included twice by tests/13_include.c. The guard keeps the second include
+//  from declaring thrice again
+//
+
+#ifndef LMAC_TESTS_13_INCLUDE_H
+#define LMAC_TESTS_13_INCLUDE_H
+
+$32 thrice($32 x) {
+    return x * 3;
+}
+
+#endif // LMAC_TESTS_13_INCLUDE_H
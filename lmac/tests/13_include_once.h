@@ -0,0 +1,12 @@
+//
+//  13_include_once.h
+//  lmac
+//
+//  Included twice by tests/13_include.c
+//
+
+#pragma once
+
+$32 half($32 x) {
+    return x / 2;
+}
@@ -0,0 +1,28 @@
+// When interpreting, function bodies are skipped over and only parsed when
+// something calls them. The skip has to step over braces in strings and
+// comments, and the bodies nothing calls are never parsed at all (build and
+// --eager-bodies still parse them). Returns 0.
+
+#include "tests/c_prelude.h"
+
+int braces() {
+    printf("} {{\n");   // }
+    /* { */
+    return 3;
+}
+
+int square(int x) {
+    if (x == 0) {
+        return 0;
+    }
+
+    return x * x;
+}
+
+int never_called(int x) {
+    return square(x) + braces();
+}
+
+int main() {
+    return square(braces()) - 9;
+}
@@ -0,0 +1,57 @@
+// Only the branches of #if, #ifdef and #ifndef whose conditions hold are
+// parsed. The rest are skipped a line at a time, so they can hold anything
+// (even a stray #else, as long as it's inside a group of its own). A header
+// with groups like these is read again each time it's included, since what's
+// defined might have changed. Returns 0.
+
+#include "tests/c_prelude.h"
+#include "tests/15_conditional.h"
+
+#define WANT_ONE
+#include "tests/15_conditional.h"
+
+#define HAVE_FAST_PATH
+
+#ifdef HAVE_FAST_PATH
+int path() {
+    return 1;
+}
+#else
+int path() {
+    return this isn't parsed;
+}
+#endif
+
+#ifndef HAVE_FAST_PATH
+    # if 1
+    this isn't parsed either
+    # else
+    nor this
+    # endif
+#elif defined(HAVE_SLOW_PATH)
+int slow() {
+    return 100;
+}
+#elif !defined(HAVE_SLOW_PATH)
+int slow() {
+    return 2;
+}
+#else
+int slow() {
+    return 200;
+}
+#endif
+
+#if 0
+int path() {
+    return 300;
+}
+#endif
+
+int main() {
+    int x = 0;
+#if defined(HAVE_FAST_PATH)
+    x = path() + slow() + one();
+#endif
+    return x - 4;
+}
@@ -0,0 +1,13 @@
+//
+//  15_conditional.h
+//  lmac
+//
+//  Included twice by tests/15_conditional.c, once before WANT_ONE is defined
+//  and once after. There's no guard, so the second include declares one
+//
+
+#ifdef WANT_ONE
+$32 one() {
+    return 1;
+}
+#endif
@@ -0,0 +1,11 @@
+// Foreign functions are bound with dlsym when the interpreter calls them
+
+#include "tests/c_prelude.h"
+
+int puts(const char * s);
+int abs(int i);
+
+int greeting = printf("Hello from %s, %d + %d = %d\n", "the interpreter", 40, 2, 40 + 2);
+int wrote = puts("no cc required");
+
+int n = abs(0 - 42) + greeting;
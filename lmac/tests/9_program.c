@@ -0,0 +1,33 @@
+// Whole programs run the same interpreted (lmac interpret, lmac run --fast-start)
+// as they do natively (lmac run)
+
+#include "tests/c_prelude.h"
+
+int fact(int n) {
+    if (n <= 1) {
+        return 1;
+    }
+
+    return n * fact(n - 1);
+}
+
+int main() {
+    int i = 0;
+    int sum = 0;
+
+loop:
+    sum = sum + i;
+    i = i + 1;
+    if (i <= 100) {
+        goto loop;
+    }
+
+    printf("sum = %d\n", sum);
+    printf("fact(10) = %d\n", fact(10));
+
+    if (sum == 5050 && fact(5) == 120) {
+        return 0;
+    }
+
+    return 1;
+}
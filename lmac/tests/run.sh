@@ -0,0 +1,76 @@
+#!/bin/sh
+#
+#  run.sh
+#  lmac
+#
+#  Builds lmac twice, unoptimized and at Release's -Os, and runs every sample
+#  through both. The samples have to come out the same either way: some bugs
+#  (like reading a variable before it's set) only show up once the optimizer
+#  gets to them, and nobody runs Release builds day to day. Samples that say
+#  what they return ("Returns 0.") have to return it under both builds, so a
+#  bug that breaks both the same way doesn't slip through.
+#
+#  Run it from the lmac directory. CC and CFLAGS are passed to the compiler,
+#  so anything the platform needs can go there:
+#
+#      tests/run.sh
+#      CFLAGS="-D_GNU_SOURCE -ldl -lpthread -lm" tests/run.sh
+#
+
+CC=${CC:-cc}
+SRC=$(pwd)
+WORK=$(mktemp -d /tmp/lmac_tests.XXXXXX)
+trap 'rm -rf "$WORK"' EXIT
+
+for opt in O0 Os; do
+    if ! $CC -std=gnu11 -w -$opt -o "$WORK/lmac_$opt" "$SRC"/*.c $CFLAGS; then
+        echo "lmac didn't build at -$opt"
+        exit 1
+    fi
+done
+
+# The samples include each other by their paths under tests/
+cp -R "$SRC/tests" "$WORK/tests"
+cd "$WORK" || exit 1
+
+failed=0
+for sample in tests/*.c; do
+    for action in build interpret; do
+        for opt in O0 Os; do
+            ./lmac_$opt $action $sample > raw.txt 2>&1
+            status=$?
+            
+            # cc's temporary files get new names every time
+            sed 's|/tmp/[^ :]*\.o|<temp>.o|' raw.txt > out_$opt.txt
+            echo "exit status $status" >> out_$opt.txt
+        done
+
+        if ! cmp -s out_O0.txt out_Os.txt; then
+            echo "FAIL $action $sample"
+            diff out_O0.txt out_Os.txt | head -20
+            failed=1
+        fi
+    done
+    
+    expected=$(grep -i -o -m1 '^//.*returns [0-9][0-9]*' $sample | grep -o '[0-9]*$')
+    if [ -z "$expected" ]; then
+        continue
+    fi
+    
+    # Samples that need other files say how to run them
+    files=$(grep -o -m1 '^// *lmac interpret tests/.*' $sample | sed 's/^.*lmac interpret //')
+    for opt in O0 Os; do
+        # The interpreter reports main's result on the first line of stderr
+        result=$(./lmac_$opt interpret ${files:-$sample} 2>&1 >/dev/null | head -1)
+        if [ "$result" != "$expected" ]; then
+            echo "FAIL $sample returned '$result' at -$opt instead of $expected"
+            failed=1
+        fi
+    done
+done
+
+if [ $failed -eq 0 ]; then
+    echo "all samples behave the same at -O0 and -Os"
+fi
+
+exit $failed
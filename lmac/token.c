@@ -39,7 +39,7 @@ void token_fprint(FILE *f, Token t) {
     fprintf(f, "{\n");
     fprintf(f, "\ttype: \"Token\",\n");
     fprintf(f, "\tname: \"%s\",\n", token_get_name(t.kind));
-    fprintf(f, "\tline: %d,\n", t.location.line);
+    fprintf(f, "\tline: %d,\n", source_location_line(t.location));
     if (t.kind == TOK_COMMENT || t.kind == TOK_IDENT || t.kind == TOK_NUMBER ||
         t.kind == TOK_UNKOWN) {
         fprintf(f, "\tcontent: \"");
@@ -9,7 +9,7 @@
 #ifndef lmac_token_h
 #define lmac_token_h
 
-#include "token.h"
+#include "source.h"
 
 typedef enum {
 #   define DIAG_KIND(kind, ...)  DIAG_##kind,
@@ -21,29 +21,47 @@ typedef enum {
 #   include "tokens.def.h"
 } TokenKind;
 
-struct Context;
+/* Spellings and locations are ranges of offsets in the source manager. Use
+ * source_manager_pointer to get at the text and source_manager_line for the
+ * line. They're 8 bytes, so a Token is 12.
+ */
 typedef struct {
-    struct Context *ctx;
-    uint8_t *start;
-    uint8_t *end;
+    SourceOffset start;
+    uint32_t length;
 } Spelling;
 
 typedef struct {
-    const char *file;
-    uint32_t line;
-    
     union {
         struct {
-            struct Context *ctx;
-            uint8_t *range_start;
-            uint8_t *range_end;
+            SourceOffset start;
+            uint32_t length;
         };
         Spelling spelling;
     };
 } SourceLocation;
 
+static inline SourceOffset source_location_end(SourceLocation sl) {
+    return sl.start + sl.length;
+}
+
+static inline SourceLocation source_location_range(SourceOffset start, SourceOffset end) {
+    SourceLocation sl = {};
+    sl.start = start;
+    sl.length = end - start;
+    return sl;
+}
+
+static inline uint32_t source_location_line(SourceLocation sl) {
+    return source_manager_line(sl.start);
+}
+
+/* The identifier has been declared as a type somewhere, so it might name
+ * one here. Identifiers without it never do */
+#define TOKEN_FLAG_TYPE_NAME    0x1
+
 typedef struct {
-    TokenKind kind;
+    TokenKind kind : 16;
+    unsigned flags : 16;
     SourceLocation location;
 } Token;
 
@@ -7,13 +7,16 @@
 //
 
 #ifndef TOKEN
-#define TOKEN(kind, name)
+#define TOKEN(kind, name, ...)
 #endif
 
 /*
  * Token database definitions:
  * kind: the enumeration kind of the token
  * name: the name of the token as a human-readable string
+ * binding power: (binary operators only) how tightly the operator holds on to
+ *                its operands. Higher binds tighter. All of them are left
+ *                associative
  */
 
 /* Should ALWAYS be first */
@@ -74,27 +77,27 @@ TOKEN(TOK_ELLIPSIS, ellipsis)
  * logical function! It encodes less implicit semantic information into the
  * front-end
  */
-TOKEN(TOK_PLUS, plus)
+TOKEN(TOK_PLUS, plus, 90)
 TOKEN(TOK_PLUS_PLUS, plus_plus)
-TOKEN(TOK_MINUS, minus)
+TOKEN(TOK_MINUS, minus, 90)
 TOKEN(TOK_MINUS_MINUS, minus_minus)
-TOKEN(TOK_STAR, star)
-TOKEN(TOK_FORWARDSLASH, forwardslash)
-TOKEN(TOK_PERCENT, percent)
-TOKEN(TOK_LANGLE, leftangle)
-TOKEN(TOK_RANGLE, rightangle)
-TOKEN(TOK_2LANGLE, two_leftangle)
-TOKEN(TOK_2RANGLE, two_rightangle)
+TOKEN(TOK_STAR, star, 100)
+TOKEN(TOK_FORWARDSLASH, forwardslash, 100)
+TOKEN(TOK_PERCENT, percent, 100)
+TOKEN(TOK_LANGLE, leftangle, 70)
+TOKEN(TOK_RANGLE, rightangle, 70)
+TOKEN(TOK_2LANGLE, two_leftangle, 80)
+TOKEN(TOK_2RANGLE, two_rightangle, 80)
 TOKEN(TOK_BANG, bang)
-TOKEN(TOK_AMP, ampersand)
-TOKEN(TOK_CARET, caret)
-TOKEN(TOK_PIPE, pipe)
-TOKEN(TOK_LANGLE_EQUALS, leftangle_equals)
-TOKEN(TOK_RANGLE_EQUALS, rightangle_equals)
-TOKEN(TOK_EQUALS_EQUALS, equals_equals)
-TOKEN(TOK_BANG_EQUALS, bang_equals)
-TOKEN(TOK_AMP_AMP, ampersand_ampersand)
-TOKEN(TOK_PIPE_PIPE, pipe_pipe)
+TOKEN(TOK_AMP, ampersand, 50)
+TOKEN(TOK_CARET, caret, 40)
+TOKEN(TOK_PIPE, pipe, 30)
+TOKEN(TOK_LANGLE_EQUALS, leftangle_equals, 70)
+TOKEN(TOK_RANGLE_EQUALS, rightangle_equals, 70)
+TOKEN(TOK_EQUALS_EQUALS, equals_equals, 60)
+TOKEN(TOK_BANG_EQUALS, bang_equals, 60)
+TOKEN(TOK_AMP_AMP, ampersand_ampersand, 20)
+TOKEN(TOK_PIPE_PIPE, pipe_pipe, 10)
 
 /* Our tokenizer is whitespace and comment preserving
  * to better map input code to generated code